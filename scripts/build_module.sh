@@ -171,6 +171,28 @@ package_libs() {
         exit 1
     fi
     
+    # Copy control socket client
+    CTL_BIN="target/aarch64-linux-android/release/aubo-ctl"
+    if [ -f "$CTL_BIN" ]; then
+        mkdir -p system/bin
+        cp "$CTL_BIN" system/bin/aubo-ctl
+        chmod 755 system/bin/aubo-ctl
+        log_info "Copied aubo-ctl to system/bin/"
+    else
+        log_warn "aubo-ctl not found: $CTL_BIN"
+    fi
+    
+    # Copy self-benchmark runner
+    BENCH_BIN="target/aarch64-linux-android/release/aubo-bench"
+    if [ -f "$BENCH_BIN" ]; then
+        mkdir -p system/bin
+        cp "$BENCH_BIN" system/bin/aubo-bench
+        chmod 755 system/bin/aubo-bench
+        log_info "Copied aubo-bench to system/bin/"
+    else
+        log_warn "aubo-bench not found: $BENCH_BIN"
+    fi
+    
     # Show library sizes
     echo
     log_info "Built libraries:"
@@ -0,0 +1,367 @@
+//! Work-avoided estimation for aubo-rs
+//!
+//! A blocked DNS lookup means the app never opens the connection that would
+//! have followed it, so blocking also saves a handshake and whatever that
+//! connection would have transferred. This module estimates that work.
+//!
+//! On allowed traffic the hooks report the addresses each resolution
+//! returned, the socket each connect went out on, and the bytes a socket
+//! moved when it is closed. Joining the three gives a history of bytes per
+//! connection for each host. A blocked lookup counts as one suppressed
+//! connect, unless the same host was already blocked within
+//! [`CONNECTION_REUSE_WINDOW`], when the app would have reused a pooled
+//! connection instead. Each suppressed connect is charged the host's mean
+//! bytes per connection, falling back to the closest parent domain with a
+//! history and then to the mean of the whole app.
+//!
+//! Counts are kept per host and attributed to the blocking filter list only
+//! when the app reports, so a blocked lookup takes one short lock.
+
+use std::collections::{BTreeMap, HashMap, VecDeque};
+use std::net::IpAddr;
+use std::time::Duration;
+
+use parking_lot::Mutex;
+use serde::{Deserialize, Serialize};
+
+use crate::utils::TimeUtils;
+
+/// How long an HTTP client keeps an idle connection to a host for reuse
+///
+/// Matches the default keep-alive of the common Android HTTP client pools.
+pub const CONNECTION_REUSE_WINDOW: Duration = Duration::from_secs(300);
+
+/// List name for blocked work no filter list could be found for
+pub const UNATTRIBUTED_LIST: &str = "unattributed";
+
+/// Resolved addresses remembered for joining connects to hosts
+const MAX_ADDRESSES: usize = 1024;
+
+/// Open connections tracked at once
+const MAX_CONNECTIONS: usize = 1024;
+
+/// Hosts with a transfer history
+const MAX_HISTORY_HOSTS: usize = 256;
+
+/// Blocked hosts tracked for connection reuse
+const MAX_BLOCKED_HOSTS: usize = 256;
+
+/// Work saved by blocking
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub struct WorkAvoided {
+    /// Blocked DNS lookups
+    pub lookups: u64,
+    /// Connects the blocked lookups suppressed
+    pub handshakes: u64,
+    /// Estimated bytes the suppressed connections would have transferred
+    pub bytes: u64,
+}
+
+impl WorkAvoided {
+    /// Add other work to this one
+    pub fn add(&mut self, other: &WorkAvoided) {
+        self.lookups += other.lookups;
+        self.handshakes += other.handshakes;
+        self.bytes = self.bytes.saturating_add(other.bytes);
+    }
+
+    /// Check if nothing was saved
+    pub fn is_empty(&self) -> bool {
+        self.lookups == 0
+    }
+}
+
+/// Work saved since the last report, per blocking filter list
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct AvoidedDelta {
+    /// Saved work by list name
+    pub lists: BTreeMap<String, WorkAvoided>,
+}
+
+impl AvoidedDelta {
+    /// Check if nothing was saved
+    pub fn is_empty(&self) -> bool {
+        self.lists.values().all(WorkAvoided::is_empty)
+    }
+
+    /// Add another delta to this one
+    pub fn merge(&mut self, other: AvoidedDelta) {
+        for (list, work) in other.lists {
+            self.lists.entry(list).or_default().add(&work);
+        }
+    }
+
+    /// Saved work over all lists
+    pub fn total(&self) -> WorkAvoided {
+        let mut total = WorkAvoided::default();
+        for work in self.lists.values() {
+            total.add(work);
+        }
+        total
+    }
+}
+
+/// Bytes moved by closed connections
+#[derive(Debug, Clone, Copy, Default)]
+struct Transfers {
+    connections: u64,
+    bytes: u64,
+}
+
+impl Transfers {
+    fn add(&mut self, bytes: u64) {
+        self.connections += 1;
+        self.bytes = self.bytes.saturating_add(bytes);
+    }
+
+    fn mean(&self) -> Option<u64> {
+        (self.connections > 0).then(|| self.bytes / self.connections)
+    }
+}
+
+/// Unreported work of a blocked host
+#[derive(Debug, Clone, Copy, Default)]
+struct BlockedHost {
+    work: WorkAvoided,
+    last_connect_ms: u64,
+}
+
+#[derive(Debug, Default)]
+struct TrackerState {
+    addresses: HashMap<IpAddr, String>,
+    address_order: VecDeque<IpAddr>,
+    connections: HashMap<i32, String>,
+    history: HashMap<String, Transfers>,
+    overall: Transfers,
+    blocked: HashMap<String, BlockedHost>,
+    overflow: WorkAvoided,
+}
+
+impl TrackerState {
+    /// Expected bytes of one connection to `host`
+    fn expected_bytes(&self, host: &str) -> u64 {
+        let mut candidate = host;
+        loop {
+            if let Some(mean) = self.history.get(candidate).and_then(Transfers::mean) {
+                return mean;
+            }
+            match candidate.split_once('.') {
+                Some((_, parent)) if parent.contains('.') => candidate = parent,
+                _ => return self.overall.mean().unwrap_or(0),
+            }
+        }
+    }
+
+    /// Make room for a new blocked host, dropping reported ones whose reuse
+    /// window has passed
+    fn has_blocked_room(&mut self, now_ms: u64) -> bool {
+        if self.blocked.len() < MAX_BLOCKED_HOSTS {
+            return true;
+        }
+        let window_ms = CONNECTION_REUSE_WINDOW.as_millis() as u64;
+        self.blocked
+            .retain(|_, host| !host.work.is_empty() || now_ms.saturating_sub(host.last_connect_ms) < window_ms);
+        self.blocked.len() < MAX_BLOCKED_HOSTS
+    }
+}
+
+/// Per-process estimator of the work blocking saved
+///
+/// One lock guards all of it. Each call holds it for a few map operations,
+/// once per resolution, per connect to a resolved address, and per close of
+/// a connection the module already flagged as tracked, so an app's threads
+/// only meet on it when they open or close connections at the same moment.
+#[derive(Debug, Default)]
+pub struct WorkAvoidedTracker {
+    state: Mutex<TrackerState>,
+}
+
+impl WorkAvoidedTracker {
+    /// Create an empty tracker
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Remember the addresses an allowed resolution of `host` returned
+    pub fn record_addresses(&self, host: &str, addresses: impl IntoIterator<Item = IpAddr>) {
+        let host = host.trim_end_matches('.').to_ascii_lowercase();
+        let mut state = self.state.lock();
+        for address in addresses {
+            if state.addresses.insert(address, host.clone()).is_none() {
+                state.address_order.push_back(address);
+            }
+            while state.address_order.len() > MAX_ADDRESSES {
+                if let Some(oldest) = state.address_order.pop_front() {
+                    state.addresses.remove(&oldest);
+                }
+            }
+        }
+    }
+
+    /// Note a connect on `fd` to `address`
+    ///
+    /// Returns whether the address belongs to a resolved host, i.e. whether
+    /// the transfer of `fd` should be reported when it is closed.
+    pub fn record_connect(&self, fd: i32, address: IpAddr) -> bool {
+        let mut state = self.state.lock();
+        let Some(host) = state.addresses.get(&address).cloned() else {
+            return false;
+        };
+        if state.connections.len() >= MAX_CONNECTIONS && !state.connections.contains_key(&fd) {
+            return false;
+        }
+        state.connections.insert(fd, host);
+        true
+    }
+
+    /// Add the bytes a tracked connection moved before `fd` was closed
+    ///
+    /// Connections that moved nothing never got going and are not counted.
+    pub fn record_transfer(&self, fd: i32, bytes: u64) {
+        let mut state = self.state.lock();
+        let Some(host) = state.connections.remove(&fd) else {
+            return;
+        };
+        if bytes == 0 {
+            return;
+        }
+
+        state.overall.add(bytes);
+        if !state.history.contains_key(&host) && state.history.len() >= MAX_HISTORY_HOSTS {
+            // Keep the hosts with the most evidence
+            let fewest = state
+                .history
+                .iter()
+                .min_by_key(|(_, transfers)| transfers.connections)
+                .map(|(host, _)| host.clone());
+            if let Some(fewest) = fewest {
+                state.history.remove(&fewest);
+            }
+        }
+        state.history.entry(host).or_default().add(bytes);
+    }
+
+    /// Count a blocked DNS lookup of `host`
+    pub fn record_blocked(&self, host: &str) {
+        self.record_blocked_at(host, TimeUtils::now_millis());
+    }
+
+    fn record_blocked_at(&self, host: &str, now_ms: u64) {
+        let host = host.trim_end_matches('.').to_ascii_lowercase();
+        let mut state = self.state.lock();
+        let expected = state.expected_bytes(&host);
+
+        if !state.blocked.contains_key(&host) && !state.has_blocked_room(now_ms) {
+            // Without room to remember the host, every lookup counts as a connect
+            state.overflow.add(&WorkAvoided {
+                lookups: 1,
+                handshakes: 1,
+                bytes: expected,
+            });
+            return;
+        }
+
+        let entry = state.blocked.entry(host).or_default();
+        entry.work.lookups += 1;
+        let window_ms = CONNECTION_REUSE_WINDOW.as_millis() as u64;
+        if entry.last_connect_ms == 0 || now_ms.saturating_sub(entry.last_connect_ms) >= window_ms {
+            entry.last_connect_ms = now_ms;
+            entry.work.handshakes += 1;
+            entry.work.bytes = entry.work.bytes.saturating_add(expected);
+        }
+    }
+
+    /// Take the work saved since the last call, if any
+    ///
+    /// `list_of` names the filter list that blocks a host; hosts it cannot
+    /// attribute are reported under [`UNATTRIBUTED_LIST`].
+    pub fn take(&self, list_of: impl Fn(&str) -> Option<String>) -> Option<AvoidedDelta> {
+        let mut state = self.state.lock();
+        let mut delta = AvoidedDelta::default();
+        for (host, blocked) in state.blocked.iter_mut().filter(|(_, blocked)| !blocked.work.is_empty()) {
+            let list = list_of(host).unwrap_or_else(|| UNATTRIBUTED_LIST.to_string());
+            delta.lists.entry(list).or_default().add(&std::mem::take(&mut blocked.work));
+        }
+        let overflow = std::mem::take(&mut state.overflow);
+        if !overflow.is_empty() {
+            delta.lists.entry(UNATTRIBUTED_LIST.to_string()).or_default().add(&overflow);
+        }
+        (!delta.is_empty()).then_some(delta)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn ip(text: &str) -> IpAddr {
+        text.parse().unwrap()
+    }
+
+    #[test]
+    fn test_transfer_history_prices_blocked_connects() {
+        let tracker = WorkAvoidedTracker::new();
+        tracker.record_addresses("cdn.ads.net", [ip("10.0.0.1"), ip("::1")]);
+        tracker.record_addresses("app.example.com", [ip("10.0.0.2")]);
+
+        assert!(tracker.record_connect(3, ip("10.0.0.1")));
+        assert!(tracker.record_connect(4, ip("::1")));
+        assert!(tracker.record_connect(5, ip("10.0.0.2")));
+        assert!(!tracker.record_connect(6, ip("192.168.1.1")));
+        tracker.record_transfer(3, 30_000);
+        tracker.record_transfer(4, 10_000);
+        tracker.record_transfer(5, 2_000);
+        tracker.record_transfer(6, 99_999);
+
+        let state = tracker.state.lock();
+        assert_eq!(state.expected_bytes("cdn.ads.net"), 20_000);
+        // A sibling has no history of its own, nor has its parent
+        assert_eq!(state.expected_bytes("pixel.ads.net"), 14_000);
+        assert_eq!(state.expected_bytes("img.cdn.ads.net"), 20_000);
+    }
+
+    #[test]
+    fn test_pooled_connections_are_not_counted_twice() {
+        let tracker = WorkAvoidedTracker::new();
+        tracker.record_addresses("tracker.net", [ip("10.0.0.9")]);
+        assert!(tracker.record_connect(7, ip("10.0.0.9")));
+        tracker.record_transfer(7, 5_000);
+
+        let window = CONNECTION_REUSE_WINDOW.as_millis() as u64;
+        tracker.record_blocked_at("tracker.net", 1_000);
+        tracker.record_blocked_at("TRACKER.net.", 2_000);
+        tracker.record_blocked_at("tracker.net", 1_000 + window);
+        tracker.record_blocked_at("other.org", 3_000);
+
+        let list_of = |host: &str| (host == "tracker.net").then(|| "easylist".to_string());
+        let delta = tracker.take(list_of).unwrap();
+        assert_eq!(
+            delta.lists["easylist"],
+            WorkAvoided {
+                lookups: 3,
+                handshakes: 2,
+                bytes: 10_000,
+            }
+        );
+        assert_eq!(delta.lists[UNATTRIBUTED_LIST].handshakes, 1);
+        assert_eq!(delta.total().lookups, 4);
+        assert!(tracker.take(list_of).is_none());
+
+        // The reuse window outlives the report
+        tracker.record_blocked_at("tracker.net", 2_000 + window);
+        assert_eq!(tracker.take(list_of).unwrap().lists["easylist"].handshakes, 0);
+    }
+
+    #[test]
+    fn test_merge_sums_per_list() {
+        let mut left = AvoidedDelta::default();
+        left.lists.insert("a".into(), WorkAvoided { lookups: 1, handshakes: 1, bytes: 100 });
+        let mut right = AvoidedDelta::default();
+        right.lists.insert("a".into(), WorkAvoided { lookups: 2, handshakes: 1, bytes: 50 });
+        right.lists.insert("b".into(), WorkAvoided { lookups: 1, handshakes: 0, bytes: 0 });
+
+        left.merge(right);
+        assert_eq!(left.lists["a"], WorkAvoided { lookups: 3, handshakes: 2, bytes: 150 });
+        assert_eq!(left.total().lookups, 4);
+    }
+}
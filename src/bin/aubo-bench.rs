@@ -0,0 +1,79 @@
+//! Self-benchmark runner for aubo-rs
+//!
+//! Loads the module's library and calls `aubo_self_benchmark`, which
+//! benchmarks the operating modes on this device and saves the fastest
+//! configuration, e.g. `aubo-bench /data/adb/aubo-rs/aubo-rs.toml`. The
+//! library is built as a C library only, so it is opened with `dlopen`
+//! rather than linked; `AUBO_LIBRARY` points at a different build, such as
+//! `target/release/libaubo_rs.so` when testing on Linux.
+
+use std::ffi::{c_char, c_int, CStr, CString};
+use std::process::ExitCode;
+
+/// Configuration used unless one is given
+const DEFAULT_CONFIG: &str = "/data/adb/aubo-rs/aubo-rs.toml";
+
+/// Library used unless `AUBO_LIBRARY` is set
+const DEFAULT_LIBRARY: &str = "/data/adb/modules/aubo_rs/system/lib64/libaubo_rs.so";
+
+/// Bytes of report the library may return
+const REPORT_BYTES: usize = 8192;
+
+type SelfBenchmark = unsafe extern "C" fn(*const c_char, *mut c_char, usize) -> c_int;
+
+fn main() -> ExitCode {
+    let config = std::env::args().nth(1).unwrap_or_else(|| DEFAULT_CONFIG.to_string());
+    let library = std::env::var("AUBO_LIBRARY").unwrap_or_else(|_| DEFAULT_LIBRARY.to_string());
+
+    match run(&library, &config) {
+        Ok((status, report)) => {
+            print!("{}", report);
+            if status == 0 {
+                ExitCode::SUCCESS
+            } else {
+                ExitCode::FAILURE
+            }
+        }
+        Err(e) => {
+            eprintln!("aubo-bench: {}: {}", library, e);
+            ExitCode::FAILURE
+        }
+    }
+}
+
+fn run(library: &str, config: &str) -> Result<(c_int, String), String> {
+    let library = CString::new(library).map_err(|e| e.to_string())?;
+    let config = CString::new(config).map_err(|e| e.to_string())?;
+
+    // SAFETY: both names are NUL-terminated; the library stays loaded for
+    // the life of the process
+    let benchmark = unsafe {
+        let handle = libc::dlopen(library.as_ptr(), libc::RTLD_NOW);
+        if handle.is_null() {
+            return Err(dl_error());
+        }
+        let symbol = libc::dlsym(handle, c"aubo_self_benchmark".as_ptr());
+        if symbol.is_null() {
+            return Err(dl_error());
+        }
+        std::mem::transmute::<*mut libc::c_void, SelfBenchmark>(symbol)
+    };
+
+    let mut report = vec![0 as c_char; REPORT_BYTES];
+    // SAFETY: the config path is NUL-terminated and the report buffer is
+    // REPORT_BYTES long
+    let status = unsafe { benchmark(config.as_ptr(), report.as_mut_ptr(), report.len()) };
+    // SAFETY: the library NUL-terminates the report within the buffer
+    let report = unsafe { CStr::from_ptr(report.as_ptr()) };
+    Ok((status, report.to_string_lossy().into_owned()))
+}
+
+fn dl_error() -> String {
+    // SAFETY: dlerror returns NULL or a NUL-terminated message
+    let message = unsafe { libc::dlerror() };
+    if message.is_null() {
+        return "unknown dynamic loader error".to_string();
+    }
+    // SAFETY: checked for NULL above
+    unsafe { CStr::from_ptr(message) }.to_string_lossy().into_owned()
+}
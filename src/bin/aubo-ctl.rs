@@ -0,0 +1,49 @@
+//! Command-line client for the aubo-rs control socket
+//!
+//! Sends its arguments as one command line to the companion and prints the
+//! reply, e.g. `aubo-ctl metrics` or `aubo-ctl explain ads.example.com`.
+//! The library is built as a C library only, so this speaks the line
+//! protocol of `aubo_rs::control` directly.
+
+use std::io::{Read, Write};
+use std::os::unix::net::UnixStream;
+use std::process::ExitCode;
+use std::time::Duration;
+
+/// Socket used unless `AUBO_CONTROL_SOCKET` is set
+const DEFAULT_SOCKET: &str = "/data/adb/aubo-rs/control.sock";
+
+/// How long to wait for the companion
+const TIMEOUT: Duration = Duration::from_secs(5);
+
+fn main() -> ExitCode {
+    let command = std::env::args().skip(1).collect::<Vec<_>>().join(" ");
+    let socket = std::env::var("AUBO_CONTROL_SOCKET").unwrap_or_else(|_| DEFAULT_SOCKET.to_string());
+
+    match send(&socket, &command) {
+        Ok(reply) => {
+            print!("{}", reply);
+            if reply.starts_with("error:") {
+                ExitCode::FAILURE
+            } else {
+                ExitCode::SUCCESS
+            }
+        }
+        Err(e) => {
+            eprintln!("aubo-ctl: {}: {}", socket, e);
+            ExitCode::FAILURE
+        }
+    }
+}
+
+fn send(socket: &str, command: &str) -> std::io::Result<String> {
+    let mut stream = UnixStream::connect(socket)?;
+    stream.set_read_timeout(Some(TIMEOUT))?;
+    stream.write_all(command.as_bytes())?;
+    stream.write_all(b"\n")?;
+    stream.shutdown(std::net::Shutdown::Write)?;
+
+    let mut reply = String::new();
+    stream.read_to_string(&mut reply)?;
+    Ok(reply)
+}
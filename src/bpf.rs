@@ -0,0 +1,895 @@
+//! Kernel connect blocking for aubo-rs
+//!
+//! Inline hooks cost memory and a detour in every app, and never see
+//! connections made without libc. In this optional mode the companion
+//! attaches cgroup `connect4`/`connect6` and `sendmsg4`/`sendmsg6` eBPF
+//! programs to a cgroup v2 hierarchy. Each program looks the destination up
+//! in a longest-prefix-match trie and rejects the connect or datagram with
+//! `EPERM` on a hit, so the kernel enforces blocking for every process in
+//! the cgroup.
+//!
+//! The programs are assembled here and loaded with the raw `bpf(2)` syscall;
+//! no compiler or loader library is needed on the device. IPv4 prefixes are
+//! also entered as IPv4-mapped IPv6 prefixes, because dual-stack Java
+//! sockets connect to `::ffff:a.b.c.d`.
+//!
+//! The tries are filled from the blocked IPs in the compiled rule set and
+//! from addresses the companion learns by resolving hosts the DNS hooks
+//! blocked. Everything here works on a plain Linux machine with cgroup v2.
+//!
+//! Programs are attached through `bpf_link`s where the kernel has them
+//! (5.7 and later), so they go away with the companion even if it crashes.
+//! Older kernels keep a plain attachment until it is detached, so programs
+//! of the same name left by an earlier companion are detached before new
+//! ones are attached.
+
+use std::collections::{HashMap, HashSet};
+use std::fmt;
+use std::fs::File;
+use std::net::IpAddr;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd};
+use std::path::Path;
+use std::time::Duration;
+
+use crate::error::{HookError, Result};
+
+/// Default cgroup v2 mount covering every app
+pub const DEFAULT_CGROUP_PATH: &str = "/sys/fs/cgroup";
+
+/// Prefixes of each family the tries hold
+pub const FILTER_CAPACITY: u32 = 65536;
+
+/// How long an address learned from a blocked host stays blocked
+pub const LEARNED_ADDRESS_TTL: Duration = Duration::from_secs(3600);
+
+/// Most hosts whose addresses are blocked at once
+const MAX_LEARNED_HOSTS: usize = 4096;
+
+const BPF_MAP_CREATE: libc::c_long = 0;
+const BPF_MAP_UPDATE_ELEM: libc::c_long = 2;
+const BPF_MAP_DELETE_ELEM: libc::c_long = 3;
+const BPF_PROG_LOAD: libc::c_long = 5;
+const BPF_PROG_ATTACH: libc::c_long = 8;
+const BPF_PROG_DETACH: libc::c_long = 9;
+const BPF_PROG_GET_FD_BY_ID: libc::c_long = 13;
+const BPF_OBJ_GET_INFO_BY_FD: libc::c_long = 15;
+const BPF_PROG_QUERY: libc::c_long = 16;
+const BPF_LINK_CREATE: libc::c_long = 28;
+
+const BPF_MAP_TYPE_LPM_TRIE: u32 = 11;
+const BPF_F_NO_PREALLOC: u32 = 1;
+const BPF_PROG_TYPE_CGROUP_SOCK_ADDR: u32 = 18;
+const BPF_F_ALLOW_MULTI: u32 = 2;
+
+const BPF_CGROUP_INET4_CONNECT: u32 = 10;
+const BPF_CGROUP_INET6_CONNECT: u32 = 11;
+const BPF_CGROUP_UDP4_SENDMSG: u32 = 14;
+const BPF_CGROUP_UDP6_SENDMSG: u32 = 15;
+
+/// Offset of `user_ip4` in `struct bpf_sock_addr`
+const USER_IP4_OFFSET: i16 = 4;
+/// Offset of `user_ip6` in `struct bpf_sock_addr`
+const USER_IP6_OFFSET: i16 = 8;
+
+/// Size of the verifier log kept when a program is rejected
+const VERIFIER_LOG_BYTES: usize = 4096;
+
+/// Program ids read per cgroup hook when looking for stale programs
+const QUERY_PROGRAMS: usize = 64;
+
+/// Offset of `name` in `struct bpf_prog_info`
+const PROG_INFO_NAME_OFFSET: usize = 64;
+/// Length of `name` in `struct bpf_prog_info`
+const PROG_NAME_BYTES: usize = 16;
+
+/// Address family of a trie
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum Family {
+    V4,
+    V6,
+}
+
+impl Family {
+    fn address_bytes(self) -> usize {
+        match self {
+            Family::V4 => 4,
+            Family::V6 => 16,
+        }
+    }
+}
+
+/// IP network blocked at connect time
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct IpPrefix {
+    addr: IpAddr,
+    len: u8,
+}
+
+impl IpPrefix {
+    /// Create a prefix, clamping the length to the address width and
+    /// clearing the host bits so equal networks compare equal
+    pub fn new(addr: IpAddr, len: u8) -> Self {
+        match addr {
+            IpAddr::V4(v4) => {
+                let len = len.min(32);
+                let mask = u32::MAX.checked_shl(32 - u32::from(len)).unwrap_or(0);
+                Self {
+                    addr: IpAddr::V4((u32::from(v4) & mask).into()),
+                    len,
+                }
+            }
+            IpAddr::V6(v6) => {
+                let len = len.min(128);
+                let mask = u128::MAX.checked_shl(128 - u32::from(len)).unwrap_or(0);
+                Self {
+                    addr: IpAddr::V6((u128::from(v6) & mask).into()),
+                    len,
+                }
+            }
+        }
+    }
+
+    /// Prefix holding exactly one address
+    pub fn host(addr: IpAddr) -> Self {
+        Self::new(addr, 128)
+    }
+
+    /// Parse `addr` or `addr/len`
+    pub fn parse(text: &str) -> Option<Self> {
+        match text.split_once('/') {
+            Some((addr, len)) => Some(Self::new(addr.parse().ok()?, len.parse().ok()?)),
+            None => Some(Self::host(text.parse().ok()?)),
+        }
+    }
+
+    /// Network address
+    pub fn addr(&self) -> IpAddr {
+        self.addr
+    }
+
+    /// Prefix length in bits
+    pub fn prefix_len(&self) -> u8 {
+        self.len
+    }
+
+    /// LPM trie keys of the prefix: the prefix length followed by the
+    /// address in network byte order
+    fn keys(&self) -> Vec<(Family, Vec<u8>)> {
+        let key = |len: u32, octets: &[u8]| {
+            let mut key = len.to_ne_bytes().to_vec();
+            key.extend_from_slice(octets);
+            key
+        };
+        match self.addr {
+            IpAddr::V4(v4) => vec![
+                (Family::V4, key(self.len as u32, &v4.octets())),
+                (Family::V6, key(96 + self.len as u32, &v4.to_ipv6_mapped().octets())),
+            ],
+            IpAddr::V6(v6) => vec![(Family::V6, key(self.len as u32, &v6.octets()))],
+        }
+    }
+}
+
+impl From<IpAddr> for IpPrefix {
+    fn from(addr: IpAddr) -> Self {
+        Self::host(addr)
+    }
+}
+
+impl fmt::Display for IpPrefix {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "{}/{}", self.addr, self.len)
+    }
+}
+
+/// One eBPF instruction
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(C)]
+struct Insn {
+    code: u8,
+    regs: u8,
+    off: i16,
+    imm: i32,
+}
+
+impl Insn {
+    const fn new(code: u8, dst: u8, src: u8, off: i16, imm: i32) -> Self {
+        Self {
+            code,
+            regs: (src << 4) | (dst & 0x0f),
+            off,
+            imm,
+        }
+    }
+
+    /// `dst = src`
+    const fn mov_reg(dst: u8, src: u8) -> Self {
+        Self::new(0xbf, dst, src, 0, 0)
+    }
+
+    /// `dst = imm`
+    const fn mov_imm(dst: u8, imm: i32) -> Self {
+        Self::new(0xb7, dst, 0, 0, imm)
+    }
+
+    /// `dst += imm`
+    const fn add_imm(dst: u8, imm: i32) -> Self {
+        Self::new(0x07, dst, 0, 0, imm)
+    }
+
+    /// `dst = *(u32 *)(src + off)`
+    const fn load_word(dst: u8, src: u8, off: i16) -> Self {
+        Self::new(0x61, dst, src, off, 0)
+    }
+
+    /// `*(u32 *)(dst + off) = src`
+    const fn store_word(dst: u8, off: i16, src: u8) -> Self {
+        Self::new(0x63, dst, src, off, 0)
+    }
+
+    /// `*(u32 *)(dst + off) = imm`
+    const fn store_word_imm(dst: u8, off: i16, imm: i32) -> Self {
+        Self::new(0x62, dst, 0, off, imm)
+    }
+
+    /// `dst = map referenced by fd`, two instructions wide
+    const fn load_map_fd(dst: u8, fd: i32) -> [Self; 2] {
+        [Self::new(0x18, dst, 1, 0, fd), Self::new(0, 0, 0, 0, 0)]
+    }
+
+    /// Call helper `id`
+    const fn call(id: i32) -> Self {
+        Self::new(0x85, 0, 0, 0, id)
+    }
+
+    /// `if dst != imm goto pc + off`
+    const fn jump_ne_imm(dst: u8, imm: i32, off: i16) -> Self {
+        Self::new(0x55, dst, 0, off, imm)
+    }
+
+    const fn exit() -> Self {
+        Self::new(0x95, 0, 0, 0, 0)
+    }
+}
+
+const R0: u8 = 0;
+const R1: u8 = 1;
+const R2: u8 = 2;
+const R6: u8 = 6;
+const R10: u8 = 10;
+const BPF_FUNC_MAP_LOOKUP_ELEM: i32 = 1;
+
+/// Assemble the program rejecting destinations found in the trie `map_fd`
+///
+/// The key is built on the stack: the full prefix length, then the
+/// destination words copied from the context as they are, which keeps them
+/// in network byte order.
+fn connect_program(family: Family, map_fd: i32) -> Vec<Insn> {
+    let words = family.address_bytes() as i16 / 4;
+    let key_offset = -(4 + 4 * words);
+    let (ctx_offset, prefix_len) = match family {
+        Family::V4 => (USER_IP4_OFFSET, 32),
+        Family::V6 => (USER_IP6_OFFSET, 128),
+    };
+
+    let mut program = vec![
+        Insn::mov_reg(R6, R1),
+        Insn::store_word_imm(R10, key_offset, prefix_len),
+    ];
+    for word in 0..words {
+        program.push(Insn::load_word(R2, R6, ctx_offset + 4 * word));
+        program.push(Insn::store_word(R10, key_offset + 4 + 4 * word, R2));
+    }
+    program.push(Insn::mov_reg(R2, R10));
+    program.push(Insn::add_imm(R2, key_offset as i32));
+    program.extend(Insn::load_map_fd(R1, map_fd));
+    program.extend([
+        Insn::call(BPF_FUNC_MAP_LOOKUP_ELEM),
+        Insn::jump_ne_imm(R0, 0, 2),
+        // Not listed: let the connect through
+        Insn::mov_imm(R0, 1),
+        Insn::exit(),
+        // Listed: reject with EPERM
+        Insn::mov_imm(R0, 0),
+        Insn::exit(),
+    ]);
+    program
+}
+
+/// Issue a `bpf(2)` command with an attribute block
+fn bpf(command: libc::c_long, attr: &mut [u64]) -> std::io::Result<i32> {
+    // SAFETY: attr is a zero-padded, 8-byte aligned buffer of the size
+    // passed, laid out as the command's union bpf_attr member
+    let result = unsafe {
+        libc::syscall(
+            libc::SYS_bpf,
+            command,
+            attr.as_mut_ptr(),
+            std::mem::size_of_val(attr) as libc::c_uint,
+        )
+    };
+    if result < 0 {
+        Err(std::io::Error::last_os_error())
+    } else {
+        Ok(result as i32)
+    }
+}
+
+/// Pack two u32 fields into one attribute word
+fn words(low: u32, high: u32) -> u64 {
+    low as u64 | (high as u64) << 32
+}
+
+fn hook_error(function: &str, reason: impl fmt::Display) -> crate::error::AuboError {
+    HookError::InstallationFailed {
+        function: function.to_string(),
+        reason: reason.to_string(),
+    }
+    .into()
+}
+
+/// LPM trie of blocked prefixes of one family
+#[derive(Debug)]
+struct PrefixTrie {
+    family: Family,
+    fd: OwnedFd,
+}
+
+impl PrefixTrie {
+    fn create(family: Family, capacity: u32) -> Result<Self> {
+        let key_size = 4 + family.address_bytes() as u32;
+        let mut attr = [0u64; 16];
+        attr[0] = words(BPF_MAP_TYPE_LPM_TRIE, key_size);
+        attr[1] = words(1, capacity.max(1));
+        attr[2] = words(BPF_F_NO_PREALLOC, 0);
+        let fd = bpf(BPF_MAP_CREATE, &mut attr).map_err(|e| hook_error("bpf lpm trie", e))?;
+        // SAFETY: the kernel just returned this fd and nothing else owns it
+        Ok(Self {
+            family,
+            fd: unsafe { OwnedFd::from_raw_fd(fd) },
+        })
+    }
+
+    fn update(&self, key: &[u8], insert: bool) -> std::io::Result<()> {
+        let value = 1u8;
+        let mut attr = [0u64; 16];
+        attr[0] = self.fd.as_raw_fd() as u64;
+        attr[1] = key.as_ptr() as u64;
+        if insert {
+            attr[2] = &value as *const u8 as u64;
+            bpf(BPF_MAP_UPDATE_ELEM, &mut attr).map(drop)
+        } else {
+            bpf(BPF_MAP_DELETE_ELEM, &mut attr).map(drop)
+        }
+    }
+}
+
+/// Load a program for `attach_type` reading the trie
+fn load_program(trie: &PrefixTrie, attach_type: u32, name: &str) -> Result<OwnedFd> {
+    let program = connect_program(trie.family, trie.fd.as_raw_fd());
+    let license = b"GPL\0";
+
+    let mut attr = [0u64; 16];
+    attr[0] = words(BPF_PROG_TYPE_CGROUP_SOCK_ADDR, program.len() as u32);
+    attr[1] = program.as_ptr() as u64;
+    attr[2] = license.as_ptr() as u64;
+    let mut prog_name = [0u8; 16];
+    for (slot, byte) in prog_name.iter_mut().zip(name.bytes().take(15)) {
+        *slot = byte;
+    }
+    attr[6] = u64::from_ne_bytes(prog_name[..8].try_into().expect("8 bytes"));
+    attr[7] = u64::from_ne_bytes(prog_name[8..].try_into().expect("8 bytes"));
+    attr[8] = words(0, attach_type);
+
+    // Load without a log first, a log too small for the verifier fails the load
+    let fd = bpf(BPF_PROG_LOAD, &mut attr.clone()).or_else(|_| {
+        let mut log = vec![0u8; VERIFIER_LOG_BYTES];
+        attr[3] = words(1, log.len() as u32);
+        attr[4] = log.as_mut_ptr() as u64;
+        bpf(BPF_PROG_LOAD, &mut attr).map_err(|e| {
+            let end = log.iter().position(|&byte| byte == 0).unwrap_or(log.len());
+            hook_error(name, format!("{} {}", e, String::from_utf8_lossy(&log[..end]).trim()))
+        })
+    })?;
+    // SAFETY: the kernel just returned this fd and nothing else owns it
+    Ok(unsafe { OwnedFd::from_raw_fd(fd) })
+}
+
+/// Attach `program` to `cgroup` through a link, returning the link
+fn link_program(cgroup: &File, program: &OwnedFd, attach_type: u32) -> std::io::Result<OwnedFd> {
+    let mut attr = [0u64; 16];
+    attr[0] = words(program.as_raw_fd() as u32, cgroup.as_raw_fd() as u32);
+    attr[1] = words(attach_type, 0);
+    let fd = bpf(BPF_LINK_CREATE, &mut attr)?;
+    // SAFETY: the kernel just returned this fd and nothing else owns it
+    Ok(unsafe { OwnedFd::from_raw_fd(fd) })
+}
+
+/// Detach `program` from `cgroup` after a plain attach
+fn detach_program(cgroup: &File, program: &OwnedFd, attach_type: u32) -> std::io::Result<()> {
+    let mut attr = [0u64; 16];
+    attr[0] = words(cgroup.as_raw_fd() as u32, program.as_raw_fd() as u32);
+    attr[1] = words(attach_type, 0);
+    bpf(BPF_PROG_DETACH, &mut attr).map(drop)
+}
+
+/// Ids of the programs attached to `cgroup` for `attach_type`
+fn attached_program_ids(cgroup: &File, attach_type: u32) -> std::io::Result<Vec<u32>> {
+    let mut ids = vec![0u32; QUERY_PROGRAMS];
+    loop {
+        let mut attr = [0u64; 16];
+        attr[0] = words(cgroup.as_raw_fd() as u32, attach_type);
+        attr[2] = ids.as_mut_ptr() as u64;
+        attr[3] = words(ids.len() as u32, 0);
+        let result = bpf(BPF_PROG_QUERY, &mut attr);
+        let count = (attr[3] & u32::MAX as u64) as usize;
+        match result {
+            Ok(_) => {
+                ids.truncate(count);
+                return Ok(ids);
+            }
+            Err(e) if e.raw_os_error() == Some(libc::ENOSPC) && count > ids.len() => ids.resize(count, 0),
+            Err(e) => return Err(e),
+        }
+    }
+}
+
+/// Name a program was loaded with
+fn program_name(id: u32) -> std::io::Result<(OwnedFd, String)> {
+    let mut attr = [0u64; 16];
+    attr[0] = words(id, 0);
+    // SAFETY: the kernel just returned this fd and nothing else owns it
+    let fd = unsafe { OwnedFd::from_raw_fd(bpf(BPF_PROG_GET_FD_BY_ID, &mut attr)?) };
+
+    let mut info = [0u64; (PROG_INFO_NAME_OFFSET + PROG_NAME_BYTES) / 8];
+    let mut attr = [0u64; 16];
+    attr[0] = words(fd.as_raw_fd() as u32, std::mem::size_of_val(&info) as u32);
+    attr[1] = info.as_mut_ptr() as u64;
+    bpf(BPF_OBJ_GET_INFO_BY_FD, &mut attr)?;
+
+    let bytes: Vec<u8> = info.iter().flat_map(|word| word.to_ne_bytes()).collect();
+    let name = &bytes[PROG_INFO_NAME_OFFSET..];
+    let end = name.iter().position(|&byte| byte == 0).unwrap_or(name.len());
+    Ok((fd, String::from_utf8_lossy(&name[..end]).into_owned()))
+}
+
+/// Detach programs called `name` that an earlier companion attached to
+/// `cgroup` without a link, returning how many were detached
+fn detach_stale_programs(cgroup: &File, attach_type: u32, name: &str) -> usize {
+    let ids = match attached_program_ids(cgroup, attach_type) {
+        Ok(ids) => ids,
+        Err(e) => {
+            log::debug!("Failed to query programs attached for {}: {}", name, e);
+            return 0;
+        }
+    };
+    ids.into_iter()
+        .filter_map(|id| program_name(id).ok())
+        .filter(|(_, attached)| attached == name)
+        // Programs behind a live link refuse a plain detach and are kept
+        .filter(|(fd, _)| detach_program(cgroup, fd, attach_type).is_ok())
+        .count()
+}
+
+/// Program attached to the cgroup
+#[derive(Debug)]
+struct AttachedProgram {
+    fd: OwnedFd,
+    attach_type: u32,
+    /// Link the kernel detaches the program with once it is closed, or
+    /// `None` if the program stays attached until detached explicitly
+    link: Option<OwnedFd>,
+}
+
+/// Kernel-enforced connect blocking for a cgroup
+#[derive(Debug)]
+pub struct ConnectFilter {
+    cgroup: File,
+    v4: PrefixTrie,
+    v6: PrefixTrie,
+    programs: Vec<AttachedProgram>,
+    blocked: HashSet<IpPrefix>,
+}
+
+impl ConnectFilter {
+    /// Create the tries and attach the programs to the cgroup at `cgroup`
+    ///
+    /// `capacity` bounds the prefixes of each family. Programs attached
+    /// before a failure are detached again.
+    pub fn attach(cgroup: &Path, capacity: u32) -> Result<Self> {
+        Self::attach_with(cgroup, capacity, true)
+    }
+
+    /// Attach as [`attach`](Self::attach), through links if `links` is set
+    /// and the kernel supports them
+    fn attach_with(cgroup: &Path, capacity: u32, links: bool) -> Result<Self> {
+        let cgroup_dir = File::open(cgroup).map_err(|e| hook_error("cgroup", format!("{}: {}", cgroup.display(), e)))?;
+        let mut filter = Self {
+            cgroup: cgroup_dir,
+            v4: PrefixTrie::create(Family::V4, capacity)?,
+            // Each IPv4 prefix also takes a mapped IPv6 entry
+            v6: PrefixTrie::create(Family::V6, capacity.saturating_mul(2))?,
+            programs: Vec::new(),
+            blocked: HashSet::new(),
+        };
+
+        let hooks = [
+            (Family::V4, BPF_CGROUP_INET4_CONNECT, "aubo_connect4"),
+            (Family::V6, BPF_CGROUP_INET6_CONNECT, "aubo_connect6"),
+            (Family::V4, BPF_CGROUP_UDP4_SENDMSG, "aubo_sendmsg4"),
+            (Family::V6, BPF_CGROUP_UDP6_SENDMSG, "aubo_sendmsg6"),
+        ];
+        for (family, attach_type, name) in hooks {
+            let stale = detach_stale_programs(&filter.cgroup, attach_type, name);
+            if stale > 0 {
+                log::info!("Detached {} {} programs left by an earlier companion", stale, name);
+            }
+
+            let trie = if family == Family::V4 { &filter.v4 } else { &filter.v6 };
+            let fd = load_program(trie, attach_type, name)?;
+            let link = if links {
+                link_program(&filter.cgroup, &fd, attach_type)
+                    .map_err(|e| log::debug!("Attaching {} without a link: {}", name, e))
+                    .ok()
+            } else {
+                None
+            };
+            if link.is_none() {
+                let mut attr = [0u64; 16];
+                attr[0] = words(filter.cgroup.as_raw_fd() as u32, fd.as_raw_fd() as u32);
+                attr[1] = words(attach_type, BPF_F_ALLOW_MULTI);
+                bpf(BPF_PROG_ATTACH, &mut attr).map_err(|e| hook_error(name, e))?;
+            }
+            filter.programs.push(AttachedProgram { fd, attach_type, link });
+        }
+        Ok(filter)
+    }
+
+    /// Block connects to `prefix`
+    pub fn block(&mut self, prefix: IpPrefix) -> Result<()> {
+        if self.blocked.contains(&prefix) {
+            return Ok(());
+        }
+        for (family, key) in prefix.keys() {
+            self.trie(family)
+                .update(&key, true)
+                .map_err(|e| hook_error("bpf map update", format!("{}: {}", prefix, e)))?;
+        }
+        self.blocked.insert(prefix);
+        Ok(())
+    }
+
+    /// Allow connects to `prefix` again
+    pub fn unblock(&mut self, prefix: IpPrefix) {
+        if self.blocked.remove(&prefix) {
+            for (family, key) in prefix.keys() {
+                // A missing entry is already what we want
+                let _ = self.trie(family).update(&key, false);
+            }
+        }
+    }
+
+    /// Make the blocked prefixes exactly `prefixes`
+    ///
+    /// Returns the number of prefixes that could not be added, e.g. because
+    /// a trie is full.
+    pub fn sync(&mut self, prefixes: impl IntoIterator<Item = IpPrefix>) -> usize {
+        let wanted: HashSet<IpPrefix> = prefixes.into_iter().collect();
+        let stale: Vec<IpPrefix> = self.blocked.difference(&wanted).copied().collect();
+        for prefix in stale {
+            self.unblock(prefix);
+        }
+        wanted.into_iter().filter(|prefix| self.block(*prefix).is_err()).count()
+    }
+
+    /// Get the number of blocked prefixes
+    pub fn blocked_count(&self) -> usize {
+        self.blocked.len()
+    }
+
+    fn trie(&self, family: Family) -> &PrefixTrie {
+        match family {
+            Family::V4 => &self.v4,
+            Family::V6 => &self.v6,
+        }
+    }
+}
+
+impl Drop for ConnectFilter {
+    fn drop(&mut self) {
+        // Links detach when their fd is closed with the program
+        for program in &self.programs {
+            if program.link.is_none() {
+                if let Err(e) = detach_program(&self.cgroup, &program.fd, program.attach_type) {
+                    log::warn!("Failed to detach connect filter program: {}", e);
+                }
+            }
+        }
+    }
+}
+
+/// Addresses learned from hosts the DNS hooks blocked
+///
+/// Hosts are queued as apps report them and resolved later, off the
+/// reporting path. Loopback and unspecified answers are dropped, since
+/// another DNS blocker may already sinkhole the host to them. Entries
+/// expire, so an address a CDN later hands to an allowed host is not
+/// blocked for long.
+#[derive(Debug, Default)]
+pub struct LearnedAddresses {
+    hosts: HashMap<String, (Vec<IpAddr>, u64)>,
+    pending: HashSet<String>,
+}
+
+impl LearnedAddresses {
+    /// Create an empty set
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Queue `host` for resolution unless its addresses are already known
+    pub fn queue(&mut self, host: &str) {
+        if self.hosts.contains_key(host) || self.pending.len() >= MAX_LEARNED_HOSTS {
+            return;
+        }
+        self.pending.insert(host.to_string());
+    }
+
+    /// Take the hosts waiting to be resolved
+    pub fn take_pending(&mut self) -> Vec<String> {
+        self.pending.drain().collect()
+    }
+
+    /// Record the addresses `host` resolved to at `now` (seconds)
+    ///
+    /// The oldest host is forgotten when the set is full.
+    pub fn learn(&mut self, host: String, addresses: impl IntoIterator<Item = IpAddr>, now: u64) {
+        let addresses: Vec<IpAddr> = addresses
+            .into_iter()
+            .filter(|addr| !addr.is_loopback() && !addr.is_unspecified())
+            .collect();
+        if addresses.is_empty() {
+            return;
+        }
+        if self.hosts.len() >= MAX_LEARNED_HOSTS && !self.hosts.contains_key(&host) {
+            let oldest = self.hosts.iter().min_by_key(|(_, (_, learned))| *learned).map(|(host, _)| host.clone());
+            if let Some(oldest) = oldest {
+                self.hosts.remove(&oldest);
+            }
+        }
+        self.hosts.insert(host, (addresses, now));
+    }
+
+    /// Forget hosts learned more than [`LEARNED_ADDRESS_TTL`] before `now`
+    pub fn expire(&mut self, now: u64) {
+        let ttl = LEARNED_ADDRESS_TTL.as_secs();
+        self.hosts.retain(|_, (_, learned)| now.saturating_sub(*learned) < ttl);
+    }
+
+    /// Get the number of hosts with known addresses
+    pub fn host_count(&self) -> usize {
+        self.hosts.len()
+    }
+
+    /// Get a host prefix for every learned address
+    pub fn prefixes(&self) -> impl Iterator<Item = IpPrefix> + '_ {
+        self.hosts.values().flat_map(|(addresses, _)| addresses.iter().copied().map(IpPrefix::host))
+    }
+}
+
+/// Connect filter kept in step with the rules and learned addresses
+#[derive(Debug)]
+pub struct KernelBlocklist {
+    filter: ConnectFilter,
+    rule_prefixes: Vec<IpPrefix>,
+    learned: LearnedAddresses,
+    enforcing: bool,
+}
+
+impl KernelBlocklist {
+    /// Manage the prefixes `filter` blocks
+    pub fn new(filter: ConnectFilter) -> Self {
+        Self {
+            filter,
+            rule_prefixes: Vec::new(),
+            learned: LearnedAddresses::new(),
+            enforcing: true,
+        }
+    }
+
+    /// Replace the prefixes blocked by the compiled rules
+    pub fn set_rule_prefixes(&mut self, prefixes: Vec<IpPrefix>) {
+        self.rule_prefixes = prefixes;
+    }
+
+    /// Block in the kernel, or only learn while in monitor-only mode
+    pub fn set_enforcing(&mut self, enforcing: bool) {
+        self.enforcing = enforcing;
+    }
+
+    /// Get the learned addresses
+    pub fn learned_mut(&mut self) -> &mut LearnedAddresses {
+        &mut self.learned
+    }
+
+    /// Update the tries to the current prefixes
+    ///
+    /// Returns the number of prefixes that could not be added.
+    pub fn sync(&mut self) -> usize {
+        if !self.enforcing {
+            return self.filter.sync(std::iter::empty());
+        }
+        let prefixes = self.rule_prefixes.iter().copied().chain(self.learned.prefixes());
+        self.filter.sync(prefixes.collect::<Vec<_>>())
+    }
+
+    /// Get the number of blocked prefixes
+    pub fn blocked_count(&self) -> usize {
+        self.filter.blocked_count()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::net::{Ipv4Addr, TcpListener};
+    use std::process::Command;
+
+    #[test]
+    fn test_prefix_keys() {
+        let prefix = IpPrefix::parse("10.1.2.0/24").unwrap();
+        let keys = prefix.keys();
+        assert_eq!(keys[0], (Family::V4, [&24u32.to_ne_bytes()[..], &[10, 1, 2, 0]].concat()));
+        assert_eq!(keys[1].1[..4], 120u32.to_ne_bytes());
+        assert_eq!(keys[1].1[4..], Ipv4Addr::new(10, 1, 2, 0).to_ipv6_mapped().octets());
+
+        let host = IpPrefix::parse("2001:db8::1").unwrap();
+        assert_eq!((host.prefix_len(), host.keys().len()), (128, 1));
+        assert_eq!(IpPrefix::host("1.2.3.4".parse().unwrap()).prefix_len(), 32);
+        assert!(IpPrefix::parse("1.2.3.4/x").is_none());
+        assert_eq!(prefix.to_string(), "10.1.2.0/24");
+
+        // Host bits do not make a different network
+        assert_eq!(IpPrefix::parse("10.0.0.1/8"), IpPrefix::parse("10.0.0.0/8"));
+        assert_eq!(IpPrefix::parse("2001:db8::1/32").unwrap().to_string(), "2001:db8::/32");
+        assert_eq!(IpPrefix::parse("1.2.3.4/0").unwrap().addr(), IpAddr::from([0, 0, 0, 0]));
+    }
+
+    #[test]
+    fn test_program_layout() {
+        let v4 = connect_program(Family::V4, 7);
+        assert_eq!(v4[1], Insn::store_word_imm(R10, -8, 32));
+        assert_eq!(v4[2], Insn::load_word(R2, R6, USER_IP4_OFFSET));
+        assert_eq!(v4.iter().filter(|insn| insn.code == 0x18).count(), 1);
+        assert_eq!(v4.last(), Some(&Insn::exit()));
+
+        let v6 = connect_program(Family::V6, 7);
+        assert_eq!(v6[1], Insn::store_word_imm(R10, -20, 128));
+        assert_eq!(v6.len(), v4.len() + 6);
+    }
+
+    #[test]
+    fn test_learned_addresses() {
+        let mut learned = LearnedAddresses::new();
+        learned.queue("ads.example");
+        learned.queue("ads.example");
+        learned.queue("sinkholed.example");
+        let mut pending = learned.take_pending();
+        pending.sort();
+        assert_eq!(pending, vec!["ads.example", "sinkholed.example"]);
+
+        let ads: Vec<IpAddr> = vec!["203.0.113.7".parse().unwrap(), "2001:db8::7".parse().unwrap()];
+        learned.learn("ads.example".to_string(), ads, 1000);
+        learned.learn("sinkholed.example".to_string(), vec![IpAddr::from([0, 0, 0, 0])], 1000);
+        assert_eq!(learned.host_count(), 1);
+        assert_eq!(learned.prefixes().count(), 2);
+
+        // Known hosts are not resolved again until they expire
+        learned.queue("ads.example");
+        assert!(learned.take_pending().is_empty());
+        learned.expire(1000 + LEARNED_ADDRESS_TTL.as_secs());
+        assert_eq!(learned.host_count(), 0);
+    }
+
+    /// Cgroup v2 directory for the test, if this machine can run eBPF
+    fn test_cgroup() -> Option<std::path::PathBuf> {
+        let mounts = std::fs::read_to_string("/proc/self/mounts").ok()?;
+        let root = mounts
+            .lines()
+            .map(|line| line.split_whitespace().collect::<Vec<_>>())
+            .find(|fields| fields.get(2) == Some(&"cgroup2"))?
+            .get(1)?
+            .to_string();
+        let dir = Path::new(&root).join(format!("aubo-test-{}", std::process::id()));
+        std::fs::create_dir(&dir).ok()?;
+        Some(dir)
+    }
+
+    #[test]
+    fn test_kernel_blocks_connects() {
+        let Some(cgroup) = test_cgroup() else {
+            eprintln!("skipping: no writable cgroup v2 hierarchy");
+            return;
+        };
+        let mut filter = match ConnectFilter::attach(&cgroup, 64) {
+            Ok(filter) => filter,
+            Err(e) => {
+                eprintln!("skipping: {}", e);
+                let _ = std::fs::remove_dir(&cgroup);
+                return;
+            }
+        };
+
+        // Moving a process into the cgroup needs delegation this test may lack
+        let procs = cgroup.join("cgroup.procs");
+        let joined = Command::new("sh")
+            .arg("-c")
+            .arg(format!("echo $$ > {}", procs.display()))
+            .status()
+            .map_or(false, |status| status.success());
+        if !joined {
+            eprintln!("skipping: cannot move processes into {}", cgroup.display());
+            drop(filter);
+            let _ = std::fs::remove_dir(&cgroup);
+            return;
+        }
+
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let port = listener.local_addr().unwrap().port();
+        let connect_from_cgroup = |addr: &str| {
+            let script = format!(
+                "echo $$ > {}/cgroup.procs && exec 3<>/dev/tcp/{}/{}",
+                cgroup.display(),
+                addr,
+                port
+            );
+            Command::new("bash").arg("-c").arg(script).status().unwrap().success()
+        };
+
+        assert!(connect_from_cgroup("127.0.0.1"));
+        filter.block(IpPrefix::parse("127.0.0.0/8").unwrap()).unwrap();
+        assert!(!connect_from_cgroup("127.0.0.1"));
+        // This process is outside the cgroup and unaffected
+        assert!(std::net::TcpStream::connect(("127.0.0.1", port)).is_ok());
+
+        assert_eq!(filter.sync(IpPrefix::parse("10.0.0.1")), 0);
+        assert_eq!(filter.blocked_count(), 1);
+        assert!(connect_from_cgroup("127.0.0.1"));
+
+        drop(filter);
+        let _ = std::fs::remove_dir(&cgroup);
+    }
+
+    #[test]
+    fn test_stale_programs_are_detached() {
+        let Some(cgroup) = test_cgroup() else {
+            eprintln!("skipping: no writable cgroup v2 hierarchy");
+            return;
+        };
+        // A companion that died without detaching its plain attachments
+        match ConnectFilter::attach_with(&cgroup, 64, false) {
+            Ok(crashed) => std::mem::forget(crashed),
+            Err(e) => {
+                eprintln!("skipping: {}", e);
+                let _ = std::fs::remove_dir(&cgroup);
+                return;
+            }
+        }
+
+        let filter = ConnectFilter::attach(&cgroup, 64).unwrap();
+        let cgroup_dir = File::open(&cgroup).unwrap();
+        let named = |name: &str| {
+            attached_program_ids(&cgroup_dir, BPF_CGROUP_INET4_CONNECT)
+                .unwrap()
+                .into_iter()
+                .filter(|id| program_name(*id).map_or(false, |(_, attached)| attached == name))
+                .count()
+        };
+        assert_eq!(named("aubo_connect4"), 1);
+
+        // Nothing is left behind once the filter is gone
+        drop(filter);
+        assert_eq!(named("aubo_connect4"), 0);
+        let _ = std::fs::remove_dir(&cgroup);
+    }
+}
@@ -0,0 +1,236 @@
+//! Per-lookup latency budget for aubo-rs
+//!
+//! A hook must never hold an app's network call hostage. Every lookup gets
+//! `hooks.analysis_timeout` to produce a verdict: waiting for the system
+//! lock is bounded by the budget, and a verdict that arrives after it is
+//! dropped so the lookup goes through. Engine work cannot be interrupted
+//! halfway, so repeated breaches trip a circuit breaker that lets lookups
+//! through without asking the engine until a cooldown has passed. The first
+//! lookup after the cooldown is a probe: answering within budget closes the
+//! breaker, breaching it opens the breaker again.
+//!
+//! Timeouts, lookups let through by the open breaker and trips are counted
+//! and handed to the companion with the stats delta.
+
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+use log::{info, warn};
+use once_cell::sync::Lazy;
+
+use crate::config::HookConfig;
+
+/// Budget of the lookups made through the C hooks
+pub static LOOKUP_BUDGET: Lazy<LookupBudget> = Lazy::new(|| {
+    let defaults = HookConfig::default();
+    LookupBudget::new(defaults.analysis_timeout, defaults.breaker_threshold, defaults.breaker_cooldown)
+});
+
+/// Counts of budget enforcement since the last report
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct BudgetCounts {
+    /// Lookups that did not get a verdict within budget
+    pub timeouts: u64,
+    /// Lookups let through without a verdict by the open breaker
+    pub bypassed: u64,
+    /// Times the breaker opened
+    pub trips: u64,
+}
+
+/// Latency budget and circuit breaker shared by all lookups of a process
+#[derive(Debug)]
+pub struct LookupBudget {
+    budget_ns: AtomicU64,
+    threshold: AtomicU32,
+    cooldown_ms: AtomicU64,
+    epoch: Instant,
+    consecutive: AtomicU32,
+    /// Milliseconds since `epoch` until the next probe, 0 while closed
+    open_until: AtomicU64,
+    timeouts: AtomicU64,
+    bypassed: AtomicU64,
+    trips: AtomicU64,
+}
+
+impl LookupBudget {
+    /// Create a budget tripping after `threshold` consecutive breaches
+    ///
+    /// A zero budget disables enforcement and a zero threshold never trips
+    /// the breaker.
+    pub fn new(budget: Duration, threshold: u32, cooldown: Duration) -> Self {
+        let lookup_budget = Self {
+            budget_ns: AtomicU64::new(0),
+            threshold: AtomicU32::new(0),
+            cooldown_ms: AtomicU64::new(0),
+            epoch: Instant::now(),
+            consecutive: AtomicU32::new(0),
+            open_until: AtomicU64::new(0),
+            timeouts: AtomicU64::new(0),
+            bypassed: AtomicU64::new(0),
+            trips: AtomicU64::new(0),
+        };
+        lookup_budget.set_limits(budget, threshold, cooldown);
+        lookup_budget
+    }
+
+    /// Apply the configured budget, closing the breaker
+    pub fn configure(&self, config: &HookConfig) {
+        self.set_limits(config.analysis_timeout, config.breaker_threshold, config.breaker_cooldown);
+        self.consecutive.store(0, Ordering::Relaxed);
+        self.open_until.store(0, Ordering::Release);
+    }
+
+    fn set_limits(&self, budget: Duration, threshold: u32, cooldown: Duration) {
+        self.budget_ns.store(budget.as_nanos().min(u64::MAX as u128) as u64, Ordering::Relaxed);
+        self.threshold.store(threshold, Ordering::Relaxed);
+        self.cooldown_ms.store(cooldown.as_millis().max(1).min(u64::MAX as u128) as u64, Ordering::Relaxed);
+    }
+
+    /// Get the time a lookup may take, `None` when enforcement is off
+    pub fn limit(&self) -> Option<Duration> {
+        match self.budget_ns.load(Ordering::Relaxed) {
+            0 => None,
+            ns => Some(Duration::from_nanos(ns)),
+        }
+    }
+
+    /// Check whether a lookup may ask the engine
+    ///
+    /// Returns false while the breaker is open, in which case the lookup
+    /// must go through. Once the cooldown has passed, one caller is let in
+    /// as the probe and the others keep going through until it reports.
+    pub fn admit(&self) -> bool {
+        let until = self.open_until.load(Ordering::Acquire);
+        if until == 0 {
+            return true;
+        }
+        let now = self.now_ms();
+        let probe = now >= until
+            && self
+                .open_until
+                .compare_exchange(until, now + self.cooldown_ms.load(Ordering::Relaxed), Ordering::AcqRel, Ordering::Relaxed)
+                .is_ok();
+        if !probe {
+            self.bypassed.fetch_add(1, Ordering::Relaxed);
+        }
+        probe
+    }
+
+    /// Report how long an admitted lookup took
+    ///
+    /// Returns whether it stayed within budget; a verdict from a lookup
+    /// that did not must be dropped.
+    pub fn record(&self, elapsed: Duration) -> bool {
+        match self.limit() {
+            Some(limit) if elapsed > limit => {
+                self.breach();
+                false
+            }
+            _ => {
+                self.consecutive.store(0, Ordering::Relaxed);
+                if self.open_until.load(Ordering::Relaxed) != 0 && self.open_until.swap(0, Ordering::AcqRel) != 0 {
+                    info!("Lookup budget met again, circuit breaker closed");
+                }
+                true
+            }
+        }
+    }
+
+    /// Count a lookup that ran out of budget
+    pub fn breach(&self) {
+        self.timeouts.fetch_add(1, Ordering::Relaxed);
+        let breaches = self.consecutive.fetch_add(1, Ordering::Relaxed).saturating_add(1);
+        let threshold = self.threshold.load(Ordering::Relaxed);
+        if threshold == 0 || breaches < threshold {
+            return;
+        }
+        let cooldown = self.cooldown_ms.load(Ordering::Relaxed);
+        if self.open_until.swap(self.now_ms() + cooldown, Ordering::AcqRel) == 0 {
+            self.trips.fetch_add(1, Ordering::Relaxed);
+            warn!(
+                "{} lookups in a row exceeded the budget, letting lookups through for {}ms",
+                breaches, cooldown
+            );
+        }
+    }
+
+    /// Check whether the breaker currently lets lookups through
+    pub fn is_open(&self) -> bool {
+        self.open_until.load(Ordering::Acquire) != 0
+    }
+
+    /// Take the counts recorded since the last call
+    pub fn take_counts(&self) -> BudgetCounts {
+        BudgetCounts {
+            timeouts: self.timeouts.swap(0, Ordering::Relaxed),
+            bypassed: self.bypassed.swap(0, Ordering::Relaxed),
+            trips: self.trips.swap(0, Ordering::Relaxed),
+        }
+    }
+
+    /// Milliseconds since creation, never 0 so 0 can mean closed
+    fn now_ms(&self) -> u64 {
+        self.epoch.elapsed().as_millis() as u64 + 1
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_breaker_trips_and_recovers() {
+        let budget = LookupBudget::new(Duration::from_millis(5), 3, Duration::from_millis(20));
+        assert!(budget.admit());
+        assert!(budget.record(Duration::from_millis(1)));
+
+        for _ in 0..2 {
+            assert!(budget.admit());
+            assert!(!budget.record(Duration::from_millis(10)));
+        }
+        assert!(!budget.is_open());
+        // A lookup within budget resets the streak
+        assert!(budget.record(Duration::from_millis(1)));
+        for _ in 0..3 {
+            assert!(!budget.record(Duration::from_millis(10)));
+        }
+        assert!(budget.is_open());
+        assert!(!budget.admit());
+        assert!(!budget.admit());
+
+        std::thread::sleep(Duration::from_millis(25));
+        // One probe gets through, the others wait for its result
+        assert!(budget.admit());
+        assert!(!budget.admit());
+        assert!(budget.record(Duration::from_millis(1)));
+        assert!(!budget.is_open());
+        assert!(budget.admit());
+
+        let counts = budget.take_counts();
+        assert_eq!(counts, BudgetCounts { timeouts: 5, bypassed: 3, trips: 1 });
+        assert_eq!(budget.take_counts(), BudgetCounts::default());
+    }
+
+    #[test]
+    fn test_failed_probe_reopens() {
+        let budget = LookupBudget::new(Duration::from_millis(5), 1, Duration::from_millis(10));
+        budget.breach();
+        assert!(budget.is_open());
+
+        std::thread::sleep(Duration::from_millis(15));
+        assert!(budget.admit());
+        assert!(!budget.record(Duration::from_millis(10)));
+        assert!(!budget.admit());
+        // Reopening after a probe is not a new trip
+        assert_eq!(budget.take_counts().trips, 1);
+    }
+
+    #[test]
+    fn test_zero_budget_disables_enforcement() {
+        let budget = LookupBudget::new(Duration::ZERO, 1, Duration::from_secs(1));
+        assert_eq!(budget.limit(), None);
+        assert!(budget.record(Duration::from_secs(10)));
+        assert!(budget.admit());
+        assert_eq!(budget.take_counts(), BudgetCounts::default());
+    }
+}
@@ -0,0 +1,618 @@
+//! Verdict cache for aubo-rs
+//!
+//! Hosts looked up through the DNS hooks repeat heavily within an app, so the
+//! engine remembers recent verdicts. The cache is split into shards, and each
+//! shard keeps two generations: new entries go into the hot generation, and
+//! when it fills up it becomes the cold generation and the previous cold one
+//! is dropped. Hits in the cold generation are promoted back to hot. This
+//! gives LRU-like behaviour without per-hit bookkeeping, and lets memory
+//! pressure drop the cold tier in one step.
+//!
+//! When a cold generation is dropped, the hashes of its keys are kept as
+//! ghost entries. A miss that finds a ghost would have been a hit with a
+//! larger cache, which is what [`CacheTuner`] uses to size each app's cache
+//! to its working set. Tuned sizes are remembered per app in
+//! [`CacheSizeStore`].
+
+use std::collections::{HashMap, HashSet};
+use std::fs;
+use std::mem::size_of;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+
+use ahash::RandomState;
+use parking_lot::Mutex;
+use serde::{Deserialize, Serialize};
+
+use crate::error::Result;
+use crate::memory::hash_table_bytes;
+
+/// Number of independently locked shards
+const SHARD_COUNT: usize = 16;
+
+/// Smallest capacity the tuner will shrink a cache to
+pub const MIN_TUNED_CAPACITY: usize = 256;
+
+/// Lookups needed before a tuning decision is made
+const TUNE_WINDOW_LOOKUPS: u64 = 512;
+
+/// Share of lookups hitting ghosts that makes the cache grow
+const GROW_GHOST_RATIO: f64 = 0.05;
+
+/// Share of lookups hitting ghosts below which the cache may shrink
+const SHRINK_GHOST_RATIO: f64 = 0.01;
+
+/// Hit ratio below which caching is considered not to help
+const USELESS_HIT_RATIO: f64 = 0.10;
+
+type Generation = HashMap<Box<str>, bool, RandomState>;
+
+/// Hashes of recently evicted keys
+type Ghosts = HashSet<u64, RandomState>;
+
+/// One lock-protected slice of the cache
+#[derive(Default)]
+struct CacheShard {
+    hot: Generation,
+    cold: Generation,
+    /// Keys of the last evicted generation
+    ghosts: Ghosts,
+    /// Keys of the generation evicted before that
+    old_ghosts: Ghosts,
+}
+
+impl CacheShard {
+    /// Hot generation size at which the shard rotates
+    fn rotate_at(capacity: usize) -> usize {
+        (capacity / 2).max(1)
+    }
+
+    fn rotate(&mut self, hasher: &RandomState) {
+        let evicted = std::mem::replace(&mut self.cold, std::mem::take(&mut self.hot));
+        self.remember(evicted, hasher);
+    }
+
+    /// Record the keys of an evicted generation as ghosts
+    ///
+    /// Two evicted generations are kept, so ghosts cover about as many keys
+    /// as the shard itself and reveal working sets up to twice its size.
+    fn remember(&mut self, evicted: Generation, hasher: &RandomState) {
+        self.old_ghosts = std::mem::take(&mut self.ghosts);
+        self.ghosts.extend(evicted.keys().map(|key| hasher.hash_one(&**key)));
+    }
+
+    fn is_ghost(&self, hash: u64) -> bool {
+        self.ghosts.contains(&hash) || self.old_ghosts.contains(&hash)
+    }
+
+    fn forget_ghosts(&mut self) {
+        self.ghosts = Ghosts::default();
+        self.old_ghosts = Ghosts::default();
+    }
+
+    fn heap_bytes(&self) -> usize {
+        let generations: usize = [&self.hot, &self.cold]
+            .iter()
+            .map(|generation| {
+                hash_table_bytes(generation.capacity(), size_of::<(Box<str>, bool)>())
+                    + generation.keys().map(|key| key.len()).sum::<usize>()
+            })
+            .sum();
+        generations
+            + hash_table_bytes(self.ghosts.capacity(), size_of::<u64>())
+            + hash_table_bytes(self.old_ghosts.capacity(), size_of::<u64>())
+    }
+}
+
+/// Lifetime lookup counters of a cache
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct CacheCounters {
+    /// Lookups answered from the cache
+    pub hits: u64,
+    /// Lookups not answered from the cache
+    pub misses: u64,
+    /// Misses on keys that were recently evicted
+    pub ghost_hits: u64,
+}
+
+impl CacheCounters {
+    fn since(&self, earlier: &CacheCounters) -> CacheCounters {
+        CacheCounters {
+            hits: self.hits.saturating_sub(earlier.hits),
+            misses: self.misses.saturating_sub(earlier.misses),
+            ghost_hits: self.ghost_hits.saturating_sub(earlier.ghost_hits),
+        }
+    }
+
+    fn lookups(&self) -> u64 {
+        self.hits + self.misses
+    }
+}
+
+/// Sharded, generational host verdict cache
+pub struct VerdictCache {
+    shards: Box<[Mutex<CacheShard>]>,
+    hasher: RandomState,
+    /// Total capacity across all shards; zero disables caching
+    capacity: AtomicUsize,
+    hits: AtomicU64,
+    misses: AtomicU64,
+    ghost_hits: AtomicU64,
+}
+
+impl VerdictCache {
+    /// Create a cache holding at most `capacity` verdicts
+    pub fn new(capacity: usize) -> Self {
+        let shards = (0..SHARD_COUNT)
+            .map(|_| Mutex::new(CacheShard::default()))
+            .collect::<Vec<_>>()
+            .into_boxed_slice();
+
+        Self {
+            shards,
+            hasher: RandomState::new(),
+            capacity: AtomicUsize::new(capacity),
+            hits: AtomicU64::new(0),
+            misses: AtomicU64::new(0),
+            ghost_hits: AtomicU64::new(0),
+        }
+    }
+
+    fn shard_for(&self, hash: u64) -> &Mutex<CacheShard> {
+        &self.shards[(hash as usize) % SHARD_COUNT]
+    }
+
+    fn shard_capacity(&self) -> usize {
+        self.capacity.load(Ordering::Relaxed).div_ceil(SHARD_COUNT)
+    }
+
+    /// Look up a cached verdict
+    pub fn get(&self, key: &str) -> Option<bool> {
+        if self.capacity.load(Ordering::Relaxed) == 0 {
+            return None;
+        }
+
+        let shard_capacity = self.shard_capacity();
+        let hash = self.hasher.hash_one(key);
+        let mut shard = self.shard_for(hash).lock();
+
+        let verdict = if let Some(&verdict) = shard.hot.get(key) {
+            Some(verdict)
+        } else if let Some((key, verdict)) = shard.cold.remove_entry(key) {
+            // Promote so the entry survives the next rotation
+            if shard.hot.len() >= CacheShard::rotate_at(shard_capacity) {
+                shard.rotate(&self.hasher);
+            }
+            shard.hot.insert(key, verdict);
+            Some(verdict)
+        } else {
+            None
+        };
+        let ghost = verdict.is_none() && shard.is_ghost(hash);
+        drop(shard);
+
+        match verdict {
+            Some(_) => self.hits.fetch_add(1, Ordering::Relaxed),
+            None => self.misses.fetch_add(1, Ordering::Relaxed),
+        };
+        if ghost {
+            self.ghost_hits.fetch_add(1, Ordering::Relaxed);
+        }
+        verdict
+    }
+
+    /// Store a verdict
+    pub fn insert(&self, key: &str, verdict: bool) {
+        let shard_capacity = self.shard_capacity();
+        if shard_capacity == 0 {
+            return;
+        }
+
+        let mut shard = self.shard_for(self.hasher.hash_one(key)).lock();
+        if shard.hot.len() >= CacheShard::rotate_at(shard_capacity) {
+            shard.rotate(&self.hasher);
+        }
+        shard.hot.insert(key.into(), verdict);
+    }
+
+    /// Get up to `limit` recently used verdicts, taken from the hot generations
+    pub fn hottest(&self, limit: usize) -> Vec<(String, bool)> {
+        let per_shard = limit.div_ceil(SHARD_COUNT);
+        let mut entries = Vec::with_capacity(limit);
+        for shard in self.shards.iter() {
+            let shard = shard.lock();
+            entries.extend(
+                shard
+                    .hot
+                    .iter()
+                    .take(per_shard)
+                    .map(|(key, &verdict)| (key.to_string(), verdict)),
+            );
+        }
+        entries.truncate(limit);
+        entries
+    }
+
+    /// Insert verdicts remembered from an earlier process
+    pub fn preload<'a>(&self, entries: impl IntoIterator<Item = (&'a str, bool)>) {
+        for (key, verdict) in entries {
+            self.insert(key, verdict);
+        }
+    }
+
+    /// Drop the cold generation and ghost entries of every shard
+    pub fn shed_cold(&self) {
+        for shard in self.shards.iter() {
+            let mut shard = shard.lock();
+            shard.cold = Generation::default();
+            shard.forget_ghosts();
+        }
+    }
+
+    /// Remove every cached verdict and release the backing memory
+    pub fn clear(&self) {
+        for shard in self.shards.iter() {
+            *shard.lock() = CacheShard::default();
+        }
+    }
+
+    /// Change the capacity, trimming entries that no longer fit
+    pub fn set_capacity(&self, capacity: usize) {
+        let previous = self.capacity.swap(capacity, Ordering::Relaxed);
+        if capacity >= previous {
+            return;
+        }
+
+        let rotate_at = CacheShard::rotate_at(capacity.div_ceil(SHARD_COUNT));
+        for shard in self.shards.iter() {
+            let mut shard = shard.lock();
+            if capacity == 0 || shard.hot.len() > rotate_at {
+                *shard = CacheShard::default();
+            } else {
+                shard.cold = Generation::default();
+                shard.forget_ghosts();
+            }
+        }
+    }
+
+    /// Get the configured capacity
+    pub fn capacity(&self) -> usize {
+        self.capacity.load(Ordering::Relaxed)
+    }
+
+    /// Get the number of cached verdicts
+    pub fn len(&self) -> usize {
+        self.shards
+            .iter()
+            .map(|shard| {
+                let shard = shard.lock();
+                shard.hot.len() + shard.cold.len()
+            })
+            .sum()
+    }
+
+    /// Get the heap bytes held by cached verdicts, including table overhead
+    pub fn heap_bytes(&self) -> usize {
+        self.shards.iter().map(|shard| shard.lock().heap_bytes()).sum()
+    }
+
+    /// Check if the cache holds no verdicts
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Get the lifetime hit and miss counts
+    pub fn hit_stats(&self) -> (u64, u64) {
+        (
+            self.hits.load(Ordering::Relaxed),
+            self.misses.load(Ordering::Relaxed),
+        )
+    }
+
+    /// Get the lifetime lookup counters, including ghost hits
+    pub fn counters(&self) -> CacheCounters {
+        CacheCounters {
+            hits: self.hits.load(Ordering::Relaxed),
+            misses: self.misses.load(Ordering::Relaxed),
+            ghost_hits: self.ghost_hits.load(Ordering::Relaxed),
+        }
+    }
+}
+
+/// Sizes a cache to its observed working set
+///
+/// The tuner looks at lookups since its last decision. Frequent ghost hits
+/// mean recently evicted entries are being asked for again, so the cache
+/// grows. A cache that rarely hits, or whose contents stay well below its
+/// capacity, shrinks. Sizes always stay within the tuner's bounds.
+#[derive(Debug)]
+pub struct CacheTuner {
+    min_capacity: usize,
+    max_capacity: AtomicUsize,
+    target: AtomicUsize,
+    window_start: Mutex<CacheCounters>,
+}
+
+impl CacheTuner {
+    /// Create a tuner starting at `initial`, clamped to the bounds
+    pub fn new(min_capacity: usize, max_capacity: usize, initial: usize) -> Self {
+        let max_capacity = max_capacity.max(min_capacity);
+        Self {
+            min_capacity,
+            max_capacity: AtomicUsize::new(max_capacity),
+            target: AtomicUsize::new(initial.clamp(min_capacity, max_capacity)),
+            window_start: Mutex::new(CacheCounters::default()),
+        }
+    }
+
+    /// Get the capacity the cache should have without memory pressure
+    pub fn target(&self) -> usize {
+        self.target.load(Ordering::Relaxed)
+    }
+
+    /// Get the upper bound
+    pub fn max_capacity(&self) -> usize {
+        self.max_capacity.load(Ordering::Relaxed)
+    }
+
+    /// Change the upper bound, lowering the target if needed
+    pub fn set_max_capacity(&self, max_capacity: usize) {
+        let max_capacity = max_capacity.max(self.min_capacity);
+        self.max_capacity.store(max_capacity, Ordering::Relaxed);
+        self.target.fetch_min(max_capacity, Ordering::Relaxed);
+    }
+
+    /// Evaluate the lookups since the last decision
+    ///
+    /// Returns the new target capacity if it changed. Nothing is decided
+    /// until enough lookups have been observed.
+    pub fn observe(&self, cache: &VerdictCache) -> Option<usize> {
+        let counters = cache.counters();
+        let mut window_start = self.window_start.lock();
+        let window = counters.since(&window_start);
+        if window.lookups() < TUNE_WINDOW_LOOKUPS {
+            return None;
+        }
+        *window_start = counters;
+
+        let current = self.target();
+        let proposed = propose_capacity(&window, current, cache.len())
+            .clamp(self.min_capacity, self.max_capacity());
+        if proposed == current {
+            return None;
+        }
+
+        self.target.store(proposed, Ordering::Relaxed);
+        Some(proposed)
+    }
+}
+
+/// Pick a capacity for one observation window
+fn propose_capacity(window: &CacheCounters, capacity: usize, len: usize) -> usize {
+    let lookups = window.lookups().max(1) as f64;
+    let ghost_ratio = window.ghost_hits as f64 / lookups;
+    let hit_ratio = window.hits as f64 / lookups;
+
+    if ghost_ratio >= GROW_GHOST_RATIO {
+        return capacity.saturating_mul(2);
+    }
+    if ghost_ratio < SHRINK_GHOST_RATIO {
+        if hit_ratio < USELESS_HIT_RATIO {
+            return capacity / 2;
+        }
+        // The working set fits in a fraction of the cache
+        if len < capacity / 4 {
+            return len * 2;
+        }
+    }
+    capacity
+}
+
+/// Tuned cache capacities per app, persisted across launches
+#[derive(Debug, Default, Serialize, Deserialize)]
+pub struct CacheSizeStore {
+    #[serde(skip)]
+    path: PathBuf,
+    sizes: HashMap<String, usize>,
+}
+
+impl CacheSizeStore {
+    /// Load the store, starting empty if the file is missing or unreadable
+    pub fn load(path: impl AsRef<Path>) -> Self {
+        let path = path.as_ref().to_path_buf();
+        let mut store: Self = fs::read_to_string(&path)
+            .ok()
+            .and_then(|content| serde_json::from_str(&content).ok())
+            .unwrap_or_default();
+        store.path = path;
+        store
+    }
+
+    /// Get the remembered capacity of an app
+    pub fn get(&self, app: &str) -> Option<usize> {
+        self.sizes.get(app).copied()
+    }
+
+    /// Remember the capacity of an app
+    pub fn set(&mut self, app: &str, capacity: usize) {
+        self.sizes.insert(app.to_string(), capacity);
+    }
+
+    /// Write the store back to its file
+    pub fn save(&self) -> Result<()> {
+        let content = serde_json::to_string(self)?;
+        fs::write(&self.path, content)?;
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_insert_and_get() {
+        let cache = VerdictCache::new(1000);
+        cache.insert("ads.example.com", true);
+        cache.insert("example.com", false);
+
+        assert_eq!(cache.get("ads.example.com"), Some(true));
+        assert_eq!(cache.get("example.com"), Some(false));
+        assert_eq!(cache.get("unknown.com"), None);
+        assert_eq!(cache.hit_stats(), (2, 1));
+        assert!(cache.heap_bytes() >= "ads.example.com".len() + "example.com".len());
+    }
+
+    #[test]
+    fn test_capacity_is_bounded() {
+        let cache = VerdictCache::new(160);
+        for i in 0..10_000 {
+            cache.insert(&format!("host{}.example.com", i), i % 2 == 0);
+        }
+
+        // Each shard holds at most two generations of half its capacity
+        assert!(cache.len() <= 160 + SHARD_COUNT * 2, "len = {}", cache.len());
+    }
+
+    #[test]
+    fn test_cold_hits_are_promoted() {
+        let cache = VerdictCache::new(SHARD_COUNT * 4);
+        cache.insert("keep.example.com", true);
+
+        // Keep touching the entry while filling the cache
+        for i in 0..1000 {
+            cache.insert(&format!("filler{}.example.com", i), false);
+            assert_eq!(cache.get("keep.example.com"), Some(true));
+        }
+    }
+
+    #[test]
+    fn test_shed_cold_and_clear() {
+        let cache = VerdictCache::new(SHARD_COUNT * 4);
+        for i in 0..1000 {
+            cache.insert(&format!("host{}.example.com", i), true);
+        }
+        let before = cache.len();
+
+        cache.shed_cold();
+        assert!(cache.len() < before);
+
+        cache.clear();
+        assert!(cache.is_empty());
+        assert_eq!(cache.heap_bytes(), 0);
+    }
+
+    #[test]
+    fn test_evicted_keys_become_ghosts() {
+        let cache = VerdictCache::new(SHARD_COUNT * 2);
+        for i in 0..1000 {
+            cache.insert(&format!("host{}.example.com", i), false);
+        }
+
+        // Re-requesting recently evicted hosts is counted as a ghost hit
+        for i in 900..1000 {
+            cache.get(&format!("host{}.example.com", i));
+        }
+        let counters = cache.counters();
+        assert!(counters.ghost_hits > 0);
+        assert!(counters.ghost_hits <= counters.misses);
+
+        cache.clear();
+        cache.get("host999.example.com");
+        assert_eq!(cache.counters().ghost_hits, counters.ghost_hits);
+    }
+
+    #[test]
+    fn test_tuner_grows_on_ghost_hits() {
+        let cache = VerdictCache::new(SHARD_COUNT * 4);
+        let tuner = CacheTuner::new(SHARD_COUNT, SHARD_COUNT * 32, SHARD_COUNT * 4);
+
+        // A working set somewhat larger than the cache keeps hitting ghosts
+        for _ in 0..8 {
+            for i in 0..90 {
+                let host = format!("host{}.example.com", i);
+                if cache.get(&host).is_none() {
+                    cache.insert(&host, false);
+                }
+            }
+        }
+
+        let target = tuner.observe(&cache).unwrap();
+        assert_eq!(target, SHARD_COUNT * 8);
+        assert_eq!(tuner.observe(&cache), None);
+    }
+
+    #[test]
+    fn test_tuner_shrinks_to_working_set_within_bounds() {
+        let cache = VerdictCache::new(10_000);
+        let tuner = CacheTuner::new(MIN_TUNED_CAPACITY, 20_000, 10_000);
+
+        // Ten hosts looked up over and over
+        for i in 0..TUNE_WINDOW_LOOKUPS {
+            let host = format!("host{}.example.com", i % 10);
+            if cache.get(&host).is_none() {
+                cache.insert(&host, true);
+            }
+        }
+        assert_eq!(tuner.observe(&cache), Some(MIN_TUNED_CAPACITY));
+
+        tuner.set_max_capacity(100);
+        assert_eq!(tuner.target(), MIN_TUNED_CAPACITY);
+    }
+
+    #[test]
+    fn test_propose_capacity() {
+        let useless = CacheCounters { hits: 10, misses: 990, ghost_hits: 0 };
+        assert_eq!(propose_capacity(&useless, 1000, 1000), 500);
+
+        let steady = CacheCounters { hits: 900, misses: 100, ghost_hits: 20 };
+        assert_eq!(propose_capacity(&steady, 1000, 900), 1000);
+    }
+
+    #[test]
+    fn test_cache_size_store_round_trip() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("cache_sizes.json");
+
+        let mut store = CacheSizeStore::load(&path);
+        assert_eq!(store.get("com.example.app"), None);
+        store.set("com.example.app", 4096);
+        store.save().unwrap();
+
+        let store = CacheSizeStore::load(&path);
+        assert_eq!(store.get("com.example.app"), Some(4096));
+    }
+
+    #[test]
+    fn test_hottest_and_preload() {
+        let cache = VerdictCache::new(1000);
+        for i in 0..100 {
+            cache.insert(&format!("host{}.example.com", i), i % 2 == 0);
+        }
+
+        let hottest = cache.hottest(32);
+        assert!(!hottest.is_empty() && hottest.len() <= 32);
+
+        let warm = VerdictCache::new(1000);
+        warm.preload(hottest.iter().map(|(host, verdict)| (host.as_str(), *verdict)));
+        for (host, verdict) in &hottest {
+            assert_eq!(warm.get(host), Some(*verdict));
+        }
+    }
+
+    #[test]
+    fn test_zero_capacity_disables_cache() {
+        let cache = VerdictCache::new(1000);
+        cache.insert("example.com", true);
+
+        cache.set_capacity(0);
+        assert!(cache.is_empty());
+
+        cache.insert("example.com", true);
+        assert_eq!(cache.get("example.com"), None);
+
+        cache.set_capacity(1000);
+        cache.insert("example.com", true);
+        assert_eq!(cache.get("example.com"), Some(true));
+    }
+}
@@ -0,0 +1,1760 @@
+//! Companion process protocol for aubo-rs
+//!
+//! App processes cannot write to `/data/adb`, so anything that must outlive
+//! an app process goes through the ZygiskNext companion, which runs as root.
+//! Each app holds one connection for its lifetime. Messages are JSON frames
+//! prefixed with their length and a request id, both little-endian `u32`;
+//! every request gets exactly one response carrying its id. An app that gave
+//! up waiting skips the late response when it arrives.
+//!
+//! The companion keeps a warm verdict cache per app: the hottest hosts and
+//! their verdicts, tagged with the fingerprint of the rule set that produced
+//! them. A new process of the same app preloads these verdicts before its
+//! hooks go live, so its first lookups are cache hits. Verdicts from a
+//! different rule set are discarded.
+//!
+//! Apps also forward their stats deltas, which the companion appends to the
+//! [`StatsJournal`], the only place stats are written to storage, and
+//! folds into the [`TimeSeries`] rings for trends over time. Their
+//! distinct-host sketches are merged per app and kept next to the warm
+//! caches. With detailed logging, the most recent lookups of each app are
+//! kept in memory for inspection.
+//!
+//! Status changes and kernel-log lines from every app land on one
+//! [`StatusBoard`], which writes them out in batches. Reported deltas also
+//! feed the [`LiveMetrics`] served on the control socket, and commands from
+//! that socket reach apps when they poll with their stats reports.
+//!
+//! Apps can move their connection to a [`SharedChannel`] once it is open:
+//! requests then go through shared memory and the socket only tells the
+//! companion when the app is gone.
+//!
+//! With a [`WorkerPool`], connection threads only move frames: requests
+//! run on the pool's workers behind one bounded queue, and file writes are
+//! handed to the pool as follow-up jobs. When the queue is full the app is
+//! told the companion is busy and carries on without it.
+//!
+//! With shadow evaluation, `reload` only reaches apps once a candidate
+//! engine built from the reloaded rules has been replayed against hosts the
+//! apps reported and passed the [`ShadowReport`] thresholds.
+//!
+//! With kernel connect blocking, the companion owns the [`ConnectFilter`]
+//! and keeps its tries filled with the blocked IPs of the rules and the
+//! addresses of hosts the apps blocked.
+
+use std::collections::{HashMap, HashSet, VecDeque};
+use std::fs;
+use std::io::{ErrorKind, Read, Write};
+use std::net::ToSocketAddrs;
+use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
+use std::os::unix::net::UnixStream;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::Duration;
+
+use log::{debug, info, warn};
+use parking_lot::Mutex;
+use serde::{Deserialize, Serialize};
+
+use crate::bpf::{ConnectFilter, KernelBlocklist};
+use crate::config::AuboConfig;
+use crate::control::{
+    render_pool_metrics, AppCommand, ControlCommand, ControlModes, ControlState, ControlUpdate, LiveMetrics, USAGE,
+};
+use crate::engine::{host_of, Explanation, FilterEngine};
+use crate::error::{Result, ZygiskError};
+use crate::journal::StatsJournal;
+use crate::pool::WorkerPool;
+use crate::shm::{self, SharedChannel, Wait};
+use crate::reqlog::RequestRecord;
+use crate::shadow::{ShadowGate, ShadowReport};
+use crate::sketch::{host_hash, HostCardinality, HostSketches};
+use crate::slowlog::{tier_name, SLOW_SAMPLES};
+use crate::stats::{StatsCollector, StatsDelta};
+use crate::status::{StatusBoard, StatusEvent};
+use crate::timeseries::{Resolution, TimeSeries, TimeSeriesPoint};
+use crate::upstream::TOP_HOSTS;
+use crate::utils::{PeriodicTask, TimeUtils};
+
+/// Largest frame either side accepts
+pub const MAX_FRAME_BYTES: usize = 1024 * 1024;
+
+/// Length and request id in front of each frame
+const FRAME_HEADER_BYTES: usize = 8;
+
+/// Hosts kept per app in the warm cache
+pub const WARM_CACHE_ENTRIES: usize = 512;
+
+/// How often a companion thread serving a shared channel checks the socket
+const SHARED_CHANNEL_IDLE_CHECK: Duration = Duration::from_millis(500);
+
+/// How long an app waits for the companion before giving up
+pub const CLIENT_TIMEOUT: Duration = Duration::from_millis(250);
+
+/// Request log records sent per frame
+pub const REQUEST_LOG_CHUNK: usize = 2048;
+
+/// Directory below the data directory holding warm caches
+const WARM_CACHE_DIR: &str = "warm";
+
+/// Directory below the data directory holding host sketches
+const HOST_SKETCH_DIR: &str = "hosts";
+
+/// File extension of host sketches
+const HOST_SKETCH_EXTENSION: &str = "hll";
+
+/// File in the data directory the `dropped-rules` command writes
+const DROPPED_RULES_FILE: &str = "dropped_rules.txt";
+
+/// Message sent by an app process
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+#[serde(tag = "type", rename_all = "snake_case")]
+pub enum Request {
+    /// Fetch the warm cache of an app for a rule set
+    LoadWarmCache {
+        /// App process name
+        app: String,
+        /// Fingerprint of the app's rule set
+        fingerprint: u64,
+    },
+    /// Replace the warm cache of an app
+    StoreWarmCache {
+        /// App process name
+        app: String,
+        /// Fingerprint of the rule set that produced the verdicts
+        fingerprint: u64,
+        /// Hosts and whether they were blocked
+        entries: Vec<(String, bool)>,
+    },
+    /// Add an app's stats changes to the live metrics, and to the journal
+    /// and time series when they are kept
+    RecordStats {
+        /// App process name
+        app: String,
+        /// Counter changes since the app's previous report
+        delta: StatsDelta,
+    },
+    /// Fetch the lifetime stats as JSON
+    ExportStats,
+    /// Fetch one time-series ring
+    ExportTimeSeries {
+        /// Ring to export
+        resolution: Resolution,
+    },
+    /// Fetch the distinct-host estimates of every app
+    ExportHostCardinality,
+    /// Add lookups from an app's request log
+    RecordRequests {
+        /// App process name
+        app: String,
+        /// Records logged since the app's previous report, oldest first
+        records: Vec<RequestRecord>,
+    },
+    /// Fetch the recent lookups of an app
+    ExportRequestLog {
+        /// App process name
+        app: String,
+        /// Only return lookups of this host
+        host: Option<String>,
+    },
+    /// Report status changes and kernel-log lines
+    ReportStatus {
+        /// App process name
+        app: String,
+        /// Events queued since the app's previous report, oldest first
+        events: Vec<StatusEvent>,
+    },
+    /// Fetch commands from the control socket
+    PollControl {
+        /// Generation of the app's previous poll, `None` on the first one
+        since: Option<u64>,
+    },
+    /// Move further requests to a shared-memory channel
+    ///
+    /// Only valid on a UNIX socket; the region's descriptor follows the
+    /// response.
+    OpenSharedChannel,
+}
+
+/// Message sent by the companion
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+#[serde(tag = "type", rename_all = "snake_case")]
+pub enum Response {
+    /// The request was handled
+    Ok,
+    /// Warm cache entries, empty if none matched the fingerprint
+    WarmCache {
+        /// Hosts and whether they were blocked
+        entries: Vec<(String, bool)>,
+    },
+    /// Lifetime stats rendered as JSON
+    Stats {
+        /// Pretty-printed stats
+        json: String,
+    },
+    /// Slots of a time-series ring, oldest first
+    TimeSeries {
+        /// Ring the points come from
+        resolution: Resolution,
+        /// One point per slot
+        points: Vec<TimeSeriesPoint>,
+    },
+    /// Distinct-host estimates per app
+    HostCardinality {
+        /// One entry per app, sorted by name
+        apps: Vec<AppHostCardinality>,
+    },
+    /// Recent lookups of an app, oldest first
+    RequestLog {
+        /// Logged lookups
+        records: Vec<RequestRecord>,
+    },
+    /// Commands and modes for a polling app
+    Control {
+        /// Commands since the app's previous poll and the current modes
+        update: ControlUpdate,
+    },
+    /// A shared-memory channel was created; its descriptor follows
+    SharedChannel,
+    /// The request failed
+    Error {
+        /// Failure description
+        message: String,
+    },
+}
+
+/// Distinct hosts contacted by one app
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct AppHostCardinality {
+    /// App process name, sanitized as in file names
+    pub app: String,
+    /// Estimated distinct hosts looked up
+    pub distinct_hosts: u64,
+    /// Estimated distinct hosts blocked
+    pub distinct_blocked_hosts: u64,
+}
+
+/// Write one JSON frame tagged with request `id`
+pub fn write_frame<W: Write, T: Serialize>(writer: &mut W, id: u32, message: &T) -> Result<()> {
+    let mut frame = Vec::new();
+    encode_frame(&mut frame, id, message)?;
+    writer.write_all(&frame)?;
+    writer.flush()?;
+    Ok(())
+}
+
+/// Read one JSON frame with its request id, or `None` on a clean end of
+/// stream
+pub fn read_frame<R: Read, T: for<'de> Deserialize<'de>>(reader: &mut R) -> Result<Option<(u32, T)>> {
+    let mut header = [0u8; FRAME_HEADER_BYTES];
+    match reader.read_exact(&mut header) {
+        Ok(()) => {}
+        Err(e) if e.kind() == ErrorKind::UnexpectedEof => return Ok(None),
+        Err(e) => return Err(e.into()),
+    }
+
+    let (len, id) = decode_header(&header)?;
+    let mut payload = vec![0u8; len];
+    reader.read_exact(&mut payload)?;
+    Ok(Some((id, serde_json::from_slice(&payload)?)))
+}
+
+/// Append the frame for `message` to `frame`
+fn encode_frame<T: Serialize>(frame: &mut Vec<u8>, id: u32, message: &T) -> Result<()> {
+    let payload = serde_json::to_vec(message)?;
+    if payload.len() > MAX_FRAME_BYTES {
+        return Err(ZygiskError::IpcError {
+            reason: format!("frame of {} bytes exceeds limit", payload.len()),
+        }
+        .into());
+    }
+
+    frame.extend_from_slice(&(payload.len() as u32).to_le_bytes());
+    frame.extend_from_slice(&id.to_le_bytes());
+    frame.extend_from_slice(&payload);
+    Ok(())
+}
+
+/// Split a frame header into payload length and request id
+fn decode_header(header: &[u8; FRAME_HEADER_BYTES]) -> Result<(usize, u32)> {
+    let len = u32::from_le_bytes([header[0], header[1], header[2], header[3]]) as usize;
+    if len > MAX_FRAME_BYTES {
+        return Err(ZygiskError::IpcError {
+            reason: format!("frame of {} bytes exceeds limit", len),
+        }
+        .into());
+    }
+    Ok((len, u32::from_le_bytes([header[4], header[5], header[6], header[7]])))
+}
+
+/// Resolve queued blocked hosts and update the connect filter
+///
+/// Lookups run without the lock held, so reports are never stuck behind a
+/// slow resolver.
+fn refresh_learned_addresses(blocklist: &Mutex<KernelBlocklist>) {
+    let hosts = blocklist.lock().learned_mut().take_pending();
+    let resolved: Vec<_> = hosts
+        .into_iter()
+        .filter_map(|host| {
+            let addresses = (host.as_str(), 0).to_socket_addrs().ok()?;
+            let addresses: Vec<_> = addresses.map(|addr| addr.ip()).collect();
+            Some((host, addresses))
+        })
+        .collect();
+
+    let now = TimeUtils::now_seconds();
+    let mut blocklist = blocklist.lock();
+    for (host, addresses) in resolved {
+        blocklist.learned_mut().learn(host, addresses, now);
+    }
+    blocklist.learned_mut().expire(now);
+    let failed = blocklist.sync();
+    if failed > 0 {
+        warn!("Connect filter is full, {} prefixes not blocked", failed);
+    }
+}
+
+/// Warm cache of one app as stored on disk
+#[derive(Debug, Clone, Default, Serialize, Deserialize)]
+struct WarmCache {
+    fingerprint: u64,
+    entries: Vec<(String, bool)>,
+}
+
+/// State shared by all connections in the companion process
+pub struct Companion {
+    data_dir: PathBuf,
+    warm_caches: Mutex<HashMap<String, WarmCache>>,
+    journal: Option<Arc<Mutex<StatsJournal>>>,
+    time_series: Option<Arc<Mutex<TimeSeries>>>,
+    host_sketches: Mutex<HashMap<String, HostCardinality>>,
+    request_logs: Mutex<HashMap<String, VecDeque<RequestRecord>>>,
+    request_log_capacity: usize,
+    status: Option<Arc<Mutex<StatusBoard>>>,
+    metrics: Mutex<LiveMetrics>,
+    control: Mutex<ControlState>,
+    explain_config: Option<Arc<AuboConfig>>,
+    explainer: Mutex<Option<Arc<FilterEngine>>>,
+    shadow: Option<Mutex<ShadowGate>>,
+    kernel_blocklist: Option<Arc<Mutex<KernelBlocklist>>>,
+    learn_addresses: bool,
+    pool: Option<Arc<WorkerPool>>,
+    pending_writes: Arc<PendingWrites>,
+    tasks: Vec<PeriodicTask>,
+}
+
+impl Companion {
+    /// Create a companion storing its state below `data_dir`
+    pub fn new(data_dir: impl Into<PathBuf>) -> Self {
+        Self {
+            data_dir: data_dir.into(),
+            warm_caches: Mutex::new(HashMap::new()),
+            journal: None,
+            time_series: None,
+            host_sketches: Mutex::new(HashMap::new()),
+            request_logs: Mutex::new(HashMap::new()),
+            request_log_capacity: 0,
+            status: None,
+            metrics: Mutex::new(LiveMetrics::default()),
+            control: Mutex::new(ControlState::default()),
+            explain_config: None,
+            explainer: Mutex::new(None),
+            shadow: None,
+            kernel_blocklist: None,
+            learn_addresses: false,
+            pool: None,
+            pending_writes: Arc::new(PendingWrites::default()),
+            tasks: Vec::new(),
+        }
+    }
+
+    /// Get the directory the companion stores its state in
+    pub fn data_dir(&self) -> &Path {
+        &self.data_dir
+    }
+
+    /// Persist stats reported by apps into `journal`
+    ///
+    /// Records are written as they arrive. Every `check_interval` the
+    /// journal is synced if enough is unsynced or it is old enough, so
+    /// storage sees one batched sync at a time. On error the companion is
+    /// left as it was.
+    pub fn start_stats_journal(&mut self, journal: StatsJournal, check_interval: Duration) -> Result<()> {
+        let journal = Arc::new(Mutex::new(journal));
+        let task_journal = Arc::clone(&journal);
+        let task = PeriodicTask::spawn("aubo-journal", check_interval, move || {
+            if let Err(e) = task_journal.lock().flush_if_due() {
+                warn!("Failed to write stats journal: {}", e);
+            }
+        })?;
+
+        self.journal = Some(journal);
+        self.tasks.push(task);
+        Ok(())
+    }
+
+    /// Fold reported stats into the `series` rings
+    ///
+    /// Changed slots are written every `flush_interval`. On error the
+    /// companion is left as it was.
+    pub fn start_time_series(&mut self, series: TimeSeries, flush_interval: Duration) -> Result<()> {
+        let series = Arc::new(Mutex::new(series));
+        let task_series = Arc::clone(&series);
+        let task = PeriodicTask::spawn("aubo-timeseries", flush_interval, move || {
+            if let Err(e) = task_series.lock().flush() {
+                warn!("Failed to write time series: {}", e);
+            }
+        })?;
+
+        self.time_series = Some(series);
+        self.tasks.push(task);
+        Ok(())
+    }
+
+    /// Keep the last `capacity` lookups reported by each app
+    ///
+    /// Logs live in memory only; they are for debugging, not history.
+    pub fn with_request_log(mut self, capacity: usize) -> Self {
+        self.request_log_capacity = capacity;
+        self
+    }
+
+    /// Collect app status on `board`, writing it out every `flush_interval`
+    ///
+    /// Set up after the stats journal so `module.prop` can show the blocked
+    /// total. On error the companion is left as it was.
+    pub fn start_status_board(&mut self, board: StatusBoard, flush_interval: Duration) -> Result<()> {
+        let board = Arc::new(Mutex::new(board));
+        let task_board = Arc::clone(&board);
+        let task_journal = self.journal.clone();
+        let task = PeriodicTask::spawn("aubo-status", flush_interval, move || {
+            let mut board = task_board.lock();
+            if !board.is_dirty() {
+                return;
+            }
+            let blocked = task_journal
+                .as_ref()
+                .map(|journal| journal.lock().totals().blocked_requests);
+            if let Err(e) = board.flush(blocked) {
+                warn!("Failed to write status: {}", e);
+            }
+        })?;
+
+        self.status = Some(board);
+        self.tasks.push(task);
+        Ok(())
+    }
+
+    /// Explain verdicts with the rules `config` loads
+    ///
+    /// The companion builds its own engine on the first `explain` command.
+    /// It loads the same lists as the apps, though admission under a tight
+    /// budget may differ since the companion has no hit counts.
+    pub fn with_explainer(mut self, config: Arc<AuboConfig>) -> Self {
+        self.explain_config = Some(config);
+        self
+    }
+
+    /// Evaluate reloaded rules in shadow before apps reload them
+    ///
+    /// Set up after [`with_explainer`](Self::with_explainer). The active
+    /// engine is built right away, so the first reload has the rules apps
+    /// started with to compare against.
+    pub fn with_shadow_evaluation(mut self) -> Self {
+        if let Err(e) = self.engine() {
+            warn!("Failed to load rules for shadow evaluation: {}", e);
+        }
+        self.shadow = Some(Mutex::new(ShadowGate::default()));
+        self
+    }
+
+    /// Run requests and file writes on `pool`
+    pub fn with_worker_pool(mut self, pool: WorkerPool) -> Self {
+        self.pool = Some(Arc::new(pool));
+        self
+    }
+
+    /// Enforce blocking in the kernel with `filter`
+    ///
+    /// Set up after [`with_explainer`](Self::with_explainer): the blocked
+    /// IPs of the rules come from the companion's engine. With
+    /// `learn_addresses`, hosts apps report as blocked are resolved every
+    /// `refresh_interval` and their addresses blocked too. On error the
+    /// filter is detached and the companion left as it was.
+    pub fn start_connect_filter(
+        &mut self,
+        filter: ConnectFilter,
+        learn_addresses: bool,
+        refresh_interval: Duration,
+    ) -> Result<()> {
+        let mut blocklist = KernelBlocklist::new(filter);
+        blocklist.set_enforcing(!self.control.lock().since(None).modes.monitor_only);
+        let blocklist = Arc::new(Mutex::new(blocklist));
+        let task_blocklist = Arc::clone(&blocklist);
+        let task = PeriodicTask::spawn("aubo-bpf", refresh_interval, move || {
+            refresh_learned_addresses(&task_blocklist)
+        })?;
+
+        self.kernel_blocklist = Some(blocklist);
+        self.refresh_rule_prefixes();
+        self.learn_addresses = learn_addresses;
+        self.tasks.push(task);
+        Ok(())
+    }
+
+    /// Check if connects are blocked in the kernel
+    pub fn blocks_connects(&self) -> bool {
+        self.kernel_blocklist.is_some()
+    }
+
+    /// Run one control socket command line and render the reply
+    pub fn execute_control(self: &Arc<Self>, line: &str) -> String {
+        let command = match ControlCommand::parse(line) {
+            Ok(command) => command,
+            Err(e) => return format!("error: {}\n{}", e, USAGE),
+        };
+        match command {
+            ControlCommand::Metrics => {
+                let mut out = self.metrics.lock().render_prometheus(&self.host_cardinality());
+                if let Some(pool) = &self.pool {
+                    render_pool_metrics(&mut out, &pool.metrics());
+                }
+                out
+            }
+            ControlCommand::Explain { target } => match self.explain(&target) {
+                Ok(explanation) => self.render_explanation(&target, &explanation),
+                Err(e) => format!("error: {}\n", e),
+            },
+            ControlCommand::Reload if self.shadow.is_some() => {
+                // Building and replaying the candidate takes a while
+                let companion = Arc::clone(self);
+                let started = self.pool.as_ref().map(|pool| pool.spawn(move || companion.evaluate_candidate()));
+                if matches!(started, Some(Ok(()))) {
+                    return "evaluating reloaded rules in shadow, see 'shadow'\n".to_string();
+                }
+                self.evaluate_candidate();
+                self.render_shadow()
+            }
+            ControlCommand::Reload => {
+                // The companion's own engine is rebuilt on the next explain
+                self.explainer.lock().take();
+                if self.kernel_blocklist.is_some() {
+                    // Compiling the rules takes a while; do it off the control thread
+                    let companion = Arc::clone(self);
+                    let compiled = self.pool.as_ref().map(|pool| pool.spawn(move || companion.refresh_rule_prefixes()));
+                    if !matches!(compiled, Some(Ok(()))) {
+                        self.refresh_rule_prefixes();
+                    }
+                }
+                format!("queued reload as generation {}\n", self.control.lock().push(AppCommand::Reload))
+            }
+            ControlCommand::ClearCaches => {
+                let generation = self.control.lock().push(AppCommand::ClearCaches);
+                format!("queued cache clear as generation {}\n", generation)
+            }
+            ControlCommand::Monitor { enabled } => {
+                self.control.lock().set_modes(ControlModes { monitor_only: enabled });
+                if let Some(engine) = self.explainer.lock().as_ref() {
+                    engine.set_monitor_only(enabled);
+                }
+                if let Some(blocklist) = &self.kernel_blocklist {
+                    let mut blocklist = blocklist.lock();
+                    blocklist.set_enforcing(!enabled);
+                    blocklist.sync();
+                }
+                format!("monitor-only mode {}\n", if enabled { "on" } else { "off" })
+            }
+            ControlCommand::SlowHosts => {
+                let mut out = String::new();
+                for (app, host) in self.metrics.lock().slowest_hosts(TOP_HOSTS) {
+                    out.push_str(&format!(
+                        "{} {}: {} resolutions, mean {:?}, max {:?}, {:.1}% failed\n",
+                        app,
+                        host.host,
+                        host.resolutions,
+                        host.mean(),
+                        Duration::from_nanos(host.max_ns),
+                        host.failure_rate() * 100.0
+                    ));
+                }
+                out
+            }
+            ControlCommand::SlowLookups => {
+                let mut out = String::new();
+                for (app, sample) in self.metrics.lock().slowest_lookups(SLOW_SAMPLES) {
+                    out.push_str(&format!(
+                        "{} {:?} {} {} tier={}",
+                        app,
+                        sample.latency(),
+                        sample.request_type,
+                        sample.url,
+                        tier_name(sample.rule)
+                    ));
+                    if let Some(profile) = &sample.profile {
+                        out.push_str(&format!(" rules={}", profile.rules_evaluated));
+                        if let Some(rule) = &profile.rule_text {
+                            out.push_str(&format!(" rule={}", rule));
+                        }
+                        for (stage, nanos) in &profile.stages {
+                            out.push_str(&format!(" {}={:?}", stage.name(), Duration::from_nanos(*nanos)));
+                        }
+                    }
+                    out.push('\n');
+                }
+                out
+            }
+            ControlCommand::Shadow => self.render_shadow(),
+            ControlCommand::Promote => {
+                let held = self.shadow.as_ref().and_then(|shadow| shadow.lock().held.take());
+                match held {
+                    Some(candidate) => format!("queued reload as generation {}\n", self.promote(candidate)),
+                    None => "error: no candidate is held\n".to_string(),
+                }
+            }
+            ControlCommand::DroppedRules => {
+                let path = self.data_dir.join(DROPPED_RULES_FILE);
+                match self.engine().and_then(|engine| engine.write_dropped_rules(&path)) {
+                    Ok(report) => format!("wrote {} dropped rules to {}\n", report.dropped, path.display()),
+                    Err(e) => format!("error: {}\n", e),
+                }
+            }
+            ControlCommand::Help => USAGE.to_string(),
+        }
+    }
+
+    /// Build an engine from the reloaded rules and promote it if it passes
+    /// shadow evaluation, otherwise hold it
+    fn evaluate_candidate(&self) {
+        let (Some(shadow), Some(config)) = (&self.shadow, &self.explain_config) else {
+            return;
+        };
+        let engines = self.engine().and_then(|active| {
+            let candidate = FilterEngine::new(Arc::clone(config), Arc::new(StatsCollector::new()))?;
+            Ok((active, Arc::new(candidate)))
+        });
+        let (active, candidate) = match engines {
+            Ok(engines) => engines,
+            Err(e) => {
+                warn!("Failed to build candidate rules: {}", e);
+                return;
+            }
+        };
+
+        let hosts = shadow.lock().reservoir.hosts().to_vec();
+        let report = ShadowReport::compare(&active, &candidate, &hosts, &config.filters);
+        let passed = report.passed();
+        match &report.rejection {
+            Some(reason) => warn!("Holding reloaded rules: {}", reason),
+            None => info!("Reloaded rules passed shadow evaluation on {} hosts", report.samples),
+        }
+        {
+            let mut shadow = shadow.lock();
+            shadow.report = Some(report);
+            shadow.held = (!passed).then(|| Arc::clone(&candidate));
+        }
+        if passed {
+            self.promote(candidate);
+        }
+    }
+
+    /// Make `candidate` the companion's engine and tell apps to reload,
+    /// returning the command generation
+    fn promote(&self, candidate: Arc<FilterEngine>) -> u64 {
+        candidate.set_monitor_only(self.control.lock().since(None).modes.monitor_only);
+        *self.explainer.lock() = Some(candidate);
+        self.refresh_rule_prefixes();
+        self.control.lock().push(AppCommand::Reload)
+    }
+
+    fn render_shadow(&self) -> String {
+        let Some(shadow) = &self.shadow else {
+            return "shadow evaluation is off\n".to_string();
+        };
+        let shadow = shadow.lock();
+        match &shadow.report {
+            Some(report) if shadow.held.is_some() => format!("{}'promote' reloads apps anyway\n", report.render()),
+            Some(report) => report.render(),
+            None => "no reload evaluated yet\n".to_string(),
+        }
+    }
+
+    /// Remember hosts an app looked up for shadow evaluation
+    fn sample_hosts<'a>(&self, hosts: impl IntoIterator<Item = &'a str>) {
+        if let Some(shadow) = &self.shadow {
+            let mut shadow = shadow.lock();
+            for host in hosts {
+                shadow.reservoir.offer(host);
+            }
+        }
+    }
+
+    /// Get the companion's engine, building it on first use
+    fn engine(&self) -> Result<Arc<FilterEngine>> {
+        let Some(config) = &self.explain_config else {
+            return Err(ZygiskError::IpcError {
+                reason: "explain is not available".to_string(),
+            }
+            .into());
+        };
+
+        let mut explainer = self.explainer.lock();
+        if let Some(engine) = explainer.as_ref() {
+            return Ok(Arc::clone(engine));
+        }
+        let engine = Arc::new(FilterEngine::new(Arc::clone(config), Arc::new(StatsCollector::new()))?);
+        engine.set_monitor_only(self.control.lock().since(None).modes.monitor_only);
+        *explainer = Some(Arc::clone(&engine));
+        Ok(engine)
+    }
+
+    /// Evaluate a host or URL with the companion's engine
+    fn explain(&self, target: &str) -> Result<Explanation> {
+        Ok(self.engine()?.explain(target))
+    }
+
+    /// Load the blocked IPs of the current rules into the connect filter
+    fn refresh_rule_prefixes(&self) {
+        let Some(blocklist) = &self.kernel_blocklist else {
+            return;
+        };
+        let prefixes = match self.engine() {
+            Ok(engine) => engine.blocked_prefixes(),
+            Err(e) => {
+                warn!("Failed to load rules for the connect filter: {}", e);
+                return;
+            }
+        };
+
+        let mut blocklist = blocklist.lock();
+        blocklist.set_rule_prefixes(prefixes);
+        let failed = blocklist.sync();
+        if failed > 0 {
+            warn!("Connect filter is full, {} prefixes not blocked", failed);
+        }
+        info!("Connect filter blocks {} prefixes", blocklist.blocked_count());
+    }
+
+    fn render_explanation(&self, target: &str, explanation: &Explanation) -> String {
+        let mut out = format!(
+            "{}: {} by {:?} rule{} (rule set generation {}{})\n",
+            target,
+            if explanation.blocked { "blocked" } else { "allowed" },
+            explanation.rule.kind(),
+            explanation
+                .rule_text
+                .as_deref()
+                .map(|text| format!(" '{}'", text))
+                .unwrap_or_default(),
+            explanation.generation,
+            if explanation.monitor_only { ", monitor-only" } else { "" },
+        );
+
+        // Recent lookups show what apps actually decided, e.g. from a cache
+        let host_id = host_hash(host_of(target));
+        for (app, log) in self.request_logs.lock().iter() {
+            let lookups: Vec<_> = log.iter().filter(|record| record.host_id == host_id).collect();
+            let Some(last) = lookups.last() else {
+                continue;
+            };
+            let blocked = lookups.iter().filter(|record| record.blocked).count();
+            out.push_str(&format!(
+                "  {}: {} recent lookups, {} blocked, last by {:?} rule in {} ns\n",
+                app,
+                lookups.len(),
+                blocked,
+                last.rule.kind(),
+                last.latency_ns
+            ));
+        }
+        out
+    }
+
+    /// Report events of the companion process itself
+    pub fn report_status(&self, events: Vec<StatusEvent>) {
+        if let Some(board) = &self.status {
+            board.lock().apply("companion", events);
+        }
+    }
+
+    /// Serve one app connection until the app closes it
+    pub fn serve<S: Read + Write + AsRawFd>(self: &Arc<Self>, stream: &mut S) -> Result<()> {
+        while let Some((id, request)) = read_frame::<_, Request>(stream)? {
+            if request == Request::OpenSharedChannel {
+                match SharedChannel::create() {
+                    Ok(channel) => {
+                        write_frame(stream, id, &Response::SharedChannel)?;
+                        shm::send_fd(stream.as_raw_fd(), channel.fd())?;
+                        self.serve_shared(channel, stream.as_raw_fd());
+                    }
+                    Err(e) => write_frame(stream, id, &Response::Error { message: e.to_string() })?,
+                }
+                continue;
+            }
+            let response = self.dispatch(request);
+            write_frame(stream, id, &response)?;
+        }
+        Ok(())
+    }
+
+    /// Answer requests on `channel` while the app on `socket` uses it
+    ///
+    /// Returns when the app closes the channel, disconnects, or sends on
+    /// the socket again.
+    fn serve_shared(self: &Arc<Self>, mut channel: SharedChannel, socket: RawFd) {
+        loop {
+            let served = channel.serve_one(SHARED_CHANNEL_IDLE_CHECK, |bytes| {
+                let response = match serde_json::from_slice::<Request>(bytes) {
+                    Ok(Request::OpenSharedChannel) => Response::Error {
+                        message: "shared channel is already open".to_string(),
+                    },
+                    Ok(request) => self.dispatch(request),
+                    Err(e) => Response::Error { message: e.to_string() },
+                };
+                let bytes = serde_json::to_vec(&response).unwrap_or_default();
+                if bytes.len() <= shm::SLOT_BYTES {
+                    return bytes;
+                }
+                let too_large = Response::Error {
+                    message: format!("response of {} bytes exceeds slot", bytes.len()),
+                };
+                serde_json::to_vec(&too_large).unwrap_or_default()
+            });
+            match served {
+                Wait::Served => {}
+                Wait::Idle if shm::socket_idle(socket) => {}
+                Wait::Idle | Wait::Closed => return,
+            }
+        }
+    }
+
+    /// Handle a request on the pool, failing open if it is saturated
+    fn dispatch(self: &Arc<Self>, request: Request) -> Response {
+        let Some(pool) = &self.pool else {
+            return self.handle(request);
+        };
+        let companion = Arc::clone(self);
+        pool.run(move || companion.handle(request))
+            .unwrap_or_else(|busy| Response::Error { message: busy.to_string() })
+    }
+
+    /// Handle a single request
+    pub fn handle(&self, request: Request) -> Response {
+        match request {
+            Request::LoadWarmCache { app, fingerprint } => Response::WarmCache {
+                entries: self.load_warm_cache(&app, fingerprint),
+            },
+            Request::StoreWarmCache { app, fingerprint, mut entries } => {
+                self.sample_hosts(entries.iter().map(|(host, _)| host.as_str()));
+                entries.truncate(WARM_CACHE_ENTRIES);
+                match self.store_warm_cache(&app, WarmCache { fingerprint, entries }) {
+                    Ok(()) => Response::Ok,
+                    Err(e) => Response::Error { message: e.to_string() },
+                }
+            }
+            Request::RecordStats { app, delta } => {
+                self.sample_hosts(delta.domains_blocked.keys().map(String::as_str));
+                self.sample_hosts(delta.slow_lookups.iter().map(|sample| host_of(&sample.url)));
+                if let Some(blocklist) = self.kernel_blocklist.as_ref().filter(|_| self.learn_addresses) {
+                    let mut blocklist = blocklist.lock();
+                    for host in delta.domains_blocked.keys() {
+                        blocklist.learned_mut().queue(host);
+                    }
+                }
+                debug!("Recording {} requests from {}", delta.total_requests, app);
+                if let Some(sketches) = &delta.host_sketches {
+                    if let Err(e) = self.merge_host_sketches(&app, sketches) {
+                        warn!("Failed to store host sketches of {}: {}", app, e);
+                    }
+                }
+                if let Some(series) = &self.time_series {
+                    series.lock().record(TimeUtils::now_seconds(), &delta);
+                }
+                self.metrics.lock().record(&app, &delta);
+                if let Some(journal) = &self.journal {
+                    if let Err(e) = journal.lock().append(&delta) {
+                        warn!("Failed to write stats journal: {}", e);
+                    }
+                }
+                Response::Ok
+            }
+            Request::ExportStats => match &self.journal {
+                Some(journal) => match journal.lock().to_json() {
+                    Ok(json) => Response::Stats { json },
+                    Err(e) => Response::Error { message: e.to_string() },
+                },
+                None => journal_disabled(),
+            },
+            Request::ExportTimeSeries { resolution } => match &self.time_series {
+                Some(series) => Response::TimeSeries {
+                    resolution,
+                    points: series.lock().points(resolution, TimeUtils::now_seconds()),
+                },
+                None => Response::Error {
+                    message: "time series are disabled".to_string(),
+                },
+            },
+            Request::ExportHostCardinality => Response::HostCardinality {
+                apps: self.host_cardinality(),
+            },
+            Request::RecordRequests { app, records } => {
+                if self.request_log_capacity == 0 {
+                    return Response::Error {
+                        message: "request log is disabled".to_string(),
+                    };
+                }
+                let mut logs = self.request_logs.lock();
+                let log = logs.entry(app).or_default();
+                log.extend(records);
+                let excess = log.len().saturating_sub(self.request_log_capacity);
+                log.drain(..excess);
+                Response::Ok
+            }
+            Request::ExportRequestLog { app, host } => {
+                let host_id = host.as_deref().map(host_hash);
+                let records = self
+                    .request_logs
+                    .lock()
+                    .get(&app)
+                    .map(|log| {
+                        log.iter()
+                            .filter(|record| host_id.map_or(true, |id| record.host_id == id))
+                            .cloned()
+                            .collect()
+                    })
+                    .unwrap_or_default();
+                Response::RequestLog { records }
+            }
+            Request::ReportStatus { app, events } => {
+                // Without a board there is nowhere to report to; the app
+                // should not keep retrying
+                if let Some(board) = &self.status {
+                    board.lock().apply(&app, events);
+                }
+                Response::Ok
+            }
+            Request::PollControl { since } => Response::Control {
+                update: ControlUpdate {
+                    kernel_blocks_connects: self.blocks_connects(),
+                    ..self.control.lock().since(since)
+                },
+            },
+            Request::OpenSharedChannel => Response::Error {
+                message: "shared channels need a socket connection".to_string(),
+            },
+        }
+    }
+
+    /// Merge an app's forwarded sketches, writing them out if they grew
+    ///
+    /// Registers only ever grow, so writes become rare once an app's usual
+    /// hosts have been seen.
+    fn merge_host_sketches(&self, app: &str, sketches: &HostSketches) -> Result<()> {
+        let key = sanitize_app(app);
+        let mut all = self.host_sketches.lock();
+        let merged = all.entry(key).or_insert_with_key(|key| self.load_host_sketches(key));
+        if !merged.merge(sketches) {
+            return Ok(());
+        }
+
+        let path = app_file(&self.data_dir, HOST_SKETCH_DIR, app, HOST_SKETCH_EXTENSION);
+        self.write_file(path, merged.to_bytes())
+    }
+
+    fn load_host_sketches(&self, key: &str) -> HostCardinality {
+        let path = app_file(&self.data_dir, HOST_SKETCH_DIR, key, HOST_SKETCH_EXTENSION);
+        fs::read(&path)
+            .ok()
+            .and_then(|bytes| HostCardinality::from_bytes(&bytes))
+            .unwrap_or_default()
+    }
+
+    /// Estimates for every app with stored or reported sketches
+    fn host_cardinality(&self) -> Vec<AppHostCardinality> {
+        let mut all = self.host_sketches.lock();
+        if let Ok(entries) = fs::read_dir(self.data_dir.join(HOST_SKETCH_DIR)) {
+            for path in entries.flatten().map(|entry| entry.path()) {
+                if path.extension().and_then(|ext| ext.to_str()) != Some(HOST_SKETCH_EXTENSION) {
+                    continue;
+                }
+                if let Some(key) = path.file_stem().and_then(|stem| stem.to_str()) {
+                    if !all.contains_key(key) {
+                        let sketches = self.load_host_sketches(key);
+                        all.insert(key.to_string(), sketches);
+                    }
+                }
+            }
+        }
+
+        let mut apps: Vec<_> = all
+            .iter()
+            .map(|(app, sketches)| AppHostCardinality {
+                app: app.clone(),
+                distinct_hosts: sketches.distinct_hosts(),
+                distinct_blocked_hosts: sketches.distinct_blocked_hosts(),
+            })
+            .collect();
+        apps.sort_by(|a, b| a.app.cmp(&b.app));
+        apps
+    }
+
+    fn warm_cache_path(&self, app: &str) -> PathBuf {
+        warm_cache_path(&self.data_dir, app)
+    }
+
+    fn load_warm_cache(&self, app: &str, fingerprint: u64) -> Vec<(String, bool)> {
+        let mut warm_caches = self.warm_caches.lock();
+        if !warm_caches.contains_key(app) {
+            let cached = fs::read_to_string(self.warm_cache_path(app))
+                .ok()
+                .and_then(|content| serde_json::from_str(&content).ok())
+                .unwrap_or_default();
+            warm_caches.insert(app.to_string(), cached);
+        }
+
+        match warm_caches.get(app) {
+            Some(cache) if cache.fingerprint == fingerprint => cache.entries.clone(),
+            Some(_) => {
+                debug!("Discarding warm cache of {} built for another rule set", app);
+                Vec::new()
+            }
+            None => Vec::new(),
+        }
+    }
+
+    fn store_warm_cache(&self, app: &str, cache: WarmCache) -> Result<()> {
+        let bytes = serde_json::to_vec(&cache)?;
+        self.write_file(self.warm_cache_path(app), bytes)?;
+        self.warm_caches.lock().insert(app.to_string(), cache);
+        Ok(())
+    }
+
+    /// Write a file, on a pool worker if there is a pool
+    ///
+    /// Failed background writes are only logged; the in-memory state stays
+    /// authoritative and is written again on its next change.
+    fn write_file(&self, path: PathBuf, bytes: Vec<u8>) -> Result<()> {
+        let Some(pool) = &self.pool else {
+            return write_file(&path, &bytes);
+        };
+        self.pending_writes.files.lock().insert(path, bytes);
+        let pending = Arc::clone(&self.pending_writes);
+        if pool.spawn(move || pending.flush()).is_err() {
+            self.pending_writes.flush();
+        }
+        Ok(())
+    }
+}
+
+/// Files waiting for a pool worker, latest contents per path
+#[derive(Default)]
+struct PendingWrites {
+    files: Mutex<HashMap<PathBuf, Vec<u8>>>,
+    /// Held while writing, so older contents never land after newer ones
+    writing: Mutex<()>,
+}
+
+impl PendingWrites {
+    fn flush(&self) {
+        let _writing = self.writing.lock();
+        let files = std::mem::take(&mut *self.files.lock());
+        for (path, bytes) in files {
+            if let Err(e) = write_file(&path, &bytes) {
+                warn!("Failed to write {}: {}", path.display(), e);
+            }
+        }
+    }
+}
+
+/// Write a file, creating its directory
+fn write_file(path: &Path, bytes: &[u8]) -> Result<()> {
+    if let Some(parent) = path.parent() {
+        fs::create_dir_all(parent)?;
+    }
+    fs::write(path, bytes)?;
+    Ok(())
+}
+
+fn journal_disabled() -> Response {
+    Response::Error {
+        message: "stats journal is disabled".to_string(),
+    }
+}
+
+/// App name reduced to characters safe in a file name
+fn sanitize_app(app: &str) -> String {
+    app.chars()
+        .map(|c| if c.is_ascii_alphanumeric() || c == '.' || c == '-' { c } else { '_' })
+        .collect()
+}
+
+/// Per-app file in a directory below the data directory
+fn app_file(data_dir: &Path, dir: &str, app: &str, extension: &str) -> PathBuf {
+    data_dir.join(dir).join(format!("{}.{}", sanitize_app(app), extension))
+}
+
+/// File holding the warm cache of an app
+fn warm_cache_path(data_dir: &Path, app: &str) -> PathBuf {
+    app_file(data_dir, WARM_CACHE_DIR, app, "json")
+}
+
+/// Hosts in the warm caches stored under `data_dir`, at most `limit`
+pub fn warm_cache_hosts(data_dir: &Path, limit: usize) -> Vec<String> {
+    let Ok(dir) = fs::read_dir(data_dir.join(WARM_CACHE_DIR)) else {
+        return Vec::new();
+    };
+    let mut seen = HashSet::new();
+    let mut hosts = Vec::new();
+    for entry in dir.flatten() {
+        let cache: Option<WarmCache> = fs::read_to_string(entry.path())
+            .ok()
+            .and_then(|content| serde_json::from_str(&content).ok());
+        for (host, _) in cache.map(|cache| cache.entries).unwrap_or_default() {
+            if hosts.len() == limit {
+                return hosts;
+            }
+            if seen.insert(host.clone()) {
+                hosts.push(host);
+            }
+        }
+    }
+    hosts
+}
+
+/// App-side connection to the companion
+///
+/// A request that times out leaves the socket as it was: the rest of a
+/// frame it could not send goes out in front of the next request, bytes
+/// of a response it could not read completely are kept, and responses to
+/// earlier requests are skipped by their id.
+pub struct CompanionClient {
+    stream: UnixStream,
+    shared: Option<SharedChannel>,
+    last_id: u32,
+    unsent: Vec<u8>,
+    received: Vec<u8>,
+}
+
+impl CompanionClient {
+    /// Wrap a connected stream
+    pub fn new(stream: UnixStream) -> Result<Self> {
+        stream.set_read_timeout(Some(CLIENT_TIMEOUT))?;
+        stream.set_write_timeout(Some(CLIENT_TIMEOUT))?;
+        Ok(Self {
+            stream,
+            shared: None,
+            last_id: 0,
+            unsent: Vec::new(),
+            received: Vec::new(),
+        })
+    }
+
+    /// Take ownership of a socket returned by `connectCompanion`
+    ///
+    /// # Safety
+    /// `fd` must be an open UNIX stream socket not owned by anything else.
+    pub unsafe fn from_raw_fd(fd: RawFd) -> Result<Self> {
+        Self::new(unsafe { UnixStream::from_raw_fd(fd) })
+    }
+
+    /// Send further requests through shared memory instead of the socket
+    pub fn open_shared_channel(&mut self) -> Result<()> {
+        match self.request(&Request::OpenSharedChannel)? {
+            Response::SharedChannel => {}
+            other => return Err(unexpected_response(other)),
+        }
+        let fd = shm::recv_fd(self.stream.as_raw_fd())?;
+        self.shared = Some(SharedChannel::from_fd(fd)?);
+        Ok(())
+    }
+
+    /// Send a request and wait for its response
+    pub fn request(&mut self, request: &Request) -> Result<Response> {
+        if let Some(channel) = &mut self.shared {
+            let response = channel.call(&serde_json::to_vec(request)?, CLIENT_TIMEOUT)?;
+            return Ok(serde_json::from_slice(&response)?);
+        }
+
+        self.last_id = self.last_id.wrapping_add(1);
+        encode_frame(&mut self.unsent, self.last_id, request)?;
+        self.send_unsent()?;
+        loop {
+            let (id, payload) = self.receive_frame()?;
+            if id == self.last_id {
+                return Ok(serde_json::from_slice(&payload)?);
+            }
+            debug!("Skipping late companion response to request {}", id);
+        }
+    }
+
+    /// Write out pending frame bytes, keeping what a timeout left unsent
+    fn send_unsent(&mut self) -> Result<()> {
+        while !self.unsent.is_empty() {
+            match self.stream.write(&self.unsent) {
+                Ok(0) => return Err(connection_closed()),
+                Ok(written) => {
+                    self.unsent.drain(..written);
+                }
+                Err(e) if e.kind() == ErrorKind::Interrupted => {}
+                Err(e) => return Err(e.into()),
+            }
+        }
+        Ok(())
+    }
+
+    /// Read the next whole frame, keeping a partial one across timeouts
+    ///
+    /// Reads stop at the end of the frame, so a file descriptor the
+    /// companion sends after it is left on the socket.
+    fn receive_frame(&mut self) -> Result<(u32, Vec<u8>)> {
+        loop {
+            let mut wanted = FRAME_HEADER_BYTES;
+            if self.received.len() >= FRAME_HEADER_BYTES {
+                let mut header = [0u8; FRAME_HEADER_BYTES];
+                header.copy_from_slice(&self.received[..FRAME_HEADER_BYTES]);
+                let (len, id) = decode_header(&header)?;
+                wanted += len;
+                if self.received.len() == wanted {
+                    let payload = self.received.split_off(FRAME_HEADER_BYTES);
+                    self.received.clear();
+                    return Ok((id, payload));
+                }
+            }
+
+            let start = self.received.len();
+            self.received.resize(wanted, 0);
+            let read = self.stream.read(&mut self.received[start..]);
+            self.received.truncate(start + read.as_ref().map_or(0, |read| *read));
+            match read {
+                Ok(0) => return Err(connection_closed()),
+                Ok(_) => {}
+                Err(e) if e.kind() == ErrorKind::Interrupted => {}
+                Err(e) => return Err(e.into()),
+            }
+        }
+    }
+
+    /// Fetch the warm cache of an app
+    pub fn load_warm_cache(&mut self, app: &str, fingerprint: u64) -> Result<Vec<(String, bool)>> {
+        let request = Request::LoadWarmCache {
+            app: app.to_string(),
+            fingerprint,
+        };
+        match self.request(&request)? {
+            Response::WarmCache { entries } => Ok(entries),
+            other => Err(unexpected_response(other)),
+        }
+    }
+
+    /// Replace the warm cache of an app
+    pub fn store_warm_cache(&mut self, app: &str, fingerprint: u64, entries: Vec<(String, bool)>) -> Result<()> {
+        let request = Request::StoreWarmCache {
+            app: app.to_string(),
+            fingerprint,
+            entries,
+        };
+        match self.request(&request)? {
+            Response::Ok => Ok(()),
+            other => Err(unexpected_response(other)),
+        }
+    }
+
+    /// Report stats changes to the companion
+    pub fn record_stats(&mut self, app: &str, delta: StatsDelta) -> Result<()> {
+        let request = Request::RecordStats {
+            app: app.to_string(),
+            delta,
+        };
+        match self.request(&request)? {
+            Response::Ok => Ok(()),
+            other => Err(unexpected_response(other)),
+        }
+    }
+
+    /// Forward request log records, split into frames of bounded size
+    pub fn record_requests(&mut self, app: &str, records: Vec<RequestRecord>) -> Result<()> {
+        for chunk in records.chunks(REQUEST_LOG_CHUNK) {
+            let request = Request::RecordRequests {
+                app: app.to_string(),
+                records: chunk.to_vec(),
+            };
+            match self.request(&request)? {
+                Response::Ok => {}
+                other => return Err(unexpected_response(other)),
+            }
+        }
+        Ok(())
+    }
+
+    /// Forward queued status events
+    pub fn report_status(&mut self, app: &str, events: Vec<StatusEvent>) -> Result<()> {
+        let request = Request::ReportStatus {
+            app: app.to_string(),
+            events,
+        };
+        match self.request(&request)? {
+            Response::Ok => Ok(()),
+            other => Err(unexpected_response(other)),
+        }
+    }
+
+    /// Fetch commands queued on the control socket since generation `since`
+    pub fn poll_control(&mut self, since: Option<u64>) -> Result<ControlUpdate> {
+        match self.request(&Request::PollControl { since })? {
+            Response::Control { update } => Ok(update),
+            other => Err(unexpected_response(other)),
+        }
+    }
+}
+
+impl Drop for CompanionClient {
+    fn drop(&mut self) {
+        if let Some(channel) = &self.shared {
+            channel.close();
+        }
+    }
+}
+
+fn connection_closed() -> crate::error::AuboError {
+    ZygiskError::IpcError {
+        reason: "companion closed the connection".to_string(),
+    }
+    .into()
+}
+
+fn unexpected_response(response: Response) -> crate::error::AuboError {
+    let reason = match response {
+        Response::Error { message } => message,
+        other => format!("unexpected response: {:?}", other),
+    };
+    ZygiskError::IpcError { reason }.into()
+}
+
+/// Serve a connection accepted by the companion module
+pub fn serve_connection(companion: &Arc<Companion>, fd: RawFd) -> Result<()> {
+    // SAFETY: ZygiskNext hands the companion an owned, connected socket
+    let mut stream = unsafe { UnixStream::from_raw_fd(fd) };
+    info!("Serving companion connection on fd {}", fd);
+    let result = companion.serve(&mut stream);
+    if let Err(e) = &result {
+        warn!("Companion connection on fd {} ended with error: {}", fd, e);
+    }
+    result
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Cursor;
+    use std::thread;
+
+    #[test]
+    fn test_frame_round_trip() {
+        let mut buffer = Vec::new();
+        let request = Request::LoadWarmCache {
+            app: "com.example.app".to_string(),
+            fingerprint: 42,
+        };
+        write_frame(&mut buffer, 7, &request).unwrap();
+
+        let mut cursor = Cursor::new(buffer);
+        assert_eq!(read_frame::<_, Request>(&mut cursor).unwrap(), Some((7, request)));
+        assert_eq!(read_frame::<_, Request>(&mut cursor).unwrap(), None);
+    }
+
+    #[test]
+    fn test_oversized_frame_is_rejected() {
+        let mut header = ((MAX_FRAME_BYTES + 1) as u32).to_le_bytes().to_vec();
+        header.extend_from_slice(&1u32.to_le_bytes());
+        assert!(read_frame::<_, Request>(&mut Cursor::new(header)).is_err());
+    }
+
+    #[test]
+    fn test_late_response_is_skipped() {
+        let (app_side, mut companion_side) = UnixStream::pair().unwrap();
+        let warm_cache = |host: &str| Response::WarmCache {
+            entries: vec![(host.to_string(), true)],
+        };
+        let server = thread::spawn(move || {
+            // Answer the first request after the app gave up on it
+            let (late, _) = read_frame::<_, Request>(&mut companion_side).unwrap().unwrap();
+            thread::sleep(CLIENT_TIMEOUT * 2);
+            write_frame(&mut companion_side, late, &warm_cache("late.example.com")).unwrap();
+
+            // Then send the next answer in two halves across a timeout
+            let (id, _) = read_frame::<_, Request>(&mut companion_side).unwrap().unwrap();
+            let mut frame = Vec::new();
+            encode_frame(&mut frame, id, &warm_cache("split.example.com")).unwrap();
+            companion_side.write_all(&frame[..frame.len() / 2]).unwrap();
+            thread::sleep(CLIENT_TIMEOUT * 2);
+            companion_side.write_all(&frame[frame.len() / 2..]).unwrap();
+
+            let (id, _) = read_frame::<_, Request>(&mut companion_side).unwrap().unwrap();
+            write_frame(&mut companion_side, id, &warm_cache("own.example.com")).unwrap();
+        });
+
+        let mut client = CompanionClient::new(app_side).unwrap();
+        assert!(client.load_warm_cache("com.example.app", 1).is_err());
+        assert!(client.load_warm_cache("com.example.app", 2).is_err());
+        thread::sleep(CLIENT_TIMEOUT * 2);
+        assert_eq!(
+            client.load_warm_cache("com.example.app", 3).unwrap(),
+            vec![("own.example.com".to_string(), true)]
+        );
+        server.join().unwrap();
+    }
+
+    #[test]
+    fn test_warm_cache_is_tagged_with_fingerprint() {
+        let dir = tempfile::tempdir().unwrap();
+        let companion = Companion::new(dir.path());
+        let entries = vec![("ads.example.com".to_string(), true), ("example.com".to_string(), false)];
+
+        let response = companion.handle(Request::StoreWarmCache {
+            app: "com.example.app".to_string(),
+            fingerprint: 7,
+            entries: entries.clone(),
+        });
+        assert_eq!(response, Response::Ok);
+
+        // A fresh companion, e.g. after a reboot, reads it back from disk
+        let companion = Companion::new(dir.path());
+        let load = |fingerprint| companion.handle(Request::LoadWarmCache {
+            app: "com.example.app".to_string(),
+            fingerprint,
+        });
+        assert_eq!(load(7), Response::WarmCache { entries });
+        assert_eq!(load(8), Response::WarmCache { entries: Vec::new() });
+    }
+
+    #[test]
+    fn test_shared_channel_carries_requests() {
+        let dir = tempfile::tempdir().unwrap();
+        let (app_side, mut companion_side) = UnixStream::pair().unwrap();
+        let data_dir = dir.path().to_path_buf();
+        let server = thread::spawn(move || {
+            let companion = Arc::new(Companion::new(data_dir));
+            companion.serve(&mut companion_side).unwrap();
+            companion
+        });
+
+        let mut client = CompanionClient::new(app_side).unwrap();
+        client.open_shared_channel().unwrap();
+        assert!(client.shared.is_some());
+        client.store_warm_cache("com.example.app", 3, vec![("ads.example.com".to_string(), true)]).unwrap();
+        assert_eq!(client.load_warm_cache("com.example.app", 3).unwrap().len(), 1);
+        assert_eq!(client.poll_control(None).unwrap().generation, 0);
+        assert!(client.open_shared_channel().is_err());
+
+        // Closing the channel ends the connection on the companion side
+        drop(client);
+        let companion = server.join().unwrap();
+        assert!(matches!(
+            companion.handle(Request::LoadWarmCache { app: "com.example.app".to_string(), fingerprint: 3 }),
+            Response::WarmCache { entries } if entries.len() == 1
+        ));
+    }
+
+    #[test]
+    fn test_saturated_pool_fails_open() {
+        let dir = tempfile::tempdir().unwrap();
+        let pool = WorkerPool::new("aubo-test", 1, 1).unwrap();
+        let (started_tx, started_rx) = std::sync::mpsc::channel::<()>();
+        let (release_tx, release_rx) = std::sync::mpsc::channel::<()>();
+        pool.spawn(move || {
+            started_tx.send(()).unwrap();
+            let _ = release_rx.recv();
+        })
+        .unwrap();
+        started_rx.recv().unwrap();
+        let companion = Arc::new(Companion::new(dir.path()).with_worker_pool(pool));
+        let poll = |companion: &Arc<Companion>| companion.dispatch(Request::PollControl { since: None });
+
+        // The only worker is stuck, so one request fills the queue and the
+        // next app is turned away
+        let queued = Arc::clone(&companion);
+        let waiter = thread::spawn(move || poll(&queued));
+        while companion.pool.as_ref().unwrap().metrics().queue_depth == 0 {
+            thread::sleep(Duration::from_millis(1));
+        }
+        assert_eq!(poll(&companion), Response::Error { message: "companion is busy".to_string() });
+
+        release_tx.send(()).unwrap();
+        assert!(matches!(waiter.join().unwrap(), Response::Control { .. }));
+        assert!(matches!(poll(&companion), Response::Control { .. }));
+        let metrics = companion.execute_control("metrics");
+        assert!(metrics.contains("aubo_companion_jobs_rejected_total 1"));
+        assert!(metrics.contains("aubo_companion_queue_wait_seconds_count{app=\"companion\"} 3"));
+    }
+
+    #[test]
+    fn test_client_and_companion_over_socket() {
+        let dir = tempfile::tempdir().unwrap();
+        let (app_side, mut companion_side) = UnixStream::pair().unwrap();
+
+        let data_dir = dir.path().to_path_buf();
+        let server = thread::spawn(move || Arc::new(Companion::new(data_dir)).serve(&mut companion_side));
+
+        let mut client = CompanionClient::new(app_side).unwrap();
+        client
+            .store_warm_cache("com.example.app", 1, vec![("tracker.net".to_string(), true)])
+            .unwrap();
+        assert_eq!(
+            client.load_warm_cache("com.example.app", 1).unwrap(),
+            vec![("tracker.net".to_string(), true)]
+        );
+
+        drop(client);
+        server.join().unwrap().unwrap();
+        assert!(warm_cache_path(dir.path(), "com.example.app").exists());
+    }
+
+    #[test]
+    fn test_stats_are_journaled() {
+        let dir = tempfile::tempdir().unwrap();
+        let stats_file = dir.path().join("stats.json");
+        let journal = StatsJournal::open(&stats_file).unwrap();
+        let mut companion = Companion::new(dir.path());
+        companion.start_stats_journal(journal, Duration::from_secs(60)).unwrap();
+
+        let mut delta = StatsDelta {
+            total_requests: 2,
+            blocked_requests: 1,
+            allowed_requests: 1,
+            ..Default::default()
+        };
+        delta.domains_blocked.insert("ads.example.com".to_string(), 1);
+        let response = companion.handle(Request::RecordStats {
+            app: "com.example.app".to_string(),
+            delta,
+        });
+        assert_eq!(response, Response::Ok);
+
+        match companion.handle(Request::ExportStats) {
+            Response::Stats { json } => assert!(json.contains("ads.example.com")),
+            other => panic!("unexpected response {:?}", other),
+        }
+
+        // The companion is never dropped in production; the record is in
+        // the log before any sync or flush
+        let journal = StatsJournal::open(&stats_file).unwrap();
+        assert_eq!(journal.totals().total_requests, 2);
+        drop(companion);
+    }
+
+    #[test]
+    fn test_stats_feed_time_series() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("stats.ts");
+        let series = TimeSeries::open(&path, Duration::from_secs(7 * 24 * 60 * 60)).unwrap();
+        let mut companion = Companion::new(dir.path());
+        companion.start_time_series(series, Duration::from_secs(60)).unwrap();
+
+        let delta = StatsDelta {
+            total_requests: 4,
+            blocked_requests: 1,
+            allowed_requests: 3,
+            ..Default::default()
+        };
+        let response = companion.handle(Request::RecordStats {
+            app: "com.example.app".to_string(),
+            delta,
+        });
+        assert_eq!(response, Response::Ok);
+
+        match companion.handle(Request::ExportTimeSeries { resolution: Resolution::Day }) {
+            Response::TimeSeries { points, .. } => {
+                assert_eq!(points.len(), 1);
+                assert_eq!(points[0].requests, 4);
+                assert!((points[0].block_rate - 0.25).abs() < 1e-9);
+            }
+            other => panic!("unexpected response {:?}", other),
+        }
+        drop(companion);
+        assert!(path.exists());
+    }
+
+    #[test]
+    fn test_live_metrics_without_persistence() {
+        let dir = tempfile::tempdir().unwrap();
+        let companion = Arc::new(Companion::new(dir.path()));
+        let delta = StatsDelta {
+            total_requests: 3,
+            blocked_requests: 1,
+            allowed_requests: 2,
+            ..Default::default()
+        };
+        let response = companion.handle(Request::RecordStats {
+            app: "com.example.app".to_string(),
+            delta,
+        });
+        assert_eq!(response, Response::Ok);
+        assert!(matches!(companion.handle(Request::ExportStats), Response::Error { .. }));
+
+        let metrics = companion.execute_control("metrics");
+        assert!(metrics.contains("aubo_requests_total{app=\"com.example.app\"} 3"), "{}", metrics);
+    }
+
+    #[test]
+    fn test_host_sketches_are_merged_per_app() {
+        let dir = tempfile::tempdir().unwrap();
+        let journal = StatsJournal::open(&dir.path().join("stats.json")).unwrap();
+        let mut companion = Companion::new(dir.path());
+        companion.start_stats_journal(journal, Duration::from_secs(60)).unwrap();
+
+        // Two processes of the same app report overlapping hosts
+        for hosts in [["a.com", "ads.net"], ["ads.net", "b.com"]] {
+            let sketches = HostCardinality::new();
+            for host in hosts {
+                sketches.record(host, host.starts_with("ads"));
+            }
+            let delta = StatsDelta {
+                host_sketches: sketches.take_changed(),
+                ..Default::default()
+            };
+            let response = companion.handle(Request::RecordStats {
+                app: "com.example.app".to_string(),
+                delta,
+            });
+            assert_eq!(response, Response::Ok);
+        }
+
+        let expected = vec![AppHostCardinality {
+            app: "com.example.app".to_string(),
+            distinct_hosts: 3,
+            distinct_blocked_hosts: 1,
+        }];
+        assert_eq!(
+            companion.handle(Request::ExportHostCardinality),
+            Response::HostCardinality { apps: expected.clone() }
+        );
+
+        // A restarted companion finds the merged sketches on disk
+        let companion = Companion::new(dir.path());
+        assert_eq!(
+            companion.handle(Request::ExportHostCardinality),
+            Response::HostCardinality { apps: expected }
+        );
+    }
+
+    #[test]
+    fn test_request_log_is_bounded_per_app() {
+        use crate::reqlog::{RequestLog, RuleId};
+
+        let dir = tempfile::tempdir().unwrap();
+        let (app_side, mut companion_side) = UnixStream::pair().unwrap();
+        let data_dir = dir.path().to_path_buf();
+        let server = thread::spawn(move || {
+            let companion = Arc::new(Companion::new(data_dir).with_request_log(REQUEST_LOG_CHUNK + 10));
+            companion.serve(&mut companion_side).unwrap();
+            companion
+        });
+
+        let log = RequestLog::new(REQUEST_LOG_CHUNK * 2);
+        for i in 0..REQUEST_LOG_CHUNK + 20 {
+            let host = if i % 2 == 0 { "tracker.net" } else { "example.com" };
+            log.record("dns", host, i % 2 == 0, RuleId::NONE, Duration::ZERO);
+        }
+        let (records, _) = log.read_since(0);
+        let mut client = CompanionClient::new(app_side).unwrap();
+        client.record_requests("com.example.app", records).unwrap();
+        drop(client);
+        let companion = server.join().unwrap();
+
+        let export = |host: Option<&str>| match companion.handle(Request::ExportRequestLog {
+            app: "com.example.app".to_string(),
+            host: host.map(str::to_string),
+        }) {
+            Response::RequestLog { records } => records,
+            other => panic!("unexpected response {:?}", other),
+        };
+        let all = export(None);
+        assert_eq!(all.len(), REQUEST_LOG_CHUNK + 10);
+        assert_eq!(all[0].sequence, 10, "oldest records are dropped first");
+        assert!(export(Some("tracker.net")).iter().all(|record| record.blocked));
+    }
+
+    #[test]
+    fn test_control_commands_reach_polling_apps() {
+        let dir = tempfile::tempdir().unwrap();
+        let companion = Arc::new(Companion::new(dir.path()).with_explainer(Arc::new(AuboConfig::default())));
+        let poll = |since| match companion.handle(Request::PollControl { since }) {
+            Response::Control { update } => update,
+            other => panic!("unexpected response {:?}", other),
+        };
+
+        let first = poll(None);
+        assert!(companion.execute_control("reload").starts_with("queued reload"));
+        companion.execute_control("monitor on");
+        let update = poll(Some(first.generation));
+        assert_eq!(update.commands, vec![AppCommand::Reload]);
+        assert!(update.modes.monitor_only);
+
+        let explained = companion.execute_control("explain doubleclick.net");
+        assert!(explained.starts_with("doubleclick.net: blocked by BlockedDomain rule 'doubleclick.net'"));
+        assert!(companion.execute_control("frobnicate").starts_with("error:"));
+    }
+
+    #[test]
+    fn test_shadow_evaluation_holds_changed_rules() {
+        let dir = tempfile::tempdir().unwrap();
+        let mut config = AuboConfig::default();
+        config.filters.filters_dir = dir.path().join("filters");
+        config.filters.cache_compiled = false;
+        fs::create_dir_all(&config.filters.filters_dir).unwrap();
+        let list = crate::filters::filter_list_path(&config.filters.filters_dir, "EasyList");
+        let companion = Arc::new(
+            Companion::new(dir.path())
+                .with_explainer(Arc::new(config))
+                .with_shadow_evaluation(),
+        );
+        let first = match companion.handle(Request::PollControl { since: None }) {
+            Response::Control { update } => update.generation,
+            other => panic!("unexpected response {:?}", other),
+        };
+
+        let hosts: Vec<String> = (0..64).map(|i| format!("host{}.example.org", i)).collect();
+        companion.handle(Request::StoreWarmCache {
+            app: "com.example.app".to_string(),
+            fingerprint: 0,
+            entries: hosts.iter().map(|host| (host.clone(), false)).collect(),
+        });
+        let rules: String = hosts[..16].iter().map(|host| format!("||{}^\n", host)).collect();
+        fs::write(&list, rules).unwrap();
+
+        let report = companion.execute_control("reload");
+        assert!(report.contains("16 verdicts changed"), "{}", report);
+        assert!(report.contains("held: "));
+        match companion.handle(Request::PollControl { since: Some(first) }) {
+            Response::Control { update } => assert!(update.commands.is_empty()),
+            other => panic!("unexpected response {:?}", other),
+        }
+        assert_eq!(companion.execute_control("shadow"), report);
+
+        assert!(companion.execute_control("promote").starts_with("queued reload"));
+        assert!(companion.execute_control("promote").starts_with("error:"));
+        assert!(companion.execute_control("explain host0.example.org").contains("blocked"));
+    }
+
+    #[test]
+    fn test_dropped_rules_are_written_on_demand() {
+        let dir = tempfile::tempdir().unwrap();
+        let mut config = AuboConfig::default();
+        config.filters.max_rules = 1;
+        config.filters.filters_dir = dir.path().join("filters");
+        let companion = Arc::new(Companion::new(dir.path()).with_explainer(Arc::new(config)));
+
+        let reply = companion.execute_control("dropped-rules");
+        assert!(reply.starts_with("wrote "), "{}", reply);
+        let text = fs::read_to_string(dir.path().join(DROPPED_RULES_FILE)).unwrap();
+        let drops = text.lines().filter(|line| line.starts_with("drop ")).count();
+        assert!(drops > 0);
+        assert!(reply.contains(&format!("wrote {} dropped rules", drops)), "{}", reply);
+        assert!(text.contains("reason rule cap reached="));
+    }
+
+    #[test]
+    fn test_warm_cache_path_is_sanitized() {
+        let path = warm_cache_path(Path::new("/data"), "com.example.app:remote/../x");
+        assert_eq!(path, Path::new("/data/warm/com.example.app_remote_.._x.json"));
+    }
+}
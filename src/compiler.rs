@@ -0,0 +1,729 @@
+//! Rule compilation and admission for aubo-rs
+//!
+//! Parsed filter rules from every enabled list are classified into the
+//! structures the engine matches against (domain sets, a literal pattern
+//! automaton and regex rules), then admitted under a rule cap and a byte
+//! budget. Rules from higher priority lists are admitted first; within a
+//! list, rules whose domains were actually hit are preferred. Rules that are
+//! not admitted are counted per list and reason; only a few are kept as
+//! samples, the full list is streamed to a caller that asks for it.
+
+use std::collections::{HashMap, HashSet};
+use std::fmt;
+
+use regex::Regex;
+
+use crate::config::FilterConfig;
+use crate::engine::FilterRule;
+use crate::filters::{parse_easylist_line, ParsedRule, RuleType};
+use crate::utils::ValidationUtils;
+
+/// Name of the rule source built from the configuration file
+pub const CONFIG_SOURCE_NAME: &str = "config";
+
+/// Estimated overhead of one domain set entry beyond its bytes
+const DOMAIN_ENTRY_OVERHEAD: usize = 48;
+
+/// Estimated automaton bytes per literal pattern byte
+const LITERAL_BYTES_PER_CHAR: usize = 16;
+
+/// Estimated fixed cost of one compiled regex rule
+const REGEX_BASE_BYTES: usize = 2048;
+
+/// Estimated regex program bytes per pattern byte
+const REGEX_BYTES_PER_CHAR: usize = 32;
+
+/// Dropped rules kept in a report as samples
+pub const DROPPED_SAMPLES: usize = 16;
+
+/// Rules from one filter list, or from the configuration
+#[derive(Debug, Clone)]
+pub struct RuleSource {
+    /// List name
+    pub name: String,
+    /// List priority, higher is admitted first
+    pub priority: u32,
+    /// Parsed rules in list order
+    pub rules: Vec<ParsedRule>,
+}
+
+impl RuleSource {
+    /// Build the source for configured black/whitelists and custom rules
+    ///
+    /// It uses the highest priority so user rules are never dropped in favour
+    /// of list rules.
+    pub fn from_config(config: &FilterConfig) -> Self {
+        let mut rules = Vec::new();
+
+        for domain in &config.whitelist_domains {
+            rules.push(ParsedRule {
+                pattern: format!("||{}^", domain),
+                rule_type: RuleType::Allow,
+                options: Vec::new(),
+            });
+        }
+        for domain in &config.blacklist_domains {
+            rules.push(ParsedRule {
+                pattern: format!("||{}^", domain),
+                rule_type: RuleType::Block,
+                options: Vec::new(),
+            });
+        }
+        rules.extend(config.custom_rules.iter().filter_map(|line| parse_easylist_line(line)));
+
+        Self {
+            name: CONFIG_SOURCE_NAME.to_string(),
+            priority: u32::MAX,
+            rules,
+        }
+    }
+}
+
+/// Why a rule was not admitted
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum DropReason {
+    /// Cosmetic or browser-only syntax with no meaning at network level
+    Unsupported,
+    /// The pattern failed to compile
+    Invalid,
+    /// An identical rule was already admitted from a higher priority list
+    Duplicate,
+    /// `filters.max_rules` was reached
+    RuleCap,
+    /// The rule did not fit into the memory budget
+    MemoryBudget,
+}
+
+impl fmt::Display for DropReason {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        let reason = match self {
+            DropReason::Unsupported => "unsupported syntax",
+            DropReason::Invalid => "invalid pattern",
+            DropReason::Duplicate => "duplicate",
+            DropReason::RuleCap => "rule cap reached",
+            DropReason::MemoryBudget => "memory budget exceeded",
+        };
+        f.write_str(reason)
+    }
+}
+
+/// A rule that was not admitted
+#[derive(Debug, Clone)]
+pub struct DroppedRule {
+    /// List the rule came from
+    pub list: String,
+    /// Original rule text
+    pub rule: String,
+    /// Why it was dropped
+    pub reason: DropReason,
+}
+
+/// Admission totals for one list
+#[derive(Debug, Clone, Default)]
+pub struct ListAdmission {
+    /// List name
+    pub name: String,
+    /// List priority
+    pub priority: u32,
+    /// Rules admitted
+    pub admitted: usize,
+    /// Rules dropped
+    pub dropped: usize,
+    /// Estimated bytes used by the admitted rules
+    pub bytes: usize,
+}
+
+/// Outcome of a compilation run
+#[derive(Debug, Clone, Default)]
+pub struct AdmissionReport {
+    /// Rule cap that was enforced
+    pub rule_cap: usize,
+    /// Byte budget that was enforced
+    pub budget_bytes: usize,
+    /// Rules admitted in total
+    pub admitted: usize,
+    /// Estimated bytes used by admitted rules
+    pub admitted_bytes: usize,
+    /// Per-list totals, highest priority first
+    pub lists: Vec<ListAdmission>,
+    /// Rules not admitted in total
+    pub dropped: usize,
+    /// Rules not admitted, by reason
+    pub dropped_by_reason: HashMap<DropReason, usize>,
+    /// The first [`DROPPED_SAMPLES`] rules that were not admitted
+    pub samples: Vec<DroppedRule>,
+}
+
+impl AdmissionReport {
+    /// Heap bytes held by the report
+    pub fn heap_bytes(&self) -> usize {
+        self.lists.capacity() * std::mem::size_of::<ListAdmission>()
+            + self.lists.iter().map(|list| list.name.capacity()).sum::<usize>()
+            + self.dropped_by_reason.capacity() * std::mem::size_of::<(DropReason, usize)>()
+            + self.samples.capacity() * std::mem::size_of::<DroppedRule>()
+            + self
+                .samples
+                .iter()
+                .map(|rule| rule.list.capacity() + rule.rule.capacity())
+                .sum::<usize>()
+    }
+
+    /// Render the report as text, one sampled dropped rule per line
+    pub fn to_text(&self) -> String {
+        let mut out = format!(
+            "admitted={} bytes={} rule_cap={} budget_bytes={} dropped={}\n",
+            self.admitted, self.admitted_bytes, self.rule_cap, self.budget_bytes, self.dropped
+        );
+        for list in &self.lists {
+            out.push_str(&format!(
+                "list name={} priority={} admitted={} dropped={} bytes={}\n",
+                list.name, list.priority, list.admitted, list.dropped, list.bytes
+            ));
+        }
+        let mut reasons: Vec<_> = self.dropped_by_reason.iter().collect();
+        reasons.sort_by_key(|(reason, _)| reason.to_string());
+        for (reason, count) in reasons {
+            out.push_str(&format!("reason {}={}\n", reason, count));
+        }
+        for rule in &self.samples {
+            out.push_str(&format!("sample list={} reason={} rule={}\n", rule.list, rule.reason, rule.rule));
+        }
+        out
+    }
+}
+
+/// Render one dropped rule as a report line
+pub fn drop_line(list: &str, rule: &str, reason: DropReason) -> String {
+    format!("drop list={} reason={} rule={}\n", list, reason, rule)
+}
+
+/// Filter list each admitted block rule came from
+///
+/// Lists are referred to by their index in `names`, which follows the order
+/// of the compiled sources.
+#[derive(Debug, Clone, Default)]
+pub struct RuleLists {
+    /// Names of the compiled sources
+    pub names: Vec<String>,
+    /// List of each literal pattern, by pattern index
+    pub patterns: Vec<u16>,
+    /// List of each regex rule, by rule index
+    pub regexes: Vec<u16>,
+}
+
+impl RuleLists {
+    /// Name of the list at `index`
+    pub fn name(&self, index: u16) -> Option<&str> {
+        self.names.get(index as usize).map(String::as_str)
+    }
+
+    /// Heap bytes of the index vectors and names
+    pub fn heap_bytes(&self) -> usize {
+        (self.patterns.capacity() + self.regexes.capacity()) * std::mem::size_of::<u16>()
+            + self.names.iter().map(|name| name.capacity() + std::mem::size_of::<String>()).sum::<usize>()
+    }
+}
+
+/// Compiled rule structures ready to be swapped into the engine
+#[derive(Debug, Default)]
+pub struct CompiledRules {
+    /// Domains blocked together with their subdomains, with their list index
+    pub blocked_domains: HashMap<String, u16>,
+    /// Domains allowed together with their subdomains
+    pub allowed_domains: HashSet<String>,
+    /// Case-insensitive substrings that block a URL
+    pub literal_patterns: Vec<String>,
+    /// Block rules that need a regex
+    pub regex_rules: Vec<FilterRule>,
+    /// Lists the block rules came from
+    pub lists: RuleLists,
+    /// Order-independent fingerprint of the admitted rules
+    pub fingerprint: u64,
+    /// Admission outcome
+    pub report: AdmissionReport,
+}
+
+/// Matching structure a rule compiles into
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+enum CompiledKind {
+    BlockDomain(String),
+    AllowDomain(String),
+    Literal(String),
+    Regex(String),
+}
+
+impl CompiledKind {
+    fn cost(&self) -> usize {
+        match self {
+            CompiledKind::BlockDomain(domain) | CompiledKind::AllowDomain(domain) => {
+                domain.len() + DOMAIN_ENTRY_OVERHEAD
+            }
+            CompiledKind::Literal(pattern) => pattern.len() * LITERAL_BYTES_PER_CHAR,
+            CompiledKind::Regex(pattern) => estimated_regex_bytes(pattern),
+        }
+    }
+
+    /// Stable FNV-1a hash, identical across processes and boots
+    fn stable_hash(&self) -> u64 {
+        let (tag, text) = match self {
+            CompiledKind::BlockDomain(text) => (b'b', text),
+            CompiledKind::AllowDomain(text) => (b'a', text),
+            CompiledKind::Literal(text) => (b'l', text),
+            CompiledKind::Regex(text) => (b'r', text),
+        };
+        std::iter::once(tag)
+            .chain(text.bytes())
+            .fold(0xcbf2_9ce4_8422_2325, |hash, byte| {
+                (hash ^ byte as u64).wrapping_mul(0x0100_0000_01b3)
+            })
+    }
+
+    fn domain(&self) -> Option<&str> {
+        match self {
+            CompiledKind::BlockDomain(domain) | CompiledKind::AllowDomain(domain) => Some(domain),
+            _ => None,
+        }
+    }
+}
+
+/// Estimated heap bytes of a compiled regex
+///
+/// The regex crate does not expose the size of its compiled programs, so
+/// this estimate is used both for admission and for memory accounting.
+pub fn estimated_regex_bytes(pattern: &str) -> usize {
+    REGEX_BASE_BYTES + pattern.len() * REGEX_BYTES_PER_CHAR
+}
+
+/// Admission candidate
+struct Candidate<'a> {
+    list: usize,
+    priority: u32,
+    hits: u64,
+    seq: usize,
+    rule: &'a ParsedRule,
+    kind: CompiledKind,
+}
+
+/// Compiles rule sources under a rule cap and byte budget
+pub struct RuleCompiler<'a> {
+    rule_cap: usize,
+    budget_bytes: usize,
+    hit_counts: Option<&'a HashMap<String, u64>>,
+}
+
+impl<'a> RuleCompiler<'a> {
+    /// Create a compiler with the given limits
+    pub fn new(rule_cap: usize, budget_bytes: usize) -> Self {
+        Self {
+            rule_cap,
+            budget_bytes,
+            hit_counts: None,
+        }
+    }
+
+    /// Prefer rules for domains with more observed hits
+    pub fn with_hit_counts(mut self, hit_counts: &'a HashMap<String, u64>) -> Self {
+        self.hit_counts = Some(hit_counts);
+        self
+    }
+
+    /// Compile and admit rules from all sources
+    pub fn compile(&self, sources: &[RuleSource]) -> CompiledRules {
+        self.compile_reporting(sources, &mut |_, _, _| {})
+    }
+
+    /// Compile like [`compile`](Self::compile), passing every rule that is
+    /// not admitted to `on_drop` with its list name and reason
+    pub fn compile_reporting(
+        &self,
+        sources: &[RuleSource],
+        on_drop: &mut dyn FnMut(&str, &ParsedRule, DropReason),
+    ) -> CompiledRules {
+        let mut report = AdmissionReport {
+            rule_cap: self.rule_cap,
+            budget_bytes: self.budget_bytes,
+            ..Default::default()
+        };
+        report.lists = sources
+            .iter()
+            .map(|source| ListAdmission {
+                name: source.name.clone(),
+                priority: source.priority,
+                ..Default::default()
+            })
+            .collect();
+
+        let mut candidates = Vec::new();
+        for (list, source) in sources.iter().enumerate() {
+            for rule in &source.rules {
+                match classify_rule(rule) {
+                    Ok(kind) => {
+                        let hits = kind
+                            .domain()
+                            .and_then(|domain| self.hit_counts?.get(domain).copied())
+                            .unwrap_or(0);
+                        candidates.push(Candidate {
+                            list,
+                            priority: source.priority,
+                            hits,
+                            seq: candidates.len(),
+                            rule,
+                            kind,
+                        });
+                    }
+                    Err(reason) => drop_rule(&mut report, on_drop, &source.name, list, rule, reason),
+                }
+            }
+        }
+
+        candidates.sort_by(|a, b| {
+            b.priority
+                .cmp(&a.priority)
+                .then(b.hits.cmp(&a.hits))
+                .then(a.seq.cmp(&b.seq))
+        });
+
+        let mut compiled = CompiledRules::default();
+        compiled.lists.names = sources.iter().map(|source| source.name.clone()).collect();
+        let mut seen = HashSet::new();
+        for candidate in candidates {
+            let name = &sources[candidate.list].name;
+            let list_index = candidate.list.min(u16::MAX as usize) as u16;
+
+            if seen.contains(&candidate.kind) {
+                drop_rule(&mut report, on_drop, name, candidate.list, candidate.rule, DropReason::Duplicate);
+                continue;
+            }
+            if report.admitted >= self.rule_cap {
+                drop_rule(&mut report, on_drop, name, candidate.list, candidate.rule, DropReason::RuleCap);
+                continue;
+            }
+
+            let cost = candidate.kind.cost();
+            if report.admitted_bytes + cost > self.budget_bytes {
+                drop_rule(&mut report, on_drop, name, candidate.list, candidate.rule, DropReason::MemoryBudget);
+                continue;
+            }
+
+            match &candidate.kind {
+                CompiledKind::BlockDomain(domain) => {
+                    compiled.blocked_domains.insert(domain.clone(), list_index);
+                }
+                CompiledKind::AllowDomain(domain) => {
+                    compiled.allowed_domains.insert(domain.clone());
+                }
+                CompiledKind::Literal(pattern) => {
+                    compiled.literal_patterns.push(pattern.clone());
+                    compiled.lists.patterns.push(list_index);
+                }
+                CompiledKind::Regex(pattern) => match Regex::new(pattern) {
+                    Ok(regex) => {
+                        compiled.regex_rules.push(FilterRule::Block {
+                            pattern: candidate.rule.pattern.clone(),
+                            regex: Some(regex),
+                        });
+                        compiled.lists.regexes.push(list_index);
+                    }
+                    Err(_) => {
+                        drop_rule(&mut report, on_drop, name, candidate.list, candidate.rule, DropReason::Invalid);
+                        continue;
+                    }
+                },
+            }
+
+            report.admitted += 1;
+            report.admitted_bytes += cost;
+            compiled.fingerprint = compiled.fingerprint.wrapping_add(candidate.kind.stable_hash());
+            let list = &mut report.lists[candidate.list];
+            list.admitted += 1;
+            list.bytes += cost;
+            seen.insert(candidate.kind);
+        }
+
+        report.lists.sort_by(|a, b| b.priority.cmp(&a.priority));
+        compiled.report = report;
+        compiled
+    }
+}
+
+fn drop_rule(
+    report: &mut AdmissionReport,
+    on_drop: &mut dyn FnMut(&str, &ParsedRule, DropReason),
+    list_name: &str,
+    list: usize,
+    rule: &ParsedRule,
+    reason: DropReason,
+) {
+    report.lists[list].dropped += 1;
+    report.dropped += 1;
+    *report.dropped_by_reason.entry(reason).or_insert(0) += 1;
+    if report.samples.len() < DROPPED_SAMPLES {
+        report.samples.push(DroppedRule {
+            list: list_name.to_string(),
+            rule: rule.pattern.clone(),
+            reason,
+        });
+    }
+    on_drop(list_name, rule, reason);
+}
+
+/// Decide which matching structure a parsed rule compiles into
+fn classify_rule(rule: &ParsedRule) -> std::result::Result<CompiledKind, DropReason> {
+    let text = rule.pattern.trim();
+
+    // Element hiding and scriptlet rules only make sense inside a browser
+    if text.is_empty()
+        || text.starts_with('[')
+        || ["##", "#@#", "#?#", "#$#", "#%#"].iter().any(|marker| text.contains(marker))
+    {
+        return Err(DropReason::Unsupported);
+    }
+
+    let is_allow = matches!(rule.rule_type, RuleType::Allow);
+    let is_block = matches!(rule.rule_type, RuleType::Block);
+    if !is_allow && !is_block {
+        return Err(DropReason::Unsupported);
+    }
+
+    // Raw regex rules
+    if text.len() > 2 && text.starts_with('/') && text.ends_with('/') {
+        if is_allow {
+            return Err(DropReason::Unsupported);
+        }
+        return Ok(CompiledKind::Regex(text[1..text.len() - 1].to_string()));
+    }
+
+    let pattern = match text.rfind('$') {
+        Some(index) => &text[..index],
+        None => text,
+    };
+    if pattern.is_empty() {
+        return Err(DropReason::Unsupported);
+    }
+
+    if let Some(domain) = anchored_domain(pattern) {
+        let domain = domain.to_ascii_lowercase();
+        return Ok(if is_allow {
+            CompiledKind::AllowDomain(domain)
+        } else {
+            CompiledKind::BlockDomain(domain)
+        });
+    }
+
+    // Hosts-style entries and bare domains
+    if pattern.contains('.') && ValidationUtils::is_valid_domain(pattern) {
+        let domain = pattern.to_ascii_lowercase();
+        return Ok(if is_allow {
+            CompiledKind::AllowDomain(domain)
+        } else {
+            CompiledKind::BlockDomain(domain)
+        });
+    }
+
+    // Path-level allow rules cannot be expressed by the domain allowlist
+    if is_allow {
+        return Err(DropReason::Unsupported);
+    }
+
+    if !pattern.contains(['*', '^', '|']) {
+        return Ok(CompiledKind::Literal(pattern.to_string()));
+    }
+
+    Ok(CompiledKind::Regex(abp_pattern_to_regex(pattern)))
+}
+
+/// Extract `example.com` from `||example.com^` style rules
+fn anchored_domain(pattern: &str) -> Option<&str> {
+    let domain = pattern.strip_prefix("||")?;
+    let domain = domain.strip_suffix('^').unwrap_or(domain);
+    ValidationUtils::is_valid_domain(domain).then_some(domain)
+}
+
+/// Translate Adblock Plus wildcard syntax into a regex
+fn abp_pattern_to_regex(pattern: &str) -> String {
+    let mut regex = String::from("(?i)");
+    let mut rest = pattern;
+
+    if let Some(stripped) = rest.strip_prefix("||") {
+        regex.push_str(r"^[a-z][a-z0-9+.-]*://([^/?#]*\.)?");
+        rest = stripped;
+    } else if let Some(stripped) = rest.strip_prefix('|') {
+        regex.push('^');
+        rest = stripped;
+    }
+
+    let (body, anchored_end) = match rest.strip_suffix('|') {
+        Some(stripped) => (stripped, true),
+        None => (rest, false),
+    };
+
+    for c in body.chars() {
+        match c {
+            '*' => regex.push_str(".*"),
+            '^' => regex.push_str(r"(?:[^\w.%-]|$)"),
+            c => regex.push_str(&regex::escape(c.encode_utf8(&mut [0; 4]))),
+        }
+    }
+
+    if anchored_end {
+        regex.push('$');
+    }
+    regex
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn block(pattern: &str) -> ParsedRule {
+        ParsedRule {
+            pattern: pattern.to_string(),
+            rule_type: RuleType::Block,
+            options: Vec::new(),
+        }
+    }
+
+    fn allow(pattern: &str) -> ParsedRule {
+        ParsedRule {
+            pattern: pattern.to_string(),
+            rule_type: RuleType::Allow,
+            options: Vec::new(),
+        }
+    }
+
+    fn source(name: &str, priority: u32, rules: Vec<ParsedRule>) -> RuleSource {
+        RuleSource {
+            name: name.to_string(),
+            priority,
+            rules,
+        }
+    }
+
+    #[test]
+    fn test_rule_classification() {
+        assert_eq!(classify_rule(&block("||ads.example.com^")), Ok(CompiledKind::BlockDomain("ads.example.com".into())));
+        assert_eq!(classify_rule(&block("||Ads.Example.com^$third-party")), Ok(CompiledKind::BlockDomain("ads.example.com".into())));
+        assert_eq!(classify_rule(&block("tracker.example.net")), Ok(CompiledKind::BlockDomain("tracker.example.net".into())));
+        assert_eq!(classify_rule(&allow("||good.example.com^")), Ok(CompiledKind::AllowDomain("good.example.com".into())));
+        assert_eq!(classify_rule(&block("/banner/ads/")), Ok(CompiledKind::Regex("banner/ads".into())));
+        assert_eq!(classify_rule(&block("-ad-banner.")), Ok(CompiledKind::Literal("-ad-banner.".into())));
+        assert!(matches!(classify_rule(&block("||example.com/ads/*")), Ok(CompiledKind::Regex(_))));
+
+        assert_eq!(classify_rule(&block("example.com##.ad-banner")), Err(DropReason::Unsupported));
+        assert_eq!(classify_rule(&block("[Adblock Plus 2.0]")), Err(DropReason::Unsupported));
+        assert_eq!(classify_rule(&allow("/path/only")), Err(DropReason::Unsupported));
+    }
+
+    #[test]
+    fn test_abp_regex_translation() {
+        let regex = Regex::new(&abp_pattern_to_regex("||example.com/ads/*.js^")).unwrap();
+        assert!(regex.is_match("https://example.com/ads/banner.js"));
+        assert!(regex.is_match("https://cdn.example.com/ads/x.js?v=1"));
+        assert!(!regex.is_match("https://notexample.com/ads/banner.js"));
+        assert!(!regex.is_match("https://example.com/content/banner.js"));
+    }
+
+    #[test]
+    fn test_priority_order_under_rule_cap() {
+        let sources = vec![
+            source("low", 10, vec![block("||low1.com^"), block("||low2.com^")]),
+            source("high", 100, vec![block("||high1.com^"), block("||high2.com^")]),
+        ];
+
+        let compiled = RuleCompiler::new(3, usize::MAX).compile(&sources);
+        let report = &compiled.report;
+
+        assert_eq!(report.admitted, 3);
+        assert!(compiled.blocked_domains.contains_key("high1.com"));
+        assert!(compiled.blocked_domains.contains_key("high2.com"));
+        assert!(compiled.blocked_domains.contains_key("low1.com"));
+        assert_eq!(report.dropped, 1);
+        assert_eq!(report.samples[0].rule, "||low2.com^");
+        assert_eq!(report.samples[0].list, "low");
+        assert_eq!(report.samples[0].reason, DropReason::RuleCap);
+        assert_eq!(compiled.lists.name(compiled.blocked_domains["high1.com"]), Some("high"));
+        assert_eq!(compiled.lists.name(compiled.blocked_domains["low1.com"]), Some("low"));
+        assert_eq!(report.lists[0].name, "high");
+        assert_eq!(report.lists[1].admitted, 1);
+        assert_eq!(report.lists[1].dropped, 1);
+    }
+
+    #[test]
+    fn test_hit_counts_break_ties_within_a_list() {
+        let sources = vec![source("list", 10, vec![block("||cold.com^"), block("||hot.com^")])];
+        let mut hits = HashMap::new();
+        hits.insert("hot.com".to_string(), 42);
+
+        let compiled = RuleCompiler::new(1, usize::MAX).with_hit_counts(&hits).compile(&sources);
+        assert!(compiled.blocked_domains.contains_key("hot.com"));
+        assert_eq!(compiled.report.samples[0].rule, "||cold.com^");
+    }
+
+    #[test]
+    fn test_memory_budget_is_enforced() {
+        let rules = (0..100).map(|i| block(&format!("||host{}.example.com^", i))).collect();
+        let sources = vec![source("list", 10, rules)];
+        let budget = 10 * ("host00.example.com".len() + DOMAIN_ENTRY_OVERHEAD);
+
+        let compiled = RuleCompiler::new(usize::MAX, budget).compile(&sources);
+        let report = &compiled.report;
+
+        assert!(report.admitted_bytes <= budget);
+        assert!(report.admitted >= 10);
+        assert_eq!(report.admitted + report.dropped, 100);
+        assert_eq!(report.dropped_by_reason.get(&DropReason::MemoryBudget), Some(&report.dropped));
+        assert_eq!(report.samples.len(), DROPPED_SAMPLES);
+
+        // Every dropped rule still reaches a caller that asks for the full list
+        let mut streamed = 0;
+        RuleCompiler::new(usize::MAX, budget).compile_reporting(&sources, &mut |list, _, reason| {
+            assert_eq!((list, reason), ("list", DropReason::MemoryBudget));
+            streamed += 1;
+        });
+        assert_eq!(streamed, report.dropped);
+    }
+
+    #[test]
+    fn test_duplicates_and_report_text() {
+        let sources = vec![
+            source("a", 20, vec![block("||dup.com^"), block("example.com##.ad")]),
+            source("b", 10, vec![block("dup.com")]),
+        ];
+
+        let compiled = RuleCompiler::new(100, usize::MAX).compile(&sources);
+        let reasons = &compiled.report.dropped_by_reason;
+        assert_eq!(reasons.get(&DropReason::Duplicate), Some(&1));
+        assert_eq!(reasons.get(&DropReason::Unsupported), Some(&1));
+
+        let text = compiled.report.to_text();
+        assert!(text.contains("sample list=b reason=duplicate rule=dup.com"));
+    }
+
+    #[test]
+    fn test_fingerprint_ignores_order() {
+        let forward = vec![source("list", 10, vec![block("||a.com^"), block("||b.com^")])];
+        let reverse = vec![source("other", 5, vec![block("||b.com^"), block("||a.com^")])];
+        let changed = vec![source("list", 10, vec![block("||a.com^"), block("||c.com^")])];
+
+        let fingerprint = |sources: &[RuleSource]| RuleCompiler::new(100, usize::MAX).compile(sources).fingerprint;
+        assert_eq!(fingerprint(&forward), fingerprint(&reverse));
+        assert_ne!(fingerprint(&forward), fingerprint(&changed));
+    }
+
+    #[test]
+    fn test_config_source() {
+        let mut config = FilterConfig::default();
+        config.blacklist_domains = vec!["bad.com".to_string()];
+        config.whitelist_domains = vec!["good.com".to_string()];
+        config.custom_rules = vec!["||custom.com^".to_string(), "! comment".to_string()];
+
+        let source = RuleSource::from_config(&config);
+        assert_eq!(source.priority, u32::MAX);
+        assert_eq!(source.rules.len(), 3);
+
+        let compiled = RuleCompiler::new(100, usize::MAX).compile(&[source]);
+        assert!(compiled.blocked_domains.contains_key("bad.com"));
+        assert!(compiled.blocked_domains.contains_key("custom.com"));
+        assert!(compiled.allowed_domains.contains("good.com"));
+    }
+}
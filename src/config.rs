@@ -63,6 +63,7 @@ pub struct GeneralConfig {
     pub debug_mode: bool,
     
     /// System update check interval
+    #[serde(with = "duration_format")]
     pub update_check_interval: Duration,
     
     /// Maximum memory usage (in MB)
@@ -88,6 +89,7 @@ pub struct FilterConfig {
     pub custom_rules: Vec<String>,
     
     /// Filter update interval
+    #[serde(with = "duration_format")]
     pub update_interval: Duration,
     
     /// Maximum filter rules in memory
@@ -104,6 +106,18 @@ pub struct FilterConfig {
     
     /// Blacklist domains (always block)
     pub blacklist_domains: Vec<String>,
+    
+    /// Replay sampled hosts against reloaded rules before apps reload them
+    #[serde(default)]
+    pub shadow_evaluation: bool,
+    
+    /// Largest rise of p99 evaluation time, as a ratio, a reload may bring
+    #[serde(default = "default_shadow_max_p99_ratio")]
+    pub shadow_max_p99_ratio: f64,
+    
+    /// Largest share of sampled hosts a reload may change the verdict of
+    #[serde(default = "default_shadow_max_changed")]
+    pub shadow_max_changed: f64,
 }
 
 /// Filter list configuration
@@ -122,6 +136,7 @@ pub struct FilterListConfig {
     pub enabled: bool,
     
     /// Update interval override for this list
+    #[serde(default, with = "duration_format::option")]
     pub update_interval: Option<Duration>,
     
     /// Priority (higher priority lists are checked first)
@@ -158,14 +173,24 @@ pub struct HookConfig {
     /// Network functions to hook
     pub hook_functions: Vec<HookFunction>,
     
-    /// Enable deep packet inspection
+    /// Inspect the first write on each connection for a blocked TLS server
+    /// name or HTTP URL
     pub deep_inspection: bool,
     
-    /// Maximum request size to analyze (in bytes)
+    /// Bytes of a first write that are parsed
     pub max_request_size: usize,
     
     /// Request analysis timeout
+    #[serde(with = "duration_format")]
     pub analysis_timeout: Duration,
+    
+    /// Consecutive lookups over the timeout that let lookups through unchecked
+    #[serde(default = "default_breaker_threshold")]
+    pub breaker_threshold: u32,
+    
+    /// How long lookups go through unchecked once the breaker opened
+    #[serde(default = "default_breaker_cooldown", with = "duration_format")]
+    pub breaker_cooldown: Duration,
 }
 
 /// Network function hooking configuration
@@ -194,9 +219,11 @@ pub struct StatsConfig {
     pub stats_file: PathBuf,
     
     /// Statistics collection interval
+    #[serde(with = "duration_format")]
     pub collection_interval: Duration,
     
     /// Statistics retention period
+    #[serde(with = "duration_format")]
     pub retention_period: Duration,
     
     /// Enable detailed request logging
@@ -212,12 +239,16 @@ pub struct StatsConfig {
 /// Performance tuning configuration
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct PerformanceConfig {
-    /// Worker thread pool size
+    /// Companion worker thread pool size
     pub worker_threads: usize,
     
-    /// Request queue size
+    /// Companion request queue size
     pub request_queue_size: usize,
     
+    /// Talk to the companion through shared memory instead of the socket
+    #[serde(default)]
+    pub companion_shared_memory: bool,
+    
     /// Filter cache size
     pub filter_cache_size: usize,
     
@@ -225,6 +256,7 @@ pub struct PerformanceConfig {
     pub dns_cache_size: usize,
     
     /// DNS cache TTL
+    #[serde(with = "duration_format")]
     pub dns_cache_ttl: Duration,
     
     /// Enable aggressive caching
@@ -233,6 +265,38 @@ pub struct PerformanceConfig {
     /// Memory pressure threshold
     pub memory_pressure_threshold: f32,
     
+    /// Memory PSI avg10 percentage treated as memory pressure
+    #[serde(default = "default_memory_psi_threshold")]
+    pub memory_psi_threshold: f32,
+    
+    /// Resize caches per app from their observed working set
+    #[serde(default = "default_cache_autotune")]
+    pub cache_autotune: bool,
+    
+    /// Reduce matching when lookups get slow or the CPU is under pressure
+    #[serde(default = "default_adaptive_degradation")]
+    pub adaptive_degradation: bool,
+    
+    /// p99 lookup latency above which matching is reduced
+    #[serde(default = "default_degrade_latency_target", with = "duration_format")]
+    pub degrade_latency_target: Duration,
+    
+    /// Block connects to blocked addresses in the kernel with cgroup eBPF
+    #[serde(default)]
+    pub ebpf_connect_blocking: bool,
+    
+    /// Cgroup v2 directory the connect filter is attached to
+    #[serde(default = "default_ebpf_cgroup_path")]
+    pub ebpf_cgroup_path: PathBuf,
+    
+    /// Also block addresses that hosts blocked by the DNS hooks resolve to
+    ///
+    /// Off by default: the filter covers the whole cgroup, including
+    /// processes outside the module's scope, and a learned CDN address may
+    /// be shared with allowed hosts.
+    #[serde(default = "default_ebpf_learn_addresses")]
+    pub ebpf_learn_addresses: bool,
+    
     /// CPU pressure threshold
     pub cpu_pressure_threshold: f32,
 }
@@ -259,6 +323,64 @@ pub struct LoggingConfig {
     pub structured: bool,
 }
 
+/// Durations as humantime strings such as `"30s"` or `"7d"`
+///
+/// Tables of `secs` and `nanos`, which configs were saved with before, are
+/// still read.
+mod duration_format {
+    use std::fmt;
+    use std::time::Duration;
+
+    use serde::de::{self, MapAccess, Visitor};
+    use serde::{Deserialize, Deserializer, Serializer};
+
+    pub(crate) fn serialize<S: Serializer>(duration: &Duration, serializer: S) -> Result<S::Ok, S::Error> {
+        serializer.collect_str(&humantime::format_duration(*duration))
+    }
+
+    pub(crate) fn deserialize<'de, D: Deserializer<'de>>(deserializer: D) -> Result<Duration, D::Error> {
+        deserializer.deserialize_any(DurationVisitor)
+    }
+
+    struct DurationVisitor;
+
+    impl<'de> Visitor<'de> for DurationVisitor {
+        type Value = Duration;
+
+        fn expecting(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+            f.write_str("a duration such as \"30s\" or \"100ms\"")
+        }
+
+        fn visit_str<E: de::Error>(self, text: &str) -> Result<Duration, E> {
+            humantime::parse_duration(text).map_err(|e| E::custom(format!("invalid duration {:?}: {}", text, e)))
+        }
+
+        fn visit_map<A: MapAccess<'de>>(self, map: A) -> Result<Duration, A::Error> {
+            Duration::deserialize(de::value::MapAccessDeserializer::new(map))
+        }
+    }
+
+    /// The same for optional durations
+    pub(crate) mod option {
+        use std::time::Duration;
+
+        use serde::{Deserialize, Deserializer, Serializer};
+
+        pub(crate) fn serialize<S: Serializer>(duration: &Option<Duration>, serializer: S) -> Result<S::Ok, S::Error> {
+            match duration {
+                Some(duration) => super::serialize(duration, serializer),
+                None => serializer.serialize_none(),
+            }
+        }
+
+        pub(crate) fn deserialize<'de, D: Deserializer<'de>>(deserializer: D) -> Result<Option<Duration>, D::Error> {
+            #[derive(Deserialize)]
+            struct Wrapper(#[serde(with = "super")] Duration);
+            Ok(Option::<Wrapper>::deserialize(deserializer)?.map(|Wrapper(duration)| duration))
+        }
+    }
+}
+
 impl Default for AuboConfig {
     fn default() -> Self {
         Self {
@@ -316,6 +438,9 @@ impl Default for FilterConfig {
             cache_compiled: true,
             whitelist_domains: Vec::new(),
             blacklist_domains: Vec::new(),
+            shadow_evaluation: false,
+            shadow_max_p99_ratio: default_shadow_max_p99_ratio(),
+            shadow_max_changed: default_shadow_max_changed(),
         }
     }
 }
@@ -353,6 +478,8 @@ impl Default for HookConfig {
             deep_inspection: true,
             max_request_size: 1024 * 1024, // 1MB
             analysis_timeout: Duration::from_millis(100),
+            breaker_threshold: default_breaker_threshold(),
+            breaker_cooldown: default_breaker_cooldown(),
         }
     }
 }
@@ -376,16 +503,64 @@ impl Default for PerformanceConfig {
         Self {
             worker_threads: num_cpus::get().min(4),
             request_queue_size: 1000,
+            companion_shared_memory: false,
             filter_cache_size: 10000,
             dns_cache_size: 1000,
             dns_cache_ttl: Duration::from_secs(300), // 5 minutes
             aggressive_caching: false,
             memory_pressure_threshold: 0.8,
+            memory_psi_threshold: default_memory_psi_threshold(),
+            cache_autotune: default_cache_autotune(),
+            adaptive_degradation: default_adaptive_degradation(),
+            degrade_latency_target: default_degrade_latency_target(),
+            ebpf_connect_blocking: false,
+            ebpf_cgroup_path: default_ebpf_cgroup_path(),
+            ebpf_learn_addresses: default_ebpf_learn_addresses(),
             cpu_pressure_threshold: 0.7,
         }
     }
 }
 
+fn default_shadow_max_p99_ratio() -> f64 {
+    1.5
+}
+
+fn default_shadow_max_changed() -> f64 {
+    0.05
+}
+
+fn default_breaker_threshold() -> u32 {
+    5
+}
+
+fn default_breaker_cooldown() -> Duration {
+    Duration::from_secs(30)
+}
+
+fn default_memory_psi_threshold() -> f32 {
+    10.0
+}
+
+fn default_cache_autotune() -> bool {
+    true
+}
+
+fn default_adaptive_degradation() -> bool {
+    true
+}
+
+fn default_degrade_latency_target() -> Duration {
+    Duration::from_millis(2)
+}
+
+fn default_ebpf_cgroup_path() -> PathBuf {
+    PathBuf::from(crate::bpf::DEFAULT_CGROUP_PATH)
+}
+
+fn default_ebpf_learn_addresses() -> bool {
+    false
+}
+
 impl Default for LoggingConfig {
     fn default() -> Self {
         Self {
@@ -472,6 +647,24 @@ impl AuboConfig {
             }));
         }
 
+        if self.performance.memory_pressure_threshold <= 0.0
+            || self.performance.memory_pressure_threshold > 1.0
+        {
+            return Err(AuboError::Config(ConfigError::InvalidValue {
+                key: "performance.memory_pressure_threshold".to_string(),
+                value: self.performance.memory_pressure_threshold.to_string(),
+            }));
+        }
+
+        if self.performance.memory_psi_threshold <= 0.0
+            || self.performance.memory_psi_threshold > 100.0
+        {
+            return Err(AuboError::Config(ConfigError::InvalidValue {
+                key: "performance.memory_psi_threshold".to_string(),
+                value: self.performance.memory_psi_threshold.to_string(),
+            }));
+        }
+
         // Validate logging level
         match self.logging.level.as_str() {
             "error" | "warn" | "info" | "debug" | "trace" => {},
@@ -554,6 +747,33 @@ mod tests {
         assert!(config.validate().is_err());
     }
 
+    #[test]
+    fn test_shipped_config_loads() {
+        let temp_dir = TempDir::new().unwrap();
+        let config_path = temp_dir.path().join(DEFAULT_CONFIG_FILE);
+        fs::write(&config_path, include_str!("../aubo-rs.toml")).unwrap();
+
+        let config = AuboConfig::load_from_file(&config_path).unwrap();
+        assert_eq!(config.general.update_check_interval, Duration::from_secs(24 * 60 * 60));
+        assert_eq!(config.hooks.analysis_timeout, Duration::from_millis(100));
+        assert_eq!(config.hooks.breaker_cooldown, Duration::from_secs(30));
+        assert_eq!(config.stats.retention_period, Duration::from_secs(7 * 24 * 60 * 60));
+        assert_eq!(config.performance.degrade_latency_target, Duration::from_millis(2));
+    }
+
+    #[test]
+    fn test_duration_formats() {
+        let config = AuboConfig::default();
+        let text = toml::to_string(&config).unwrap();
+        assert!(text.contains("analysis_timeout = \"100ms\""));
+
+        // Configs saved with duration tables still load
+        let legacy = text.replace("analysis_timeout = \"100ms\"", "analysis_timeout = { secs = 0, nanos = 5000000 }");
+        let loaded: AuboConfig = toml::from_str(&legacy).unwrap();
+        assert_eq!(loaded.hooks.analysis_timeout, Duration::from_millis(5));
+        assert!(toml::from_str::<AuboConfig>(&text.replace("\"100ms\"", "\"soon\"")).is_err());
+    }
+
     #[test]
     fn test_config_file_operations() {
         let temp_dir = TempDir::new().unwrap();
@@ -0,0 +1,670 @@
+//! Local control socket for aubo-rs
+//!
+//! The companion listens on a UNIX socket in the data directory, readable by
+//! root only, so a running system can be inspected without scraping logs.
+//! A client sends one command line and reads the reply until the companion
+//! closes the connection:
+//!
+//! - `metrics`: counters, lookup latency histograms, cache hit ratios,
+//!   memory per structure and work saved per blocking list for every
+//!   reporting app, plus the companion's worker queue, in the Prometheus
+//!   text format
+//! - `explain <host>`: the rule deciding a host, plus the app's recent
+//!   lookups of it when detailed logging is on
+//! - `reload`, `clear-caches`: queued for every app, which picks them up
+//!   with its next stats report
+//! - `monitor on|off`: record blocking verdicts without enforcing them
+//! - `slow-hosts`: hosts with the most upstream DNS resolution time
+//! - `slow-lookups`: the slowest recent verdicts with their stage times
+//!
+//! The `aubo-ctl` binary is a thin client for the same protocol.
+
+use std::collections::{BTreeMap, VecDeque};
+use std::fmt::Write as _;
+use std::fs;
+use std::io::{BufRead, BufReader, Read, Write};
+use std::os::unix::fs::PermissionsExt;
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Arc;
+use std::thread::JoinHandle;
+use std::time::Duration;
+
+use log::{debug, info, warn};
+use serde::{Deserialize, Serialize};
+
+use crate::avoided::{AvoidedDelta, WorkAvoided};
+use crate::companion::AppHostCardinality;
+use crate::error::{Result, ZygiskError};
+use crate::memory::MemoryUsage;
+use crate::pool::PoolMetrics;
+use crate::slowlog::SlowLookup;
+use crate::stats::{StatsDelta, LATENCY_BUCKETS};
+use crate::upstream::{HostLatency, UpstreamDelta};
+
+/// Socket file name below the data directory
+pub const CONTROL_SOCKET_FILE: &str = "control.sock";
+
+/// Longest command line the server reads
+pub const MAX_COMMAND_BYTES: usize = 1024;
+
+/// How long a client may take to send its command or read the reply
+const CLIENT_TIMEOUT: Duration = Duration::from_secs(2);
+
+/// Commands apps keep for late pollers
+const MAX_RETAINED_COMMANDS: usize = 16;
+
+/// Slow lookups kept per app across reports
+const RECENT_SLOW_LOOKUPS: usize = 32;
+
+/// Command accepted on the control socket
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum ControlCommand {
+    /// Render metrics in the Prometheus text format
+    Metrics,
+    /// Explain the verdict for a host or URL
+    Explain {
+        /// Host or URL to explain
+        target: String,
+    },
+    /// Reload rules in every app
+    Reload,
+    /// Clear verdict caches in every app
+    ClearCaches,
+    /// Switch monitor-only mode in every app
+    Monitor {
+        /// Whether blocking verdicts are only recorded
+        enabled: bool,
+    },
+    /// List the hosts with the most upstream resolution time
+    SlowHosts,
+    /// List the slowest recent lookups
+    SlowLookups,
+    /// Show the latest shadow evaluation of reloaded rules
+    Shadow,
+    /// Reload apps with rules held by shadow evaluation
+    Promote,
+    /// Write every rule the current lists drop to a file
+    DroppedRules,
+    /// List the commands
+    Help,
+}
+
+impl ControlCommand {
+    /// Parse a command line
+    pub fn parse(line: &str) -> Result<Self> {
+        let mut words = line.split_whitespace();
+        let command = match (words.next(), words.next()) {
+            (Some("metrics"), None) => ControlCommand::Metrics,
+            (Some("explain"), Some(target)) => ControlCommand::Explain {
+                target: target.to_string(),
+            },
+            (Some("reload"), None) => ControlCommand::Reload,
+            (Some("clear-caches"), None) => ControlCommand::ClearCaches,
+            (Some("slow-hosts"), None) => ControlCommand::SlowHosts,
+            (Some("slow-lookups"), None) => ControlCommand::SlowLookups,
+            (Some("shadow"), None) => ControlCommand::Shadow,
+            (Some("promote"), None) => ControlCommand::Promote,
+            (Some("dropped-rules"), None) => ControlCommand::DroppedRules,
+            (Some("monitor"), Some("on")) => ControlCommand::Monitor { enabled: true },
+            (Some("monitor"), Some("off")) => ControlCommand::Monitor { enabled: false },
+            (Some("help"), None) | (None, _) => ControlCommand::Help,
+            _ => {
+                return Err(ZygiskError::IpcError {
+                    reason: format!("unknown command '{}'", line.trim()),
+                }
+                .into())
+            }
+        };
+        if words.next().is_some() {
+            return Err(ZygiskError::IpcError {
+                reason: format!("unexpected arguments in '{}'", line.trim()),
+            }
+            .into());
+        }
+        Ok(command)
+    }
+}
+
+/// Usage shown for `help` and unknown commands
+pub const USAGE: &str = "\
+commands:
+  metrics              Prometheus metrics of every reporting app
+  explain <host|url>   rule deciding a host and its recent lookups
+  reload               reload rules in every app
+  clear-caches         clear verdict caches in every app
+  monitor on|off       record blocking verdicts without enforcing them
+  slow-hosts           hosts with the most upstream DNS resolution time
+  slow-lookups         slowest recent verdicts with their stage times
+  shadow               latest shadow evaluation of reloaded rules
+  promote              reload apps with rules shadow evaluation held
+  dropped-rules        write every rule not admitted to a file
+";
+
+/// Command forwarded from the control socket to apps
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(rename_all = "snake_case")]
+pub enum AppCommand {
+    /// Reload rules
+    Reload,
+    /// Clear the verdict cache
+    ClearCaches,
+}
+
+/// Switches every app follows, including apps started later
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub struct ControlModes {
+    /// Record blocking verdicts without enforcing them
+    pub monitor_only: bool,
+}
+
+/// Commands and modes handed to an app polling the companion
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct ControlUpdate {
+    /// Generation to poll from next time
+    pub generation: u64,
+    /// Commands queued since the app's last poll, oldest first
+    pub commands: Vec<AppCommand>,
+    /// Current modes
+    pub modes: ControlModes,
+    /// Whether the companion's connect filter is attached, see [`crate::bpf`]
+    #[serde(default)]
+    pub kernel_blocks_connects: bool,
+}
+
+/// Commands queued for apps, numbered by generation
+#[derive(Debug, Default)]
+pub struct ControlState {
+    generation: u64,
+    commands: VecDeque<(u64, AppCommand)>,
+    modes: ControlModes,
+}
+
+impl ControlState {
+    /// Queue a command for every app
+    pub fn push(&mut self, command: AppCommand) -> u64 {
+        self.generation += 1;
+        if self.commands.len() == MAX_RETAINED_COMMANDS {
+            self.commands.pop_front();
+        }
+        self.commands.push_back((self.generation, command));
+        self.generation
+    }
+
+    /// Replace the modes
+    pub fn set_modes(&mut self, modes: ControlModes) {
+        self.modes = modes;
+    }
+
+    /// Get the commands after generation `since`
+    ///
+    /// A new app passes `None`: it starts with fresh rules and an empty
+    /// cache, so it only takes the modes and the current generation.
+    pub fn since(&self, since: Option<u64>) -> ControlUpdate {
+        let commands = match since {
+            Some(since) => self
+                .commands
+                .iter()
+                .filter(|(generation, _)| *generation > since)
+                .map(|(_, command)| *command)
+                .collect(),
+            None => Vec::new(),
+        };
+        ControlUpdate {
+            generation: self.generation,
+            commands,
+            modes: self.modes,
+            kernel_blocks_connects: false,
+        }
+    }
+}
+
+/// Counters of one app since the companion started
+#[derive(Debug, Clone, Default)]
+struct AppMetrics {
+    requests: u64,
+    blocked: u64,
+    cache_hits: u64,
+    cache_misses: u64,
+    latency: [u64; LATENCY_BUCKETS],
+    memory: Vec<MemoryUsage>,
+    upstream: UpstreamDelta,
+    avoided: AvoidedDelta,
+    slow_lookups: VecDeque<SlowLookup>,
+    lookup_timeouts: u64,
+    lookups_bypassed: u64,
+    breaker_trips: u64,
+    degraded_lookups: u64,
+}
+
+/// Live counters of every reporting app
+#[derive(Debug, Default)]
+pub struct LiveMetrics {
+    apps: BTreeMap<String, AppMetrics>,
+}
+
+impl LiveMetrics {
+    /// Fold a reported delta into the app's counters
+    pub fn record(&mut self, app: &str, delta: &StatsDelta) {
+        let metrics = self.apps.entry(app.to_string()).or_default();
+        metrics.requests += delta.total_requests;
+        metrics.blocked += delta.blocked_requests;
+        metrics.cache_hits += delta.cache_hits;
+        metrics.cache_misses += delta.cache_misses;
+        metrics.lookup_timeouts += delta.lookup_timeouts;
+        metrics.lookups_bypassed += delta.lookups_bypassed;
+        metrics.breaker_trips += delta.breaker_trips;
+        metrics.degraded_lookups += delta.degraded_lookups;
+        for (bucket, count) in metrics.latency.iter_mut().zip(&delta.latency_buckets) {
+            *bucket += count;
+        }
+        if let Some(memory) = &delta.memory {
+            metrics.memory = memory.structures.clone();
+        }
+        if let Some(upstream) = &delta.upstream {
+            metrics.upstream.merge(upstream.clone());
+        }
+        if let Some(avoided) = &delta.avoided {
+            metrics.avoided.merge(avoided.clone());
+        }
+        for sample in &delta.slow_lookups {
+            if metrics.slow_lookups.len() == RECENT_SLOW_LOOKUPS {
+                metrics.slow_lookups.pop_front();
+            }
+            metrics.slow_lookups.push_back(sample.clone());
+        }
+    }
+
+    /// Get the slowest of the recently reported lookups, slowest first
+    pub fn slowest_lookups(&self, limit: usize) -> Vec<(String, SlowLookup)> {
+        let mut samples: Vec<_> = self
+            .apps
+            .iter()
+            .flat_map(|(app, metrics)| metrics.slow_lookups.iter().map(move |sample| (app.clone(), sample.clone())))
+            .collect();
+        samples.sort_by(|a, b| b.1.latency_ns.cmp(&a.1.latency_ns));
+        samples.truncate(limit);
+        samples
+    }
+
+    /// Get the hosts with the most upstream resolution time, slowest first
+    pub fn slowest_hosts(&self, limit: usize) -> Vec<(String, HostLatency)> {
+        let mut hosts: Vec<_> = self
+            .apps
+            .iter()
+            .flat_map(|(app, metrics)| metrics.upstream.slowest.top().into_iter().map(move |host| (app.clone(), host)))
+            .collect();
+        hosts.sort_by(|a, b| b.1.total_ns.cmp(&a.1.total_ns));
+        hosts.truncate(limit);
+        hosts
+    }
+
+    /// Render the counters in the Prometheus text format
+    pub fn render_prometheus(&self, cardinality: &[AppHostCardinality]) -> String {
+        let mut out = String::new();
+        let counter = |out: &mut String, name: &str, help: &str, value: fn(&AppMetrics) -> u64| {
+            let _ = writeln!(out, "# HELP {} {}\n# TYPE {} counter", name, help, name);
+            for (app, metrics) in &self.apps {
+                let _ = writeln!(out, "{}{{app=\"{}\"}} {}", name, escape_label(app), value(metrics));
+            }
+        };
+        counter(&mut out, "aubo_requests_total", "Lookups answered by the filter engine", |m| m.requests);
+        counter(&mut out, "aubo_blocked_total", "Lookups that were blocked", |m| m.blocked);
+        counter(&mut out, "aubo_cache_hits_total", "Verdict cache hits", |m| m.cache_hits);
+        counter(&mut out, "aubo_cache_misses_total", "Verdict cache misses", |m| m.cache_misses);
+
+        out.push_str("# HELP aubo_cache_hit_ratio Verdict cache hits per cacheable lookup\n# TYPE aubo_cache_hit_ratio gauge\n");
+        for (app, metrics) in &self.apps {
+            let lookups = metrics.cache_hits + metrics.cache_misses;
+            if lookups > 0 {
+                let ratio = metrics.cache_hits as f64 / lookups as f64;
+                let _ = writeln!(out, "aubo_cache_hit_ratio{{app=\"{}\"}} {:.6}", escape_label(app), ratio);
+            }
+        }
+
+        let lookups: Vec<_> = self.apps.iter().map(|(app, metrics)| (app, &metrics.latency[..])).collect();
+        render_histogram(&mut out, "aubo_lookup_latency_seconds", "Filter engine lookup latency", &lookups);
+        counter(&mut out, "aubo_lookup_timeouts_total", "Lookups let through after exceeding the latency budget", |m| m.lookup_timeouts);
+        counter(&mut out, "aubo_lookups_bypassed_total", "Lookups let through unchecked by the open circuit breaker", |m| m.lookups_bypassed);
+        counter(&mut out, "aubo_breaker_trips_total", "Times repeated budget breaches opened the circuit breaker", |m| m.breaker_trips);
+        counter(&mut out, "aubo_degraded_lookups_total", "Lookups answered with reduced matching under load", |m| m.degraded_lookups);
+
+        counter(&mut out, "aubo_dns_resolutions_total", "Resolutions passed to the real resolver", |m| m.upstream.resolutions);
+        counter(&mut out, "aubo_dns_failures_total", "Resolutions the real resolver failed", |m| m.upstream.failures);
+        counter(&mut out, "aubo_dns_blocked_total", "DNS lookups answered by blocking", |m| m.upstream.blocked);
+        out.push_str("# HELP aubo_dns_saved_seconds_total Resolver time saved by blocking, at the mean resolution time\n# TYPE aubo_dns_saved_seconds_total counter\n");
+        for (app, metrics) in &self.apps {
+            let saved = metrics.upstream.estimated_saved().as_secs_f64();
+            let _ = writeln!(out, "aubo_dns_saved_seconds_total{{app=\"{}\"}} {:.6}", escape_label(app), saved);
+        }
+        let resolutions: Vec<_> = self
+            .apps
+            .iter()
+            .filter(|(_, metrics)| !metrics.upstream.latency_buckets.is_empty())
+            .map(|(app, metrics)| (app, &metrics.upstream.latency_buckets[..]))
+            .collect();
+        render_histogram(&mut out, "aubo_dns_latency_seconds", "Upstream DNS resolution latency", &resolutions);
+
+        let per_list = |out: &mut String, name: &str, help: &str, value: fn(&WorkAvoided) -> u64| {
+            let _ = writeln!(out, "# HELP {} {}\n# TYPE {} counter", name, help, name);
+            for (app, metrics) in &self.apps {
+                for (list, work) in &metrics.avoided.lists {
+                    let (app, list) = (escape_label(app), escape_label(list));
+                    let _ = writeln!(out, "{}{{app=\"{}\",list=\"{}\"}} {}", name, app, list, value(work));
+                }
+            }
+        };
+        per_list(&mut out, "aubo_avoided_lookups_total", "Blocked DNS lookups per blocking list", |w| w.lookups);
+        per_list(&mut out, "aubo_avoided_handshakes_total", "Connects suppressed by blocked lookups", |w| w.handshakes);
+        per_list(&mut out, "aubo_avoided_bytes_total", "Estimated bytes the suppressed connections would have moved", |w| w.bytes);
+
+        out.push_str("# HELP aubo_memory_heap_bytes Heap bytes per engine structure\n# TYPE aubo_memory_heap_bytes gauge\n");
+        for (app, metrics) in &self.apps {
+            for usage in &metrics.memory {
+                let _ = writeln!(
+                    out,
+                    "aubo_memory_heap_bytes{{app=\"{}\",structure=\"{}\"}} {}",
+                    escape_label(app),
+                    escape_label(&usage.name),
+                    usage.heap_bytes
+                );
+            }
+        }
+
+        out.push_str("# HELP aubo_distinct_hosts Estimated distinct hosts looked up\n# TYPE aubo_distinct_hosts gauge\n");
+        for app in cardinality {
+            let _ = writeln!(out, "aubo_distinct_hosts{{app=\"{}\"}} {}", escape_label(&app.app), app.distinct_hosts);
+        }
+        out.push_str("# HELP aubo_distinct_blocked_hosts Estimated distinct hosts blocked\n# TYPE aubo_distinct_blocked_hosts gauge\n");
+        for app in cardinality {
+            let _ = writeln!(out, "aubo_distinct_blocked_hosts{{app=\"{}\"}} {}", escape_label(&app.app), app.distinct_blocked_hosts);
+        }
+        out
+    }
+}
+
+/// Append the companion worker pool's queue metrics
+pub fn render_pool_metrics(out: &mut String, pool: &PoolMetrics) {
+    let gauges = [
+        ("aubo_companion_workers", "Companion worker threads", pool.workers),
+        ("aubo_companion_queue_capacity", "Requests the companion queue holds", pool.queue_capacity),
+        ("aubo_companion_queue_depth", "Requests waiting in the companion queue", pool.queue_depth),
+        ("aubo_companion_jobs_pending", "Requests and follow-up jobs waiting for a worker", pool.pending),
+    ];
+    for (name, help, value) in gauges {
+        let _ = writeln!(out, "# HELP {} {}\n# TYPE {} gauge\n{} {}", name, help, name, name, value);
+    }
+    let counters = [
+        ("aubo_companion_jobs_total", "Jobs accepted by the companion workers", pool.submitted),
+        ("aubo_companion_jobs_rejected_total", "Requests turned away because the queue was full", pool.rejected),
+        ("aubo_companion_jobs_stolen_total", "Jobs a worker took from another worker", pool.stolen),
+    ];
+    for (name, help, value) in counters {
+        let _ = writeln!(out, "# HELP {} {}\n# TYPE {} counter\n{} {}", name, help, name, name, value);
+    }
+    render_histogram(
+        out,
+        "aubo_companion_queue_wait_seconds",
+        "Time jobs waited for a companion worker",
+        &[(&"companion".to_string(), &pool.wait[..])],
+    );
+}
+
+/// Render log2 nanosecond buckets as a Prometheus histogram
+///
+/// Exact latencies are not kept, so the sum is estimated from bucket
+/// midpoints.
+fn render_histogram(out: &mut String, name: &str, help: &str, apps: &[(&String, &[u64])]) {
+    let _ = writeln!(out, "# HELP {} {}\n# TYPE {} histogram", name, help, name);
+    for (app, buckets) in apps {
+        let app = escape_label(app);
+        let mut cumulative = 0;
+        let mut sum_nanos = 0.0;
+        for (bucket, &count) in buckets.iter().enumerate() {
+            cumulative += count;
+            sum_nanos += count as f64 * (0.75 * (1u64 << bucket) as f64);
+            if bucket + 1 < buckets.len() {
+                let upper = (1u64 << bucket) as f64 / 1e9;
+                let _ = writeln!(out, "{}_bucket{{app=\"{}\",le=\"{}\"}} {}", name, app, upper, cumulative);
+            }
+        }
+        let _ = writeln!(out, "{}_bucket{{app=\"{}\",le=\"+Inf\"}} {}", name, app, cumulative);
+        let _ = writeln!(out, "{}_sum{{app=\"{}\"}} {:.9}", name, app, sum_nanos / 1e9);
+        let _ = writeln!(out, "{}_count{{app=\"{}\"}} {}", name, app, cumulative);
+    }
+}
+
+fn escape_label(value: &str) -> String {
+    value.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n")
+}
+
+/// Thread serving the control socket until dropped
+pub struct ControlServer {
+    path: PathBuf,
+    stop: Arc<AtomicBool>,
+    handle: Option<JoinHandle<()>>,
+}
+
+impl ControlServer {
+    /// Listen on `path` and answer each command line with `handler`
+    ///
+    /// A stale socket file is replaced. Connections are served one at a
+    /// time; every command is short.
+    pub fn spawn<F>(path: impl Into<PathBuf>, handler: F) -> Result<Self>
+    where
+        F: Fn(&str) -> String + Send + 'static,
+    {
+        let path = path.into();
+        let _ = fs::remove_file(&path);
+        let listener = UnixListener::bind(&path)?;
+        fs::set_permissions(&path, fs::Permissions::from_mode(0o600))?;
+
+        let stop = Arc::new(AtomicBool::new(false));
+        let thread_stop = Arc::clone(&stop);
+        let handle = std::thread::Builder::new()
+            .name("aubo-control".to_string())
+            .spawn(move || {
+                for stream in listener.incoming() {
+                    if thread_stop.load(Ordering::Acquire) {
+                        break;
+                    }
+                    match stream {
+                        Ok(stream) => {
+                            if let Err(e) = serve_command(stream, &handler) {
+                                debug!("Control connection failed: {}", e);
+                            }
+                        }
+                        Err(e) => warn!("Failed to accept control connection: {}", e),
+                    }
+                }
+            })?;
+
+        info!("Control socket listening on {}", path.display());
+        Ok(Self {
+            path,
+            stop,
+            handle: Some(handle),
+        })
+    }
+
+    /// Get the socket path
+    pub fn path(&self) -> &Path {
+        &self.path
+    }
+}
+
+impl Drop for ControlServer {
+    fn drop(&mut self) {
+        self.stop.store(true, Ordering::Release);
+        // Wake the blocked accept
+        let _ = UnixStream::connect(&self.path);
+        if let Some(handle) = self.handle.take() {
+            let _ = handle.join();
+        }
+        let _ = fs::remove_file(&self.path);
+    }
+}
+
+fn serve_command<F: Fn(&str) -> String>(stream: UnixStream, handler: &F) -> Result<()> {
+    stream.set_read_timeout(Some(CLIENT_TIMEOUT))?;
+    stream.set_write_timeout(Some(CLIENT_TIMEOUT))?;
+
+    let mut line = String::new();
+    BufReader::new((&stream).take(MAX_COMMAND_BYTES as u64)).read_line(&mut line)?;
+    let reply = handler(line.trim());
+    (&stream).write_all(reply.as_bytes())?;
+    Ok(())
+}
+
+/// Send one command line and return the reply
+pub fn send_command(path: &Path, command: &str) -> Result<String> {
+    let mut stream = UnixStream::connect(path)?;
+    stream.set_read_timeout(Some(CLIENT_TIMEOUT))?;
+    stream.write_all(command.as_bytes())?;
+    stream.write_all(b"\n")?;
+    stream.shutdown(std::net::Shutdown::Write)?;
+
+    let mut reply = String::new();
+    stream.read_to_string(&mut reply)?;
+    Ok(reply)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::reqlog::RuleId;
+
+    #[test]
+    fn test_parse_commands() {
+        assert_eq!(ControlCommand::parse("metrics").unwrap(), ControlCommand::Metrics);
+        assert_eq!(
+            ControlCommand::parse(" explain ads.net ").unwrap(),
+            ControlCommand::Explain { target: "ads.net".to_string() }
+        );
+        assert_eq!(ControlCommand::parse("monitor off").unwrap(), ControlCommand::Monitor { enabled: false });
+        assert_eq!(ControlCommand::parse("slow-lookups").unwrap(), ControlCommand::SlowLookups);
+        assert_eq!(ControlCommand::parse("dropped-rules").unwrap(), ControlCommand::DroppedRules);
+        assert_eq!(ControlCommand::parse("").unwrap(), ControlCommand::Help);
+        assert!(ControlCommand::parse("explain").is_err());
+        assert!(ControlCommand::parse("reload now").is_err());
+    }
+
+    #[test]
+    fn test_commands_since_generation() {
+        let mut state = ControlState::default();
+        state.push(AppCommand::Reload);
+        let update = state.since(None);
+        assert_eq!((update.generation, update.commands.len()), (1, 0));
+
+        state.push(AppCommand::ClearCaches);
+        state.set_modes(ControlModes { monitor_only: true });
+        let update = state.since(Some(1));
+        assert_eq!(update.commands, vec![AppCommand::ClearCaches]);
+        assert!(update.modes.monitor_only);
+        assert!(state.since(Some(update.generation)).commands.is_empty());
+    }
+
+    #[test]
+    fn test_prometheus_rendering() {
+        let mut metrics = LiveMetrics::default();
+        let mut delta = StatsDelta {
+            total_requests: 10,
+            blocked_requests: 4,
+            cache_hits: 3,
+            cache_misses: 1,
+            latency_buckets: vec![0; LATENCY_BUCKETS],
+            lookup_timeouts: 2,
+            ..Default::default()
+        };
+        delta.latency_buckets[10] = 10;
+        metrics.record("com.example\"app", &delta);
+
+        let text = metrics.render_prometheus(&[]);
+        assert!(text.contains("aubo_requests_total{app=\"com.example\\\"app\"} 10"));
+        assert!(text.contains("aubo_cache_hit_ratio{app=\"com.example\\\"app\"} 0.750000"));
+        assert!(text.contains("le=\"0.000001024\"} 10"));
+        assert!(text.contains("aubo_lookup_latency_seconds_count{app=\"com.example\\\"app\"} 10"));
+        assert!(text.contains("aubo_lookup_timeouts_total{app=\"com.example\\\"app\"} 2"));
+        assert!(!text.contains("aubo_dns_latency_seconds_count"));
+
+        let mut upstream = UpstreamDelta::default();
+        upstream.slowest.record("slow.net", Duration::from_millis(80), false);
+        upstream.resolutions = 1;
+        upstream.total_ns = 80_000_000;
+        upstream.latency_buckets = vec![0; LATENCY_BUCKETS];
+        upstream.latency_buckets[27] = 1;
+        upstream.blocked = 2;
+        metrics.record("other", &StatsDelta { upstream: Some(upstream), ..Default::default() });
+
+        let text = metrics.render_prometheus(&[]);
+        assert!(text.contains("aubo_dns_saved_seconds_total{app=\"other\"} 0.160000"));
+        assert!(text.contains("aubo_dns_latency_seconds_count{app=\"other\"} 1"));
+        assert_eq!(metrics.slowest_hosts(5)[0].1.host, "slow.net");
+
+        let mut avoided = AvoidedDelta::default();
+        avoided.lists.insert("easylist".into(), WorkAvoided { lookups: 3, handshakes: 2, bytes: 4096 });
+        metrics.record("other", &StatsDelta { avoided: Some(avoided.clone()), ..Default::default() });
+        metrics.record("other", &StatsDelta { avoided: Some(avoided), ..Default::default() });
+
+        let text = metrics.render_prometheus(&[]);
+        assert!(text.contains("aubo_avoided_handshakes_total{app=\"other\",list=\"easylist\"} 4"));
+        assert!(text.contains("aubo_avoided_bytes_total{app=\"other\",list=\"easylist\"} 8192"));
+
+        // Every sample follows the header of its own family
+        let apps: Vec<_> = ["one", "two"]
+            .iter()
+            .map(|app| AppHostCardinality {
+                app: app.to_string(),
+                distinct_hosts: 5,
+                distinct_blocked_hosts: 2,
+            })
+            .collect();
+        let text = metrics.render_prometheus(&apps);
+        let mut family = "";
+        for line in text.lines() {
+            match line.strip_prefix("# TYPE ") {
+                Some(header) => family = header.split(' ').next().unwrap(),
+                None if !line.starts_with('#') => assert!(line.starts_with(family), "{} outside {}", line, family),
+                None => {}
+            }
+        }
+    }
+
+    #[test]
+    fn test_recent_slow_lookups_are_bounded() {
+        let mut metrics = LiveMetrics::default();
+        let sample = |latency_ns: u64| SlowLookup {
+            timestamp_ms: 0,
+            url: format!("host{}.net", latency_ns),
+            request_type: "dns".to_string(),
+            latency_ns,
+            rule: RuleId::NONE,
+            profile: None,
+        };
+        for batch in 0..10u64 {
+            let slow_lookups = (0..4).map(|i| sample(batch * 4 + i)).collect();
+            metrics.record("app", &StatsDelta { slow_lookups, ..Default::default() });
+        }
+        metrics.record("other", &StatsDelta { slow_lookups: vec![sample(1_000)], ..Default::default() });
+
+        let slowest = metrics.slowest_lookups(3);
+        assert_eq!(slowest[0], ("other".to_string(), sample(1_000)));
+        assert_eq!(slowest[1].1.latency_ns, 39);
+        assert_eq!(metrics.apps["app"].slow_lookups.len(), RECENT_SLOW_LOOKUPS);
+    }
+
+    #[test]
+    fn test_server_round_trip() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join(CONTROL_SOCKET_FILE);
+        let server = ControlServer::spawn(&path, |line| format!("got {}\n", line)).unwrap();
+
+        assert_eq!(send_command(&path, "metrics").unwrap(), "got metrics\n");
+        let mode = fs::metadata(&path).unwrap().permissions().mode();
+        assert_eq!(mode & 0o777, 0o600);
+
+        drop(server);
+        assert!(!path.exists());
+    }
+}
@@ -2,11 +2,17 @@
 #include <dlfcn.h>
 #include <unistd.h>
 #include <string>
+#include <mutex>
+#include <atomic>
 #include <cstring>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <linux/tcp.h>
 #include <errno.h>
+#include <time.h>
+#include <stdint.h>
 
 // For memfd_create and ashmem
 #ifdef __NR_memfd_create
@@ -48,6 +54,15 @@
 typedef int (*aubo_initialize_fn)(const char* config_path);
 typedef int (*aubo_shutdown_fn)();
 typedef int (*aubo_should_block_request_fn)(const char* url, const char* request_type, const char* origin);
+typedef int (*aubo_attach_companion_fn)(int fd);
+typedef int (*aubo_companion_serve_fn)(int fd);
+typedef void (*aubo_record_resolution_fn)(const char* host, uint64_t elapsed_ns, int failed);
+typedef void (*aubo_record_addresses_fn)(const char* host, const struct addrinfo* res);
+typedef int (*aubo_record_connect_fn)(int fd, const struct sockaddr* addr, socklen_t addrlen);
+typedef void (*aubo_record_transfer_fn)(int fd, uint64_t bytes);
+typedef int (*aubo_connect_hooks_needed_fn)();
+typedef int (*aubo_deep_inspection_enabled_fn)();
+typedef int (*aubo_inspect_first_write_fn)(const uint8_t* data, size_t len);
 
 // Global state
 static ZygiskNextAPI api_table;
@@ -56,14 +71,61 @@ static void* rust_lib_handle = nullptr;
 static aubo_initialize_fn aubo_initialize = nullptr;
 static aubo_shutdown_fn aubo_shutdown = nullptr;
 static aubo_should_block_request_fn aubo_should_block_request = nullptr;
+static aubo_attach_companion_fn aubo_attach_companion = nullptr;
+static aubo_companion_serve_fn aubo_companion_serve = nullptr;
+static aubo_record_resolution_fn aubo_record_resolution = nullptr;
+static aubo_record_addresses_fn aubo_record_addresses = nullptr;
+static aubo_record_connect_fn aubo_record_connect = nullptr;
+static aubo_record_transfer_fn aubo_record_transfer = nullptr;
+static aubo_connect_hooks_needed_fn aubo_connect_hooks_needed = nullptr;
+static aubo_deep_inspection_enabled_fn aubo_deep_inspection_enabled = nullptr;
+static aubo_inspect_first_write_fn aubo_inspect_first_write = nullptr;
+
+// Sockets whose transfer is reported on close, one bit per fd
+#define MAX_TRACKED_FD 4096
+static std::atomic<uint64_t> tracked_fds[MAX_TRACKED_FD / 64];
+
+// Connected sockets whose first write is still to be inspected, one bit
+// per fd. The bit is cleared by that write, so later writes only pay an
+// atomic load.
+static std::atomic<uint64_t> uninspected_fds[MAX_TRACKED_FD / 64];
+static bool inspect_first_writes = false;
 
 // Hook function prototypes
 static int (*old_connect)(int sockfd, const struct sockaddr *addr, socklen_t addrlen) = nullptr;
+static int (*old_close)(int fd) = nullptr;
 static struct hostent* (*old_gethostbyname)(const char *name) = nullptr;
 static int (*old_getaddrinfo)(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res) = nullptr;
+static ssize_t (*old_send)(int sockfd, const void *buf, size_t len, int flags) = nullptr;
+static ssize_t (*old_sendto)(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen) = nullptr;
+static ssize_t (*old_sendmsg)(int sockfd, const struct msghdr *msg, int flags) = nullptr;
+static ssize_t (*old_write)(int fd, const void *buf, size_t count) = nullptr;
+
+// Hooks active on this thread. Lookups and connects made while a hook runs,
+// by the module itself or by libc inside the original function, go straight
+// to libc instead of re-entering the engine.
+static thread_local int hook_depth = 0;
+
+struct HookScope {
+    HookScope() { ++hook_depth; }
+    ~HookScope() { --hook_depth; }
+    HookScope(const HookScope&) = delete;
+    HookScope& operator=(const HookScope&) = delete;
+};
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
 // Network request logging and blocking
 static int my_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
+    if (hook_depth > 0) {
+        return old_connect(sockfd, addr, addrlen);
+    }
+    HookScope scope;
+
     // Extract connection information for analysis
     if (addr && aubo_should_block_request) {
         // For demonstration, we'll just log the connection attempt
@@ -71,10 +133,112 @@ static int my_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen
     }
     
     // Call original function
-    return old_connect(sockfd, addr, addrlen);
+    int result = old_connect(sockfd, addr, addrlen);
+    if (!addr || !old_close || sockfd < 0 || sockfd >= MAX_TRACKED_FD) {
+        return result;
+    }
+    int saved_errno = errno;
+    if (result != 0 && saved_errno != EINPROGRESS) {
+        return result;
+    }
+    
+    // Inspect the first write of connections to internet addresses
+    uint64_t bit = 1ull << (sockfd % 64);
+    if (inspect_first_writes && (addr->sa_family == AF_INET || addr->sa_family == AF_INET6)) {
+        uninspected_fds[sockfd / 64].fetch_or(bit, std::memory_order_relaxed);
+    }
+    
+    // Remember connections to resolved hosts to learn their transfer sizes
+    if (aubo_record_connect && aubo_record_connect(sockfd, addr, addrlen)) {
+        tracked_fds[sockfd / 64].fetch_or(bit, std::memory_order_relaxed);
+    }
+    errno = saved_errno;
+    return result;
+}
+
+// Check the first write on a connected socket, returning true if it must
+// fail. Only the write that clears the fd's bit calls into the library.
+static bool first_write_blocked(int fd, const void *buf, size_t len) {
+    if (fd < 0 || fd >= MAX_TRACKED_FD || !buf || len == 0) {
+        return false;
+    }
+    uint64_t bit = 1ull << (fd % 64);
+    std::atomic<uint64_t>& word = uninspected_fds[fd / 64];
+    if (!(word.load(std::memory_order_relaxed) & bit)) {
+        return false;
+    }
+    if (!(word.fetch_and(~bit, std::memory_order_relaxed) & bit)) {
+        return false;
+    }
+    
+    HookScope scope;
+    if (!aubo_inspect_first_write((const uint8_t*)buf, len)) {
+        return false;
+    }
+    LOGI("Blocked connection on fd %d by its first request", fd);
+    shutdown(fd, SHUT_RDWR);
+    errno = ECONNRESET;
+    return true;
+}
+
+static ssize_t my_send(int sockfd, const void *buf, size_t len, int flags) {
+    if (hook_depth == 0 && first_write_blocked(sockfd, buf, len)) {
+        return -1;
+    }
+    return old_send(sockfd, buf, len, flags);
+}
+
+static ssize_t my_sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen) {
+    if (hook_depth == 0 && first_write_blocked(sockfd, buf, len)) {
+        return -1;
+    }
+    return old_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
+}
+
+static ssize_t my_sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+    // Only the first buffer is inspected; TLS stacks write the whole
+    // ClientHello record from one buffer
+    if (hook_depth == 0 && msg && msg->msg_iovlen > 0 && msg->msg_iov &&
+        first_write_blocked(sockfd, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len)) {
+        return -1;
+    }
+    return old_sendmsg(sockfd, msg, flags);
+}
+
+static ssize_t my_write(int fd, const void *buf, size_t count) {
+    if (hook_depth == 0 && first_write_blocked(fd, buf, count)) {
+        return -1;
+    }
+    return old_write(fd, buf, count);
+}
+
+static int my_close(int fd) {
+    if (fd >= 0 && fd < MAX_TRACKED_FD) {
+        uint64_t bit = 1ull << (fd % 64);
+        if (uninspected_fds[fd / 64].load(std::memory_order_relaxed) & bit) {
+            uninspected_fds[fd / 64].fetch_and(~bit, std::memory_order_relaxed);
+        }
+        if (aubo_record_transfer && tracked_fds[fd / 64].fetch_and(~bit, std::memory_order_relaxed) & bit) {
+            int saved_errno = errno;
+            struct tcp_info info;
+            socklen_t len = sizeof(info);
+            uint64_t bytes = 0;
+            if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+                bytes = info.tcpi_bytes_acked + info.tcpi_bytes_received;
+            }
+            aubo_record_transfer(fd, bytes);
+            errno = saved_errno;
+        }
+    }
+    return old_close(fd);
 }
 
 static struct hostent* my_gethostbyname(const char *name) {
+    if (hook_depth > 0) {
+        return old_gethostbyname(name);
+    }
+    HookScope scope;
+
     if (name && aubo_should_block_request) {
         LOGD("gethostbyname() intercepted - hostname: %s", name);
         
@@ -86,10 +250,21 @@ static struct hostent* my_gethostbyname(const char *name) {
         }
     }
     
-    return old_gethostbyname(name);
+    if (!name || !aubo_record_resolution) {
+        return old_gethostbyname(name);
+    }
+    uint64_t started = monotonic_ns();
+    struct hostent* result = old_gethostbyname(name);
+    aubo_record_resolution(name, monotonic_ns() - started, result == nullptr);
+    return result;
 }
 
 static int my_getaddrinfo(const char *node, const char *service, const struct addrinfo *hints, struct addrinfo **res) {
+    if (hook_depth > 0) {
+        return old_getaddrinfo(node, service, hints, res);
+    }
+    HookScope scope;
+
     if (node && aubo_should_block_request) {
         LOGD("getaddrinfo() intercepted - node: %s, service: %s", node, service ? service : "null");
         
@@ -101,7 +276,19 @@ static int my_getaddrinfo(const char *node, const char *service, const struct ad
         }
     }
     
-    return old_getaddrinfo(node, service, hints, res);
+    if (!node || !aubo_record_resolution) {
+        return old_getaddrinfo(node, service, hints, res);
+    }
+    // Time the real resolver to see what blocking and caching save
+    uint64_t started = monotonic_ns();
+    int result = old_getaddrinfo(node, service, hints, res);
+    int saved_errno = errno;  // EAI_SYSTEM callers read errno
+    aubo_record_resolution(node, monotonic_ns() - started, result != 0);
+    if (result == 0 && res && aubo_record_addresses) {
+        aubo_record_addresses(node, *res);
+    }
+    errno = saved_errno;
+    return result;
 }
 
 // Load library using memfd to bypass SELinux restrictions
@@ -274,6 +461,25 @@ static bool load_rust_library() {
     aubo_shutdown = (aubo_shutdown_fn)dlsym(rust_lib_handle, "aubo_shutdown");
     aubo_should_block_request = (aubo_should_block_request_fn)dlsym(rust_lib_handle, "aubo_should_block_request");
     
+    // Companion symbols are optional; without them apps run without warm state
+    aubo_attach_companion = (aubo_attach_companion_fn)dlsym(rust_lib_handle, "aubo_attach_companion");
+    aubo_companion_serve = (aubo_companion_serve_fn)dlsym(rust_lib_handle, "aubo_companion_serve");
+    
+    // Optional as well; without it upstream resolutions are not timed
+    aubo_record_resolution = (aubo_record_resolution_fn)dlsym(rust_lib_handle, "aubo_record_resolution");
+    
+    // Optional too; without them the work saved by blocking is not priced
+    aubo_record_addresses = (aubo_record_addresses_fn)dlsym(rust_lib_handle, "aubo_record_addresses");
+    aubo_record_connect = (aubo_record_connect_fn)dlsym(rust_lib_handle, "aubo_record_connect");
+    aubo_record_transfer = (aubo_record_transfer_fn)dlsym(rust_lib_handle, "aubo_record_transfer");
+    
+    // Optional; without it connect() is always hooked
+    aubo_connect_hooks_needed = (aubo_connect_hooks_needed_fn)dlsym(rust_lib_handle, "aubo_connect_hooks_needed");
+    
+    // Optional; without them first writes are not inspected
+    aubo_deep_inspection_enabled = (aubo_deep_inspection_enabled_fn)dlsym(rust_lib_handle, "aubo_deep_inspection_enabled");
+    aubo_inspect_first_write = (aubo_inspect_first_write_fn)dlsym(rust_lib_handle, "aubo_inspect_first_write");
+    
     if (!aubo_initialize || !aubo_shutdown || !aubo_should_block_request) {
         LOGE("Failed to load required symbols from Rust library");
         LOGE("aubo_initialize: %p", aubo_initialize);
@@ -297,20 +503,28 @@ static bool install_network_hooks() {
     }
     
     bool success = true;
+    size_t size;
+    
+    // When the companion blocks connects in the kernel, only DNS is hooked
+    bool hook_connect = !aubo_connect_hooks_needed || aubo_connect_hooks_needed();
+    if (!hook_connect) {
+        LOGI("Connects are blocked in the kernel, hooking DNS only");
+    }
     
     // Hook connect()
-    size_t size;
-    auto connect_addr = api_table.symbolLookup(resolver, "connect", false, &size);
-    if (connect_addr) {
-        if (api_table.inlineHook(connect_addr, (void*)my_connect, (void**)&old_connect) == ZN_SUCCESS) {
-            LOGI("Successfully hooked connect() at %p", connect_addr);
+    if (hook_connect) {
+        auto connect_addr = api_table.symbolLookup(resolver, "connect", false, &size);
+        if (connect_addr) {
+            if (api_table.inlineHook(connect_addr, (void*)my_connect, (void**)&old_connect) == ZN_SUCCESS) {
+                LOGI("Successfully hooked connect() at %p", connect_addr);
+            } else {
+                LOGE("Failed to hook connect()");
+                success = false;
+            }
         } else {
-            LOGE("Failed to hook connect()");
+            LOGE("Failed to find connect() symbol");
             success = false;
         }
-    } else {
-        LOGE("Failed to find connect() symbol");
-        success = false;
     }
     
     // Hook gethostbyname()
@@ -341,6 +555,39 @@ static bool install_network_hooks() {
         success = false;
     }
     
+    // Hook close() to report the bytes of tracked connections and forget
+    // uninspected sockets; optional
+    bool inspect = hook_connect && aubo_deep_inspection_enabled && aubo_inspect_first_write &&
+        aubo_deep_inspection_enabled();
+    if (hook_connect && ((aubo_record_connect && aubo_record_transfer) || inspect)) {
+        auto close_addr = api_table.symbolLookup(resolver, "close", false, &size);
+        if (close_addr && api_table.inlineHook(close_addr, (void*)my_close, (void**)&old_close) == ZN_SUCCESS) {
+            LOGI("Successfully hooked close() at %p", close_addr);
+        } else {
+            LOGD("close() not hooked, transfer sizes will not be learned and first writes not inspected");
+        }
+    }
+    
+    // Hook the write functions to inspect the first write on each
+    // connection; sockets are only marked once all four are hooked, so no
+    // path to a socket is missed
+    if (inspect && old_close) {
+        auto send_addr = api_table.symbolLookup(resolver, "send", false, &size);
+        auto sendto_addr = api_table.symbolLookup(resolver, "sendto", false, &size);
+        auto sendmsg_addr = api_table.symbolLookup(resolver, "sendmsg", false, &size);
+        auto write_addr = api_table.symbolLookup(resolver, "write", false, &size);
+        if (send_addr && sendto_addr && sendmsg_addr && write_addr &&
+            api_table.inlineHook(send_addr, (void*)my_send, (void**)&old_send) == ZN_SUCCESS &&
+            api_table.inlineHook(sendto_addr, (void*)my_sendto, (void**)&old_sendto) == ZN_SUCCESS &&
+            api_table.inlineHook(sendmsg_addr, (void*)my_sendmsg, (void**)&old_sendmsg) == ZN_SUCCESS &&
+            api_table.inlineHook(write_addr, (void*)my_write, (void**)&old_write) == ZN_SUCCESS) {
+            inspect_first_writes = true;
+            LOGI("Hooked send(), sendto(), sendmsg() and write() for first-write inspection");
+        } else {
+            LOGE("Failed to hook write functions, first writes will not be inspected");
+        }
+    }
+    
     api_table.freeSymbolResolver(resolver);
     return success;
 }
@@ -366,20 +613,28 @@ static void onModuleLoaded(void* self_handle, const struct ZygiskNextAPI* api) {
         return;
     }
     
+    // Attach the companion before hooking so warm verdicts are preloaded
+    // before the first lookup. The Rust side takes ownership of the fd, and
+    // without one writes the queued status itself.
+    if (aubo_attach_companion) {
+        int companion_fd = api_table.connectCompanion(handle);
+        if (companion_fd < 0) {
+            LOGD("Companion not available, starting without warm verdicts");
+            aubo_attach_companion(-1);
+        } else if (aubo_attach_companion(companion_fd) != 0) {
+            LOGD("Failed to attach companion");
+        }
+    }
+    
     // Install network hooks
     if (!install_network_hooks()) {
         LOGE("Failed to install network hooks");
         return;
     }
     
+    // The kernel log line for this is written once per boot by the
+    // companion, not by every process
     LOGI("aubo-rs module loaded successfully - ad-blocking active");
-    
-    // Write to dmesg for debugging
-    FILE* kmsg = fopen("/dev/kmsg", "w");
-    if (kmsg) {
-        fprintf(kmsg, "<6>aubo-rs: ZygiskNext module loaded and initialized successfully\n");
-        fclose(kmsg);
-    }
 }
 
 static void onCompanionLoaded() {
@@ -425,23 +680,28 @@ static void onModuleConnected(int fd) {
         LOGD("Library in system path, no SELinux update needed: %s", native_lib);
     }
 
-    auto lib_fd = open(native_lib, O_RDONLY | O_CLOEXEC);
-    if (lib_fd < 0) {
-        LOGD("Failed to open library file: errno %d", errno);
+    // Serve the app's companion requests; the Rust side owns and closes fd.
+    // Connections may arrive concurrently, so the library is loaded once.
+    static std::once_flag companion_lib_once;
+    std::call_once(companion_lib_once, [] {
+        if (!rust_lib_handle) {
+            load_rust_library();
+        }
+    });
+    if (!rust_lib_handle) {
+        LOGE("Companion cannot load Rust library");
         close(fd);
         return;
     }
-    
-    // Send file descriptor to companion (simplified socket_utils implementation)
-    int fd_to_send = lib_fd;
-    if (send(fd, &fd_to_send, sizeof(fd_to_send), 0) < 0) {
-        LOGE("Failed to send file descriptor: errno %d", errno);
-    } else {
-        LOGI("Successfully sent library file descriptor");
+    if (!aubo_companion_serve) {
+        LOGE("Rust library has no companion entry point");
+        close(fd);
+        return;
     }
     
-    close(lib_fd);
-    close(fd);
+    if (aubo_companion_serve(fd) != 0) {
+        LOGD("Companion connection ended with an error");
+    }
 }
 
 // Export ZygiskNext module structure
@@ -0,0 +1,295 @@
+//! Adaptive degradation for aubo-rs
+//!
+//! On a throttled or overloaded device we would rather block less than slow
+//! the phone down. The engine reads a single [`ModeWord`] on every lookup
+//! that selects how much matching it does:
+//!
+//! - [`MatchMode::Full`]: domain lists, patterns and regexes
+//! - [`MatchMode::DomainsOnly`]: exact and suffix domain matches only
+//! - [`MatchMode::CacheOnly`]: cached verdicts only, misses are allowed
+//!
+//! A [`DegradeController`] samples the p99 lookup latency and CPU PSI
+//! (`/proc/pressure/cpu`) from the engine's pressure task. Like the memory
+//! monitor it escalates at once and relaxes one mode at a time after
+//! several calm samples. Degraded lookups are cheaper, so a sample only
+//! counts as calm when the latency is well below target; otherwise the mode
+//! would flap between levels. Allow verdicts reached in a degraded mode are
+//! not cached, so full matching takes over again on recovery.
+
+use std::fs;
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+use std::time::Duration;
+
+use crate::config::AuboConfig;
+use crate::memory::{parse_psi, PsiStats};
+use crate::stats::{latency_percentile, LatencyHistogram};
+
+/// Path of the CPU PSI file
+pub const PSI_CPU_PATH: &str = "/proc/pressure/cpu";
+
+/// Consecutive calm samples required before the mode is relaxed by one
+const RELAX_SAMPLES: u32 = 3;
+
+/// Latency over the target, as a multiple, that calls for cache-only mode
+const CACHE_ONLY_FACTOR: u32 = 4;
+
+/// Lookups a sample needs before its latency percentile is trusted
+const MIN_SAMPLE_LOOKUPS: u64 = 32;
+
+/// Bits of the mode word holding the [`MatchMode`]
+const MATCH_MODE_MASK: u32 = 0b11;
+
+/// Mode word flag for recording blocking verdicts without enforcing them
+const MONITOR_ONLY: u32 = 1 << 8;
+
+/// How much matching a lookup does
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+#[repr(u8)]
+pub enum MatchMode {
+    /// Every rule is evaluated
+    Full = 0,
+    /// Only the domain allowlist and blocklist are consulted
+    DomainsOnly = 1,
+    /// Only cached verdicts are used
+    CacheOnly = 2,
+}
+
+impl MatchMode {
+    fn from_bits(bits: u32) -> Self {
+        match bits & MATCH_MODE_MASK {
+            0 => MatchMode::Full,
+            1 => MatchMode::DomainsOnly,
+            _ => MatchMode::CacheOnly,
+        }
+    }
+
+    /// Get the next less degraded mode
+    fn relaxed(self) -> Self {
+        match self {
+            MatchMode::CacheOnly => MatchMode::DomainsOnly,
+            _ => MatchMode::Full,
+        }
+    }
+}
+
+/// Snapshot of the mode word
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct EngineMode(u32);
+
+impl EngineMode {
+    /// Get the match mode
+    pub fn match_mode(self) -> MatchMode {
+        MatchMode::from_bits(self.0)
+    }
+
+    /// Check if blocking verdicts are only recorded
+    pub fn monitor_only(self) -> bool {
+        self.0 & MONITOR_ONLY != 0
+    }
+}
+
+/// Lookup mode of an engine, read with one atomic load per lookup
+#[derive(Debug, Default)]
+pub struct ModeWord(AtomicU32);
+
+impl ModeWord {
+    /// Create a word in full, enforcing mode
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Read the current mode
+    pub fn load(&self) -> EngineMode {
+        EngineMode(self.0.load(Ordering::Relaxed))
+    }
+
+    /// Set the monitor-only flag, returning its previous value
+    pub fn set_monitor_only(&self, monitor_only: bool) -> bool {
+        let previous = if monitor_only {
+            self.0.fetch_or(MONITOR_ONLY, Ordering::Relaxed)
+        } else {
+            self.0.fetch_and(!MONITOR_ONLY, Ordering::Relaxed)
+        };
+        previous & MONITOR_ONLY != 0
+    }
+
+    /// Set the match mode, returning the previous one
+    pub fn set_match_mode(&self, mode: MatchMode) -> MatchMode {
+        let previous = self
+            .0
+            .fetch_update(Ordering::Relaxed, Ordering::Relaxed, |word| {
+                Some(word & !MATCH_MODE_MASK | mode as u32)
+            })
+            .unwrap_or_else(|word| word);
+        MatchMode::from_bits(previous)
+    }
+}
+
+/// Read the CPU PSI averages, if the kernel exposes them
+pub fn read_cpu_psi() -> Option<PsiStats> {
+    fs::read_to_string(PSI_CPU_PATH)
+        .ok()
+        .and_then(|content| parse_psi(&content))
+}
+
+/// Chooses the match mode from lookup latency and CPU pressure
+#[derive(Debug)]
+pub struct DegradeController {
+    /// p99 lookup latency above which matching is reduced
+    latency_target: Duration,
+    /// CPU PSI avg10 percentage considered pressure
+    cpu_threshold: f32,
+    latency: LatencyHistogram,
+    calm_samples: AtomicU32,
+    degraded_lookups: AtomicU64,
+}
+
+impl DegradeController {
+    /// Create a controller using the configured targets
+    pub fn new(config: &AuboConfig) -> Self {
+        Self {
+            latency_target: config.performance.degrade_latency_target,
+            cpu_threshold: config.performance.cpu_pressure_threshold * 100.0,
+            latency: LatencyHistogram::default(),
+            calm_samples: AtomicU32::new(0),
+            degraded_lookups: AtomicU64::new(0),
+        }
+    }
+
+    /// Count one lookup and the mode it was answered in
+    pub fn record(&self, latency: Duration, mode: MatchMode) {
+        self.latency.record(latency);
+        if mode != MatchMode::Full {
+            self.degraded_lookups.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    /// Take the number of lookups answered in a degraded mode since the
+    /// last call
+    pub fn take_degraded_lookups(&self) -> u64 {
+        self.degraded_lookups.swap(0, Ordering::Relaxed)
+    }
+
+    /// Pick the mode a latency and CPU pressure call for
+    pub fn classify(&self, p99: Option<Duration>, cpu: Option<PsiStats>, target: Duration) -> MatchMode {
+        let cpu = cpu.unwrap_or_default();
+        let by_latency = match p99 {
+            Some(p99) if p99 > target * CACHE_ONLY_FACTOR => MatchMode::CacheOnly,
+            Some(p99) if p99 > target => MatchMode::DomainsOnly,
+            _ => MatchMode::Full,
+        };
+        let by_cpu = if cpu.full_avg10 >= self.cpu_threshold {
+            MatchMode::CacheOnly
+        } else if cpu.some_avg10 >= self.cpu_threshold {
+            MatchMode::DomainsOnly
+        } else {
+            MatchMode::Full
+        };
+        by_latency.max(by_cpu)
+    }
+
+    /// Take a latency sample, update `mode` and return the new match mode if
+    /// it changed
+    pub fn update(&self, mode: &ModeWord, cpu: Option<PsiStats>) -> Option<MatchMode> {
+        let buckets = self.latency.take();
+        let p99 = (buckets.iter().sum::<u64>() >= MIN_SAMPLE_LOOKUPS)
+            .then(|| latency_percentile(&buckets, 0.99))
+            .flatten();
+        let current = mode.load().match_mode();
+
+        let observed = self.classify(p99, cpu, self.latency_target);
+        if observed > current {
+            self.calm_samples.store(0, Ordering::Relaxed);
+            mode.set_match_mode(observed);
+            return Some(observed);
+        }
+
+        let calm = self.classify(p99, cpu, self.latency_target / 2) < current;
+        if !calm {
+            self.calm_samples.store(0, Ordering::Relaxed);
+            return None;
+        }
+        if self.calm_samples.fetch_add(1, Ordering::Relaxed) + 1 < RELAX_SAMPLES {
+            return None;
+        }
+
+        self.calm_samples.store(0, Ordering::Relaxed);
+        let relaxed = current.relaxed();
+        mode.set_match_mode(relaxed);
+        Some(relaxed)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn controller() -> DegradeController {
+        let mut config = AuboConfig::default();
+        config.performance.degrade_latency_target = Duration::from_micros(100);
+        config.performance.cpu_pressure_threshold = 0.5;
+        DegradeController::new(&config)
+    }
+
+    fn sample(controller: &DegradeController, latency: Duration) {
+        for _ in 0..MIN_SAMPLE_LOOKUPS {
+            controller.record(latency, MatchMode::Full);
+        }
+    }
+
+    #[test]
+    fn test_mode_word_bits() {
+        let word = ModeWord::new();
+        assert_eq!(word.load().match_mode(), MatchMode::Full);
+        assert!(!word.set_monitor_only(true));
+        assert_eq!(word.set_match_mode(MatchMode::CacheOnly), MatchMode::Full);
+
+        let mode = word.load();
+        assert!(mode.monitor_only());
+        assert_eq!(mode.match_mode(), MatchMode::CacheOnly);
+        assert!(word.set_monitor_only(false));
+        assert_eq!(word.load().match_mode(), MatchMode::CacheOnly);
+        assert!(!word.load().monitor_only());
+    }
+
+    #[test]
+    fn test_escalates_at_once_and_relaxes_gradually() {
+        let controller = controller();
+        let word = ModeWord::new();
+
+        sample(&controller, Duration::from_millis(1));
+        assert_eq!(controller.update(&word, None), Some(MatchMode::CacheOnly));
+
+        // Fast again, but relaxing takes several calm samples per mode
+        for _ in 0..RELAX_SAMPLES - 1 {
+            sample(&controller, Duration::from_micros(10));
+            assert_eq!(controller.update(&word, None), None);
+        }
+        sample(&controller, Duration::from_micros(10));
+        assert_eq!(controller.update(&word, None), Some(MatchMode::DomainsOnly));
+
+        // Just under target is not calm enough to relax further
+        for _ in 0..RELAX_SAMPLES {
+            sample(&controller, Duration::from_micros(70));
+            assert_eq!(controller.update(&word, None), None);
+        }
+        for _ in 0..RELAX_SAMPLES {
+            controller.update(&word, None);
+        }
+        assert_eq!(word.load().match_mode(), MatchMode::Full);
+    }
+
+    #[test]
+    fn test_cpu_pressure_degrades() {
+        let controller = controller();
+        let word = ModeWord::new();
+        let psi = |some_avg10, full_avg10| Some(PsiStats { some_avg10, full_avg10 });
+
+        // Too few lookups to judge latency, CPU pressure alone decides
+        controller.record(Duration::from_secs(1), MatchMode::Full);
+        assert_eq!(controller.update(&word, psi(60.0, 0.0)), Some(MatchMode::DomainsOnly));
+        assert_eq!(controller.update(&word, psi(60.0, 55.0)), Some(MatchMode::CacheOnly));
+        assert_eq!(controller.update(&word, psi(60.0, 0.0)), None);
+        assert_eq!(controller.take_degraded_lookups(), 0);
+    }
+}
@@ -1,17 +1,63 @@
 //! Filter engine for aubo-rs ad-blocking
 
-use std::collections::HashSet;
+use std::collections::{HashMap, HashSet};
+use std::fs::File;
+use std::io::{BufWriter, Write};
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
 use std::sync::Arc;
-use std::time::Instant;
+use std::time::{Duration, Instant};
 
 use aho_corasick::AhoCorasick;
-use log::info;
-use parking_lot::RwLock;
+use log::{debug, info, warn};
+use parking_lot::{Mutex, RwLock};
 use regex::Regex;
+use serde::{Deserialize, Serialize};
 
+use crate::bpf::IpPrefix;
+use crate::cache::{CacheSizeStore, CacheTuner, VerdictCache, MIN_TUNED_CAPACITY};
+use crate::compiler::{drop_line, estimated_regex_bytes, AdmissionReport, RuleCompiler, RuleLists, RuleSource};
 use crate::config::AuboConfig;
-use crate::error::Result;
+use crate::degrade::{read_cpu_psi, DegradeController, MatchMode, ModeWord};
+use crate::error::{FilterError, Result};
+use crate::filters::{filter_list_path, FilterManager, ParsedRule, RuleType};
+use crate::memory::{
+    self, string_map_heap_bytes, string_set_heap_bytes, MemoryBreakdown, MemoryMonitor, MemorySample, PressureLevel,
+};
+use crate::reqlog::{RequestLog, RuleId, RuleKind};
+use crate::slowlog::{SlowLookup, SlowLookupSampler, Stage, StageProbe, StageTimer};
 use crate::stats::StatsCollector;
+use crate::utils::{PeriodicTask, SystemInfo};
+
+/// How often memory pressure is sampled
+const PRESSURE_POLL_INTERVAL: Duration = Duration::from_secs(5);
+
+/// File in the data directory holding tuned cache sizes per app
+const CACHE_SIZES_FILE: &str = "cache_sizes.json";
+
+/// How far beyond `filter_cache_size` the tuner may grow a cache
+const MAX_CACHE_GROWTH: usize = 4;
+
+/// Memory breakdown entry of the verdict cache
+const VERDICT_CACHE_STRUCTURE: &str = "verdict_cache";
+
+/// Priority of the built-in rules, just below user configuration
+const BUILTIN_PRIORITY: u32 = u32::MAX - 1;
+
+/// Domains blocked when no list has been downloaded yet
+const BUILTIN_BLOCKED_DOMAINS: &[&str] = &[
+    "googleadservices.com",
+    "doubleclick.net",
+    "googlesyndication.com",
+    "facebook.com",
+    "analytics.google.com",
+];
+
+/// Domains that are never blocked by the built-in rules
+const BUILTIN_ALLOWED_DOMAINS: &[&str] = &["github.com", "stackoverflow.com"];
+
+/// URL substrings blocked by the built-in rules
+const BUILTIN_PATTERNS: &[&str] = &["ads", "analytics", "tracking", "adnxs", "adsystem"];
 
 /// Filter rule types
 #[derive(Debug, Clone)]
@@ -24,28 +70,98 @@ pub enum FilterRule {
     HostBlock { domain: String },
 }
 
+/// Why the engine decides a URL the way it does
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct Explanation {
+    /// Whether the rules block the URL
+    pub blocked: bool,
+    /// Rule that decided the verdict
+    pub rule: RuleId,
+    /// Text of the deciding rule, if one matched
+    pub rule_text: Option<String>,
+    /// Whether blocking verdicts are only recorded, not enforced
+    pub monitor_only: bool,
+    /// Rule set generation the verdict came from
+    pub generation: u64,
+}
+
 /// Filter engine for processing requests
 pub struct FilterEngine {
     config: Arc<AuboConfig>,
     stats: Arc<StatsCollector>,
     rules: RwLock<Vec<FilterRule>>,
-    domain_blocklist: RwLock<HashSet<String>>,
+    domain_blocklist: RwLock<HashMap<String, u16>>,
     domain_allowlist: RwLock<HashSet<String>>,
     pattern_matcher: RwLock<Option<AhoCorasick>>,
+    rule_lists: RwLock<RuleLists>,
     last_update: RwLock<Instant>,
+    admission_report: RwLock<AdmissionReport>,
+    generation: AtomicU64,
+    fingerprint: AtomicU64,
+    verdict_cache: Arc<VerdictCache>,
+    cache_tuner: Arc<CacheTuner>,
+    cache_sizes: Option<Arc<Mutex<CacheSizeStore>>>,
+    app_name: String,
+    memory_monitor: Arc<MemoryMonitor>,
+    request_log: Option<Arc<RequestLog>>,
+    slow_lookups: SlowLookupSampler,
+    mode: Arc<ModeWord>,
+    degrade: Option<Arc<DegradeController>>,
+    background_tasks: Mutex<Vec<PeriodicTask>>,
 }
 
 impl FilterEngine {
     /// Create a new filter engine
     pub fn new(config: Arc<AuboConfig>, stats: Arc<StatsCollector>) -> Result<Self> {
+        let app_name = SystemInfo::process_name().unwrap_or_else(|| "unknown".to_string());
+        let configured = config.performance.filter_cache_size;
+
+        let (cache_tuner, cache_sizes) = if config.performance.cache_autotune {
+            let store = CacheSizeStore::load(config.general.data_dir.join(CACHE_SIZES_FILE));
+            let initial = store.get(&app_name).unwrap_or(configured);
+            let tuner = CacheTuner::new(
+                MIN_TUNED_CAPACITY.min(configured),
+                configured.saturating_mul(MAX_CACHE_GROWTH),
+                initial,
+            );
+            (tuner, Some(Arc::new(Mutex::new(store))))
+        } else {
+            (CacheTuner::new(configured, configured, configured), None)
+        };
+
+        let verdict_cache = Arc::new(VerdictCache::new(cache_tuner.target()));
+        let memory_monitor = Arc::new(MemoryMonitor::new(&config));
+        let request_log = config
+            .stats
+            .detailed_logging
+            .then(|| Arc::new(RequestLog::new(config.stats.max_log_entries)));
+        let degrade = config
+            .performance
+            .adaptive_degradation
+            .then(|| Arc::new(DegradeController::new(&config)));
+
         let engine = Self {
             config,
             stats,
             rules: RwLock::new(Vec::new()),
-            domain_blocklist: RwLock::new(HashSet::new()),
+            domain_blocklist: RwLock::new(HashMap::new()),
             domain_allowlist: RwLock::new(HashSet::new()),
             pattern_matcher: RwLock::new(None),
+            rule_lists: RwLock::new(RuleLists::default()),
             last_update: RwLock::new(Instant::now()),
+            admission_report: RwLock::new(AdmissionReport::default()),
+            generation: AtomicU64::new(0),
+            fingerprint: AtomicU64::new(0),
+            verdict_cache,
+            cache_tuner: Arc::new(cache_tuner),
+            cache_sizes,
+            app_name,
+            memory_monitor,
+            request_log,
+            slow_lookups: SlowLookupSampler::new(),
+            mode: Arc::new(ModeWord::new()),
+            degrade,
+            background_tasks: Mutex::new(Vec::new()),
         };
 
         engine.load_default_filters()?;
@@ -54,75 +170,606 @@ impl FilterEngine {
 
     /// Check if a request should be blocked
     pub fn should_block(&self, url: &str, request_type: &str, origin: &str) -> bool {
-        // Check allowlist first (whitelist takes priority)
-        if self.is_whitelisted(url) {
-            return false;
+        let started = Instant::now();
+        let mode = self.mode.load();
+
+        // Bare hostnames from the DNS hooks are cached; full URLs vary too much
+        let cacheable = !url.contains('/');
+        let cached = if cacheable { self.verdict_cache.get(url) } else { None };
+        let (verdict, rule) = match (cached, mode.match_mode()) {
+            (Some(verdict), _) => (verdict, RuleId::CACHED),
+            (None, MatchMode::Full) => {
+                let (verdict, rule) = self.evaluate(url, request_type, origin);
+                if cacheable {
+                    self.verdict_cache.insert(url, verdict);
+                }
+                (verdict, rule)
+            }
+            // Allows from reduced matching may be pattern blocks in full mode
+            (None, MatchMode::DomainsOnly) => {
+                let (verdict, rule) = self.matching_domain_rule(url, &mut ()).unwrap_or((false, RuleId::NONE));
+                if cacheable && verdict {
+                    self.verdict_cache.insert(url, verdict);
+                }
+                (verdict, rule)
+            }
+            (None, MatchMode::CacheOnly) => (false, RuleId::NONE),
+        };
+
+        // In monitor mode the deciding rule is still logged
+        let verdict = verdict && !mode.monitor_only();
+        let latency = started.elapsed();
+        if let Some(degrade) = &self.degrade {
+            degrade.record(latency, mode.match_mode());
         }
+        let host = host_of(url);
+        self.stats.record_lookup(latency, cacheable.then_some(cached.is_some()));
+        self.stats.record_host(host, verdict);
+        if verdict && request_type == "dns" {
+            self.stats.record_blocked_resolution(host);
+        }
+        self.slow_lookups.record(url, request_type, rule, latency);
+        if let Some(log) = &self.request_log {
+            log.record(request_type, host, verdict, rule, latency);
+        }
+        verdict
+    }
 
-        // Check domain blocklist
-        if let Some(domain) = extract_domain(url) {
-            if self.domain_blocklist.read().contains(&domain) {
-                return true;
+    /// Explain the verdict for a URL or host without touching the cache or
+    /// the stats
+    pub fn explain(&self, url: &str) -> Explanation {
+        let (blocked, rule) = self.evaluate(url, "", "");
+        let domain_rule = |listed: &dyn Fn(&str) -> bool| {
+            extract_domain(url).and_then(|domain| matching_domain(&domain, listed).map(str::to_string))
+        };
+        let rule_text = match rule.kind() {
+            RuleKind::AllowedDomain => domain_rule(&|domain| self.domain_allowlist.read().contains(domain)),
+            RuleKind::BlockedDomain => domain_rule(&|domain| self.domain_blocklist.read().contains_key(domain)),
+            // The automaton keeps no pattern text, but the match is the pattern
+            RuleKind::Pattern => self
+                .pattern_matcher
+                .read()
+                .as_ref()
+                .and_then(|matcher| matcher.find(url))
+                .map(|found| url[found.range()].to_ascii_lowercase()),
+            RuleKind::Regex => self.rules.read().get(rule.payload() as usize).map(|rule| match rule {
+                FilterRule::Block { pattern, .. } | FilterRule::Allow { pattern, .. } => pattern.clone(),
+                FilterRule::HostBlock { domain } => domain.clone(),
+            }),
+            RuleKind::None | RuleKind::Cached => None,
+        };
+
+        Explanation {
+            blocked,
+            rule,
+            rule_text,
+            monitor_only: self.is_monitor_only(),
+            generation: self.generation(),
+        }
+    }
+
+    /// Check if the rules alone block a URL or host, bypassing the cache,
+    /// the stats and monitor-only mode
+    pub fn rule_verdict(&self, url: &str) -> bool {
+        self.evaluate(url, "", "").0
+    }
+
+    /// Get the name of the filter list whose rule blocks a URL or host
+    ///
+    /// Evaluates the rules again, so callers attribute blocks when reporting
+    /// rather than on every lookup. Returns `None` if nothing blocks it.
+    pub fn block_list(&self, url: &str) -> Option<String> {
+        let (blocked, rule) = self.evaluate(url, "", "");
+        if !blocked {
+            return None;
+        }
+        let lists = self.rule_lists.read();
+        let index = match rule.kind() {
+            RuleKind::BlockedDomain => {
+                let domain = extract_domain(url)?;
+                let blocklist = self.domain_blocklist.read();
+                let listed = matching_domain(&domain, |candidate| blocklist.contains_key(candidate))?;
+                blocklist.get(listed).copied()
             }
+            RuleKind::Pattern => lists.patterns.get(rule.payload() as usize).copied(),
+            RuleKind::Regex => lists.regexes.get(rule.payload() as usize).copied(),
+            _ => None,
+        }?;
+        lists.name(index).map(str::to_string)
+    }
+
+    /// Get the blocked domain entries that are IP addresses or prefixes
+    ///
+    /// Entries the allowlist overrides are left out.
+    pub fn blocked_prefixes(&self) -> Vec<IpPrefix> {
+        let prefixes: Vec<IpPrefix> = self.domain_blocklist.read().keys().filter_map(|entry| IpPrefix::parse(entry)).collect();
+        prefixes
+            .into_iter()
+            .filter(|prefix| self.evaluate(&prefix.addr().to_string(), "", "").1.kind() != RuleKind::AllowedDomain)
+            .collect()
+    }
+
+    /// Only record blocking verdicts instead of enforcing them
+    pub fn set_monitor_only(&self, monitor_only: bool) {
+        if self.mode.set_monitor_only(monitor_only) != monitor_only {
+            info!("Monitor-only mode {}", if monitor_only { "enabled" } else { "disabled" });
+        }
+    }
+
+    /// Check if blocking verdicts are only recorded
+    pub fn is_monitor_only(&self) -> bool {
+        self.mode.load().monitor_only()
+    }
+
+    /// Get how much matching lookups currently do
+    pub fn match_mode(&self) -> MatchMode {
+        self.mode.load().match_mode()
+    }
+
+    /// Take the number of lookups answered with reduced matching since the
+    /// last call
+    pub fn take_degraded_lookups(&self) -> u64 {
+        self.degrade.as_ref().map_or(0, |degrade| degrade.take_degraded_lookups())
+    }
+
+    /// Reload the built-in rules, configured rules and cached lists
+    pub fn reload_rules(&self) -> Result<()> {
+        self.load_default_filters()
+    }
+
+    /// Evaluate a request against the loaded rules, bypassing the cache
+    ///
+    /// Returns the verdict and the rule that decided it.
+    fn evaluate(&self, url: &str, request_type: &str, origin: &str) -> (bool, RuleId) {
+        self.evaluate_probed(url, request_type, origin, &mut ())
+    }
+
+    /// Evaluate a request, reporting each stage to `probe`
+    fn evaluate_probed(&self, url: &str, request_type: &str, origin: &str, probe: &mut impl StageProbe) -> (bool, RuleId) {
+        if let Some(decided) = self.matching_domain_rule(url, probe) {
+            return decided;
         }
 
         // Check pattern-based rules
-        self.check_pattern_rules(url, request_type, origin)
+        match self.matching_pattern_rule(url, request_type, origin, probe) {
+            Some(rule) => (true, rule),
+            None => (false, RuleId::NONE),
+        }
+    }
+
+    /// Find the exact or suffix domain rule deciding a URL, if any
+    fn matching_domain_rule(&self, url: &str, probe: &mut impl StageProbe) -> Option<(bool, RuleId)> {
+        probe.enter(Stage::Parse);
+        let domain = extract_domain(url)?;
+
+        // Check allowlist first (whitelist takes priority)
+        probe.enter(Stage::Allowlist);
+        let allowlist = self.domain_allowlist.read();
+        let allowed = matching_domain(&domain, |candidate| {
+            probe.rule_evaluated();
+            allowlist.contains(candidate)
+        });
+        if let Some(rule) = allowed {
+            return Some((false, RuleId::domain(RuleKind::AllowedDomain, rule)));
+        }
+
+        // Check domain blocklist
+        probe.enter(Stage::Blocklist);
+        let blocklist = self.domain_blocklist.read();
+        let blocked = matching_domain(&domain, |candidate| {
+            probe.rule_evaluated();
+            blocklist.contains_key(candidate)
+        });
+        blocked.map(|rule| (true, RuleId::domain(RuleKind::BlockedDomain, rule)))
     }
 
-    /// Load default filter lists
+    /// Load the built-in rules, configured rules and locally cached lists
     fn load_default_filters(&self) -> Result<()> {
         info!("Loading default filter lists");
-        
-        // Load built-in blocklist
-        let mut blocklist = self.domain_blocklist.write();
-        blocklist.extend([
-            "googleadservices.com".to_string(),
-            "doubleclick.net".to_string(),
-            "googlesyndication.com".to_string(),
-            "facebook.com".to_string(),
-            "analytics.google.com".to_string(),
-        ]);
-
-        // Load allowlist
-        let mut allowlist = self.domain_allowlist.write();
-        allowlist.extend([
-            "github.com".to_string(),
-            "stackoverflow.com".to_string(),
-        ]);
-
-        info!("Loaded {} blocked domains, {} allowed domains", 
-              blocklist.len(), allowlist.len());
+        self.load_rules(&self.default_sources())?;
         Ok(())
     }
 
-    /// Check if URL is whitelisted
-    fn is_whitelisted(&self, url: &str) -> bool {
-        if let Some(domain) = extract_domain(url) {
-            self.domain_allowlist.read().contains(&domain)
+    /// Built-in rules, configured rules and locally cached lists
+    fn default_sources(&self) -> Vec<RuleSource> {
+        let mut sources = vec![builtin_source(), RuleSource::from_config(&self.config.filters)];
+        sources.extend(self.cached_list_sources());
+        sources
+    }
+
+    /// Read previously downloaded lists from the filters directory
+    fn cached_list_sources(&self) -> Vec<RuleSource> {
+        let filters_dir = &self.config.filters.filters_dir;
+        let mut manager = FilterManager::new();
+
+        for list in &self.config.filters.default_lists {
+            let name = list.name.clone();
+            let path = filter_list_path(filters_dir, &name);
+            if !list.enabled || !path.exists() {
+                continue;
+            }
+
+            if let Err(e) = manager
+                .add_filter_list(list.clone())
+                .and_then(|_| manager.load_filter_list_from_file(&name, &path))
+            {
+                warn!("Skipping filter list '{}': {}", name, e);
+            }
+        }
+
+        manager.rule_sources()
+    }
+
+    /// Compile rule sources and swap them in
+    ///
+    /// Rules are admitted by list priority and observed hits until either
+    /// `filters.max_rules` or the memory budget derived from
+    /// `general.max_memory_mb` is exhausted; everything else is reported.
+    pub fn load_rules(&self, sources: &[RuleSource]) -> Result<AdmissionReport> {
+        let hit_counts = self.stats.domains_blocked();
+        let budget_bytes = memory::rule_budget_bytes(&self.config);
+        let compiled = RuleCompiler::new(self.config.filters.max_rules, budget_bytes)
+            .with_hit_counts(&hit_counts)
+            .compile(sources);
+
+        let matcher = if compiled.literal_patterns.is_empty() {
+            None
         } else {
-            false
+            let matcher = AhoCorasick::builder()
+                .ascii_case_insensitive(true)
+                .build(&compiled.literal_patterns)
+                .map_err(|e| FilterError::CompilationFailed { reason: e.to_string() })?;
+            Some(matcher)
+        };
+
+        let report = compiled.report;
+        info!(
+            "Admitted {} rules ({} bytes of {} budget), dropped {}: {} blocked domains, {} allowed domains, {} patterns, {} regex rules",
+            report.admitted,
+            report.admitted_bytes,
+            report.budget_bytes,
+            report.dropped,
+            compiled.blocked_domains.len(),
+            compiled.allowed_domains.len(),
+            compiled.literal_patterns.len(),
+            compiled.regex_rules.len()
+        );
+        for (reason, count) in &report.dropped_by_reason {
+            debug!("Dropped {} rules: {}", count, reason);
+        }
+
+        *self.domain_blocklist.write() = compiled.blocked_domains;
+        *self.domain_allowlist.write() = compiled.allowed_domains;
+        *self.pattern_matcher.write() = matcher;
+        *self.rules.write() = compiled.regex_rules;
+        *self.rule_lists.write() = compiled.lists;
+        *self.last_update.write() = Instant::now();
+        *self.admission_report.write() = report.clone();
+        self.fingerprint.store(compiled.fingerprint, Ordering::Release);
+        self.generation.fetch_add(1, Ordering::Release);
+
+        // The cache may only grow into rule budget the rules left unused
+        if self.cache_sizes.is_some() {
+            let configured = self.config.performance.filter_cache_size;
+            let headroom = budget_bytes.saturating_sub(report.admitted_bytes) / memory::CACHE_ENTRY_BYTES;
+            self.cache_tuner
+                .set_max_capacity((configured + headroom).min(configured.saturating_mul(MAX_CACHE_GROWTH)));
+            if self.memory_monitor.level() == PressureLevel::Normal {
+                self.verdict_cache.set_capacity(self.cache_tuner.target());
+            }
+        }
+
+        // Verdicts from the previous rule set are stale
+        self.verdict_cache.clear();
+        self.stats.update_memory_breakdown(self.memory_breakdown());
+        Ok(report)
+    }
+
+    /// Find the first pattern-based rule blocking a URL
+    fn matching_pattern_rule(
+        &self,
+        url: &str,
+        _request_type: &str,
+        _origin: &str,
+        probe: &mut impl StageProbe,
+    ) -> Option<RuleId> {
+        probe.enter(Stage::Patterns);
+        if let Some(matcher) = self.pattern_matcher.read().as_ref() {
+            probe.rule_evaluated();
+            if let Some(found) = matcher.find(url) {
+                return Some(RuleId::new(RuleKind::Pattern, found.pattern().as_u32()));
+            }
+        }
+
+        probe.enter(Stage::Regex);
+        self.rules
+            .read()
+            .iter()
+            .position(|rule| match rule {
+                FilterRule::Block { regex: Some(regex), .. } => {
+                    probe.rule_evaluated();
+                    regex.is_match(url)
+                }
+                _ => false,
+            })
+            .map(|index| RuleId::new(RuleKind::Regex, index as u32))
+    }
+
+    /// Take the slowest lookups since the last call, with replayed stage times
+    ///
+    /// Each sample is evaluated again with a [`StageTimer`], so this belongs
+    /// on the reporting path, not the lookup path.
+    pub fn take_slow_lookups(&self) -> Vec<SlowLookup> {
+        let mut samples = self.slow_lookups.take();
+        for sample in &mut samples {
+            let mut timer = StageTimer::new();
+            self.evaluate_probed(&sample.url, &sample.request_type, "", &mut timer);
+            let mut profile = timer.finish();
+            profile.rule_text = self.explain(&sample.url).rule_text;
+            sample.profile = Some(profile);
         }
+        samples
     }
 
-    /// Check pattern-based rules
-    fn check_pattern_rules(&self, url: &str, _request_type: &str, _origin: &str) -> bool {
-        // Simple pattern matching for now
-        let patterns = ["ads", "analytics", "tracking", "adnxs", "adsystem"];
-        patterns.iter().any(|pattern| url.contains(pattern))
+    /// Get the recent-request log, if detailed logging is enabled
+    pub fn request_log(&self) -> Option<&Arc<RequestLog>> {
+        self.request_log.as_ref()
     }
 
     /// Start background tasks
     pub fn start_background_tasks(&self) -> Result<()> {
         info!("Starting filter engine background tasks");
+
+        let cache = Arc::clone(&self.verdict_cache);
+        let monitor = Arc::clone(&self.memory_monitor);
+        let stats = Arc::clone(&self.stats);
+        let tuner = Arc::clone(&self.cache_tuner);
+        let cache_sizes = self.cache_sizes.clone();
+        let app_name = self.app_name.clone();
+        let mode = Arc::clone(&self.mode);
+        let degrade = self.degrade.clone();
+        let pressure_task = PeriodicTask::spawn("aubo-mem", PRESSURE_POLL_INTERVAL, move || {
+            if let Some(level) = monitor.update(&MemorySample::read()) {
+                apply_memory_pressure(&cache, level, tuner.target());
+            }
+            if let Some(cache_sizes) = &cache_sizes {
+                if monitor.level() == PressureLevel::Normal {
+                    tune_cache(&cache, &tuner, cache_sizes, &app_name);
+                }
+            }
+            // Rule structures only change on reload; the cache changes constantly
+            stats.update_structure_memory(VERDICT_CACHE_STRUCTURE, cache.heap_bytes(), 0);
+            if let Some(changed) = degrade.as_ref().and_then(|degrade| degrade.update(&mode, read_cpu_psi())) {
+                info!("Lookup matching mode now {:?}", changed);
+            }
+        })?;
+
+        self.background_tasks.lock().push(pressure_task);
         Ok(())
     }
 
     /// Stop background tasks
     pub fn stop_background_tasks(&self) -> Result<()> {
         info!("Stopping filter engine background tasks");
+
+        let tasks = std::mem::take(&mut *self.background_tasks.lock());
+        for task in tasks {
+            task.stop();
+        }
         Ok(())
     }
+
+    /// Get the current memory pressure level
+    pub fn memory_pressure(&self) -> PressureLevel {
+        self.memory_monitor.level()
+    }
+
+    /// Get the verdict cache
+    pub fn verdict_cache(&self) -> &VerdictCache {
+        &self.verdict_cache
+    }
+
+    /// Measure the memory held by each engine structure and filter list
+    ///
+    /// Domain sets, the verdict cache and the automaton are measured; regex
+    /// programs and per-list shares use the compiler's estimates. Nothing is
+    /// memory mapped yet, so mapped bytes are zero.
+    pub fn memory_breakdown(&self) -> MemoryBreakdown {
+        let mut breakdown = MemoryBreakdown::default();
+
+        breakdown.set_structure("blocked_domains", string_map_heap_bytes(&self.domain_blocklist.read()), 0);
+        breakdown.set_structure("allowed_domains", string_set_heap_bytes(&self.domain_allowlist.read()), 0);
+
+        let automaton_bytes = self
+            .pattern_matcher
+            .read()
+            .as_ref()
+            .map_or(0, |matcher| matcher.memory_usage());
+        breakdown.set_structure("pattern_automaton", automaton_bytes, 0);
+
+        let regex_bytes = self
+            .rules
+            .read()
+            .iter()
+            .map(|rule| match rule {
+                FilterRule::Block { pattern, .. } | FilterRule::Allow { pattern, .. } => estimated_regex_bytes(pattern),
+                FilterRule::HostBlock { domain } => domain.capacity(),
+            })
+            .sum();
+        breakdown.set_structure("regex_rules", regex_bytes, 0);
+        breakdown.set_structure("rule_lists", self.rule_lists.read().heap_bytes(), 0);
+
+        breakdown.set_structure(VERDICT_CACHE_STRUCTURE, self.verdict_cache.heap_bytes(), 0);
+        if let Some(log) = &self.request_log {
+            breakdown.set_structure("request_log", log.heap_bytes(), 0);
+        }
+
+        let report = self.admission_report.read();
+        breakdown.set_structure("admission_report", report.heap_bytes(), 0);
+        for list in &report.lists {
+            breakdown.set_list(&list.name, list.bytes, 0);
+        }
+
+        breakdown
+    }
+
+    /// Get the admission report of the current rule set
+    ///
+    /// It holds counts and a few sample rules; see
+    /// [`write_dropped_rules`](Self::write_dropped_rules) for all of them.
+    pub fn admission_report(&self) -> AdmissionReport {
+        self.admission_report.read().clone()
+    }
+
+    /// Write every rule the default sources drop to `path`, one per line,
+    /// followed by the admission summary
+    ///
+    /// The rules are compiled again rather than kept after loading, so the
+    /// file reflects the lists and hit counts at the time of the call.
+    pub fn write_dropped_rules(&self, path: &Path) -> Result<AdmissionReport> {
+        let hit_counts = self.stats.domains_blocked();
+        let compiler = RuleCompiler::new(self.config.filters.max_rules, memory::rule_budget_bytes(&self.config))
+            .with_hit_counts(&hit_counts);
+
+        let mut out = BufWriter::new(File::create(path)?);
+        let mut written = Ok(());
+        let compiled = compiler.compile_reporting(&self.default_sources(), &mut |list, rule, reason| {
+            if written.is_ok() {
+                written = out.write_all(drop_line(list, &rule.pattern, reason).as_bytes());
+            }
+        });
+        written?;
+        let report = compiled.report;
+        out.write_all(report.to_text().as_bytes())?;
+        out.flush()?;
+        Ok(report)
+    }
+
+    /// Get the rule set generation, bumped on every reload
+    pub fn generation(&self) -> u64 {
+        self.generation.load(Ordering::Acquire)
+    }
+
+    /// Get the fingerprint of the loaded rules
+    ///
+    /// Unlike the generation, it is the same in every process and across
+    /// boots as long as the admitted rules are the same, so it can tag
+    /// verdicts that outlive the process.
+    pub fn rules_fingerprint(&self) -> u64 {
+        self.fingerprint.load(Ordering::Acquire)
+    }
+
+    /// Get the process name the engine tunes and persists state for
+    pub fn app_name(&self) -> &str {
+        &self.app_name
+    }
+
+    /// Get the most recently used verdicts for the warm cache
+    pub fn warm_verdicts(&self, limit: usize) -> Vec<(String, bool)> {
+        self.verdict_cache.hottest(limit)
+    }
+
+    /// Preload verdicts from the warm cache of an earlier process
+    ///
+    /// Verdicts must come from a rule set with the current fingerprint.
+    pub fn preload_verdicts(&self, entries: &[(String, bool)]) {
+        self.verdict_cache
+            .preload(entries.iter().map(|(host, verdict)| (host.as_str(), *verdict)));
+        debug!("Preloaded {} warm verdicts", entries.len());
+    }
+}
+
+/// Apply the tuner's decision to the cache and remember it for the app
+fn tune_cache(cache: &VerdictCache, tuner: &CacheTuner, cache_sizes: &Mutex<CacheSizeStore>, app_name: &str) {
+    let Some(capacity) = tuner.observe(cache) else {
+        return;
+    };
+
+    debug!("Resizing verdict cache for {} to {} entries", app_name, capacity);
+    cache.set_capacity(capacity);
+
+    let mut cache_sizes = cache_sizes.lock();
+    cache_sizes.set(app_name, capacity);
+    if let Err(e) = cache_sizes.save() {
+        warn!("Failed to save tuned cache size: {}", e);
+    }
+}
+
+/// Rules compiled into the engine so it works before any list is downloaded
+fn builtin_source() -> RuleSource {
+    let block = |pattern: String| ParsedRule {
+        pattern,
+        rule_type: RuleType::Block,
+        options: Vec::new(),
+    };
+
+    let mut rules: Vec<ParsedRule> = BUILTIN_ALLOWED_DOMAINS
+        .iter()
+        .map(|domain| ParsedRule {
+            pattern: format!("||{}^", domain),
+            rule_type: RuleType::Allow,
+            options: Vec::new(),
+        })
+        .collect();
+    rules.extend(BUILTIN_BLOCKED_DOMAINS.iter().map(|domain| block(format!("||{}^", domain))));
+    rules.extend(BUILTIN_PATTERNS.iter().map(|pattern| block(pattern.to_string())));
+
+    RuleSource {
+        name: "builtin".to_string(),
+        priority: BUILTIN_PRIORITY,
+        rules,
+    }
+}
+
+/// Check a domain and each of its parent domains against a domain set
+///
+/// Returns the matching entry, i.e. the domain or the parent that is listed.
+fn matching_domain<'a>(domain: &'a str, mut listed: impl FnMut(&str) -> bool) -> Option<&'a str> {
+    let domain = domain.trim_end_matches('.');
+    let mut candidate = domain;
+    loop {
+        if listed(candidate) {
+            return Some(candidate);
+        }
+        match candidate.split_once('.') {
+            Some((_, parent)) if !parent.is_empty() => candidate = parent,
+            _ => return None,
+        }
+    }
+}
+
+/// Resize the verdict cache for a new memory pressure level
+///
+/// `normal_capacity` is the size the cache has without pressure, i.e. the
+/// tuned size when auto-tuning is enabled.
+fn apply_memory_pressure(cache: &VerdictCache, level: PressureLevel, normal_capacity: usize) {
+    match level {
+        PressureLevel::Normal => {
+            info!("Memory pressure cleared, restoring verdict cache to {} entries", normal_capacity);
+            cache.set_capacity(normal_capacity);
+        }
+        PressureLevel::Moderate => {
+            warn!("Memory pressure detected, dropping cold verdict cache tier");
+            cache.shed_cold();
+            cache.set_capacity(normal_capacity / 4);
+        }
+        PressureLevel::Critical => {
+            warn!("Critical memory pressure, releasing verdict cache");
+            cache.set_capacity(0);
+        }
+    }
+}
+
+/// Host part of a URL or bare hostname, without allocating
+pub(crate) fn host_of(url: &str) -> &str {
+    let rest = url.split_once("://").map_or(url, |(_, rest)| rest);
+    let authority = rest.split(['/', '?', '#']).next().unwrap_or(rest);
+    let host = authority.rsplit_once('@').map_or(authority, |(_, host)| host);
+    if host.starts_with('[') {
+        // IPv6 literal, keep the brackets and drop the port
+        return host.split_inclusive(']').next().unwrap_or(host);
+    }
+    host.split(':').next().unwrap_or(host)
 }
 
 /// Extract domain from URL
@@ -202,6 +849,342 @@ mod tests {
         assert_eq!(extract_domain("invalid://"), None);
     }
 
+    #[test]
+    fn test_host_of() {
+        assert_eq!(host_of("https://user@Ads.example.com:8443/path?q"), "Ads.example.com");
+        assert_eq!(host_of("tracker.net"), "tracker.net");
+        assert_eq!(host_of("http://[::1]:80/"), "[::1]");
+    }
+
+    #[test]
+    fn test_first_write_tunnels_are_blocked() {
+        let engine = create_test_engine();
+        let block = |data: &[u8]| {
+            let inspected = crate::inspect::inspect_first_write(data);
+            let (url, request_type) = inspected.lookup().unwrap();
+            engine.should_block(&url, request_type, "first-write")
+        };
+
+        assert!(block(b"CONNECT doubleclick.net:443 HTTP/1.1\r\nHost: doubleclick.net:443\r\n\r\n"));
+        assert!(block(b"GET / HTTP/1.1\r\nHost: doubleclick.net:8080\r\n\r\n"));
+        assert!(!block(b"CONNECT github.com:443 HTTP/1.1\r\n\r\n"));
+    }
+
+    #[test]
+    fn test_request_log_records_deciding_rule() {
+        let mut config = AuboConfig::default();
+        config.stats.detailed_logging = true;
+        config.stats.max_log_entries = 16;
+        let engine = FilterEngine::new(Arc::new(config), Arc::new(StatsCollector::new())).unwrap();
+
+        engine.should_block("ads.doubleclick.net", "dns", "test");
+        engine.should_block("ads.doubleclick.net", "dns", "test");
+        engine.should_block("github.com", "dns", "test");
+        engine.should_block("https://example.com/tracking.js", "https", "test");
+
+        let log = engine.request_log().unwrap();
+        let (records, _) = log.read_since(0);
+        let rules: Vec<_> = records.iter().map(|record| (record.blocked, record.rule.kind())).collect();
+        assert_eq!(
+            rules,
+            vec![
+                (true, RuleKind::BlockedDomain),
+                (true, RuleKind::Cached),
+                (false, RuleKind::AllowedDomain),
+                (true, RuleKind::Pattern),
+            ]
+        );
+        assert_eq!(records[0].rule, RuleId::domain(RuleKind::BlockedDomain, "doubleclick.net"));
+        assert_eq!(records[3].host_id, crate::sketch::host_hash("example.com"));
+        assert!(engine.memory_breakdown().structure("request_log").is_some());
+
+        // Disabled by default
+        assert!(create_test_engine().request_log().is_none());
+    }
+
+    #[test]
+    fn test_lookups_feed_host_sketches() {
+        let engine = create_test_engine();
+        engine.stats.start_collection().unwrap();
+
+        engine.should_block("doubleclick.net", "dns", "test");
+        engine.should_block("doubleclick.net", "dns", "test");
+        engine.should_block("https://doubleclick.net/track", "http", "test");
+        engine.should_block("github.com", "dns", "test");
+
+        let hosts = engine.stats.host_cardinality();
+        assert_eq!((hosts.distinct_hosts(), hosts.distinct_blocked_hosts()), (2, 1));
+    }
+
+    #[test]
+    fn test_verdict_cache_hits() {
+        let engine = create_test_engine();
+
+        assert!(engine.should_block("doubleclick.net", "dns", "test"));
+        assert!(engine.should_block("doubleclick.net", "dns", "test"));
+        assert!(!engine.should_block("github.com", "dns", "test"));
+
+        let (hits, misses) = engine.verdict_cache().hit_stats();
+        assert_eq!((hits, misses), (1, 2));
+
+        // Full URLs bypass the cache
+        engine.should_block("https://doubleclick.net/track", "http", "test");
+        assert_eq!(engine.verdict_cache().hit_stats(), (1, 2));
+    }
+
+    #[test]
+    fn test_memory_pressure_sheds_and_restores_cache() {
+        let cache = VerdictCache::new(1000);
+        for i in 0..500 {
+            cache.insert(&format!("host{}.example.com", i), false);
+        }
+
+        apply_memory_pressure(&cache, PressureLevel::Moderate, 1000);
+        assert_eq!(cache.capacity(), 250);
+        assert!(cache.len() <= 250);
+
+        apply_memory_pressure(&cache, PressureLevel::Critical, 1000);
+        assert!(cache.is_empty());
+        cache.insert("example.com", false);
+        assert!(cache.is_empty());
+
+        apply_memory_pressure(&cache, PressureLevel::Normal, 1000);
+        cache.insert("example.com", false);
+        assert_eq!(cache.get("example.com"), Some(false));
+    }
+
+    #[test]
+    fn test_background_tasks_start_and_stop() {
+        let engine = create_test_engine();
+        engine.start_background_tasks().unwrap();
+        assert_eq!(engine.background_tasks.lock().len(), 1);
+        engine.stop_background_tasks().unwrap();
+        assert!(engine.background_tasks.lock().is_empty());
+    }
+
+    fn block_rule(pattern: &str) -> ParsedRule {
+        ParsedRule {
+            pattern: pattern.to_string(),
+            rule_type: RuleType::Block,
+            options: Vec::new(),
+        }
+    }
+
+    #[test]
+    fn test_load_rules_matches_subdomains_and_respects_allowlist() {
+        let engine = create_test_engine();
+        let generation = engine.generation();
+
+        engine.should_block("cdn.adserver.net", "dns", "test");
+        assert!(!engine.verdict_cache().is_empty());
+
+        let sources = vec![
+            RuleSource {
+                name: "list".to_string(),
+                priority: 10,
+                rules: vec![block_rule("||adserver.net^"), block_rule("||safe.org^"), block_rule("/promo[0-9]+/")],
+            },
+            RuleSource {
+                name: "allow".to_string(),
+                priority: 20,
+                rules: vec![ParsedRule {
+                    pattern: "||safe.org^".to_string(),
+                    rule_type: RuleType::Allow,
+                    options: Vec::new(),
+                }],
+            },
+        ];
+        let report = engine.load_rules(&sources).unwrap();
+
+        assert_eq!(report.admitted, 4);
+        assert_eq!(engine.generation(), generation + 1);
+        assert!(engine.verdict_cache().is_empty());
+        assert!(engine.should_block("cdn.adserver.net", "dns", "test"));
+        assert!(!engine.should_block("www.safe.org", "dns", "test"));
+        assert!(engine.should_block("https://example.com/promo42/x.png", "http", "test"));
+        assert!(!engine.should_block("notadserver.net", "dns", "test"));
+    }
+
+    #[test]
+    fn test_rule_cap_keeps_high_priority_rules() {
+        let mut config = AuboConfig::default();
+        config.filters.max_rules = 1;
+        let engine = FilterEngine::new(Arc::new(config), Arc::new(StatsCollector::new())).unwrap();
+
+        let report = engine.admission_report();
+        assert_eq!(report.admitted, 1);
+        assert!(report.dropped > 0);
+        let builtin = report.lists.iter().find(|list| list.name == "builtin").unwrap();
+        assert_eq!(builtin.admitted, 1);
+    }
+
+    #[test]
+    fn test_memory_breakdown_is_published() {
+        let engine = create_test_engine();
+        let breakdown = engine.memory_breakdown();
+
+        for name in ["blocked_domains", "allowed_domains", "pattern_automaton", "regex_rules", VERDICT_CACHE_STRUCTURE] {
+            assert!(breakdown.structure(name).is_some(), "missing {}", name);
+        }
+        assert!(breakdown.structure("blocked_domains").unwrap().heap_bytes > 0);
+        assert!(breakdown.structure("pattern_automaton").unwrap().heap_bytes > 0);
+        assert!(breakdown.lists.iter().any(|list| list.name == "builtin" && list.heap_bytes > 0));
+
+        // Loading rules publishes the breakdown through the stats
+        let published = engine.stats.memory_breakdown();
+        assert!(published.structure("blocked_domains").is_some());
+        assert!(published.structure(crate::stats::STATS_STRUCTURE).is_some());
+    }
+
+    #[test]
+    fn test_cache_size_is_restored_per_app() {
+        let dir = tempfile::tempdir().unwrap();
+        let mut config = AuboConfig::default();
+        config.general.data_dir = dir.path().to_path_buf();
+
+        let app_name = SystemInfo::process_name().unwrap_or_else(|| "unknown".to_string());
+        let mut store = CacheSizeStore::load(dir.path().join(CACHE_SIZES_FILE));
+        store.set(&app_name, 2048);
+        store.save().unwrap();
+
+        let engine = FilterEngine::new(Arc::new(config.clone()), Arc::new(StatsCollector::new())).unwrap();
+        assert_eq!(engine.cache_tuner.target(), 2048);
+        assert_eq!(engine.verdict_cache().capacity(), 2048);
+
+        // Without auto-tuning the configured size is used as-is
+        config.performance.cache_autotune = false;
+        let engine = FilterEngine::new(Arc::new(config), Arc::new(StatsCollector::new())).unwrap();
+        assert_eq!(engine.verdict_cache().capacity(), 10000);
+    }
+
+    #[test]
+    fn test_tuned_size_is_persisted() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join(CACHE_SIZES_FILE);
+        let cache_sizes = Mutex::new(CacheSizeStore::load(&path));
+        let cache = VerdictCache::new(10_000);
+        let tuner = CacheTuner::new(MIN_TUNED_CAPACITY, 40_000, 10_000);
+
+        for i in 0..1000 {
+            let host = format!("host{}.example.com", i % 10);
+            if cache.get(&host).is_none() {
+                cache.insert(&host, false);
+            }
+        }
+        tune_cache(&cache, &tuner, &cache_sizes, "com.example.app");
+
+        assert_eq!(cache.capacity(), MIN_TUNED_CAPACITY);
+        assert_eq!(CacheSizeStore::load(&path).get("com.example.app"), Some(MIN_TUNED_CAPACITY));
+    }
+
+    #[test]
+    fn test_warm_verdicts_round_trip() {
+        let engine = create_test_engine();
+        assert_ne!(engine.rules_fingerprint(), 0);
+
+        engine.should_block("doubleclick.net", "dns", "test");
+        engine.should_block("example.org", "dns", "test");
+        let warm = engine.warm_verdicts(16);
+        assert_eq!(warm.len(), 2);
+
+        // A new process with the same rules starts with cache hits
+        let next = create_test_engine();
+        assert_eq!(next.rules_fingerprint(), engine.rules_fingerprint());
+        next.preload_verdicts(&warm);
+        assert!(next.should_block("doubleclick.net", "dns", "test"));
+        assert_eq!(next.verdict_cache().hit_stats(), (1, 0));
+    }
+
+    #[test]
+    fn test_explain_and_monitor_mode() {
+        let engine = create_test_engine();
+
+        let explanation = engine.explain("https://ads.doubleclick.net/x");
+        assert!(explanation.blocked);
+        assert_eq!(explanation.rule.kind(), RuleKind::BlockedDomain);
+        assert_eq!(explanation.rule_text.as_deref(), Some("doubleclick.net"));
+
+        let explanation = engine.explain("https://example.com/ADS/banner.png");
+        assert_eq!(explanation.rule.kind(), RuleKind::Pattern);
+        assert_eq!(explanation.rule_text.as_deref(), Some("ads"));
+        assert!(!engine.explain("github.com").blocked);
+
+        engine.set_monitor_only(true);
+        assert!(!engine.should_block("doubleclick.net", "dns", ""));
+        assert!(engine.explain("doubleclick.net").monitor_only);
+        engine.set_monitor_only(false);
+        assert!(engine.should_block("doubleclick.net", "dns", ""));
+    }
+
+    #[test]
+    fn test_degraded_matching() {
+        let engine = create_test_engine();
+        engine.mode.set_match_mode(MatchMode::DomainsOnly);
+        assert!(engine.should_block("doubleclick.net", "dns", ""));
+        // Pattern rules are skipped and the allow is not cached
+        assert!(!engine.should_block("myads.example", "dns", ""));
+        assert_eq!(engine.verdict_cache().get("myads.example"), None);
+
+        engine.mode.set_match_mode(MatchMode::CacheOnly);
+        assert!(engine.should_block("doubleclick.net", "dns", ""));
+        assert!(!engine.should_block("googleadservices.com", "dns", ""));
+        assert_eq!(engine.take_degraded_lookups(), 4);
+
+        engine.mode.set_match_mode(MatchMode::Full);
+        assert!(engine.should_block("myads.example", "dns", ""));
+        assert!(engine.should_block("googleadservices.com", "dns", ""));
+        assert_eq!(engine.take_degraded_lookups(), 0);
+    }
+
+    #[test]
+    fn test_slow_lookups_are_profiled() {
+        let engine = create_test_engine();
+        engine.should_block("https://example.com/tracking/pixel.gif", "http", "");
+
+        let samples = engine.take_slow_lookups();
+        assert_eq!(samples.len(), 1);
+        assert_eq!(samples[0].rule.kind(), RuleKind::Pattern);
+        let profile = samples[0].profile.as_ref().unwrap();
+        let stages: Vec<Stage> = profile.stages.iter().map(|(stage, _)| *stage).collect();
+        assert_eq!(stages, vec![Stage::Parse, Stage::Allowlist, Stage::Blocklist, Stage::Patterns]);
+        assert!(profile.rules_evaluated >= 3);
+        assert_eq!(profile.rule_text.as_deref(), Some("tracking"));
+        assert!(engine.take_slow_lookups().is_empty());
+    }
+
+    #[test]
+    fn test_block_list_attribution() {
+        let engine = create_test_engine();
+        assert_eq!(engine.block_list("ads.doubleclick.net").as_deref(), Some("builtin"));
+        assert_eq!(engine.block_list("https://example.com/tracking/pixel").as_deref(), Some("builtin"));
+        assert_eq!(engine.block_list("github.com"), None);
+        assert_eq!(engine.block_list("example.org"), None);
+    }
+
+    #[test]
+    fn test_blocked_prefixes() {
+        let mut config = AuboConfig::default();
+        config.filters.blacklist_domains =
+            vec!["203.0.113.7".to_string(), "198.51.100.9".to_string(), "192.0.2.1".to_string()];
+        config.filters.whitelist_domains = vec!["192.0.2.1".to_string()];
+        let engine = FilterEngine::new(Arc::new(config), Arc::new(StatsCollector::new())).unwrap();
+
+        let mut prefixes: Vec<String> = engine.blocked_prefixes().iter().map(ToString::to_string).collect();
+        prefixes.sort();
+        assert_eq!(prefixes, vec!["198.51.100.9/32", "203.0.113.7/32"]);
+    }
+
+    #[test]
+    fn test_matching_domain() {
+        let set: HashSet<String> = ["example.com".to_string()].into_iter().collect();
+        let listed = |domain: &str| set.contains(domain);
+        assert_eq!(matching_domain("example.com", listed), Some("example.com"));
+        assert_eq!(matching_domain("a.b.example.com", listed), Some("example.com"));
+        assert_eq!(matching_domain("example.com.", listed), Some("example.com"));
+        assert_eq!(matching_domain("badexample.com", listed), None);
+        assert_eq!(matching_domain("com", listed), None);
+    }
+
     #[test]
     fn test_performance_blocking() {
         let engine = create_test_engine();
@@ -2,7 +2,11 @@
 
 use std::collections::HashMap;
 use std::fs;
-use std::path::Path;
+#[cfg(feature = "network")]
+use std::net::ToSocketAddrs;
+use std::path::{Path, PathBuf};
+#[cfg(feature = "network")]
+use std::sync::Arc;
 use std::time::SystemTime;
 
 use log::{debug, error, info, warn};
@@ -11,8 +15,11 @@ use reqwest;
 use serde::{Deserialize, Serialize};
 use url::Url;
 
+use crate::compiler::RuleSource;
 use crate::config::{FilterListConfig, FilterListType};
 use crate::error::{FilterError, Result};
+#[cfg(feature = "network")]
+use crate::hooks::internal_call;
 
 /// Filter list metadata
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -23,6 +30,7 @@ pub struct FilterListMetadata {
     pub last_updated: Option<SystemTime>,
     pub rule_count: usize,
     pub enabled: bool,
+    pub priority: u32,
 }
 
 /// Parsed filter rule
@@ -42,6 +50,22 @@ pub enum RuleType {
     Invalid,
 }
 
+/// Resolver for list downloads that tags its lookups as internal calls
+#[cfg(feature = "network")]
+struct InternalResolver;
+
+#[cfg(feature = "network")]
+impl reqwest::dns::Resolve for InternalResolver {
+    fn resolve(&self, name: reqwest::dns::Name) -> reqwest::dns::Resolving {
+        let host = name.as_str().to_string();
+        Box::pin(async move {
+            let lookup = move || internal_call(|| (host.as_str(), 0).to_socket_addrs());
+            let addrs: reqwest::dns::Addrs = Box::new(tokio::task::spawn_blocking(lookup).await??);
+            Ok(addrs)
+        })
+    }
+}
+
 /// Filter list manager
 pub struct FilterManager {
     lists: HashMap<String, FilterListMetadata>,
@@ -66,6 +90,7 @@ impl FilterManager {
             last_updated: None,
             rule_count: 0,
             enabled: config.enabled,
+            priority: config.priority,
         };
 
         self.lists.insert(config.name, metadata);
@@ -105,9 +130,22 @@ impl FilterManager {
     }
 
     /// Download filter list content
+    ///
+    /// The list host is resolved as an internal call, so the DNS hooks of
+    /// this process neither filter it nor ask the engine about it.
     #[cfg(feature = "network")]
     async fn download_filter_list(&self, url: &Url) -> Result<String> {
-        let response = reqwest::get(url.as_str())
+        let client = reqwest::Client::builder()
+            .dns_resolver(Arc::new(InternalResolver))
+            .build()
+            .map_err(|e| FilterError::DownloadFailed {
+                name: "unknown".to_string(),
+                url: url.to_string(),
+                reason: e.to_string(),
+            })?;
+        let response = client
+            .get(url.as_str())
+            .send()
             .await
             .map_err(|e| FilterError::DownloadFailed {
                 name: "unknown".to_string(),
@@ -177,33 +215,7 @@ impl FilterManager {
 
     /// Parse EasyList format
     fn parse_easylist_format(&self, content: &str) -> Result<Vec<ParsedRule>> {
-        let mut rules = Vec::new();
-
-        for line in content.lines() {
-            let line = line.trim();
-            
-            if line.is_empty() || line.starts_with('!') {
-                continue;
-            }
-
-            if line.starts_with("@@") {
-                // Allow rule
-                rules.push(ParsedRule {
-                    pattern: line[2..].to_string(),
-                    rule_type: RuleType::Allow,
-                    options: Vec::new(),
-                });
-            } else {
-                // Block rule
-                rules.push(ParsedRule {
-                    pattern: line.to_string(),
-                    rule_type: RuleType::Block,
-                    options: Vec::new(),
-                });
-            }
-        }
-
-        Ok(rules)
+        Ok(content.lines().filter_map(parse_easylist_line).collect())
     }
 
     /// Parse AdGuard format
@@ -274,8 +286,60 @@ impl FilterManager {
             .collect()
     }
 
+    /// Get the cached rules of every enabled list, tagged with list priority
+    pub fn rule_sources(&self) -> Vec<RuleSource> {
+        self.lists
+            .values()
+            .filter(|metadata| metadata.enabled)
+            .filter_map(|metadata| {
+                let rules = self.rules_cache.get(&metadata.name)?;
+                Some(RuleSource {
+                    name: metadata.name.clone(),
+                    priority: metadata.priority,
+                    rules: rules.clone(),
+                })
+            })
+            .collect()
+    }
+
     /// Get metadata for all filter lists
     pub fn get_metadata(&self) -> &HashMap<String, FilterListMetadata> {
         &self.lists
     }
+}
+
+/// Parse a single EasyList-style line, skipping blanks and comments
+pub fn parse_easylist_line(line: &str) -> Option<ParsedRule> {
+    let line = line.trim();
+
+    if line.is_empty() || line.starts_with('!') {
+        return None;
+    }
+
+    let rule = if let Some(pattern) = line.strip_prefix("@@") {
+        // Allow rule
+        ParsedRule {
+            pattern: pattern.to_string(),
+            rule_type: RuleType::Allow,
+            options: Vec::new(),
+        }
+    } else {
+        // Block rule
+        ParsedRule {
+            pattern: line.to_string(),
+            rule_type: RuleType::Block,
+            options: Vec::new(),
+        }
+    };
+
+    Some(rule)
+}
+
+/// Local cache path of a downloaded filter list
+pub fn filter_list_path(filters_dir: &Path, name: &str) -> PathBuf {
+    let file_name: String = name
+        .chars()
+        .map(|c| if c.is_ascii_alphanumeric() || c == '-' { c.to_ascii_lowercase() } else { '_' })
+        .collect();
+    filters_dir.join(format!("{}.txt", file_name))
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 //! Network interception hooks for aubo-rs
 
+use std::cell::Cell;
 use std::collections::HashMap;
 
 use std::net::IpAddr;
@@ -17,6 +18,35 @@ use crate::error::{HookError, Result};
 use crate::stats::StatsCollector;
 use crate::zygisk::{get_zygisk_api, ZygiskApi};
 
+thread_local! {
+    /// Depth of internal calls on this thread, see [`internal_call`]
+    static INTERNAL_CALLS: Cell<u32> = const { Cell::new(0) };
+}
+
+/// Run `f` as the module's own networking
+///
+/// Lookups and connects made while `f` runs still pass through the hooks of
+/// this process, but the C entry points see the thread tag and let them
+/// through before touching any lock, so filter downloads and internal
+/// resolutions are never filtered and never re-enter the engine.
+pub fn internal_call<T>(f: impl FnOnce() -> T) -> T {
+    struct Tag;
+    impl Drop for Tag {
+        fn drop(&mut self) {
+            INTERNAL_CALLS.with(|depth| depth.set(depth.get() - 1));
+        }
+    }
+
+    INTERNAL_CALLS.with(|depth| depth.set(depth.get() + 1));
+    let _tag = Tag;
+    f()
+}
+
+/// Check if the current thread is inside [`internal_call`]
+pub fn is_internal_call() -> bool {
+    INTERNAL_CALLS.with(|depth| depth.get() > 0)
+}
+
 /// Network function hook information
 #[derive(Debug)]
 pub struct HookInfo {
@@ -180,7 +210,7 @@ impl NetworkHooks {
 
         if should_block {
             self.blocked_counter.fetch_add(1, Ordering::SeqCst);
-            info!("Blocked request: {} from {}", context.domain, context.origin_process);
+            debug!("Blocked request: {} from {}", context.domain, context.origin_process);
             self.stats.record_blocked_request(&context.domain, &context.request_type);
         } else {
             debug!("Allowed request: {} from {}", context.domain, context.origin_process);
@@ -197,4 +227,22 @@ impl NetworkHooks {
             self.blocked_counter.load(Ordering::SeqCst),
         )
     }
-}
\ No newline at end of file
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_internal_calls_nest() {
+        assert!(!is_internal_call());
+        let nested = internal_call(|| internal_call(is_internal_call) && is_internal_call());
+        assert!(nested);
+        assert!(!is_internal_call());
+
+        // The tag is per thread and survives a panic unwinding through it
+        let _ = std::panic::catch_unwind(|| internal_call(|| panic!("download failed")));
+        assert!(!is_internal_call());
+        internal_call(|| std::thread::spawn(|| assert!(!is_internal_call())).join().unwrap());
+    }
+}
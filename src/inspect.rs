@@ -0,0 +1,299 @@
+//! First-write inspection for aubo-rs
+//!
+//! Apps that connect to IP literals or resolve names privately (DNS over
+//! HTTPS, hardcoded addresses) never pass through the DNS hooks. With
+//! `hooks.deep_inspection`, the connect hook marks each new socket and the
+//! `send`/`sendto`/`sendmsg`/`write` hooks hand the first write on it to
+//! [`inspect_first_write`]. A TLS connection opens with a ClientHello whose
+//! server name extension names the host, so the verdict path can refuse the
+//! connection before the handshake goes any further. A plaintext HTTP/1.x
+//! connection opens with a request line and a `Host` header, which give the
+//! full URL, so path rules apply at network level as well.
+//!
+//! The parsers borrow from the app's buffer: the TLS parser looks at no
+//! more than the first record and the HTTP parser at no more than the bytes
+//! it is given, which the hooks cut to `hooks.max_request_size`. Anything
+//! they cannot follow, such as a ClientHello or request head split across
+//! writes, is treated as unnamed and let through. Later writes on the
+//! socket are never inspected.
+
+use std::borrow::Cow;
+
+/// TLS record content type of handshake messages
+const HANDSHAKE: u8 = 22;
+
+/// Handshake message type of a ClientHello
+const CLIENT_HELLO: u8 = 1;
+
+/// Extension type of the server name indication
+const SERVER_NAME: u16 = 0;
+
+/// Server name type of a DNS host name
+const HOST_NAME: u8 = 0;
+
+/// Largest TLS plaintext record body
+const MAX_RECORD: usize = 1 << 14;
+
+/// Longest DNS host name
+const MAX_HOST_NAME: usize = 253;
+
+/// Request headers parsed before giving up on finding `Host`
+const MAX_HTTP_HEADERS: usize = 32;
+
+/// What the first write on a connection reveals
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum FirstWrite<'a> {
+    /// TLS ClientHello naming a server
+    Sni(&'a str),
+    /// HTTP/1.x request for `target` on `host`
+    Http {
+        /// Host, with the port if the request named one
+        host: &'a str,
+        /// Request target, a path or for proxies an absolute URL
+        target: &'a str,
+    },
+    /// TLS ClientHello or HTTP request without a host, or cut off before it
+    Unnamed,
+    /// Neither a TLS ClientHello nor an HTTP/1.x request
+    Other,
+}
+
+impl FirstWrite<'_> {
+    /// Get what the engine should match and the request type to match it as
+    pub fn lookup(&self) -> Option<(Cow<'_, str>, &'static str)> {
+        match *self {
+            FirstWrite::Sni(host) => Some((Cow::Borrowed(host), "tls")),
+            FirstWrite::Http { target, .. } if target.starts_with("http://") => Some((Cow::Borrowed(target), "http")),
+            FirstWrite::Http { host, target } if target.starts_with('/') => {
+                Some((Cow::Owned(format!("http://{}{}", host, target)), "http"))
+            }
+            // CONNECT and other authority-form targets carry a port the engine would take for a scheme
+            FirstWrite::Http { host, .. } => Some((Cow::Borrowed(crate::engine::host_of(host)), "http")),
+            FirstWrite::Unnamed | FirstWrite::Other => None,
+        }
+    }
+}
+
+/// Inspect the first bytes an app writes to a connection
+pub fn inspect_first_write(data: &[u8]) -> FirstWrite<'_> {
+    if let Some(hello) = client_hello(data) {
+        return server_name(hello).map_or(FirstWrite::Unnamed, FirstWrite::Sni);
+    }
+    http_request(data).unwrap_or(FirstWrite::Other)
+}
+
+/// Find the host and target of an HTTP/1.x request head
+///
+/// Returns `None` if `data` does not start like one.
+fn http_request(data: &[u8]) -> Option<FirstWrite<'_>> {
+    let mut headers = [httparse::EMPTY_HEADER; MAX_HTTP_HEADERS];
+    let mut request = httparse::Request::new(&mut headers);
+    let complete = match request.parse(data) {
+        Ok(status) => status.is_complete(),
+        Err(httparse::Error::TooManyHeaders) => false,
+        Err(_) => return None,
+    };
+    request.method?;
+    let Some(target) = request.path else {
+        return Some(FirstWrite::Unnamed);
+    };
+
+    // CONNECT names the host itself, and proxies get absolute URLs
+    let authority = match target.strip_prefix("http://") {
+        Some(rest) => Some(rest.split('/').next().unwrap_or(rest)),
+        None if request.method == Some("CONNECT") => Some(target),
+        None => None,
+    };
+    let host = match authority {
+        Some(authority) => Some(authority),
+        None if complete => request
+            .headers
+            .iter()
+            .find(|header| header.name.eq_ignore_ascii_case("host"))
+            .and_then(|header| std::str::from_utf8(header.value).ok())
+            .map(str::trim),
+        None => None,
+    };
+
+    let host = host.filter(|host| host_name(host.split(':').next().unwrap_or(host).as_bytes()).is_some());
+    Some(host.map_or(FirstWrite::Unnamed, |host| FirstWrite::Http { host, target }))
+}
+
+/// Get the ClientHello body of the first record, cut to the bytes present
+fn client_hello(data: &[u8]) -> Option<&[u8]> {
+    // Record header: type, legacy version 3.x, length
+    let [HANDSHAKE, 3, _, len_hi, len_lo, rest @ ..] = data else {
+        return None;
+    };
+    let record_len = usize::from(u16::from_be_bytes([*len_hi, *len_lo]));
+    if record_len > MAX_RECORD {
+        return None;
+    }
+    let record = &rest[..record_len.min(rest.len())];
+
+    // Handshake header: type and 24-bit length
+    let [CLIENT_HELLO, _, _, _, body @ ..] = record else {
+        return None;
+    };
+    Some(body)
+}
+
+/// Find the host name in a ClientHello body
+fn server_name(hello: &[u8]) -> Option<&str> {
+    let mut reader = Reader(hello);
+    reader.skip(2 + 32)?; // legacy version, random
+    reader.vector(1)?; // legacy session id
+    reader.vector(2)?; // cipher suites
+    reader.vector(1)?; // compression methods
+
+    let mut extensions = Reader(reader.vector(2)?);
+    while !extensions.0.is_empty() {
+        let kind = extensions.u16()?;
+        let data = extensions.vector(2)?;
+        if kind != SERVER_NAME {
+            continue;
+        }
+
+        let mut names = Reader(Reader(data).vector(2)?);
+        while !names.0.is_empty() {
+            let name_type = names.u8()?;
+            let name = names.vector(2)?;
+            if name_type == HOST_NAME {
+                return host_name(name);
+            }
+        }
+        return None;
+    }
+    None
+}
+
+/// Accept a plausible DNS host name
+fn host_name(name: &[u8]) -> Option<&str> {
+    let valid = !name.is_empty()
+        && name.len() <= MAX_HOST_NAME
+        && name.iter().all(|&b| b.is_ascii_alphanumeric() || b == b'-' || b == b'.' || b == b'_');
+    valid.then(|| std::str::from_utf8(name).ok()).flatten()
+}
+
+/// Bounds-checked big-endian reader over a borrowed slice
+struct Reader<'a>(&'a [u8]);
+
+impl<'a> Reader<'a> {
+    fn take(&mut self, len: usize) -> Option<&'a [u8]> {
+        if len > self.0.len() {
+            return None;
+        }
+        let (head, tail) = self.0.split_at(len);
+        self.0 = tail;
+        Some(head)
+    }
+
+    fn skip(&mut self, len: usize) -> Option<()> {
+        self.take(len).map(|_| ())
+    }
+
+    fn u8(&mut self) -> Option<u8> {
+        self.take(1).map(|b| b[0])
+    }
+
+    fn u16(&mut self) -> Option<u16> {
+        self.take(2).map(|b| u16::from_be_bytes([b[0], b[1]]))
+    }
+
+    /// Read a vector prefixed by a `width`-byte length
+    fn vector(&mut self, width: usize) -> Option<&'a [u8]> {
+        let len = self.take(width)?.iter().fold(0usize, |len, &b| len << 8 | usize::from(b));
+        self.take(len)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn with_len16(body: &[u8]) -> Vec<u8> {
+        let mut out = (body.len() as u16).to_be_bytes().to_vec();
+        out.extend_from_slice(body);
+        out
+    }
+
+    /// Build a TLS record holding a ClientHello with `extensions`
+    fn client_hello_record(extensions: &[(u16, Vec<u8>)]) -> Vec<u8> {
+        let mut hello = vec![3, 3];
+        hello.extend_from_slice(&[7; 32]);
+        hello.extend_from_slice(&[32]);
+        hello.extend_from_slice(&[9; 32]);
+        hello.extend(with_len16(&[0x13, 0x01, 0x13, 0x02]));
+        hello.extend_from_slice(&[1, 0]);
+        let mut encoded = Vec::new();
+        for (kind, data) in extensions {
+            encoded.extend_from_slice(&kind.to_be_bytes());
+            encoded.extend(with_len16(data));
+        }
+        hello.extend(with_len16(&encoded));
+
+        let mut handshake = vec![CLIENT_HELLO];
+        handshake.extend_from_slice(&(hello.len() as u32).to_be_bytes()[1..]);
+        handshake.extend(hello);
+        let mut record = vec![HANDSHAKE, 3, 1];
+        record.extend(with_len16(&handshake));
+        record
+    }
+
+    fn sni_extension(host: &str) -> (u16, Vec<u8>) {
+        let mut entry = vec![HOST_NAME];
+        entry.extend(with_len16(host.as_bytes()));
+        (SERVER_NAME, with_len16(&entry))
+    }
+
+    #[test]
+    fn test_extracts_sni() {
+        let record = client_hello_record(&[(10, vec![0, 2, 0, 29]), sni_extension("ads.example.com"), (16, vec![0; 14])]);
+        assert_eq!(inspect_first_write(&record), FirstWrite::Sni("ads.example.com"));
+
+        // Bytes after the first record are never looked at
+        let mut two_records = record.clone();
+        two_records.extend(client_hello_record(&[sni_extension("other.example.com")]));
+        assert_eq!(inspect_first_write(&two_records), FirstWrite::Sni("ads.example.com"));
+    }
+
+    #[test]
+    fn test_unnamed_and_truncated_hellos_pass() {
+        assert_eq!(inspect_first_write(&client_hello_record(&[(10, vec![0, 2, 0, 29])])), FirstWrite::Unnamed);
+        assert_eq!(inspect_first_write(&client_hello_record(&[sni_extension("bad host!")])), FirstWrite::Unnamed);
+
+        let record = client_hello_record(&[(21, vec![0; 512]), sni_extension("ads.example.com")]);
+        for cut in [9, 50, 100, record.len() - 4] {
+            assert_eq!(inspect_first_write(&record[..cut]), FirstWrite::Unnamed, "cut at {}", cut);
+        }
+    }
+
+    #[test]
+    fn test_http_requests() {
+        let request = b"GET /ads/banner.js?id=3 HTTP/1.1\r\nUser-Agent: sdk\r\nhost: ads.example.com:8080\r\n\r\n";
+        let inspected = inspect_first_write(request);
+        assert_eq!(inspected, FirstWrite::Http { host: "ads.example.com:8080", target: "/ads/banner.js?id=3" });
+        assert_eq!(inspected.lookup().unwrap().0, "http://ads.example.com:8080/ads/banner.js?id=3");
+
+        // Proxies and tunnels carry the host in the target
+        let proxied = inspect_first_write(b"GET http://t.example.com/pixel HTTP/1.1\r\n");
+        assert_eq!(proxied.lookup().unwrap(), (Cow::Borrowed("http://t.example.com/pixel"), "http"));
+        let tunnel = inspect_first_write(b"CONNECT t.example.com:443 HTTP/1.1\r\n\r\n");
+        assert_eq!(tunnel.lookup().unwrap().0, "t.example.com");
+
+        // A head cut off before Host, or without one, is let through
+        assert_eq!(inspect_first_write(b"GET /ads HTTP/1.1\r\nHost: ads.exa"), FirstWrite::Unnamed);
+        assert_eq!(inspect_first_write(b"GET /ads HTTP/1.1\r\n\r\n"), FirstWrite::Unnamed);
+        assert_eq!(inspect_first_write(b"GET /ads HTTP/1.1\r\nHost: bad host\r\n\r\n"), FirstWrite::Unnamed);
+    }
+
+    #[test]
+    fn test_other_traffic() {
+        assert_eq!(inspect_first_write(b"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"), FirstWrite::Other);
+        assert_eq!(inspect_first_write(b"\x00\x01binary"), FirstWrite::Other);
+        assert_eq!(inspect_first_write(&[]), FirstWrite::Other);
+        assert_eq!(inspect_first_write(&[HANDSHAKE, 3, 3, 0xff, 0xff, CLIENT_HELLO]), FirstWrite::Other);
+        // A server hello or other handshake message is not a client's opening
+        assert_eq!(inspect_first_write(&[HANDSHAKE, 3, 3, 0, 4, 2, 0, 0, 0]), FirstWrite::Other);
+    }
+}
@@ -0,0 +1,464 @@
+//! Append-only stats journal for aubo-rs
+//!
+//! Rewriting the whole stats file on every save costs I/O proportional to
+//! the history and wakes the flash for each write. The journal instead
+//! appends a compact binary record per stats delta as it arrives and only
+//! batches the `fdatasync`, issued once enough bytes are unsynced or the
+//! oldest of them is old enough. A killed companion loses nothing; a power
+//! cut loses at most what the page cache had not written back. When the log
+//! grows past a threshold it is folded into a snapshot and truncated. JSON
+//! is only produced when asked for.
+//!
+//! Both files use the same record framing: payload length and FNV-1a
+//! checksum as little-endian `u32`, followed by the payload. A torn record at
+//! the end of the log is detected on replay and cut off.
+
+use std::collections::HashMap;
+use std::fs::{self, File, OpenOptions};
+use std::io::{Read, Write};
+use std::path::{Path, PathBuf};
+use std::time::{Duration, Instant};
+
+use log::{debug, info, warn};
+
+use crate::error::{Result, StatsError};
+use crate::stats::{Stats, StatsDelta};
+use crate::utils::TimeUtils;
+
+/// Magic bytes at the start of a snapshot
+const SNAPSHOT_MAGIC: &[u8; 8] = b"AUBOSNAP";
+
+/// Snapshot format version
+const SNAPSHOT_VERSION: u32 = 1;
+
+/// Unsynced bytes that force a sync
+pub const MAX_UNSYNCED_BYTES: usize = 64 * 1024;
+
+/// Longest time written records wait for a sync
+pub const SYNC_INTERVAL: Duration = Duration::from_secs(10 * 60);
+
+/// Log size at which it is folded into the snapshot
+pub const COMPACT_THRESHOLD_BYTES: u64 = 1024 * 1024;
+
+/// Record header size: payload length and checksum
+const RECORD_HEADER_BYTES: usize = 8;
+
+/// FNV-1a over a byte slice
+fn checksum(data: &[u8]) -> u32 {
+    data.iter()
+        .fold(0x811c_9dc5, |hash, &byte| (hash ^ byte as u32).wrapping_mul(0x0100_0193))
+}
+
+/// Counters as they are encoded in a record
+struct Counters<'a> {
+    timestamp: u64,
+    total_requests: u64,
+    blocked_requests: u64,
+    allowed_requests: u64,
+    domains_blocked: &'a HashMap<String, u64>,
+    request_types: &'a HashMap<String, u64>,
+}
+
+impl<'a> Counters<'a> {
+    fn from_delta(delta: &'a StatsDelta, timestamp: u64) -> Self {
+        Self {
+            timestamp,
+            total_requests: delta.total_requests,
+            blocked_requests: delta.blocked_requests,
+            allowed_requests: delta.allowed_requests,
+            domains_blocked: &delta.domains_blocked,
+            request_types: &delta.request_types,
+        }
+    }
+
+    fn from_stats(stats: &'a Stats) -> Self {
+        Self {
+            timestamp: stats.start_time,
+            total_requests: stats.total_requests,
+            blocked_requests: stats.blocked_requests,
+            allowed_requests: stats.allowed_requests,
+            domains_blocked: &stats.domains_blocked,
+            request_types: &stats.request_types,
+        }
+    }
+
+    /// Append a framed record to `out`
+    fn encode(&self, out: &mut Vec<u8>) {
+        let start = out.len();
+        out.extend_from_slice(&[0; RECORD_HEADER_BYTES]);
+
+        for value in [self.timestamp, self.total_requests, self.blocked_requests, self.allowed_requests] {
+            out.extend_from_slice(&value.to_le_bytes());
+        }
+        encode_map(self.domains_blocked, out);
+        encode_map(self.request_types, out);
+
+        let payload_len = (out.len() - start - RECORD_HEADER_BYTES) as u32;
+        let sum = checksum(&out[start + RECORD_HEADER_BYTES..]);
+        out[start..start + 4].copy_from_slice(&payload_len.to_le_bytes());
+        out[start + 4..start + 8].copy_from_slice(&sum.to_le_bytes());
+    }
+}
+
+fn encode_map(map: &HashMap<String, u64>, out: &mut Vec<u8>) {
+    let entries: Vec<_> = map.iter().filter(|(key, _)| key.len() <= u16::MAX as usize).collect();
+    out.extend_from_slice(&(entries.len() as u32).to_le_bytes());
+    for (key, count) in entries {
+        out.extend_from_slice(&(key.len() as u16).to_le_bytes());
+        out.extend_from_slice(key.as_bytes());
+        out.extend_from_slice(&count.to_le_bytes());
+    }
+}
+
+/// A decoded record
+#[derive(Debug, Default)]
+struct Record {
+    timestamp: u64,
+    delta: StatsDelta,
+}
+
+/// Cursor over a record payload
+struct Decoder<'a> {
+    data: &'a [u8],
+}
+
+impl<'a> Decoder<'a> {
+    fn take(&mut self, len: usize) -> Option<&'a [u8]> {
+        if self.data.len() < len {
+            return None;
+        }
+        let (head, rest) = self.data.split_at(len);
+        self.data = rest;
+        Some(head)
+    }
+
+    fn u16(&mut self) -> Option<u16> {
+        Some(u16::from_le_bytes(self.take(2)?.try_into().ok()?))
+    }
+
+    fn u32(&mut self) -> Option<u32> {
+        Some(u32::from_le_bytes(self.take(4)?.try_into().ok()?))
+    }
+
+    fn u64(&mut self) -> Option<u64> {
+        Some(u64::from_le_bytes(self.take(8)?.try_into().ok()?))
+    }
+
+    fn map(&mut self) -> Option<HashMap<String, u64>> {
+        let len = self.u32()? as usize;
+        let mut map = HashMap::with_capacity(len.min(self.data.len() / 10));
+        for _ in 0..len {
+            let key_len = self.u16()? as usize;
+            let key = std::str::from_utf8(self.take(key_len)?).ok()?.to_string();
+            map.insert(key, self.u64()?);
+        }
+        Some(map)
+    }
+}
+
+fn decode_payload(payload: &[u8]) -> Option<Record> {
+    let mut decoder = Decoder { data: payload };
+    let timestamp = decoder.u64()?;
+    let delta = StatsDelta {
+        total_requests: decoder.u64()?,
+        blocked_requests: decoder.u64()?,
+        allowed_requests: decoder.u64()?,
+        domains_blocked: decoder.map()?,
+        request_types: decoder.map()?,
+        ..StatsDelta::default()
+    };
+    decoder.data.is_empty().then_some(Record { timestamp, delta })
+}
+
+/// Decode the framed record at the start of `data`, returning it and its size
+fn decode_record(data: &[u8]) -> Option<(Record, usize)> {
+    let header = data.get(..RECORD_HEADER_BYTES)?;
+    let len = u32::from_le_bytes(header[..4].try_into().ok()?) as usize;
+    let sum = u32::from_le_bytes(header[4..].try_into().ok()?);
+    let payload = data.get(RECORD_HEADER_BYTES..RECORD_HEADER_BYTES + len)?;
+    if checksum(payload) != sum {
+        return None;
+    }
+    Some((decode_payload(payload)?, RECORD_HEADER_BYTES + len))
+}
+
+/// Append-only binary stats journal with snapshot compaction
+pub struct StatsJournal {
+    log_path: PathBuf,
+    snapshot_path: PathBuf,
+    log: File,
+    log_bytes: u64,
+    unsynced_bytes: usize,
+    last_sync: Instant,
+    totals: Stats,
+}
+
+impl StatsJournal {
+    /// Open the journal next to `stats_file`, replaying snapshot and log
+    ///
+    /// The log is `<stats_file>.log` and the snapshot `<stats_file>.snap`,
+    /// with the original extension replaced.
+    pub fn open(stats_file: &Path) -> Result<Self> {
+        let log_path = stats_file.with_extension("log");
+        let snapshot_path = stats_file.with_extension("snap");
+        if let Some(parent) = log_path.parent() {
+            fs::create_dir_all(parent)?;
+        }
+
+        let mut totals = read_snapshot(&snapshot_path).unwrap_or_else(|| {
+            if snapshot_path.exists() {
+                warn!("Ignoring unreadable stats snapshot {}", snapshot_path.display());
+            }
+            Stats::default()
+        });
+
+        let mut log = OpenOptions::new().read(true).append(true).create(true).open(&log_path)?;
+        let mut content = Vec::new();
+        log.read_to_end(&mut content)?;
+
+        let mut offset = 0;
+        let mut records = 0;
+        while let Some((record, size)) = decode_record(&content[offset..]) {
+            record.delta.apply_to(&mut totals);
+            totals.last_updated = record.timestamp;
+            offset += size;
+            records += 1;
+        }
+        if offset < content.len() {
+            warn!("Truncating {} bytes of torn stats log", content.len() - offset);
+            log.set_len(offset as u64)?;
+        }
+        debug!("Replayed {} stats records from {}", records, log_path.display());
+
+        Ok(Self {
+            log_path,
+            snapshot_path,
+            log,
+            log_bytes: offset as u64,
+            unsynced_bytes: 0,
+            last_sync: Instant::now(),
+            totals,
+        })
+    }
+
+    /// Get the lifetime totals including unsynced records
+    pub fn totals(&self) -> &Stats {
+        &self.totals
+    }
+
+    /// Write a delta to the log, leaving the sync for later
+    ///
+    /// A failed write is cut off again so later records still replay, and
+    /// the delta is not counted.
+    pub fn append(&mut self, delta: &StatsDelta) -> Result<()> {
+        if delta.is_empty() {
+            return Ok(());
+        }
+        let timestamp = TimeUtils::now_seconds();
+        let mut record = Vec::new();
+        Counters::from_delta(delta, timestamp).encode(&mut record);
+        if let Err(e) = self.log.write_all(&record) {
+            let _ = self.log.set_len(self.log_bytes);
+            return Err(write_failed(&self.log_path, e));
+        }
+
+        self.log_bytes += record.len() as u64;
+        self.unsynced_bytes += record.len();
+        delta.apply_to(&mut self.totals);
+        self.totals.last_updated = timestamp;
+        Ok(())
+    }
+
+    /// Get the number of written bytes waiting for a sync
+    pub fn unsynced_bytes(&self) -> usize {
+        self.unsynced_bytes
+    }
+
+    /// Sync written records if enough are unsynced or they are old enough
+    ///
+    /// Returns whether anything was synced.
+    pub fn flush_if_due(&mut self) -> Result<bool> {
+        let due = self.unsynced_bytes >= MAX_UNSYNCED_BYTES || self.last_sync.elapsed() >= SYNC_INTERVAL;
+        if !due || self.unsynced_bytes == 0 {
+            return Ok(false);
+        }
+        self.flush()?;
+        Ok(true)
+    }
+
+    /// Sync all written records
+    pub fn flush(&mut self) -> Result<()> {
+        self.last_sync = Instant::now();
+        if self.unsynced_bytes == 0 {
+            return Ok(());
+        }
+
+        self.log.sync_data().map_err(|e| write_failed(&self.log_path, e))?;
+        self.unsynced_bytes = 0;
+
+        if self.log_bytes >= COMPACT_THRESHOLD_BYTES {
+            self.compact()?;
+        }
+        Ok(())
+    }
+
+    /// Fold the log into a new snapshot and truncate it
+    pub fn compact(&mut self) -> Result<()> {
+        let mut content = Vec::with_capacity(16);
+        content.extend_from_slice(SNAPSHOT_MAGIC);
+        content.extend_from_slice(&SNAPSHOT_VERSION.to_le_bytes());
+        Counters::from_stats(&self.totals).encode(&mut content);
+
+        let tmp_path = self.snapshot_path.with_extension("snap.tmp");
+        let mut tmp = File::create(&tmp_path).map_err(|e| write_failed(&tmp_path, e))?;
+        tmp.write_all(&content).map_err(|e| write_failed(&tmp_path, e))?;
+        tmp.sync_all().map_err(|e| write_failed(&tmp_path, e))?;
+        fs::rename(&tmp_path, &self.snapshot_path).map_err(|e| write_failed(&self.snapshot_path, e))?;
+
+        self.log.set_len(0).map_err(|e| write_failed(&self.log_path, e))?;
+        self.log.sync_all().map_err(|e| write_failed(&self.log_path, e))?;
+        info!("Compacted {} bytes of stats log into snapshot", self.log_bytes);
+        self.log_bytes = 0;
+        self.unsynced_bytes = 0;
+        self.last_sync = Instant::now();
+        Ok(())
+    }
+
+    /// Render the totals as pretty JSON for humans
+    pub fn to_json(&self) -> Result<String> {
+        serde_json::to_string_pretty(&self.totals).map_err(|e| {
+            StatsError::SerializationError {
+                message: e.to_string(),
+            }
+            .into()
+        })
+    }
+}
+
+impl Drop for StatsJournal {
+    fn drop(&mut self) {
+        if let Err(e) = self.flush() {
+            warn!("Failed to flush stats journal: {}", e);
+        }
+    }
+}
+
+fn read_snapshot(path: &Path) -> Option<Stats> {
+    let content = fs::read(path).ok()?;
+    let rest = content.strip_prefix(SNAPSHOT_MAGIC)?;
+    let version = u32::from_le_bytes(rest.get(..4)?.try_into().ok()?);
+    if version != SNAPSHOT_VERSION {
+        return None;
+    }
+
+    let (record, _) = decode_record(&rest[4..])?;
+    let mut stats = Stats {
+        start_time: record.timestamp,
+        ..Stats::default()
+    };
+    record.delta.apply_to(&mut stats);
+    Some(stats)
+}
+
+fn write_failed(path: &Path, e: std::io::Error) -> crate::error::AuboError {
+    StatsError::WriteFailed {
+        path: path.display().to_string(),
+        reason: e.to_string(),
+    }
+    .into()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn delta(domain: &str, count: u64) -> StatsDelta {
+        let mut delta = StatsDelta {
+            total_requests: count,
+            blocked_requests: count,
+            ..Default::default()
+        };
+        delta.domains_blocked.insert(domain.to_string(), count);
+        delta.request_types.insert("dns".to_string(), count);
+        delta
+    }
+
+    #[test]
+    fn test_record_round_trip() {
+        let original = delta("ads.example.com", 3);
+        let mut buffer = Vec::new();
+        Counters::from_delta(&original, 1234).encode(&mut buffer);
+
+        let (record, size) = decode_record(&buffer).unwrap();
+        assert_eq!(size, buffer.len());
+        assert_eq!(record.timestamp, 1234);
+        assert_eq!(record.delta, original);
+
+        // Any corruption is detected by the checksum
+        buffer[RECORD_HEADER_BYTES + 3] ^= 0xff;
+        assert!(decode_record(&buffer).is_none());
+    }
+
+    #[test]
+    fn test_records_are_written_before_sync() {
+        let dir = tempfile::tempdir().unwrap();
+        let stats_file = dir.path().join("stats.json");
+
+        let mut journal = StatsJournal::open(&stats_file).unwrap();
+        journal.append(&delta("ads.example.com", 2)).unwrap();
+        journal.append(&StatsDelta::default()).unwrap();
+        assert!(journal.unsynced_bytes() > 0);
+        assert!(!journal.flush_if_due().unwrap());
+
+        // A companion killed before the sync still replays the record
+        let replayed = StatsJournal::open(&stats_file).unwrap();
+        assert_eq!(replayed.totals().total_requests, 2);
+
+        journal.flush().unwrap();
+        assert_eq!(journal.unsynced_bytes(), 0);
+    }
+
+    #[test]
+    fn test_replay_and_compaction() {
+        let dir = tempfile::tempdir().unwrap();
+        let stats_file = dir.path().join("stats.json");
+
+        {
+            let mut journal = StatsJournal::open(&stats_file).unwrap();
+            journal.append(&delta("ads.example.com", 2)).unwrap();
+            journal.flush().unwrap();
+            journal.compact().unwrap();
+            journal.append(&delta("ads.example.com", 1)).unwrap();
+            journal.append(&delta("tracker.net", 4)).unwrap();
+        }
+
+        let journal = StatsJournal::open(&stats_file).unwrap();
+        let totals = journal.totals();
+        assert_eq!(totals.total_requests, 7);
+        assert_eq!(totals.domains_blocked.get("ads.example.com"), Some(&3));
+        assert_eq!(totals.domains_blocked.get("tracker.net"), Some(&4));
+        assert!(journal.to_json().unwrap().contains("tracker.net"));
+    }
+
+    #[test]
+    fn test_torn_tail_is_truncated() {
+        let dir = tempfile::tempdir().unwrap();
+        let stats_file = dir.path().join("stats.json");
+        let log_path = stats_file.with_extension("log");
+
+        {
+            let mut journal = StatsJournal::open(&stats_file).unwrap();
+            journal.append(&delta("ads.example.com", 1)).unwrap();
+        }
+        let good_len = fs::metadata(&log_path).unwrap().len();
+
+        // Simulate a crash in the middle of a write
+        let mut log = OpenOptions::new().append(true).open(&log_path).unwrap();
+        log.write_all(&[42, 0, 0, 0, 1, 2]).unwrap();
+        drop(log);
+
+        let journal = StatsJournal::open(&stats_file).unwrap();
+        assert_eq!(journal.totals().total_requests, 1);
+        assert_eq!(fs::metadata(&log_path).unwrap().len(), good_len);
+    }
+}
@@ -19,10 +19,31 @@
 //! The system is built on several core components:
 //!
 //! - [`hooks`]: Network interception and ZygiskNext integration
+//! - [`inspect`]: TLS server names and HTTP URLs from the first write on a connection
+//! - [`budget`]: Per-lookup latency budget with fail-open circuit breaker
+//! - [`bpf`]: Optional kernel connect blocking with cgroup eBPF programs
 //! - [`filters`]: Filter list management and request analysis
 //! - [`engine`]: Core blocking engine and decision logic
+//! - [`degrade`]: Adaptive full, domains-only and cache-only matching under load
 //! - [`config`]: Configuration management and persistence
+//! - [`control`]: Control socket with Prometheus metrics, verdict explanations and commands
 //! - [`stats`]: Performance monitoring and statistics collection
+//! - [`cache`]: Verdict caching for repeated lookups
+//! - [`companion`]: Protocol between app processes and the root companion
+//! - [`pool`]: Work-stealing companion workers behind a bounded queue
+//! - [`shm`]: Shared-memory futex channel for companion requests
+//! - [`journal`]: Append-only binary stats persistence
+//! - [`status`]: Coalesced status and kernel-log reporting via the companion
+//! - [`timeseries`]: Downsampled minute, hour and day stats rings
+//! - [`upstream`]: Upstream DNS resolution latency, failures and slowest hosts
+//! - [`avoided`]: Estimated handshakes and bytes saved by blocking, per list
+//! - [`sketch`]: HyperLogLog distinct-host sketches
+//! - [`reqlog`]: Lock-free ring of recent lookups for detailed logging
+//! - [`slowlog`]: Reservoir of the slowest lookups with replayed stage times
+//! - [`compiler`]: Rule compilation and budgeted admission
+//! - [`shadow`]: Shadow evaluation of reloaded rules before apps swap them in
+//! - [`memory`]: Memory pressure monitoring, cache shedding and accounting
+//! - [`selfbench`]: On-device benchmark choosing the companion transport, workers and degradation target
 //!
 //! ## Safety
 //!
@@ -50,27 +71,68 @@
 )]
 #![deny(unsafe_op_in_unsafe_fn)]
 
+pub mod avoided;
+pub mod bpf;
+pub mod budget;
+pub mod cache;
+pub mod companion;
+pub mod compiler;
 pub mod config;
+pub mod control;
+pub mod degrade;
 pub mod engine;
 pub mod error;
 pub mod filters;
 pub mod hooks;
+pub mod inspect;
+pub mod journal;
+pub mod memory;
+pub mod pool;
+pub mod reqlog;
+pub mod selfbench;
+pub mod shadow;
+pub mod shm;
+pub mod sketch;
+pub mod slowlog;
 pub mod stats;
+pub mod status;
+pub mod timeseries;
+pub mod upstream;
 pub mod utils;
 pub mod zygisk;
 
 use std::sync::atomic::{AtomicBool, Ordering};
 use std::sync::Arc;
+use std::time::{Duration, Instant};
 
 use anyhow::Result;
-use log::{error, info, warn};
+use log::{debug, error, info, warn};
 use once_cell::sync::Lazy;
-use parking_lot::RwLock;
+use parking_lot::{Mutex, RwLock};
 
+use crate::bpf::ConnectFilter;
+use crate::budget::LOOKUP_BUDGET;
+use crate::companion::{Companion, CompanionClient, WARM_CACHE_ENTRIES};
 use crate::config::AuboConfig;
+use crate::control::{AppCommand, ControlServer, ControlUpdate, CONTROL_SOCKET_FILE};
 use crate::engine::FilterEngine;
 use crate::hooks::NetworkHooks;
-use crate::stats::StatsCollector;
+use crate::journal::StatsJournal;
+use crate::pool::WorkerPool;
+use crate::reqlog::RequestLog;
+use crate::stats::{StatsCollector, StatsDelta};
+use crate::status::{StatusBoard, StatusEvent};
+use crate::timeseries::TimeSeries;
+use crate::utils::PeriodicTask;
+
+/// How often an app hands its hottest verdicts to the companion
+const WARM_CACHE_SAVE_INTERVAL: Duration = Duration::from_secs(60);
+
+/// How often the companion writes out status and kernel-log lines
+const STATUS_FLUSH_INTERVAL: Duration = Duration::from_secs(30);
+
+/// How often the companion resolves newly blocked hosts for the connect filter
+const CONNECT_FILTER_REFRESH_INTERVAL: Duration = Duration::from_secs(10);
 
 /// Global instance of the aubo-rs system
 pub static AUBO_INSTANCE: Lazy<Arc<RwLock<Option<AuboSystem>>>> = 
@@ -79,6 +141,9 @@ pub static AUBO_INSTANCE: Lazy<Arc<RwLock<Option<AuboSystem>>>> =
 /// Global flag indicating if the system is initialized
 static INITIALIZED: AtomicBool = AtomicBool::new(false);
 
+/// Whether the companion reported its kernel connect filter attached
+static KERNEL_BLOCKS_CONNECTS: AtomicBool = AtomicBool::new(false);
+
 /// Main aubo-rs system that coordinates all components
 pub struct AuboSystem {
     /// Configuration manager
@@ -89,6 +154,10 @@ pub struct AuboSystem {
     network_hooks: Arc<NetworkHooks>,
     /// Statistics collector
     stats: Arc<StatsCollector>,
+    /// Connection to the companion process, if attached
+    companion: Mutex<Option<Arc<Mutex<CompanionClient>>>>,
+    /// Tasks started after the system was created
+    background_tasks: Mutex<Vec<PeriodicTask>>,
     /// Shutdown flag
     shutdown: AtomicBool,
 }
@@ -112,6 +181,8 @@ impl AuboSystem {
             filter_engine,
             network_hooks,
             stats,
+            companion: Mutex::new(None),
+            background_tasks: Mutex::new(Vec::new()),
             shutdown: AtomicBool::new(false),
         })
     }
@@ -140,6 +211,13 @@ impl AuboSystem {
         self.shutdown.store(true, Ordering::SeqCst);
         
         // Stop components in reverse order
+        for task in std::mem::take(&mut *self.background_tasks.lock()) {
+            task.stop();
+        }
+        if let Some(companion) = self.companion.lock().take() {
+            save_warm_cache(&self.filter_engine, &companion);
+            report_stats(&self.filter_engine, &self.stats, &companion);
+        }
         self.stats.stop_collection()?;
         self.filter_engine.stop_background_tasks()?;
         self.network_hooks.uninstall_hooks()?;
@@ -148,6 +226,60 @@ impl AuboSystem {
         Ok(())
     }
 
+    /// Attach the connection to the companion process
+    ///
+    /// The app's warm verdict cache is preloaded right away, so this should
+    /// run before hooks start answering lookups. From then on the hottest
+    /// verdicts are handed back to the companion periodically and on stop.
+    pub fn attach_companion(&self, mut client: CompanionClient) -> Result<()> {
+        let engine = &self.filter_engine;
+        if self.config.performance.companion_shared_memory {
+            if let Err(e) = client.open_shared_channel() {
+                debug!("Shared companion channel not available, using the socket: {}", e);
+            }
+        }
+        match client.load_warm_cache(engine.app_name(), engine.rules_fingerprint()) {
+            Ok(entries) => engine.preload_verdicts(&entries),
+            Err(e) => warn!("Failed to load warm verdict cache: {}", e),
+        }
+        status::kernel_log_once("Module loaded and attached to companion");
+        report_status(engine, &mut client);
+        let mut control_generation = match client.poll_control(None) {
+            Ok(update) => apply_control(engine, update),
+            Err(e) => {
+                debug!("Failed to poll control commands: {}", e);
+                None
+            }
+        };
+
+        let client = Arc::new(Mutex::new(client));
+        let task_engine = Arc::clone(&self.filter_engine);
+        let task_client = Arc::clone(&client);
+        let warm_task = PeriodicTask::spawn("aubo-warm", WARM_CACHE_SAVE_INTERVAL, move || {
+            save_warm_cache(&task_engine, &task_client);
+        })?;
+
+        let task_engine = Arc::clone(&self.filter_engine);
+        let task_stats = Arc::clone(&self.stats);
+        let task_client = Arc::clone(&client);
+        let mut log_cursor = 0;
+        let stats_task = PeriodicTask::spawn("aubo-stats", self.config.stats.collection_interval, move || {
+            report_stats(&task_engine, &task_stats, &task_client);
+            report_status(&task_engine, &mut task_client.lock());
+            match task_client.lock().poll_control(control_generation) {
+                Ok(update) => control_generation = apply_control(&task_engine, update),
+                Err(e) => debug!("Failed to poll control commands: {}", e),
+            }
+            if let Some(log) = task_engine.request_log() {
+                log_cursor = report_requests(&task_engine, log, log_cursor, &task_client);
+            }
+        })?;
+
+        *self.companion.lock() = Some(client);
+        self.background_tasks.lock().extend([warm_task, stats_task]);
+        Ok(())
+    }
+
     /// Check if the system is shutting down
     pub fn is_shutting_down(&self) -> bool {
         self.shutdown.load(Ordering::SeqCst)
@@ -174,6 +306,98 @@ impl AuboSystem {
     }
 }
 
+/// Hand the hottest verdicts of this process to the companion
+fn save_warm_cache(engine: &FilterEngine, companion: &Mutex<CompanionClient>) {
+    let entries = engine.warm_verdicts(WARM_CACHE_ENTRIES);
+    if entries.is_empty() {
+        return;
+    }
+
+    let count = entries.len();
+    match companion
+        .lock()
+        .store_warm_cache(engine.app_name(), engine.rules_fingerprint(), entries)
+    {
+        Ok(()) => debug!("Saved {} warm verdicts", count),
+        Err(e) => warn!("Failed to save warm verdict cache: {}", e),
+    }
+}
+
+/// Hand the stats recorded since the last report to the companion
+fn report_stats(engine: &FilterEngine, stats: &StatsCollector, companion: &Mutex<CompanionClient>) {
+    let mut delta = stats.take_delta();
+    let budget = LOOKUP_BUDGET.take_counts();
+    delta.merge(StatsDelta {
+        avoided: stats.take_avoided(|host| engine.block_list(host)),
+        slow_lookups: engine.take_slow_lookups(),
+        lookup_timeouts: budget.timeouts,
+        lookups_bypassed: budget.bypassed,
+        breaker_trips: budget.trips,
+        degraded_lookups: engine.take_degraded_lookups(),
+        ..StatsDelta::default()
+    });
+    if delta.is_empty() {
+        return;
+    }
+    delta.memory = Some(stats.memory_breakdown());
+
+    if let Err(e) = companion.lock().record_stats(engine.app_name(), delta.clone()) {
+        // Keep the counts for the next attempt
+        debug!("Failed to report stats: {}", e);
+        stats.requeue_delta(delta);
+    }
+}
+
+/// Run commands from the control socket, returning the generation to poll
+/// from next
+fn apply_control(engine: &FilterEngine, update: ControlUpdate) -> Option<u64> {
+    for command in update.commands {
+        match command {
+            AppCommand::Reload => {
+                if let Err(e) = engine.reload_rules() {
+                    warn!("Failed to reload rules: {}", e);
+                }
+            }
+            AppCommand::ClearCaches => engine.verdict_cache().clear(),
+        }
+    }
+    engine.set_monitor_only(update.modes.monitor_only);
+    KERNEL_BLOCKS_CONNECTS.store(update.kernel_blocks_connects, Ordering::Relaxed);
+    Some(update.generation)
+}
+
+/// Hand the queued status events to the companion
+fn report_status(engine: &FilterEngine, companion: &mut CompanionClient) {
+    let events = status::take_pending();
+    if events.is_empty() {
+        return;
+    }
+
+    if let Err(e) = companion.report_status(engine.app_name(), events.clone()) {
+        debug!("Failed to report status: {}", e);
+        status::requeue(events);
+    }
+}
+
+/// Hand the lookups logged since `cursor` to the companion
+///
+/// Returns the cursor for the next report. Records that could not be sent
+/// are retried until the ring overwrites them.
+fn report_requests(engine: &FilterEngine, log: &RequestLog, cursor: u64, companion: &Mutex<CompanionClient>) -> u64 {
+    let (records, next) = log.read_since(cursor);
+    if records.is_empty() {
+        return next;
+    }
+
+    match companion.lock().record_requests(engine.app_name(), records) {
+        Ok(()) => next,
+        Err(e) => {
+            debug!("Failed to report request log: {}", e);
+            cursor
+        }
+    }
+}
+
 /// Initialize the global aubo-rs system
 pub fn initialize(config: AuboConfig) -> Result<()> {
     if INITIALIZED.load(Ordering::SeqCst) {
@@ -181,6 +405,7 @@ pub fn initialize(config: AuboConfig) -> Result<()> {
         return Ok(());
     }
 
+    LOOKUP_BUDGET.configure(&config.hooks);
     let system = AuboSystem::new(config)?;
     system.start()?;
 
@@ -225,19 +450,42 @@ pub fn get_system() -> Option<Arc<RwLock<Option<AuboSystem>>>> {
 }
 
 /// Check if a request should be blocked
-/// 
-/// This is the main entry point for request filtering
+///
+/// This is the main entry point for request filtering. It answers within
+/// the lookup budget: a verdict that takes longer is dropped and the request
+/// goes through, see [`budget`]. The module's own lookups are never
+/// filtered, see [`hooks::internal_call`].
 pub fn should_block_request(url: &str, request_type: &str, origin: &str) -> bool {
-    if let Some(system_ref) = get_system() {
-        if let Some(system) = system_ref.read().as_ref() {
-            return system.filter_engine().should_block(url, request_type, origin);
-        }
+    if hooks::is_internal_call() {
+        return false;
     }
-    false
+    let Some(system_ref) = get_system() else {
+        return false;
+    };
+    let budget = &*LOOKUP_BUDGET;
+    if !budget.admit() {
+        return false;
+    }
+
+    let started = Instant::now();
+    let instance = match budget.limit() {
+        Some(limit) => system_ref.try_read_for(limit),
+        None => Some(system_ref.read()),
+    };
+    let Some(instance) = instance else {
+        budget.breach();
+        return false;
+    };
+    let verdict = match instance.as_ref() {
+        Some(system) => system.filter_engine().should_block(url, request_type, origin),
+        None => return false,
+    };
+    budget.record(started.elapsed()) && verdict
 }
 
 // C FFI exports for ZygiskNext integration
 use std::ffi::CStr;
+use std::net::{IpAddr, Ipv4Addr, Ipv6Addr};
 use std::os::raw::{c_char, c_int};
 
 /// Initialize aubo-rs from ZygiskNext context
@@ -249,7 +497,7 @@ pub fn initialize_from_zygisk() -> Result<()> {
     // Enhanced dmesg logging with priority markers
     log_to_dmesg("=== ZygiskNext module initialization started ===");
     log_to_dmesg(&format!("aubo-rs version: {}", env!("CARGO_PKG_VERSION")));
-    log_to_dmesg(&format!("Process ID: {}", std::process::id()));
+    debug!("Process ID: {}", std::process::id());
     
     // Log system information for debugging
     if let Ok(api_level) = std::env::var("ANDROID_API") {
@@ -259,7 +507,7 @@ pub fn initialize_from_zygisk() -> Result<()> {
     // Ensure data directory exists with proper permissions
     let data_dir = "/data/adb/aubo-rs";
     if let Err(e) = std::fs::create_dir_all(data_dir) {
-        log_to_dmesg(&format!("Failed to create data directory: {}", e));
+        log_error_to_dmesg(&format!("Failed to create data directory: {}", e));
     } else {
         log_to_dmesg("Data directory verified/created successfully");
     }
@@ -282,7 +530,7 @@ pub fn initialize_from_zygisk() -> Result<()> {
         },
         Err(e) => {
             warn!("Failed to load config from {}: {}", config_path, e);
-            log_to_dmesg(&format!("Config load failed: {} - creating default configuration", e));
+            log_error_to_dmesg(&format!("Config load failed: {} - creating default configuration", e));
             
             match create_default_config(config_path) {
                 Ok(config) => {
@@ -290,8 +538,9 @@ pub fn initialize_from_zygisk() -> Result<()> {
                     config
                 },
                 Err(e) => {
-                    log_to_dmesg(&format!("Failed to create default config: {}", e));
+                    log_error_to_dmesg(&format!("Failed to create default config: {}", e));
                     update_status_file("error", &format!("Configuration creation failed: {}", e));
+                    status::flush_unattached(std::path::Path::new(data_dir));
                     return Err(e);
                 }
             }
@@ -325,29 +574,124 @@ pub fn initialize_from_zygisk() -> Result<()> {
         }
         Err(e) => {
             error!("Failed to initialize aubo-rs: {}", e);
-            log_to_dmesg(&format!("=== INITIALIZATION FAILED: {} ===", e));
-            log_to_dmesg("aubo-rs module is not active - no ad-blocking will occur");
+            log_error_to_dmesg(&format!("=== INITIALIZATION FAILED: {} ===", e));
+            log_error_to_dmesg("aubo-rs module is not active - no ad-blocking will occur");
             update_status_file("error", &format!("Initialization failed: {}", e));
             
             // Provide debugging hints
-            log_to_dmesg("Debugging hints:");
-            log_to_dmesg("1. Check if ZygiskNext is properly installed and enabled");
-            log_to_dmesg("2. Verify /data/adb/aubo-rs directory permissions");
-            log_to_dmesg("3. Check logcat output: logcat -s aubo-rs");
-            log_to_dmesg("4. Run health check: sh /data/adb/aubo-rs/health_check.sh");
+            log_error_to_dmesg("Debugging hints:");
+            log_error_to_dmesg("1. Check if ZygiskNext is properly installed and enabled");
+            log_error_to_dmesg("2. Verify /data/adb/aubo-rs directory permissions");
+            log_error_to_dmesg("3. Check logcat output: logcat -s aubo-rs");
+            log_error_to_dmesg("4. Run health check: sh /data/adb/aubo-rs/health_check.sh");
             
+            // Without a system no companion is attached to deliver these
+            status::flush_unattached(std::path::Path::new(data_dir));
             Err(e)
         }
     }
 }
 
+/// Companion state shared by every app connection
+static COMPANION: Lazy<Arc<Companion>> = Lazy::new(|| {
+    let config_path = std::path::Path::new(config::DEFAULT_DATA_DIR).join(config::DEFAULT_CONFIG_FILE);
+    let config = AuboConfig::load_from_file(config_path).unwrap_or_default();
+    let mut companion = companion_with_stats(&config).with_explainer(Arc::new(config.clone()));
+    start_connect_filter(&mut companion, &config);
+    if config.filters.shadow_evaluation {
+        companion = companion.with_shadow_evaluation();
+    }
+    let board = StatusBoard::new(&config.general.data_dir, status::MODULE_PROP_PATH);
+    if let Err(e) = companion.start_status_board(board, STATUS_FLUSH_INTERVAL) {
+        error!("Failed to start status reporting: {}", e);
+    }
+    let performance = &config.performance;
+    let companion = match WorkerPool::new("aubo-worker", performance.worker_threads, performance.request_queue_size) {
+        Ok(pool) => companion.with_worker_pool(pool),
+        Err(e) => {
+            error!("Failed to start companion workers: {}", e);
+            companion
+        }
+    };
+    companion.report_status(vec![StatusEvent::KernelLog {
+        message: "Companion module loaded".to_string(),
+        once_per_boot: true,
+    }]);
+    Arc::new(companion)
+});
+
+/// Attach the kernel connect filter if configured
+///
+/// Without it, apps still block through their hooks; only connects made
+/// without libc go through.
+fn start_connect_filter(companion: &mut Companion, config: &AuboConfig) {
+    let performance = &config.performance;
+    if !performance.ebpf_connect_blocking {
+        return;
+    }
+    let filter = match ConnectFilter::attach(&performance.ebpf_cgroup_path, bpf::FILTER_CAPACITY) {
+        Ok(filter) => filter,
+        Err(e) => {
+            error!("Failed to attach connect filter: {}", e);
+            return;
+        }
+    };
+    let learn_addresses = performance.ebpf_learn_addresses;
+    if let Err(e) = companion.start_connect_filter(filter, learn_addresses, CONNECT_FILTER_REFRESH_INTERVAL) {
+        error!("Failed to start connect filter refresh: {}", e);
+    }
+}
+
+/// Create the companion with stats persistence as configured
+fn companion_with_stats(config: &AuboConfig) -> Companion {
+    let mut companion = Companion::new(&config.general.data_dir);
+    if config.stats.detailed_logging {
+        companion = companion.with_request_log(config.stats.max_log_entries);
+    }
+    if !config.stats.enabled {
+        return companion;
+    }
+
+    let interval = config.stats.collection_interval;
+    match StatsJournal::open(&config.stats.stats_file) {
+        Ok(journal) => {
+            if let Err(e) = companion.start_stats_journal(journal, interval) {
+                error!("Failed to start stats journal: {}", e);
+            }
+        }
+        Err(e) => error!("Failed to open stats journal: {}", e),
+    }
+
+    let series_path = config.stats.stats_file.with_extension("ts");
+    match TimeSeries::open(&series_path, config.stats.retention_period) {
+        Ok(series) => {
+            if let Err(e) = companion.start_time_series(series, interval) {
+                error!("Failed to start time series: {}", e);
+            }
+        }
+        Err(e) => error!("Failed to open time series: {}", e),
+    }
+    companion
+}
+
+/// Control socket of the companion, started with the first app connection
+static CONTROL_SERVER: Lazy<Option<ControlServer>> = Lazy::new(|| {
+    let path = COMPANION.data_dir().join(CONTROL_SOCKET_FILE);
+    match ControlServer::spawn(path, |line| COMPANION.execute_control(line)) {
+        Ok(server) => Some(server),
+        Err(e) => {
+            error!("Failed to start control socket: {}", e);
+            None
+        }
+    }
+});
+
 /// Handle companion process connection for ZygiskNext
-/// This function manages communication with Zygisk companion processes
+/// This function serves one app process until it disconnects
 pub fn handle_companion_connection(fd: i32) -> Result<()> {
     info!("Handling companion connection on fd: {}", fd);
-    log_to_dmesg(&format!("aubo-rs: Companion connection established on fd: {}", fd));
-    // For now, just acknowledge the connection
-    // In a full implementation, this would handle companion process communication
+    Lazy::force(&CONTROL_SERVER);
+    companion::serve_connection(&COMPANION, fd)?;
     Ok(())
 }
 
@@ -358,78 +702,30 @@ fn setup_logging() {
         .init();
 }
 
-/// Log message to dmesg for debugging
+/// Queue a kernel-log line for the companion
+///
+/// Apps cannot write `/dev/kmsg` cheaply or reliably, so the line is kept in
+/// memory and handed over with the next report. Load messages are the same
+/// in every process and only the first one of a boot is logged.
 fn log_to_dmesg(message: &str) {
-    use std::process::Command;
-    
-    let timestamp = chrono::Utc::now().format("%Y-%m-%d %H:%M:%S UTC");
-    let full_message = format!("aubo-rs: {}", message);
-    
-    // Method 1: Direct write to /dev/kmsg (most reliable for dmesg)
-    if let Err(_) = std::fs::write("/dev/kmsg", format!("<6>{}", full_message)) {
-        // Method 2: Try using log command as fallback
-        let _ = Command::new("log")
-            .arg("-p")
-            .arg("i")
-            .arg("-t")
-            .arg("aubo-rs")
-            .arg(message)
-            .output();
-    }
-    
-    // Method 3: Also log to logcat for runtime debugging
-    let _ = Command::new("logcat")
-        .arg("-d")
-        .arg("-s")
-        .arg("aubo-rs")
-        .output();
-    
-    // Append to debug log file with proper formatting
-    let log_entry = format!("{}: {}\n", timestamp, message);
-    if let Ok(existing) = std::fs::read_to_string("/data/adb/aubo-rs/logs/debug.log") {
-        let _ = std::fs::write("/data/adb/aubo-rs/logs/debug.log", format!("{}{}", existing, log_entry));
-    } else {
-        let _ = std::fs::write("/data/adb/aubo-rs/logs/debug.log", log_entry);
-    }
-    
-    // Ensure file permissions are correct
-    let _ = Command::new("chmod")
-        .arg("644")
-        .arg("/data/adb/aubo-rs/logs/debug.log")
-        .output();
+    debug!("{}", message);
+    status::kernel_log_once(message);
+}
+
+/// Queue a kernel-log line about a failure, logged by every process
+fn log_error_to_dmesg(message: &str) {
+    warn!("{}", message);
+    status::kernel_log(message);
 }
 
-/// Update module status file for debugging
+/// Queue a status change for the companion
 fn update_status_file(status: &str, message: &str) {
-    let timestamp = chrono::Utc::now().format("%Y-%m-%d %H:%M:%S UTC");
-    
-    // Get additional system information
-    let hook_count = get_active_hook_count();
-    let filter_count = get_loaded_filter_count();
-    let uptime = std::fs::read_to_string("/proc/uptime")
-        .unwrap_or_default()
-        .split_whitespace()
-        .next()
-        .unwrap_or("unknown")
-        .to_string();
-    
-    let status_content = format!(
-        "status={}\ntime={}\nmessage={}\nversion={}\nuptime={}\nhooks_active={}\nfilters_loaded={}\nlast_update={}\nlib_path=/data/adb/modules/aubo_rs/lib/aubo_rs.so\nconfig_path=/data/adb/aubo-rs/aubo-rs.toml\ndebug_log=/data/adb/aubo-rs/debug.log\nprocess_id={}\n",
-        status,
-        timestamp,
-        message,
-        env!("CARGO_PKG_VERSION"),
-        uptime,
-        hook_count,
-        filter_count,
-        timestamp,
-        std::process::id()
-    );
-    
-    let _ = std::fs::write("/data/adb/aubo-rs/status.txt", status_content);
-    
-    // Also update module.prop if possible
-    update_module_prop_status(status, message);
+    status::queue(StatusEvent::Status {
+        status: status.to_string(),
+        message: message.to_string(),
+        hooks_active: get_active_hook_count(),
+        filters_loaded: get_loaded_filter_count(),
+    });
 }
 
 /// Get count of active hooks (placeholder - will be implemented with actual hook tracking)
@@ -454,85 +750,6 @@ fn get_loaded_filter_count() -> u32 {
     }
 }
 
-/// Update module.prop with current status and dynamic description
-fn update_module_prop_status(status: &str, message: &str) {
-    let module_prop_path = "/data/adb/modules/aubo_rs/module.prop";
-    if let Ok(content) = std::fs::read_to_string(module_prop_path) {
-        // Get current system information for dynamic description
-        let hooks_status = if status == "running" { "✅" } else { "❌" };
-        let filter_status = if status == "running" { "✅" } else { "❌" };
-        let zygisk_status = if std::path::Path::new("/data/adb/modules/zygisksu").exists() { "✅" } else { "❌" };
-        let library_status = if std::path::Path::new("/data/adb/modules/aubo_rs/lib/aubo_rs.so").exists() { "✅" } else { "❌" };
-        
-        // Get blocked count from stats if available
-        let blocked_count = if let Some(system_ref) = get_system() {
-            if let Some(system) = system_ref.read().as_ref() {
-                let stats = system.stats().get_stats();
-                stats.blocked_requests.to_string()
-            } else {
-                "0".to_string()
-            }
-        } else {
-            "0".to_string()
-        };
-        
-        // Detect root method
-        let root_method = if std::path::Path::new("/data/adb/modules/magisk_busybox").exists() || 
-                             std::path::Path::new("/system/xbin/magisk").exists() {
-            "Magisk"
-        } else if std::path::Path::new("/data/adb/modules/kernelsu").exists() || 
-                  std::path::Path::new("/system/bin/ksu").exists() {
-            "KernelSU"
-        } else if std::path::Path::new("/data/adb/modules/apatch").exists() || 
-                  std::path::Path::new("/system/bin/apd").exists() {
-            "APatch"
-        } else {
-            "Unknown"
-        };
-        
-        // Create dynamic description similar to ZygiskNext format
-        let dynamic_desc = format!(
-            "[{}Network Hooks {}Ad Filters {}ZygiskNext {}Library. Root: {}, {} blocked] System-wide ad-blocker using Rust and ZygiskNext",
-            hooks_status, filter_status, zygisk_status, library_status, root_method, blocked_count
-        );
-        
-        // Update description line
-        let lines: Vec<&str> = content.lines().collect();
-        let mut new_content = String::new();
-        let mut in_runtime_section = false;
-        
-        for line in lines {
-            if line.starts_with("# Runtime Status") {
-                in_runtime_section = true;
-                break;
-            }
-            if line.starts_with("description=") {
-                new_content.push_str(&format!("description={}\n", dynamic_desc));
-            } else if !in_runtime_section {
-                new_content.push_str(line);
-                new_content.push('\n');
-            }
-        }
-        
-        // Add current runtime status
-        new_content.push_str(&format!(
-            "\n# Runtime Status\nruntimeStatus={}\nruntimeMessage={}\nruntimeUpdate={}\nruntimeActive={}\nhooksActive={}\nfiltersActive={}\nzygiskActive={}\nlibraryActive={}\nblockedTotal={}\nrootMethod={}\n",
-            status,
-            message.replace('\n', " "),
-            chrono::Utc::now().format("%Y-%m-%d %H:%M:%S UTC"),
-            if status == "running" { "true" } else { "false" },
-            hooks_status,
-            filter_status,
-            zygisk_status,
-            library_status,
-            blocked_count,
-            root_method
-        ));
-        
-        let _ = std::fs::write(module_prop_path, new_content);
-    }
-}
-
 /// Create default configuration with fallback values
 fn create_default_config(config_path: &str) -> Result<AuboConfig> {
     let config = AuboConfig::default();
@@ -566,16 +783,15 @@ pub unsafe extern "C" fn aubo_initialize(config_path: *const c_char) -> c_int {
         }
     };
 
-    match AuboConfig::load_from_file(config_path) {
-        Ok(config) => match initialize(config) {
-            Ok(_) => 0,
-            Err(e) => {
-                error!("Failed to initialize aubo-rs: {}", e);
-                -1
-            }
-        },
+    let result = AuboConfig::load_from_file(config_path).map_err(anyhow::Error::from);
+    match result.and_then(initialize) {
+        Ok(_) => 0,
         Err(e) => {
-            error!("Failed to load config from {}: {}", config_path, e);
+            error!("Failed to initialize aubo-rs: {}", e);
+            status::kernel_log(format!("Failed to initialize from {}: {}", config_path, e));
+            update_status_file("error", &format!("Initialization failed: {}", e));
+            // The module gives up without attaching the companion
+            status::flush_unattached(std::path::Path::new(config::DEFAULT_DATA_DIR));
             -1
         }
     }
@@ -631,3 +847,264 @@ pub unsafe extern "C" fn aubo_should_block_request(
         0
     }
 }
+
+/// C-compatible report of a resolution done by the real resolver
+///
+/// Called by the DNS hooks after a lookup that was not blocked, with the
+/// time the real resolver took and whether it failed.
+#[no_mangle]
+#[export_name = "aubo_record_resolution"]
+pub unsafe extern "C" fn aubo_record_resolution(host: *const c_char, elapsed_ns: u64, failed: c_int) {
+    if host.is_null() || hooks::is_internal_call() {
+        return;
+    }
+    // SAFETY: the hook passes the NUL-terminated host it was called with
+    let Ok(host) = unsafe { CStr::from_ptr(host) }.to_str() else {
+        return;
+    };
+
+    if let Some(system_ref) = get_system() {
+        if let Some(system) = system_ref.read().as_ref() {
+            system.stats().record_resolution(host, Duration::from_nanos(elapsed_ns), failed != 0);
+        }
+    }
+}
+
+/// Read the IP address of a socket address
+///
+/// # Safety
+///
+/// `addr` must be null or point to at least `len` readable bytes.
+unsafe fn sockaddr_ip(addr: *const libc::sockaddr, len: libc::socklen_t) -> Option<IpAddr> {
+    if addr.is_null() {
+        return None;
+    }
+    let len = len as usize;
+    // SAFETY: the family is the first field and the caller vouches for len
+    // bytes; each variant is only read when len covers its struct
+    unsafe {
+        match (*addr).sa_family as c_int {
+            libc::AF_INET if len >= std::mem::size_of::<libc::sockaddr_in>() => {
+                let addr = std::ptr::read_unaligned(addr as *const libc::sockaddr_in);
+                Some(IpAddr::V4(Ipv4Addr::from(u32::from_be(addr.sin_addr.s_addr))))
+            }
+            libc::AF_INET6 if len >= std::mem::size_of::<libc::sockaddr_in6>() => {
+                let addr = std::ptr::read_unaligned(addr as *const libc::sockaddr_in6);
+                Some(IpAddr::V6(Ipv6Addr::from(addr.sin6_addr.s6_addr)))
+            }
+            _ => None,
+        }
+    }
+}
+
+/// C-compatible report of the addresses an allowed resolution returned
+///
+/// Called by `getaddrinfo` after the real resolver succeeded, so connects
+/// to these addresses can be joined to `host`.
+#[no_mangle]
+#[export_name = "aubo_record_addresses"]
+pub unsafe extern "C" fn aubo_record_addresses(host: *const c_char, res: *const libc::addrinfo) {
+    if host.is_null() || res.is_null() || hooks::is_internal_call() {
+        return;
+    }
+    // SAFETY: the hook passes the NUL-terminated host it was called with
+    let Ok(host) = unsafe { CStr::from_ptr(host) }.to_str() else {
+        return;
+    };
+
+    let mut addresses = Vec::new();
+    let mut entry = res;
+    while !entry.is_null() {
+        // SAFETY: the list comes straight from getaddrinfo and is not freed yet
+        let info = unsafe { &*entry };
+        // SAFETY: getaddrinfo sets ai_addrlen to the size of ai_addr
+        addresses.extend(unsafe { sockaddr_ip(info.ai_addr, info.ai_addrlen) });
+        entry = info.ai_next;
+    }
+
+    if let Some(system_ref) = get_system() {
+        if let Some(system) = system_ref.read().as_ref() {
+            system.stats().work_avoided().record_addresses(host, addresses);
+        }
+    }
+}
+
+/// C-compatible report of a connect
+///
+/// Returns 1 if the address belongs to a resolved host, in which case the
+/// hooks report the bytes `fd` moved when it is closed, 0 otherwise.
+#[no_mangle]
+#[export_name = "aubo_record_connect"]
+pub unsafe extern "C" fn aubo_record_connect(fd: c_int, addr: *const libc::sockaddr, len: libc::socklen_t) -> c_int {
+    if hooks::is_internal_call() {
+        return 0;
+    }
+    // SAFETY: the hook passes the address connect was called with
+    let Some(address) = (unsafe { sockaddr_ip(addr, len) }) else {
+        return 0;
+    };
+
+    if let Some(system_ref) = get_system() {
+        if let Some(system) = system_ref.read().as_ref() {
+            return system.stats().work_avoided().record_connect(fd, address) as c_int;
+        }
+    }
+    0
+}
+
+/// C-compatible report of the bytes a tracked connection moved
+///
+/// Called by the `close` hook for sockets `aubo_record_connect` accepted,
+/// with the bytes sent and received over the connection.
+#[no_mangle]
+#[export_name = "aubo_record_transfer"]
+pub extern "C" fn aubo_record_transfer(fd: c_int, bytes: u64) {
+    if let Some(system_ref) = get_system() {
+        if let Some(system) = system_ref.read().as_ref() {
+            system.stats().work_avoided().record_transfer(fd, bytes);
+        }
+    }
+}
+
+/// C-compatible check whether the `connect` and `close` hooks are needed
+///
+/// Returns 0 when the attached companion reported its kernel connect
+/// filter in place and first writes are not inspected, so the inline hooks
+/// only need to cover DNS. Call it after `aubo_attach_companion`.
+#[no_mangle]
+#[export_name = "aubo_connect_hooks_needed"]
+pub extern "C" fn aubo_connect_hooks_needed() -> c_int {
+    if let Some(system_ref) = get_system() {
+        if let Some(system) = system_ref.read().as_ref() {
+            let kernel_blocks = KERNEL_BLOCKS_CONNECTS.load(Ordering::Relaxed);
+            return (!kernel_blocks || system.config().hooks.deep_inspection) as c_int;
+        }
+    }
+    1
+}
+
+/// C-compatible check whether the first write on each connection is
+/// inspected
+#[no_mangle]
+#[export_name = "aubo_deep_inspection_enabled"]
+pub extern "C" fn aubo_deep_inspection_enabled() -> c_int {
+    if let Some(system_ref) = get_system() {
+        if let Some(system) = system_ref.read().as_ref() {
+            return system.config().hooks.deep_inspection as c_int;
+        }
+    }
+    0
+}
+
+/// C-compatible inspection of the first write on a connection
+///
+/// Called once per connected socket by the write hooks with the bytes of
+/// its first write, of which at most `hooks.max_request_size` are parsed.
+/// Returns 1 if they open a TLS handshake with a blocked server or an HTTP
+/// request for a blocked URL, in which case the hook fails the write.
+#[no_mangle]
+#[export_name = "aubo_inspect_first_write"]
+pub unsafe extern "C" fn aubo_inspect_first_write(data: *const u8, len: usize) -> c_int {
+    if data.is_null() || hooks::is_internal_call() {
+        return 0;
+    }
+    let Some(limit) = get_system().and_then(|system_ref| {
+        system_ref.read().as_ref().map(|system| system.config().hooks.max_request_size)
+    }) else {
+        return 0;
+    };
+    // SAFETY: the hook passes the buffer and length the app is writing
+    let data = unsafe { std::slice::from_raw_parts(data, len.min(limit)) };
+    match inspect::inspect_first_write(data).lookup() {
+        Some((url, request_type)) => should_block_request(&url, request_type, "first-write") as c_int,
+        None => 0,
+    }
+}
+
+/// C-compatible companion attach function
+///
+/// Takes ownership of `fd`, a socket returned by `connectCompanion`. A
+/// negative `fd` means the companion is unavailable; queued status events
+/// are then written out directly.
+#[no_mangle]
+#[export_name = "aubo_attach_companion"]
+pub unsafe extern "C" fn aubo_attach_companion(fd: c_int) -> c_int {
+    let data_dir = get_system()
+        .and_then(|system_ref| system_ref.read().as_ref().map(|system| system.config().general.data_dir.clone()))
+        .unwrap_or_else(|| config::DEFAULT_DATA_DIR.into());
+    if fd < 0 {
+        status::flush_unattached(&data_dir);
+        return -1;
+    }
+
+    // SAFETY: the caller transfers ownership of the connected socket
+    let client = match unsafe { CompanionClient::from_raw_fd(fd) } {
+        Ok(client) => client,
+        Err(e) => {
+            error!("Failed to set up companion connection: {}", e);
+            status::flush_unattached(&data_dir);
+            return -1;
+        }
+    };
+
+    if let Some(system_ref) = get_system() {
+        if let Some(system) = system_ref.read().as_ref() {
+            return match system.attach_companion(client) {
+                Ok(()) => 0,
+                Err(e) => {
+                    error!("Failed to attach companion: {}", e);
+                    status::flush_unattached(&data_dir);
+                    -1
+                }
+            };
+        }
+    }
+    status::flush_unattached(&data_dir);
+    -1
+}
+
+/// C-compatible self-benchmark, run by `aubo-bench` at install
+///
+/// Benchmarks the operating modes on this device and saves the fastest
+/// configuration to `config_path`. The report, or the error, is copied to
+/// `report` as a NUL-terminated string cut to `report_len` bytes.
+#[no_mangle]
+#[export_name = "aubo_self_benchmark"]
+pub unsafe extern "C" fn aubo_self_benchmark(config_path: *const c_char, report: *mut c_char, report_len: usize) -> c_int {
+    if config_path.is_null() {
+        return -1;
+    }
+    // SAFETY: the caller passes a NUL-terminated path
+    let Ok(config_path) = unsafe { CStr::from_ptr(config_path) }.to_str() else {
+        return -1;
+    };
+    let (status, text) = match selfbench::run_and_apply(std::path::Path::new(config_path)) {
+        Ok(bench) => (0, bench.render()),
+        Err(e) => {
+            error!("Self-benchmark failed: {}", e);
+            (-1, format!("error: {}\n", e))
+        }
+    };
+    if !report.is_null() && report_len > 0 {
+        let len = text.len().min(report_len - 1);
+        // SAFETY: the caller passes a buffer of at least `report_len` bytes
+        unsafe {
+            std::ptr::copy_nonoverlapping(text.as_ptr(), report.cast::<u8>(), len);
+            *report.add(len) = 0;
+        }
+    }
+    status
+}
+
+/// C-compatible companion entry point, run inside the companion process
+#[no_mangle]
+#[export_name = "aubo_companion_serve"]
+pub unsafe extern "C" fn aubo_companion_serve(fd: c_int) -> c_int {
+    match handle_companion_connection(fd) {
+        Ok(()) => 0,
+        Err(e) => {
+            error!("Companion connection failed: {}", e);
+            -1
+        }
+    }
+}
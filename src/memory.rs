@@ -0,0 +1,442 @@
+//! Memory pressure monitoring for aubo-rs
+//!
+//! The blocker runs inside every hooked app, so it must give memory back
+//! before the device starts killing processes. This module samples Linux PSI
+//! (`/proc/pressure/memory`), system memory availability and the process RSS,
+//! and classifies the result into a [`PressureLevel`] that the engine uses to
+//! shed caches. Process RSS cannot say what the engine itself costs, so
+//! structures also report their own size through [`MemoryBreakdown`].
+
+use std::collections::{HashMap, HashSet};
+use std::fs;
+use std::mem::size_of;
+use std::sync::atomic::{AtomicU32, AtomicU64, AtomicU8, Ordering};
+
+use serde::{Deserialize, Serialize};
+
+use crate::config::AuboConfig;
+use crate::utils::MemoryUtils;
+
+/// Path of the memory PSI file
+pub const PSI_MEMORY_PATH: &str = "/proc/pressure/memory";
+
+/// Path of the system memory summary
+pub const MEMINFO_PATH: &str = "/proc/meminfo";
+
+/// Consecutive calmer samples required before the level is relaxed
+const RELAX_SAMPLES: u32 = 3;
+
+/// Allowance for stats, buffers and everything outside rules and caches
+pub const RUNTIME_RESERVE_BYTES: usize = 4 * 1024 * 1024;
+
+/// Estimated heap cost of one verdict cache entry
+pub const CACHE_ENTRY_BYTES: usize = 96;
+
+/// Bytes of `general.max_memory_mb` left for compiled rules
+///
+/// The verdict cache and a fixed runtime reserve are set aside first so that
+/// a full rule set plus a full cache still fits the configured budget.
+pub fn rule_budget_bytes(config: &AuboConfig) -> usize {
+    let total = (config.general.max_memory_mb as usize).saturating_mul(1024 * 1024);
+    let cache = config.performance.filter_cache_size.saturating_mul(CACHE_ENTRY_BYTES);
+    total.saturating_sub(cache).saturating_sub(RUNTIME_RESERVE_BYTES)
+}
+
+/// Bytes attributed to one structure or filter list
+#[derive(Debug, Clone, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub struct MemoryUsage {
+    /// Structure or list name
+    pub name: String,
+    /// Heap bytes owned by the structure
+    pub heap_bytes: u64,
+    /// Bytes of file-backed or anonymous mappings owned by the structure
+    pub mapped_bytes: u64,
+}
+
+/// Engine memory broken down by structure and by filter list
+///
+/// List entries are the share of the rule structures attributed to each
+/// list, so they overlap with the structure entries and are not summed into
+/// the totals.
+#[derive(Debug, Clone, Default, PartialEq, Eq, Serialize, Deserialize)]
+pub struct MemoryBreakdown {
+    /// Per-structure usage
+    pub structures: Vec<MemoryUsage>,
+    /// Per-list usage
+    pub lists: Vec<MemoryUsage>,
+}
+
+impl MemoryBreakdown {
+    /// Add or replace the entry for a structure
+    pub fn set_structure(&mut self, name: &str, heap_bytes: usize, mapped_bytes: usize) {
+        set_usage(&mut self.structures, name, heap_bytes, mapped_bytes);
+    }
+
+    /// Add or replace the entry for a filter list
+    pub fn set_list(&mut self, name: &str, heap_bytes: usize, mapped_bytes: usize) {
+        set_usage(&mut self.lists, name, heap_bytes, mapped_bytes);
+    }
+
+    /// Get the entry for a structure
+    pub fn structure(&self, name: &str) -> Option<&MemoryUsage> {
+        self.structures.iter().find(|usage| usage.name == name)
+    }
+
+    /// Total heap bytes across structures
+    pub fn total_heap_bytes(&self) -> u64 {
+        self.structures.iter().map(|usage| usage.heap_bytes).sum()
+    }
+
+    /// Total mapped bytes across structures
+    pub fn total_mapped_bytes(&self) -> u64 {
+        self.structures.iter().map(|usage| usage.mapped_bytes).sum()
+    }
+
+    /// Heap bytes used by the breakdown itself
+    pub fn heap_bytes(&self) -> usize {
+        [&self.structures, &self.lists]
+            .iter()
+            .map(|entries| {
+                entries.capacity() * size_of::<MemoryUsage>()
+                    + entries.iter().map(|usage| usage.name.capacity()).sum::<usize>()
+            })
+            .sum()
+    }
+}
+
+fn set_usage(entries: &mut Vec<MemoryUsage>, name: &str, heap_bytes: usize, mapped_bytes: usize) {
+    let usage = MemoryUsage {
+        name: name.to_string(),
+        heap_bytes: heap_bytes as u64,
+        mapped_bytes: mapped_bytes as u64,
+    };
+    match entries.iter_mut().find(|entry| entry.name == name) {
+        Some(entry) => *entry = usage,
+        None => entries.push(usage),
+    }
+}
+
+/// Heap bytes of a hashbrown table with the given capacity and slot size
+///
+/// Each slot costs its element plus one control byte.
+pub fn hash_table_bytes(capacity: usize, slot_bytes: usize) -> usize {
+    capacity * (slot_bytes + 1)
+}
+
+/// Heap bytes of a set of owned strings, including the strings
+pub fn string_set_heap_bytes<S>(set: &HashSet<String, S>) -> usize {
+    hash_table_bytes(set.capacity(), size_of::<String>())
+        + set.iter().map(|value| value.capacity()).sum::<usize>()
+}
+
+/// Heap bytes of a map keyed by owned strings, including the keys
+pub fn string_map_heap_bytes<V, S>(map: &HashMap<String, V, S>) -> usize {
+    hash_table_bytes(map.capacity(), size_of::<(String, V)>())
+        + map.keys().map(|key| key.capacity()).sum::<usize>()
+}
+
+/// Memory pressure level
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+#[repr(u8)]
+pub enum PressureLevel {
+    /// No pressure, caches run at their configured size
+    Normal = 0,
+    /// Some tasks are stalling on memory, cold cache tiers are dropped
+    Moderate = 1,
+    /// The system is thrashing or we exceeded our budget, caches are released
+    Critical = 2,
+}
+
+impl PressureLevel {
+    fn from_u8(value: u8) -> Self {
+        match value {
+            0 => PressureLevel::Normal,
+            1 => PressureLevel::Moderate,
+            _ => PressureLevel::Critical,
+        }
+    }
+}
+
+/// Ten-second PSI averages, in percent of wall time
+#[derive(Debug, Clone, Copy, PartialEq, Default)]
+pub struct PsiStats {
+    /// Share of time at least one task stalled on memory
+    pub some_avg10: f32,
+    /// Share of time all non-idle tasks stalled on memory
+    pub full_avg10: f32,
+}
+
+/// Parse the contents of a PSI file
+pub fn parse_psi(content: &str) -> Option<PsiStats> {
+    let mut stats = PsiStats::default();
+    let mut found = false;
+
+    for line in content.lines() {
+        let mut fields = line.split_whitespace();
+        let target = match fields.next() {
+            Some("some") => &mut stats.some_avg10,
+            Some("full") => &mut stats.full_avg10,
+            _ => continue,
+        };
+
+        if let Some(value) = fields.find_map(|field| field.strip_prefix("avg10=")) {
+            *target = value.parse().ok()?;
+            found = true;
+        }
+    }
+
+    found.then_some(stats)
+}
+
+/// Read a `<key>: <value> kB` entry from `/proc/meminfo` contents
+fn meminfo_kb(content: &str, key: &str) -> Option<u64> {
+    content
+        .lines()
+        .find_map(|line| line.strip_prefix(key)?.strip_prefix(':'))
+        .and_then(|rest| rest.split_whitespace().next())
+        .and_then(|value| value.parse().ok())
+}
+
+/// A single observation of the memory state
+#[derive(Debug, Clone, Default)]
+pub struct MemorySample {
+    /// PSI averages, if the kernel exposes them
+    pub psi: Option<PsiStats>,
+    /// Total system memory in kB
+    pub mem_total_kb: u64,
+    /// Memory available without swapping in kB
+    pub mem_available_kb: u64,
+    /// Resident set size of this process in bytes
+    pub rss_bytes: u64,
+}
+
+impl MemorySample {
+    /// Sample the current memory state from procfs
+    pub fn read() -> Self {
+        let psi = fs::read_to_string(PSI_MEMORY_PATH)
+            .ok()
+            .and_then(|content| parse_psi(&content));
+        let meminfo = fs::read_to_string(MEMINFO_PATH).unwrap_or_default();
+
+        Self {
+            psi,
+            mem_total_kb: meminfo_kb(&meminfo, "MemTotal").unwrap_or(0),
+            mem_available_kb: meminfo_kb(&meminfo, "MemAvailable").unwrap_or(0),
+            rss_bytes: MemoryUtils::get_memory_usage().unwrap_or(0),
+        }
+    }
+
+    /// Fraction of system memory in use, if known
+    pub fn used_ratio(&self) -> Option<f32> {
+        if self.mem_total_kb == 0 {
+            return None;
+        }
+        let available = self.mem_available_kb.min(self.mem_total_kb);
+        Some(1.0 - available as f32 / self.mem_total_kb as f32)
+    }
+}
+
+/// Tracks memory pressure and decides when caches should shrink or recover
+#[derive(Debug)]
+pub struct MemoryMonitor {
+    /// PSI avg10 percentage considered pressure
+    psi_threshold: f32,
+    /// System memory usage ratio considered pressure
+    usage_threshold: f32,
+    /// RSS growth allowed over the baseline before we are over budget
+    rss_budget_bytes: u64,
+    /// RSS observed when the monitor was created, i.e. before our caches grew
+    baseline_rss: AtomicU64,
+    level: AtomicU8,
+    calm_samples: AtomicU32,
+}
+
+impl MemoryMonitor {
+    /// Create a monitor using the configured thresholds
+    pub fn new(config: &AuboConfig) -> Self {
+        Self {
+            psi_threshold: config.performance.memory_psi_threshold,
+            usage_threshold: config.performance.memory_pressure_threshold,
+            rss_budget_bytes: config.general.max_memory_mb * 1024 * 1024,
+            baseline_rss: AtomicU64::new(MemoryUtils::get_memory_usage().unwrap_or(0)),
+            level: AtomicU8::new(PressureLevel::Normal as u8),
+            calm_samples: AtomicU32::new(0),
+        }
+    }
+
+    /// Classify a sample without updating the monitor state
+    pub fn classify(&self, sample: &MemorySample) -> PressureLevel {
+        // In app processes RSS belongs mostly to the app, so only growth
+        // since start-up is charged against our budget
+        let baseline = self.baseline_rss.load(Ordering::Relaxed);
+        let rss_growth = sample.rss_bytes.saturating_sub(baseline);
+        let psi = sample.psi.unwrap_or_default();
+
+        if psi.full_avg10 >= self.psi_threshold || rss_growth >= self.rss_budget_bytes {
+            return PressureLevel::Critical;
+        }
+
+        let usage_high = sample
+            .used_ratio()
+            .map_or(false, |ratio| ratio >= self.usage_threshold);
+        if psi.some_avg10 >= self.psi_threshold || usage_high {
+            return PressureLevel::Moderate;
+        }
+
+        PressureLevel::Normal
+    }
+
+    /// Feed a sample and return the new level if it changed
+    ///
+    /// Escalation is immediate; relaxing requires several calmer samples in a
+    /// row so caches are not rebuilt while pressure is oscillating.
+    pub fn update(&self, sample: &MemorySample) -> Option<PressureLevel> {
+        let observed = self.classify(sample);
+        let current = self.level();
+
+        if observed > current {
+            self.calm_samples.store(0, Ordering::Relaxed);
+            self.level.store(observed as u8, Ordering::Relaxed);
+            return Some(observed);
+        }
+
+        if observed == current {
+            self.calm_samples.store(0, Ordering::Relaxed);
+            return None;
+        }
+
+        if self.calm_samples.fetch_add(1, Ordering::Relaxed) + 1 < RELAX_SAMPLES {
+            return None;
+        }
+
+        self.calm_samples.store(0, Ordering::Relaxed);
+        self.level.store(observed as u8, Ordering::Relaxed);
+        Some(observed)
+    }
+
+    /// Get the current pressure level
+    pub fn level(&self) -> PressureLevel {
+        PressureLevel::from_u8(self.level.load(Ordering::Relaxed))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const PSI_CALM: &str = "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n\
+                            full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n";
+    const PSI_SOME: &str = "some avg10=25.50 avg60=10.00 avg300=2.00 total=123\n\
+                            full avg10=1.00 avg60=0.50 avg300=0.10 total=45\n";
+    const PSI_FULL: &str = "some avg10=60.00 avg60=40.00 avg300=20.00 total=999\n\
+                            full avg10=35.00 avg60=20.00 avg300=5.00 total=555\n";
+
+    fn sample(psi: &str, rss_bytes: u64) -> MemorySample {
+        MemorySample {
+            psi: parse_psi(psi),
+            mem_total_kb: 4 * 1024 * 1024,
+            mem_available_kb: 2 * 1024 * 1024,
+            rss_bytes,
+        }
+    }
+
+    fn test_monitor() -> MemoryMonitor {
+        let monitor = MemoryMonitor::new(&AuboConfig::default());
+        monitor.baseline_rss.store(0, Ordering::Relaxed);
+        monitor
+    }
+
+    #[test]
+    fn test_parse_psi() {
+        let stats = parse_psi(PSI_SOME).unwrap();
+        assert_eq!(stats.some_avg10, 25.5);
+        assert_eq!(stats.full_avg10, 1.0);
+
+        // Older kernels only report the "some" line
+        let stats = parse_psi("some avg10=3.00 avg60=1.00 avg300=0.00 total=7").unwrap();
+        assert_eq!(stats.some_avg10, 3.0);
+        assert_eq!(stats.full_avg10, 0.0);
+
+        assert!(parse_psi("").is_none());
+        assert!(parse_psi("some avg10=abc").is_none());
+    }
+
+    #[test]
+    fn test_meminfo_parsing() {
+        let content = "MemTotal:        3809036 kB\nMemFree:          130464 kB\nMemAvailable:    1290348 kB\n";
+        assert_eq!(meminfo_kb(content, "MemTotal"), Some(3809036));
+        assert_eq!(meminfo_kb(content, "MemAvailable"), Some(1290348));
+        assert_eq!(meminfo_kb(content, "SwapTotal"), None);
+    }
+
+    #[test]
+    fn test_classification() {
+        let monitor = test_monitor();
+        let budget = AuboConfig::default().general.max_memory_mb * 1024 * 1024;
+
+        assert_eq!(monitor.classify(&sample(PSI_CALM, 0)), PressureLevel::Normal);
+        assert_eq!(monitor.classify(&sample(PSI_SOME, 0)), PressureLevel::Moderate);
+        assert_eq!(monitor.classify(&sample(PSI_FULL, 0)), PressureLevel::Critical);
+        assert_eq!(monitor.classify(&sample(PSI_CALM, budget)), PressureLevel::Critical);
+
+        let mut low_memory = sample(PSI_CALM, 0);
+        low_memory.mem_available_kb = low_memory.mem_total_kb / 10;
+        assert_eq!(monitor.classify(&low_memory), PressureLevel::Moderate);
+    }
+
+    #[test]
+    fn test_rule_budget() {
+        let mut config = AuboConfig::default();
+        config.general.max_memory_mb = 64;
+        config.performance.filter_cache_size = 10_000;
+        assert_eq!(
+            rule_budget_bytes(&config),
+            64 * 1024 * 1024 - 10_000 * CACHE_ENTRY_BYTES - RUNTIME_RESERVE_BYTES
+        );
+
+        config.general.max_memory_mb = 1;
+        assert_eq!(rule_budget_bytes(&config), 0);
+    }
+
+    #[test]
+    fn test_memory_breakdown() {
+        let mut breakdown = MemoryBreakdown::default();
+        breakdown.set_structure("blocked_domains", 1000, 0);
+        breakdown.set_structure("rules_file", 0, 4096);
+        breakdown.set_structure("blocked_domains", 1500, 0);
+        breakdown.set_list("EasyList", 800, 0);
+
+        assert_eq!(breakdown.structures.len(), 2);
+        assert_eq!(breakdown.structure("blocked_domains").unwrap().heap_bytes, 1500);
+        assert_eq!(breakdown.total_heap_bytes(), 1500);
+        assert_eq!(breakdown.total_mapped_bytes(), 4096);
+        assert!(breakdown.heap_bytes() > 0);
+    }
+
+    #[test]
+    fn test_string_collection_sizes() {
+        let mut set = HashSet::new();
+        assert_eq!(string_set_heap_bytes(&set), 0);
+
+        set.insert("example.com".to_string());
+        let bytes = string_set_heap_bytes(&set);
+        assert!(bytes >= size_of::<String>() + "example.com".len());
+
+        let mut map = HashMap::new();
+        map.insert("example.com".to_string(), 1u64);
+        assert!(string_map_heap_bytes(&map) >= size_of::<(String, u64)>() + "example.com".len());
+    }
+
+    #[test]
+    fn test_escalation_is_immediate_and_relaxing_is_damped() {
+        let monitor = test_monitor();
+
+        assert_eq!(monitor.update(&sample(PSI_FULL, 0)), Some(PressureLevel::Critical));
+
+        for _ in 0..RELAX_SAMPLES - 1 {
+            assert_eq!(monitor.update(&sample(PSI_CALM, 0)), None);
+        }
+        assert_eq!(monitor.update(&sample(PSI_CALM, 0)), Some(PressureLevel::Normal));
+        assert_eq!(monitor.level(), PressureLevel::Normal);
+    }
+}
@@ -0,0 +1,373 @@
+//! Work-stealing worker pool for the companion
+//!
+//! Every app holds a connection to the companion, and reports from many apps
+//! arrive together: at boot, after a reload, when the user switches apps.
+//! Handling each request on its connection thread lets a burst pile up on
+//! the journal and board locks without bound. Instead, connection threads
+//! only read and write frames and hand requests to a fixed set of workers
+//! through a bounded queue shared by all connections.
+//!
+//! When the queue is full the submitter gets a [`PoolBusy`] and fails open:
+//! the app is told the companion is busy and carries on with its own
+//! verdicts, keeping its stats for the next report. Nothing waits on a
+//! saturated companion.
+//!
+//! Jobs a worker spawns, such as the file write after a sketch merge or a
+//! rule compilation, go to that worker's own deque and skip the queue bound,
+//! since the request that caused them was already admitted. A worker runs
+//! its own newest job first, then takes from the shared queue, then steals
+//! the oldest job of another worker, so a long job does not strand the work
+//! queued behind it.
+
+use std::cell::Cell;
+use std::collections::VecDeque;
+use std::panic::{self, AssertUnwindSafe};
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::sync::{mpsc, Arc};
+use std::thread::JoinHandle;
+use std::time::{Duration, Instant};
+
+use parking_lot::{Condvar, Mutex};
+use serde::{Deserialize, Serialize};
+
+use crate::error::Result;
+use crate::stats::{latency_bucket, LATENCY_BUCKETS};
+
+/// How long an idle worker sleeps before looking for work again
+///
+/// Wakeups are signalled; this only bounds the cost of a missed one.
+const IDLE_WAIT: Duration = Duration::from_millis(100);
+
+/// Boxed job run by a worker
+type Job = Box<dyn FnOnce() + Send + 'static>;
+
+/// The pool's queue is full
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct PoolBusy;
+
+impl std::fmt::Display for PoolBusy {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.write_str("companion is busy")
+    }
+}
+
+struct Queued {
+    job: Job,
+    queued_at: Instant,
+}
+
+impl Queued {
+    fn new(job: Job) -> Self {
+        Self {
+            job,
+            queued_at: Instant::now(),
+        }
+    }
+}
+
+thread_local! {
+    /// Pool and worker index of the current thread, if it is a worker
+    static CURRENT_WORKER: Cell<Option<(usize, usize)>> = const { Cell::new(None) };
+}
+
+/// State shared by the pool handle and its workers
+struct Shared {
+    queue: Mutex<VecDeque<Queued>>,
+    capacity: usize,
+    locals: Vec<Mutex<VecDeque<Queued>>>,
+    wake: Condvar,
+    /// Jobs in the queue and all local deques
+    pending: AtomicUsize,
+    stop: AtomicBool,
+    submitted: AtomicU64,
+    rejected: AtomicU64,
+    stolen: AtomicU64,
+    completed: AtomicU64,
+    wait: [AtomicU64; LATENCY_BUCKETS],
+}
+
+impl Shared {
+    fn id(self: &Arc<Self>) -> usize {
+        Arc::as_ptr(self) as usize
+    }
+
+    fn push_local(&self, index: usize, job: Job) {
+        self.locals[index].lock().push_back(Queued::new(job));
+        self.submitted.fetch_add(1, Ordering::Relaxed);
+        self.pending.fetch_add(1, Ordering::Release);
+        // Taking the queue lock orders this with a worker about to sleep
+        drop(self.queue.lock());
+        self.wake.notify_one();
+    }
+
+    fn push_queue(&self, job: Job) -> std::result::Result<(), PoolBusy> {
+        let mut queue = self.queue.lock();
+        if queue.len() >= self.capacity {
+            drop(queue);
+            self.rejected.fetch_add(1, Ordering::Relaxed);
+            return Err(PoolBusy);
+        }
+        queue.push_back(Queued::new(job));
+        self.submitted.fetch_add(1, Ordering::Relaxed);
+        self.pending.fetch_add(1, Ordering::Release);
+        drop(queue);
+        self.wake.notify_one();
+        Ok(())
+    }
+
+    /// Next job for worker `index`: its own newest, then the queue, then the
+    /// oldest job of another worker
+    fn find_job(&self, index: usize) -> Option<Queued> {
+        if let Some(queued) = self.locals[index].lock().pop_back() {
+            return Some(queued);
+        }
+        if let Some(queued) = self.queue.lock().pop_front() {
+            return Some(queued);
+        }
+        let workers = self.locals.len();
+        for offset in 1..workers {
+            let victim = &self.locals[(index + offset) % workers];
+            if let Some(queued) = victim.try_lock().and_then(|mut deque| deque.pop_front()) {
+                self.stolen.fetch_add(1, Ordering::Relaxed);
+                return Some(queued);
+            }
+        }
+        None
+    }
+
+    fn run(&self, queued: Queued) {
+        self.pending.fetch_sub(1, Ordering::Relaxed);
+        self.wait[latency_bucket(queued.queued_at.elapsed())].fetch_add(1, Ordering::Relaxed);
+        if panic::catch_unwind(AssertUnwindSafe(queued.job)).is_err() {
+            log::error!("Companion job panicked");
+        }
+        self.completed.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn work(self: &Arc<Self>, index: usize) {
+        CURRENT_WORKER.with(|current| current.set(Some((self.id(), index))));
+        while !self.stop.load(Ordering::Acquire) {
+            if let Some(queued) = self.find_job(index) {
+                self.run(queued);
+                continue;
+            }
+            let mut queue = self.queue.lock();
+            if self.pending.load(Ordering::Acquire) == 0 && !self.stop.load(Ordering::Acquire) {
+                self.wake.wait_for(&mut queue, IDLE_WAIT);
+            }
+        }
+    }
+}
+
+/// Counters of a worker pool
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct PoolMetrics {
+    /// Worker threads
+    pub workers: usize,
+    /// Bound of the shared queue
+    pub queue_capacity: usize,
+    /// Jobs waiting in the shared queue
+    pub queue_depth: usize,
+    /// Jobs waiting in the queue and the workers' deques
+    pub pending: usize,
+    /// Jobs accepted since the pool started
+    pub submitted: u64,
+    /// Jobs turned away because the queue was full
+    pub rejected: u64,
+    /// Jobs a worker took from another worker's deque
+    pub stolen: u64,
+    /// Jobs finished
+    pub completed: u64,
+    /// Time from submission to start, in [`latency_bucket`] buckets
+    pub wait: Vec<u64>,
+}
+
+/// Fixed set of worker threads behind a bounded queue
+pub struct WorkerPool {
+    shared: Arc<Shared>,
+    handles: Vec<JoinHandle<()>>,
+}
+
+impl WorkerPool {
+    /// Start `workers` threads named after `name`, queueing at most
+    /// `queue_capacity` submitted jobs
+    pub fn new(name: &str, workers: usize, queue_capacity: usize) -> Result<Self> {
+        let workers = workers.max(1);
+        let shared = Arc::new(Shared {
+            queue: Mutex::new(VecDeque::new()),
+            capacity: queue_capacity.max(1),
+            locals: (0..workers).map(|_| Mutex::new(VecDeque::new())).collect(),
+            wake: Condvar::new(),
+            pending: AtomicUsize::new(0),
+            stop: AtomicBool::new(false),
+            submitted: AtomicU64::new(0),
+            rejected: AtomicU64::new(0),
+            stolen: AtomicU64::new(0),
+            completed: AtomicU64::new(0),
+            wait: Default::default(),
+        });
+
+        let mut pool = Self {
+            shared,
+            handles: Vec::with_capacity(workers),
+        };
+        for index in 0..workers {
+            let shared = Arc::clone(&pool.shared);
+            let handle = std::thread::Builder::new()
+                .name(format!("{}-{}", name, index))
+                .spawn(move || shared.work(index))?;
+            pool.handles.push(handle);
+        }
+        Ok(pool)
+    }
+
+    /// Index of the current thread if it is one of this pool's workers
+    fn current_worker(&self) -> Option<usize> {
+        let id = self.shared.id();
+        CURRENT_WORKER
+            .with(Cell::get)
+            .and_then(|(pool, index)| (pool == id).then_some(index))
+    }
+
+    /// Run `job` on a worker
+    ///
+    /// Jobs spawned by a worker of this pool are always accepted; others
+    /// are turned away when the queue is full.
+    pub fn spawn(&self, job: impl FnOnce() + Send + 'static) -> std::result::Result<(), PoolBusy> {
+        match self.current_worker() {
+            Some(index) => {
+                self.shared.push_local(index, Box::new(job));
+                Ok(())
+            }
+            None => self.shared.push_queue(Box::new(job)),
+        }
+    }
+
+    /// Run `job` on a worker and wait for its result
+    ///
+    /// Called from a worker of this pool, the job runs inline so the worker
+    /// cannot end up waiting on itself. Returns `Err` if the queue is full
+    /// or the job panicked.
+    pub fn run<T: Send + 'static>(
+        &self,
+        job: impl FnOnce() -> T + Send + 'static,
+    ) -> std::result::Result<T, PoolBusy> {
+        if self.current_worker().is_some() {
+            return Ok(job());
+        }
+        let (result_tx, result_rx) = mpsc::sync_channel(1);
+        self.shared.push_queue(Box::new(move || {
+            let _ = result_tx.send(job());
+        }))?;
+        result_rx.recv().map_err(|_| PoolBusy)
+    }
+
+    /// Get the pool's counters
+    pub fn metrics(&self) -> PoolMetrics {
+        let shared = &self.shared;
+        PoolMetrics {
+            workers: shared.locals.len(),
+            queue_capacity: shared.capacity,
+            queue_depth: shared.queue.lock().len(),
+            pending: shared.pending.load(Ordering::Relaxed),
+            submitted: shared.submitted.load(Ordering::Relaxed),
+            rejected: shared.rejected.load(Ordering::Relaxed),
+            stolen: shared.stolen.load(Ordering::Relaxed),
+            completed: shared.completed.load(Ordering::Relaxed),
+            wait: shared.wait.iter().map(|bucket| bucket.load(Ordering::Relaxed)).collect(),
+        }
+    }
+}
+
+impl Drop for WorkerPool {
+    fn drop(&mut self) {
+        self.shared.stop.store(true, Ordering::Release);
+        drop(self.shared.queue.lock());
+        self.shared.wake.notify_all();
+        // A job may hold the last reference; its own thread then exits on its own
+        let current = std::thread::current().id();
+        for handle in self.handles.drain(..).filter(|handle| handle.thread().id() != current) {
+            if handle.join().is_err() {
+                log::error!("Companion worker panicked");
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::Barrier;
+
+    #[test]
+    fn test_run_returns_results() {
+        let pool = WorkerPool::new("aubo-test", 3, 16).unwrap();
+        let results: Vec<u32> = (0..50).map(|i| pool.run(move || i * 2).unwrap()).collect();
+        assert_eq!(results, (0..50).map(|i| i * 2).collect::<Vec<_>>());
+
+        let metrics = pool.metrics();
+        assert_eq!((metrics.workers, metrics.submitted), (3, 50));
+        assert_eq!(metrics.wait.iter().sum::<u64>(), 50);
+        assert_eq!(metrics.rejected, 0);
+    }
+
+    #[test]
+    fn test_full_queue_fails_open() {
+        let pool = WorkerPool::new("aubo-test", 1, 2).unwrap();
+        let gate = Arc::new(Barrier::new(2));
+        let worker_gate = Arc::clone(&gate);
+        pool.spawn(move || {
+            worker_gate.wait();
+        })
+        .unwrap();
+
+        // The worker is blocked, so the queue fills up
+        let mut accepted = 0;
+        while pool.spawn(|| {}).is_ok() {
+            accepted += 1;
+            assert!(accepted <= 3, "queue bound not applied");
+        }
+        assert_eq!(pool.run(|| ()), Err(PoolBusy));
+        assert!(pool.metrics().rejected >= 2);
+        assert!(pool.metrics().queue_depth >= 1);
+
+        gate.wait();
+        while pool.metrics().pending > 0 {
+            std::thread::sleep(Duration::from_millis(1));
+        }
+        assert_eq!(pool.run(|| 7), Ok(7));
+    }
+
+    #[test]
+    fn test_idle_workers_steal_spawned_jobs() {
+        let pool = Arc::new(WorkerPool::new("aubo-test", 4, 4).unwrap());
+        let done = Arc::new(AtomicUsize::new(0));
+        let threads = Arc::new(Mutex::new(std::collections::HashSet::new()));
+
+        let (task_pool, task_done, task_threads) = (Arc::clone(&pool), Arc::clone(&done), Arc::clone(&threads));
+        pool.run(move || {
+            // Children land on this worker's deque; the others must steal
+            for _ in 0..32 {
+                let (done, threads) = (Arc::clone(&task_done), Arc::clone(&task_threads));
+                task_pool
+                    .spawn(move || {
+                        threads.lock().insert(std::thread::current().id());
+                        std::thread::sleep(Duration::from_millis(2));
+                        done.fetch_add(1, Ordering::SeqCst);
+                    })
+                    .unwrap();
+            }
+            // Spawning past the queue bound is fine from a worker
+            assert!(task_pool.metrics().pending >= 4);
+        })
+        .unwrap();
+
+        let started = Instant::now();
+        while done.load(Ordering::SeqCst) < 32 && started.elapsed() < Duration::from_secs(10) {
+            std::thread::sleep(Duration::from_millis(1));
+        }
+        assert_eq!(done.load(Ordering::SeqCst), 32);
+        assert!(pool.metrics().stolen > 0);
+        assert!(threads.lock().len() > 1);
+    }
+}
@@ -0,0 +1,316 @@
+//! Recent-request log for aubo-rs
+//!
+//! When `stats.detailed_logging` is enabled, every lookup is appended to a
+//! fixed-capacity ring of compact records instead of being logged as text.
+//! Writers claim a position with one atomic add and overwrite the oldest
+//! record in place; nothing is allocated and no lock is taken. Each slot
+//! carries a stamp derived from its position, which lets readers copy
+//! records while writers keep going and skip any record that was being
+//! overwritten during the copy.
+//!
+//! Hosts are stored as their [`host_hash`], so "why was this host blocked"
+//! is answered by hashing the host and searching the log for it. The app
+//! forwards new records to the companion with its stats reports.
+
+use std::sync::atomic::{fence, AtomicU64, Ordering};
+use std::time::Duration;
+
+use serde::{Deserialize, Serialize};
+
+use crate::sketch::host_hash;
+use crate::utils::TimeUtils;
+
+/// Request types with a compact hook code, in code order starting at 1
+pub const HOOK_NAMES: [&str; 6] = ["dns", "http", "https", "connect", "send", "websocket"];
+
+/// Compact code of a request type, 0 for unknown ones
+pub fn hook_code(request_type: &str) -> u8 {
+    HOOK_NAMES
+        .iter()
+        .position(|name| name.eq_ignore_ascii_case(request_type))
+        .map_or(0, |index| index as u8 + 1)
+}
+
+/// Request type of a hook code
+pub fn hook_name(code: u8) -> &'static str {
+    match code {
+        0 => "other",
+        code => HOOK_NAMES.get(code as usize - 1).copied().unwrap_or("other"),
+    }
+}
+
+/// Kind of rule that decided a verdict
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(rename_all = "snake_case")]
+#[repr(u8)]
+pub enum RuleKind {
+    /// No rule matched, the request was allowed
+    None = 0,
+    /// The verdict came from the verdict cache
+    Cached = 1,
+    /// An allowlisted domain
+    AllowedDomain = 2,
+    /// A blocked domain
+    BlockedDomain = 3,
+    /// A literal URL pattern
+    Pattern = 4,
+    /// A regular expression rule
+    Regex = 5,
+}
+
+impl RuleKind {
+    fn from_bits(bits: u32) -> Self {
+        match bits {
+            1 => RuleKind::Cached,
+            2 => RuleKind::AllowedDomain,
+            3 => RuleKind::BlockedDomain,
+            4 => RuleKind::Pattern,
+            5 => RuleKind::Regex,
+            _ => RuleKind::None,
+        }
+    }
+}
+
+/// Compact identifier of the rule behind a verdict
+///
+/// The top three bits hold the [`RuleKind`]. The rest is the index of a
+/// pattern or regex rule in the loaded rule set, or the low bits of the
+/// [`host_hash`] of the matched domain rule.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+pub struct RuleId(pub u32);
+
+impl RuleId {
+    const KIND_SHIFT: u32 = 29;
+    const PAYLOAD_MASK: u32 = (1 << Self::KIND_SHIFT) - 1;
+
+    /// No rule matched
+    pub const NONE: RuleId = RuleId(0);
+
+    /// The verdict came from the cache
+    pub const CACHED: RuleId = RuleId((RuleKind::Cached as u32) << Self::KIND_SHIFT);
+
+    /// Identifier for a rule of `kind` with an index or hash payload
+    pub fn new(kind: RuleKind, payload: u32) -> Self {
+        RuleId(((kind as u32) << Self::KIND_SHIFT) | (payload & Self::PAYLOAD_MASK))
+    }
+
+    /// Identifier for a matched domain rule
+    pub fn domain(kind: RuleKind, domain: &str) -> Self {
+        Self::new(kind, host_hash(domain) as u32)
+    }
+
+    /// Kind of the rule
+    pub fn kind(self) -> RuleKind {
+        RuleKind::from_bits(self.0 >> Self::KIND_SHIFT)
+    }
+
+    /// Index or hash payload
+    pub fn payload(self) -> u32 {
+        self.0 & Self::PAYLOAD_MASK
+    }
+}
+
+/// One logged lookup
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct RequestRecord {
+    /// Position in the log, increasing without gaps
+    pub sequence: u64,
+    /// Time of the lookup in milliseconds since the epoch
+    pub timestamp_ms: u64,
+    /// Request type code, see [`hook_name`]
+    pub hook: u8,
+    /// [`host_hash`] of the looked-up host
+    pub host_id: u64,
+    /// UID of the app
+    pub uid: u32,
+    /// Whether the request was blocked
+    pub blocked: bool,
+    /// Rule that decided the verdict
+    pub rule: RuleId,
+    /// Lookup latency in nanoseconds, saturating
+    pub latency_ns: u32,
+}
+
+/// Words of encoded record data per slot
+const RECORD_WORDS: usize = 4;
+
+/// One ring slot
+///
+/// The stamp is `2 * position + 1` while the record for `position` is being
+/// written and `2 * position + 2` once it is complete.
+#[derive(Default)]
+struct Slot {
+    stamp: AtomicU64,
+    words: [AtomicU64; RECORD_WORDS],
+}
+
+/// Fixed-capacity lock-free ring of recent lookups
+pub struct RequestLog {
+    slots: Box<[Slot]>,
+    head: AtomicU64,
+    uid: u32,
+}
+
+impl std::fmt::Debug for RequestLog {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        f.debug_struct("RequestLog")
+            .field("capacity", &self.slots.len())
+            .field("head", &self.head.load(Ordering::Relaxed))
+            .finish()
+    }
+}
+
+impl RequestLog {
+    /// Create a log keeping the last `capacity` lookups of this process
+    pub fn new(capacity: usize) -> Self {
+        // SAFETY: getuid has no preconditions and cannot fail
+        let uid = unsafe { libc::getuid() };
+        Self::with_uid(capacity, uid)
+    }
+
+    fn with_uid(capacity: usize, uid: u32) -> Self {
+        Self {
+            slots: (0..capacity.max(1)).map(|_| Slot::default()).collect(),
+            head: AtomicU64::new(0),
+            uid,
+        }
+    }
+
+    /// Get the number of records the log keeps
+    pub fn capacity(&self) -> usize {
+        self.slots.len()
+    }
+
+    /// Get the heap bytes of the ring
+    pub fn heap_bytes(&self) -> usize {
+        self.slots.len() * std::mem::size_of::<Slot>()
+    }
+
+    /// Get the position the next record will take
+    pub fn head(&self) -> u64 {
+        self.head.load(Ordering::Acquire)
+    }
+
+    /// Append a lookup, overwriting the oldest record once the ring is full
+    pub fn record(&self, request_type: &str, host: &str, blocked: bool, rule: RuleId, latency: Duration) {
+        let position = self.head.fetch_add(1, Ordering::AcqRel);
+        let slot = &self.slots[(position % self.slots.len() as u64) as usize];
+
+        let latency_ns = latency.as_nanos().min(u32::MAX as u128) as u64;
+        let flags = (latency_ns << 32) | ((hook_code(request_type) as u64) << 8) | blocked as u64;
+        let words = [
+            TimeUtils::now_millis(),
+            host_hash(host),
+            ((self.uid as u64) << 32) | rule.0 as u64,
+            flags,
+        ];
+
+        slot.stamp.store(2 * position + 1, Ordering::Relaxed);
+        fence(Ordering::Release);
+        for (word, value) in slot.words.iter().zip(words) {
+            word.store(value, Ordering::Relaxed);
+        }
+        slot.stamp.store(2 * position + 2, Ordering::Release);
+    }
+
+    /// Copy the records from position `cursor` on, oldest first
+    ///
+    /// Records already overwritten or being written are skipped. Returns
+    /// the records and the cursor for the next call. A record could only be
+    /// torn if the ring wrapped around completely during a single write.
+    pub fn read_since(&self, cursor: u64) -> (Vec<RequestRecord>, u64) {
+        let head = self.head();
+        let start = cursor.max(head.saturating_sub(self.slots.len() as u64));
+        let mut records = Vec::with_capacity((head - start.min(head)) as usize);
+
+        for position in start..head {
+            let slot = &self.slots[(position % self.slots.len() as u64) as usize];
+            let stamp = slot.stamp.load(Ordering::Acquire);
+            if stamp != 2 * position + 2 {
+                continue;
+            }
+            let words: [u64; RECORD_WORDS] = std::array::from_fn(|i| slot.words[i].load(Ordering::Relaxed));
+            fence(Ordering::Acquire);
+            if slot.stamp.load(Ordering::Relaxed) != stamp {
+                continue;
+            }
+
+            records.push(RequestRecord {
+                sequence: position,
+                timestamp_ms: words[0],
+                host_id: words[1],
+                uid: (words[2] >> 32) as u32,
+                rule: RuleId(words[2] as u32),
+                latency_ns: (words[3] >> 32) as u32,
+                hook: (words[3] >> 8) as u8,
+                blocked: words[3] & 1 != 0,
+            });
+        }
+        (records, head.max(cursor))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::Arc;
+    use std::thread;
+
+    #[test]
+    fn test_rule_id_packing() {
+        let rule = RuleId::new(RuleKind::Regex, 42);
+        assert_eq!((rule.kind(), rule.payload()), (RuleKind::Regex, 42));
+        assert_eq!(RuleId::CACHED.kind(), RuleKind::Cached);
+        assert_eq!(RuleId::NONE.kind(), RuleKind::None);
+        assert_eq!(RuleId::domain(RuleKind::BlockedDomain, "ads.net").kind(), RuleKind::BlockedDomain);
+    }
+
+    #[test]
+    fn test_records_round_trip_and_overwrite_oldest() {
+        let log = RequestLog::with_uid(4, 10123);
+        for i in 0..6 {
+            let rule = RuleId::new(RuleKind::Pattern, i);
+            log.record("dns", &format!("host{}.net", i), i % 2 == 0, rule, Duration::from_nanos(700));
+        }
+
+        let (records, cursor) = log.read_since(0);
+        assert_eq!(cursor, 6);
+        assert_eq!(records.iter().map(|r| r.sequence).collect::<Vec<_>>(), vec![2, 3, 4, 5]);
+
+        let last = &records[3];
+        assert_eq!(last.host_id, host_hash("host5.net"));
+        assert_eq!((last.uid, last.blocked, last.latency_ns), (10123, false, 700));
+        assert_eq!(hook_name(last.hook), "dns");
+        assert_eq!(last.rule, RuleId::new(RuleKind::Pattern, 5));
+
+        // Nothing new since the cursor
+        assert!(log.read_since(cursor).0.is_empty());
+    }
+
+    #[test]
+    fn test_reads_run_alongside_writers() {
+        let log = Arc::new(RequestLog::with_uid(64, 0));
+        let writers: Vec<_> = (0..4)
+            .map(|_| {
+                let log = Arc::clone(&log);
+                thread::spawn(move || {
+                    for _ in 0..5_000 {
+                        log.record("http", "tracker.net", true, RuleId::NONE, Duration::ZERO);
+                    }
+                })
+            })
+            .collect();
+
+        let mut cursor = 0;
+        while writers.iter().any(|writer| !writer.is_finished()) {
+            let (records, next) = log.read_since(cursor);
+            assert!(records.iter().all(|r| r.host_id == host_hash("tracker.net") && r.blocked));
+            assert!(records.windows(2).all(|pair| pair[0].sequence < pair[1].sequence));
+            cursor = next;
+        }
+        for writer in writers {
+            writer.join().unwrap();
+        }
+        assert_eq!(log.head(), 20_000);
+    }
+}
@@ -0,0 +1,537 @@
+//! On-device self-benchmark for aubo-rs
+//!
+//! Which companion transport and how many companion workers serve a device
+//! best depends on its cores, memory and kernel, and the lookup latency
+//! adaptive degradation should aim for depends on how fast the CPU matches
+//! rules. Instead of shipping one configuration for every phone, the
+//! installer runs `aubo-bench`, which calls [`run_and_apply`] through the
+//! library's C interface. It replays representative traffic against each
+//! available mode on the device itself:
+//!
+//! - the in-process engine, with hosts from the apps' warm caches topped up
+//!   with synthetic ones, looked up with a skew like real traffic
+//! - companion requests over the socket and over the shared-memory channel
+//! - companion worker pools of increasing size under concurrent apps
+//!
+//! The fastest choices are written back to the configuration and the
+//! measurements to [`BENCHMARK_REPORT_FILE`] in the data directory. Nothing
+//! here is specific to Android, so the benchmark also runs on Linux.
+
+use std::fs;
+use std::os::unix::net::UnixStream;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::thread;
+use std::time::{Duration, Instant};
+
+use log::{info, warn};
+
+use crate::companion::{warm_cache_hosts, Companion, CompanionClient};
+use crate::config::AuboConfig;
+use crate::engine::FilterEngine;
+use crate::error::{ConfigError, Result};
+use crate::pool::WorkerPool;
+use crate::shadow::percentile;
+use crate::stats::{StatsCollector, StatsDelta};
+
+/// File below the data directory the last benchmark report is written to
+pub const BENCHMARK_REPORT_FILE: &str = "benchmark.txt";
+
+/// Directory below the data directory used as the companion's scratch space
+const SCRATCH_DIR: &str = "bench";
+
+/// Distinct hosts in the replayed traffic
+const REPLAY_HOSTS: usize = 2_000;
+
+/// Lookups replayed against the engine
+const REPLAY_LOOKUPS: usize = 20_000;
+
+/// Request rounds per transport
+const TRANSPORT_ROUNDS: usize = 1_000;
+
+/// Request rounds per app in the worker benchmark
+const WORKER_ROUNDS: usize = 200;
+
+/// Speedup the shared-memory channel must show over the socket to be used
+const SHARED_MEMORY_MARGIN: f64 = 0.9;
+
+/// Share of the best throughput a smaller worker pool may fall short by
+const WORKER_THROUGHPUT_SLACK: f64 = 0.95;
+
+/// Degradation target as a multiple of the measured p99 lookup latency
+const DEGRADE_TARGET_FACTOR: u32 = 2;
+
+/// Ad and tracking hosts mixed into synthetic traffic
+const BLOCKED_HOSTS: &[&str] = &[
+    "doubleclick.net",
+    "googleadservices.com",
+    "googlesyndication.com",
+    "app-measurement.com",
+    "adcolony.com",
+    "applovin.com",
+    "unityads.unity3d.com",
+    "crashlytics.com",
+];
+
+/// Labels synthetic ordinary hosts are made of
+const HOST_PREFIXES: &[&str] = &["api", "cdn", "img", "www", "static", "m", "edge"];
+const HOST_NAMES: &[&str] = &["news", "shop", "video", "mail", "social", "maps", "cloud", "music"];
+const HOST_TLDS: &[&str] = &["com", "net", "org", "io"];
+
+/// Latency and throughput of one mode
+#[derive(Debug, Clone, PartialEq)]
+pub struct Measurement {
+    /// Operations timed
+    pub samples: usize,
+    /// Median operation time
+    pub p50: Duration,
+    /// p99 operation time
+    pub p99: Duration,
+    /// Operations completed per second
+    pub per_second: f64,
+}
+
+impl Measurement {
+    /// Summarize per-operation nanosecond timings over a wall-clock run
+    fn from_samples(mut samples: Vec<u64>, wall: Duration) -> Self {
+        Self {
+            samples: samples.len(),
+            p50: percentile(&mut samples, 0.50),
+            p99: percentile(&mut samples, 0.99),
+            per_second: samples.len() as f64 / wall.as_secs_f64().max(f64::EPSILON),
+        }
+    }
+
+    fn render(&self) -> String {
+        format!(
+            "p50 {:?}, p99 {:?}, {:.0}/s over {}",
+            self.p50, self.p99, self.per_second, self.samples
+        )
+    }
+}
+
+/// Configuration chosen from a benchmark
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Tuning {
+    /// Talk to the companion through shared memory
+    pub companion_shared_memory: bool,
+    /// Companion worker threads
+    pub worker_threads: usize,
+    /// p99 lookup latency adaptive degradation aims for
+    pub degrade_latency_target: Duration,
+}
+
+impl Tuning {
+    /// Set the chosen values in the text of a configuration file
+    ///
+    /// Only these keys of `[performance]` change; comments, formatting and
+    /// every other setting stay as the user left them.
+    pub fn patch(&self, text: &str) -> Result<String> {
+        let mut document: toml_edit::DocumentMut = text.parse().map_err(|e: toml_edit::TomlError| {
+            ConfigError::InvalidFormat {
+                details: e.to_string(),
+            }
+        })?;
+        let performance = document
+            .entry("performance")
+            .or_insert(toml_edit::table())
+            .as_table_like_mut()
+            .ok_or_else(|| ConfigError::InvalidFormat {
+                details: "performance is not a table".to_string(),
+            })?;
+        let target = humantime::format_duration(self.degrade_latency_target).to_string();
+        let values = [
+            ("companion_shared_memory", toml_edit::value(self.companion_shared_memory)),
+            ("worker_threads", toml_edit::value(self.worker_threads as i64)),
+            ("degrade_latency_target", toml_edit::value(target)),
+        ];
+        for (key, value) in values {
+            match performance.get_mut(key) {
+                Some(item) => *item = value,
+                None => {
+                    performance.insert(key, value);
+                }
+            }
+        }
+        Ok(document.to_string())
+    }
+}
+
+/// Measurements of every mode and the configuration chosen from them
+#[derive(Debug, Clone)]
+pub struct BenchReport {
+    /// CPU cores available
+    pub cores: usize,
+    /// Lookups against the in-process engine
+    pub engine: Measurement,
+    /// Requests over the companion socket
+    pub socket: Measurement,
+    /// Requests over the shared-memory channel, or why it is unavailable
+    pub shared_memory: std::result::Result<Measurement, String>,
+    /// Concurrent requests per companion worker count
+    pub workers: Vec<(usize, Measurement)>,
+    /// Chosen configuration
+    pub tuning: Tuning,
+}
+
+impl BenchReport {
+    /// Render the report for the installer and `benchmark.txt`
+    pub fn render(&self) -> String {
+        let mut out = format!("{} cores\nengine lookups: {}\n", self.cores, self.engine.render());
+        out.push_str(&format!("socket requests: {}\n", self.socket.render()));
+        match &self.shared_memory {
+            Ok(measurement) => out.push_str(&format!("shared-memory requests: {}\n", measurement.render())),
+            Err(reason) => out.push_str(&format!("shared-memory requests: unavailable ({})\n", reason)),
+        }
+        for (threads, measurement) in &self.workers {
+            out.push_str(&format!("{} workers: {}\n", threads, measurement.render()));
+        }
+        out.push_str(&format!(
+            "chosen: companion_shared_memory = {}, worker_threads = {}, degrade_latency_target = {:?}\n",
+            self.tuning.companion_shared_memory, self.tuning.worker_threads, self.tuning.degrade_latency_target
+        ));
+        out
+    }
+}
+
+/// Benchmark every mode and choose the configuration for this device
+pub fn run(config: &AuboConfig) -> Result<BenchReport> {
+    let cores = num_cpus::get().max(1);
+    let traffic = replay_traffic(config, REPLAY_LOOKUPS);
+    let engine = bench_engine(config, &traffic)?;
+
+    let scratch = config.general.data_dir.join(SCRATCH_DIR);
+    let _cleanup = ScratchDir::create(scratch.clone())?;
+    let socket = bench_transport(&scratch, false)?;
+    let shared_memory = bench_transport(&scratch, true).map_err(|e| e.to_string());
+    let mut workers = Vec::new();
+    for threads in worker_candidates(cores) {
+        workers.push((threads, bench_workers(&scratch, threads, cores)?));
+    }
+
+    let tuning = choose(config, &engine, &socket, shared_memory.as_ref().ok(), &workers);
+    Ok(BenchReport {
+        cores,
+        engine,
+        socket,
+        shared_memory,
+        workers,
+        tuning,
+    })
+}
+
+/// Benchmark with the configuration at `config_path`, save the chosen
+/// values to it and write the report next to it
+pub fn run_and_apply(config_path: &Path) -> Result<BenchReport> {
+    let config = AuboConfig::load_from_file(config_path)?;
+    let text = fs::read_to_string(config_path)?;
+    info!("Benchmarking operating modes on this device");
+    let report = run(&config)?;
+
+    fs::write(config_path, report.tuning.patch(&text)?)?;
+    let report_path = config.ensure_data_dir()?.join(BENCHMARK_REPORT_FILE);
+    fs::write(&report_path, report.render())?;
+    info!("Benchmark chose {:?}", report.tuning);
+    Ok(report)
+}
+
+/// Pick the fastest modes, keeping the simpler one when they are close
+fn choose(
+    config: &AuboConfig,
+    engine: &Measurement,
+    socket: &Measurement,
+    shared_memory: Option<&Measurement>,
+    workers: &[(usize, Measurement)],
+) -> Tuning {
+    let companion_shared_memory =
+        shared_memory.is_some_and(|shared| shared.p99.as_secs_f64() < socket.p99.as_secs_f64() * SHARED_MEMORY_MARGIN);
+
+    let best = workers.iter().map(|(_, m)| m.per_second).fold(0.0, f64::max);
+    let worker_threads = workers
+        .iter()
+        .find(|(_, m)| m.per_second >= best * WORKER_THROUGHPUT_SLACK)
+        .map(|(threads, _)| *threads)
+        .unwrap_or(config.performance.worker_threads);
+
+    // A slow CPU must not sit in degraded matching all the time, and
+    // lookups should still degrade before they run out of budget
+    let mut degrade_latency_target = config
+        .performance
+        .degrade_latency_target
+        .max(engine.p99 * DEGRADE_TARGET_FACTOR);
+    if !config.hooks.analysis_timeout.is_zero() {
+        degrade_latency_target = degrade_latency_target.min(config.hooks.analysis_timeout);
+    }
+
+    Tuning {
+        companion_shared_memory,
+        worker_threads,
+        degrade_latency_target,
+    }
+}
+
+/// Worker counts worth trying on `cores` cores
+fn worker_candidates(cores: usize) -> Vec<usize> {
+    let mut candidates: Vec<usize> = [1, 2, 4, 8].into_iter().filter(|&n| n < cores).collect();
+    candidates.push(cores.min(8));
+    candidates
+}
+
+/// Hosts to replay, in lookup order
+///
+/// Hosts apps stored in their warm caches come first; synthetic ordinary
+/// and ad hosts fill up the rest. Lookups favour hosts early in the list,
+/// so a few hosts make up most of the traffic as they do on a phone.
+pub fn replay_traffic(config: &AuboConfig, lookups: usize) -> Vec<String> {
+    let mut hosts = warm_cache_hosts(&config.general.data_dir, REPLAY_HOSTS);
+    let blocked: Vec<&str> = BLOCKED_HOSTS
+        .iter()
+        .copied()
+        .chain(config.filters.blacklist_domains.iter().map(String::as_str))
+        .collect();
+    let mut i = 0;
+    while hosts.len() < REPLAY_HOSTS {
+        hosts.push(if i % 5 == 4 {
+            format!("{}{}.{}", HOST_PREFIXES[i % HOST_PREFIXES.len()], i, blocked[i % blocked.len()])
+        } else {
+            format!(
+                "{}.{}{}.{}",
+                HOST_PREFIXES[i % HOST_PREFIXES.len()],
+                HOST_NAMES[i % HOST_NAMES.len()],
+                i,
+                HOST_TLDS[i % HOST_TLDS.len()]
+            )
+        });
+        i += 1;
+    }
+
+    let mut state = 0x5eed_u64;
+    (0..lookups)
+        .map(|_| {
+            state = state.wrapping_add(0x9e37_79b9_7f4a_7c15);
+            let unit = (splitmix(state) >> 11) as f64 / (1u64 << 53) as f64;
+            hosts[((unit * unit * unit) * hosts.len() as f64) as usize].clone()
+        })
+        .collect()
+}
+
+/// SplitMix64 finalizer
+fn splitmix(value: u64) -> u64 {
+    let mut z = value;
+    z = (z ^ (z >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    z = (z ^ (z >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+    z ^ (z >> 31)
+}
+
+/// Replay `traffic` against an in-process engine doing full matching
+fn bench_engine(config: &AuboConfig, traffic: &[String]) -> Result<Measurement> {
+    let mut config = config.clone();
+    config.performance.adaptive_degradation = false;
+    let engine = FilterEngine::new(Arc::new(config), Arc::new(StatsCollector::new()))?;
+
+    let mut samples = Vec::with_capacity(traffic.len());
+    let started = Instant::now();
+    for host in traffic {
+        let lookup = Instant::now();
+        std::hint::black_box(engine.should_block(host, "dns", "getaddrinfo"));
+        samples.push(lookup.elapsed().as_nanos() as u64);
+    }
+    Ok(Measurement::from_samples(samples, started.elapsed()))
+}
+
+/// Time an app's requests to a companion over the socket or shared memory
+fn bench_transport(scratch: &Path, shared_memory: bool) -> Result<Measurement> {
+    let companion = Arc::new(Companion::new(scratch));
+    let (app_side, mut companion_side) = UnixStream::pair()?;
+    let server = thread::spawn(move || companion.serve(&mut companion_side));
+
+    let mut client = CompanionClient::new(app_side)?;
+    let result = (|| {
+        if shared_memory {
+            client.open_shared_channel()?;
+        }
+        let mut samples = Vec::with_capacity(TRANSPORT_ROUNDS * 2);
+        let started = Instant::now();
+        for round in 0..TRANSPORT_ROUNDS {
+            let request = Instant::now();
+            client.poll_control(Some(round as u64))?;
+            samples.push(request.elapsed().as_nanos() as u64);
+
+            let request = Instant::now();
+            let _ = client.record_stats("bench", sample_delta(round));
+            samples.push(request.elapsed().as_nanos() as u64);
+        }
+        Ok(Measurement::from_samples(samples, started.elapsed()))
+    })();
+
+    drop(client);
+    if let Ok(Err(e)) = server.join() {
+        warn!("Benchmark companion connection failed: {}", e);
+    }
+    result
+}
+
+/// Stats delta of the size an app reports every interval
+fn sample_delta(round: usize) -> StatsDelta {
+    let mut delta = StatsDelta {
+        total_requests: 40,
+        blocked_requests: 8,
+        allowed_requests: 32,
+        ..StatsDelta::default()
+    };
+    for (i, host) in BLOCKED_HOSTS.iter().enumerate() {
+        delta.domains_blocked.insert(host.to_string(), (round + i) as u64 % 3 + 1);
+    }
+    delta
+}
+
+/// Time concurrent apps' requests to a companion with `threads` workers
+fn bench_workers(scratch: &Path, threads: usize, apps: usize) -> Result<Measurement> {
+    let pool = WorkerPool::new("aubo-bench", threads, apps * 4)?;
+    let companion = Arc::new(Companion::new(scratch).with_worker_pool(pool));
+
+    let started = Instant::now();
+    let mut clients = Vec::with_capacity(apps);
+    for app in 0..apps {
+        let (app_side, mut companion_side) = UnixStream::pair()?;
+        let server = Arc::clone(&companion);
+        thread::spawn(move || server.serve(&mut companion_side));
+        let mut client = CompanionClient::new(app_side)?;
+        clients.push(thread::spawn(move || -> Result<Vec<u64>> {
+            let name = format!("bench.app{}", app);
+            let entries: Vec<(String, bool)> =
+                (0..64).map(|i| (format!("host{}.example.org", i), i % 5 == 0)).collect();
+            let mut samples = Vec::with_capacity(WORKER_ROUNDS);
+            for round in 0..WORKER_ROUNDS {
+                let request = Instant::now();
+                client.load_warm_cache(&name, 1)?;
+                client.poll_control(Some(round as u64))?;
+                if round % 10 == 0 {
+                    client.store_warm_cache(&name, 1, entries.clone())?;
+                }
+                samples.push(request.elapsed().as_nanos() as u64);
+            }
+            Ok(samples)
+        }));
+    }
+
+    let mut samples = Vec::with_capacity(apps * WORKER_ROUNDS);
+    for client in clients {
+        let client_samples = client
+            .join()
+            .map_err(|_| std::io::Error::other("benchmark app thread panicked"))??;
+        samples.extend(client_samples);
+    }
+    Ok(Measurement::from_samples(samples, started.elapsed()))
+}
+
+/// Scratch directory removed again when dropped
+struct ScratchDir(PathBuf);
+
+impl ScratchDir {
+    fn create(path: PathBuf) -> Result<Self> {
+        fs::create_dir_all(&path)?;
+        Ok(Self(path))
+    }
+}
+
+impl Drop for ScratchDir {
+    fn drop(&mut self) {
+        let _ = fs::remove_dir_all(&self.0);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn measurement(p99_us: u64, per_second: f64) -> Measurement {
+        Measurement {
+            samples: 100,
+            p50: Duration::from_micros(p99_us / 2),
+            p99: Duration::from_micros(p99_us),
+            per_second,
+        }
+    }
+
+    #[test]
+    fn test_replay_traffic_is_skewed() {
+        let config = AuboConfig::default();
+        let traffic = replay_traffic(&config, 10_000);
+        assert_eq!(traffic.len(), 10_000);
+        let distinct: std::collections::HashSet<_> = traffic.iter().collect();
+        assert!(distinct.len() > 100 && distinct.len() < REPLAY_HOSTS);
+        assert!(traffic.iter().any(|host| host.ends_with(".doubleclick.net")));
+    }
+
+    #[test]
+    fn test_choose_prefers_simpler_modes_when_close() {
+        let mut config = AuboConfig::default();
+        config.performance.degrade_latency_target = Duration::from_millis(2);
+        config.hooks.analysis_timeout = Duration::from_millis(5);
+        let workers = vec![
+            (1, measurement(100, 1000.0)),
+            (2, measurement(80, 1960.0)),
+            (4, measurement(80, 2000.0)),
+        ];
+
+        let tuning = choose(&config, &measurement(10, 0.0), &measurement(100, 0.0), Some(&measurement(95, 0.0)), &workers);
+        assert_eq!(
+            tuning,
+            Tuning {
+                companion_shared_memory: false,
+                worker_threads: 2,
+                degrade_latency_target: Duration::from_millis(2),
+            }
+        );
+
+        // A clearly faster channel wins, and a slow CPU raises the target
+        // up to the lookup budget
+        let tuning = choose(&config, &measurement(4_000, 0.0), &measurement(100, 0.0), Some(&measurement(50, 0.0)), &workers);
+        assert!(tuning.companion_shared_memory);
+        assert_eq!(tuning.degrade_latency_target, Duration::from_millis(5));
+        assert!(!choose(&config, &measurement(10, 0.0), &measurement(100, 0.0), None, &workers).companion_shared_memory);
+    }
+
+    #[test]
+    fn test_run_and_apply_patches_shipped_config() {
+        let dir = tempfile::tempdir().unwrap();
+        let shipped = include_str!("../aubo-rs.toml").replace("/data/adb/aubo-rs", &dir.path().display().to_string());
+        let config_path = dir.path().join(crate::config::DEFAULT_CONFIG_FILE);
+        fs::write(&config_path, &shipped).unwrap();
+
+        let report = run_and_apply(&config_path).unwrap();
+        assert_eq!(report.engine.samples, REPLAY_LOOKUPS);
+        assert!(!report.workers.is_empty());
+        assert!(fs::read_to_string(dir.path().join(BENCHMARK_REPORT_FILE)).unwrap().contains("chosen: "));
+        assert!(!dir.path().join(SCRATCH_DIR).exists());
+
+        // Only the tuned keys changed; comments and hand edits survive
+        let saved = fs::read_to_string(&config_path).unwrap();
+        let changed: Vec<_> = shipped.lines().zip(saved.lines()).filter(|(a, b)| a != b).map(|(_, b)| b).collect();
+        assert!(changed.iter().all(|line| {
+            ["companion_shared_memory =", "worker_threads =", "degrade_latency_target ="]
+                .iter()
+                .any(|key| line.starts_with(key))
+        }));
+        assert_eq!(shipped.lines().count(), saved.lines().count());
+        let config = AuboConfig::load_from_file(&config_path).unwrap();
+        assert_eq!(config.performance.worker_threads, report.tuning.worker_threads);
+        assert_eq!(config.performance.degrade_latency_target, report.tuning.degrade_latency_target);
+    }
+
+    #[test]
+    fn test_patch_adds_missing_keys() {
+        let tuning = Tuning {
+            companion_shared_memory: true,
+            worker_threads: 3,
+            degrade_latency_target: Duration::from_micros(2500),
+        };
+        let patched = tuning.patch("# mine\n[general]\nenabled = true\n").unwrap();
+        assert!(patched.starts_with("# mine\n[general]\nenabled = true\n"));
+        let performance = &patched.parse::<toml::Table>().unwrap()["performance"];
+        assert_eq!(performance["worker_threads"].as_integer(), Some(3));
+        assert_eq!(performance["degrade_latency_target"].as_str(), Some("2ms 500us"));
+        assert!(tuning.patch("[performance\n").is_err());
+    }
+}
@@ -0,0 +1,302 @@
+//! Shadow evaluation of reloaded rules for aubo-rs
+//!
+//! A new list version can make lookups slower or change verdicts without
+//! anyone noticing. With `filters.shadow_evaluation`, `reload` first builds
+//! a candidate engine in the companion and replays sampled live hosts
+//! against both it and the active engine, off every app's critical path.
+//! The hosts come from what apps report (warm caches, blocked domains and
+//! slowest lookups) and are kept in a fixed-size [`HostReservoir`].
+//!
+//! Apps are only told to reload once the candidate passes: its p99
+//! evaluation time must stay within `shadow_max_p99_ratio` of the active
+//! engine's, and at most `shadow_max_changed` of the sampled hosts may
+//! change verdict. A failing candidate is held until `promote` forces it
+//! through or a later reload replaces it.
+
+use std::collections::HashSet;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+
+use crate::config::FilterConfig;
+use crate::engine::FilterEngine;
+use crate::sketch::host_hash;
+
+/// Hosts kept for shadow evaluation
+pub const SHADOW_SAMPLE_HOSTS: usize = 512;
+
+/// Sampled hosts below which thresholds are not judged
+pub const MIN_SHADOW_SAMPLES: usize = 32;
+
+/// Times each host is evaluated by each engine
+const SHADOW_ROUNDS: usize = 3;
+
+/// Changed verdicts listed in a report
+const REPORTED_CHANGES: usize = 16;
+
+/// Uniform sample of the hosts apps looked up
+///
+/// Reservoir sampling keeps every distinct host offered so far equally
+/// likely to be in the sample, however many are offered.
+#[derive(Debug, Default)]
+pub struct HostReservoir {
+    hosts: Vec<String>,
+    members: HashSet<String>,
+    offered: u64,
+}
+
+impl HostReservoir {
+    /// Create an empty reservoir
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Offer a looked-up host
+    pub fn offer(&mut self, host: &str) {
+        if host.is_empty() || self.members.contains(host) {
+            return;
+        }
+        self.offered += 1;
+        if self.hosts.len() < SHADOW_SAMPLE_HOSTS {
+            self.hosts.push(host.to_string());
+            self.members.insert(host.to_string());
+            return;
+        }
+
+        let slot = (mix(host_hash(host) ^ self.offered) % self.offered) as usize;
+        if let Some(replaced) = self.hosts.get_mut(slot) {
+            self.members.remove(replaced.as_str());
+            *replaced = host.to_string();
+            self.members.insert(host.to_string());
+        }
+    }
+
+    /// Get the sampled hosts
+    pub fn hosts(&self) -> &[String] {
+        &self.hosts
+    }
+}
+
+/// Shadow evaluation state kept by the companion
+#[derive(Default)]
+pub struct ShadowGate {
+    /// Hosts replayed against candidates
+    pub reservoir: HostReservoir,
+    /// Candidate that failed the thresholds, waiting for `promote`
+    pub held: Option<Arc<FilterEngine>>,
+    /// Report of the latest evaluation
+    pub report: Option<ShadowReport>,
+}
+
+/// SplitMix64 finalizer
+fn mix(value: u64) -> u64 {
+    let mut z = value.wrapping_add(0x9e37_79b9_7f4a_7c15);
+    z = (z ^ (z >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    z = (z ^ (z >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+    z ^ (z >> 31)
+}
+
+/// Host whose verdict differs between the engines
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct VerdictChange {
+    /// Sampled host
+    pub host: String,
+    /// Whether the active rules block it
+    pub active: bool,
+}
+
+/// Outcome of replaying sampled hosts against two engines
+#[derive(Debug, Clone, PartialEq)]
+pub struct ShadowReport {
+    /// Hosts replayed
+    pub samples: usize,
+    /// Median evaluation time of the active engine
+    pub active_p50: Duration,
+    /// p99 evaluation time of the active engine
+    pub active_p99: Duration,
+    /// Median evaluation time of the candidate engine
+    pub candidate_p50: Duration,
+    /// p99 evaluation time of the candidate engine
+    pub candidate_p99: Duration,
+    /// Hosts whose verdict changed
+    pub changed: usize,
+    /// First changed hosts, at most [`REPORTED_CHANGES`]
+    pub changes: Vec<VerdictChange>,
+    /// Why the candidate was held, `None` if it passed
+    pub rejection: Option<String>,
+}
+
+impl ShadowReport {
+    /// Replay `hosts` against both engines and judge the candidate
+    ///
+    /// Evaluations alternate between the engines, so changes in CPU
+    /// frequency or load during the replay affect both alike.
+    pub fn compare(active: &FilterEngine, candidate: &FilterEngine, hosts: &[String], config: &FilterConfig) -> Self {
+        let mut active_ns = Vec::with_capacity(hosts.len() * SHADOW_ROUNDS);
+        let mut candidate_ns = Vec::with_capacity(hosts.len() * SHADOW_ROUNDS);
+        let mut changed = 0;
+        let mut changes = Vec::new();
+
+        for host in hosts {
+            let mut verdicts = (false, false);
+            for _ in 0..SHADOW_ROUNDS {
+                let started = Instant::now();
+                verdicts.0 = active.rule_verdict(host);
+                active_ns.push(started.elapsed().as_nanos() as u64);
+
+                let started = Instant::now();
+                verdicts.1 = candidate.rule_verdict(host);
+                candidate_ns.push(started.elapsed().as_nanos() as u64);
+            }
+            if verdicts.0 != verdicts.1 {
+                changed += 1;
+                if changes.len() < REPORTED_CHANGES {
+                    changes.push(VerdictChange {
+                        host: host.clone(),
+                        active: verdicts.0,
+                    });
+                }
+            }
+        }
+
+        let mut report = Self {
+            samples: hosts.len(),
+            active_p50: percentile(&mut active_ns, 0.50),
+            active_p99: percentile(&mut active_ns, 0.99),
+            candidate_p50: percentile(&mut candidate_ns, 0.50),
+            candidate_p99: percentile(&mut candidate_ns, 0.99),
+            changed,
+            changes,
+            rejection: None,
+        };
+        report.rejection = report.judge(config);
+        report
+    }
+
+    /// Check the report against the thresholds, returning why it fails
+    fn judge(&self, config: &FilterConfig) -> Option<String> {
+        if self.samples < MIN_SHADOW_SAMPLES {
+            return None;
+        }
+        // Sub-microsecond p99s are timer noise, not a regression
+        let active_p99 = self.active_p99.max(Duration::from_micros(1));
+        let ratio = self.candidate_p99.as_secs_f64() / active_p99.as_secs_f64();
+        if ratio > config.shadow_max_p99_ratio {
+            return Some(format!(
+                "p99 rose {:.2}x ({:?} to {:?}), limit {:.2}x",
+                ratio, self.active_p99, self.candidate_p99, config.shadow_max_p99_ratio
+            ));
+        }
+        let changed = self.changed as f64 / self.samples as f64;
+        if changed > config.shadow_max_changed {
+            return Some(format!(
+                "{:.1}% of sampled hosts changed verdict, limit {:.1}%",
+                changed * 100.0,
+                config.shadow_max_changed * 100.0
+            ));
+        }
+        None
+    }
+
+    /// Check if the candidate may be promoted
+    pub fn passed(&self) -> bool {
+        self.rejection.is_none()
+    }
+
+    /// Render the report for the control socket
+    pub fn render(&self) -> String {
+        let mut out = format!(
+            "{} sampled hosts{}\n  active:    p50 {:?}, p99 {:?}\n  candidate: p50 {:?}, p99 {:?}\n  {} verdicts changed\n",
+            self.samples,
+            if self.samples < MIN_SHADOW_SAMPLES { " (too few to judge)" } else { "" },
+            self.active_p50,
+            self.active_p99,
+            self.candidate_p50,
+            self.candidate_p99,
+            self.changed
+        );
+        for change in &self.changes {
+            let (from, to) = if change.active { ("blocked", "allowed") } else { ("allowed", "blocked") };
+            out.push_str(&format!("    {}: {} -> {}\n", change.host, from, to));
+        }
+        match &self.rejection {
+            Some(reason) => out.push_str(&format!("held: {}\n", reason)),
+            None => out.push_str("passed\n"),
+        }
+        out
+    }
+}
+
+/// Exact percentile of nanosecond samples, sorting them in place
+pub(crate) fn percentile(samples: &mut [u64], quantile: f64) -> Duration {
+    if samples.is_empty() {
+        return Duration::ZERO;
+    }
+    samples.sort_unstable();
+    let rank = ((samples.len() as f64 * quantile).ceil() as usize).clamp(1, samples.len());
+    Duration::from_nanos(samples[rank - 1])
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::config::AuboConfig;
+    use crate::stats::StatsCollector;
+
+    fn engine(config: AuboConfig) -> FilterEngine {
+        FilterEngine::new(Arc::new(config), Arc::new(StatsCollector::new())).unwrap()
+    }
+
+    fn hosts(count: usize) -> Vec<String> {
+        (0..count).map(|i| format!("host{}.example.org", i)).collect()
+    }
+
+    #[test]
+    fn test_reservoir_is_bounded_and_distinct() {
+        let mut reservoir = HostReservoir::new();
+        let offered = hosts(SHADOW_SAMPLE_HOSTS * 4);
+        for host in &offered {
+            reservoir.offer(host);
+            reservoir.offer(host);
+        }
+        assert_eq!(reservoir.hosts().len(), SHADOW_SAMPLE_HOSTS);
+        let distinct: HashSet<_> = reservoir.hosts().iter().collect();
+        assert_eq!(distinct.len(), SHADOW_SAMPLE_HOSTS);
+        // Later hosts get their share of the sample
+        let late = &offered[SHADOW_SAMPLE_HOSTS..];
+        assert!(reservoir.hosts().iter().filter(|host| late.contains(host)).count() > SHADOW_SAMPLE_HOSTS / 2);
+    }
+
+    #[test]
+    fn test_verdict_changes_hold_candidate() {
+        let active = engine(AuboConfig::default());
+        let mut config = AuboConfig::default();
+        let mut sampled = hosts(MIN_SHADOW_SAMPLES * 2);
+        for host in &sampled[..MIN_SHADOW_SAMPLES / 2] {
+            config.filters.blacklist_domains.push(host.clone());
+        }
+        let candidate = engine(config.clone());
+
+        let report = ShadowReport::compare(&active, &candidate, &sampled, &config.filters);
+        assert_eq!(report.changed, MIN_SHADOW_SAMPLES / 2);
+        assert_eq!(report.changes.len(), REPORTED_CHANGES);
+        assert!(!report.changes[0].active);
+        assert!(!report.passed());
+        assert!(report.render().contains("held: "));
+
+        // The same rules pass, and too few samples are not judged
+        config.filters.shadow_max_p99_ratio = 100.0;
+        let report = ShadowReport::compare(&candidate, &candidate, &sampled, &config.filters);
+        assert!(report.passed(), "{}", report.render());
+        sampled.truncate(MIN_SHADOW_SAMPLES - 1);
+        let report = ShadowReport::compare(&active, &candidate, &sampled, &config.filters);
+        assert!(report.passed());
+    }
+
+    #[test]
+    fn test_percentile() {
+        let mut samples: Vec<u64> = (1..=100).rev().collect();
+        assert_eq!(percentile(&mut samples, 0.5), Duration::from_nanos(50));
+        assert_eq!(percentile(&mut samples, 0.99), Duration::from_nanos(99));
+        assert_eq!(percentile(&mut [], 0.99), Duration::ZERO);
+    }
+}
@@ -0,0 +1,427 @@
+//! Shared-memory transport for the companion protocol
+//!
+//! A request over the companion socket costs a write and a read on each
+//! side, and the reply only arrives after the scheduler has run the
+//! companion thread. On a [`SharedChannel`] the app and the companion share
+//! a `memfd` mapping holding one request and one response slot. The app
+//! writes its request and publishes it through a state word, then spins
+//! briefly for the answer; only if the companion has not answered yet does
+//! it sleep on the state word with `futex(2)`. Each side marks itself
+//! sleeping before it waits, and the other side only issues a wake when
+//! that mark is set, so a request answered within the spin costs no system
+//! call at all.
+//!
+//! The channel is set up over the socket: the companion creates the region
+//! and passes its descriptor with `SCM_RIGHTS`. Messages are the same JSON
+//! as on the socket and the [`CompanionClient`](crate::companion::CompanionClient)
+//! API does not change. The socket stays open so the companion notices when
+//! the app goes away.
+
+use std::io;
+use std::mem;
+use std::os::fd::{AsFd, AsRawFd, BorrowedFd, FromRawFd, OwnedFd, RawFd};
+use std::ptr;
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::time::{Duration, Instant};
+
+use crate::error::{Result, ZygiskError};
+
+/// Largest request or response a slot holds
+pub const SLOT_BYTES: usize = 1024 * 1024;
+
+/// Bytes reserved for the header, one cache line
+const HEADER_BYTES: usize = 64;
+
+/// Size of the shared region
+const REGION_BYTES: usize = HEADER_BYTES + 2 * SLOT_BYTES;
+
+/// Polls of the state word before the app sleeps on it
+const SPIN_ITERATIONS: u32 = 4096;
+
+/// No request in flight
+const IDLE: u32 = 0;
+/// The app published a request
+const REQUEST: u32 = 1;
+/// The companion published the response
+const RESPONSE: u32 = 2;
+/// The app closed the channel
+const CLOSED: u32 = 3;
+
+/// Start of the shared region
+#[repr(C)]
+struct Header {
+    /// One of `IDLE`, `REQUEST`, `RESPONSE` or `CLOSED`; the futex word
+    state: AtomicU32,
+    /// Set while the app sleeps waiting for a response
+    app_sleeping: AtomicU32,
+    /// Set while the companion sleeps waiting for a request
+    companion_sleeping: AtomicU32,
+    request_len: AtomicU32,
+    response_len: AtomicU32,
+}
+
+/// Outcome of waiting for a request
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Wait {
+    /// A request was answered
+    Served,
+    /// Nothing arrived in time
+    Idle,
+    /// The app closed the channel
+    Closed,
+}
+
+/// One side of a shared-memory request channel
+#[derive(Debug)]
+pub struct SharedChannel {
+    fd: OwnedFd,
+    base: *mut u8,
+}
+
+// SAFETY: the mapping is owned by the channel and only reached through
+// `&mut self` or atomics in the header, so it can move between threads.
+unsafe impl Send for SharedChannel {}
+
+impl SharedChannel {
+    /// Create a new region, as the companion does for each app
+    pub fn create() -> Result<Self> {
+        let name = b"aubo-rpc\0";
+        // SAFETY: `name` is NUL-terminated and outlives the call
+        let raw = unsafe { libc::syscall(libc::SYS_memfd_create, name.as_ptr(), libc::MFD_CLOEXEC) };
+        if raw < 0 {
+            return Err(io::Error::last_os_error().into());
+        }
+        // SAFETY: memfd_create returned a new descriptor that nothing else owns
+        let fd = unsafe { OwnedFd::from_raw_fd(raw as RawFd) };
+        // SAFETY: plain syscall on a descriptor we own
+        if unsafe { libc::ftruncate(fd.as_raw_fd(), REGION_BYTES as libc::off_t) } != 0 {
+            return Err(io::Error::last_os_error().into());
+        }
+        Self::map(fd)
+    }
+
+    /// Map a region received from the companion
+    pub fn from_fd(fd: OwnedFd) -> Result<Self> {
+        // SAFETY: all-zero is a valid `stat`, and fstat only writes into it
+        let mut stat: libc::stat = unsafe { mem::zeroed() };
+        // SAFETY: `stat` is a valid out pointer for the call
+        if unsafe { libc::fstat(fd.as_raw_fd(), &mut stat) } != 0 {
+            return Err(io::Error::last_os_error().into());
+        }
+        if stat.st_size as usize != REGION_BYTES {
+            return Err(ipc_error(format!("shared region has {} bytes, expected {}", stat.st_size, REGION_BYTES)));
+        }
+        Self::map(fd)
+    }
+
+    fn map(fd: OwnedFd) -> Result<Self> {
+        // SAFETY: a fresh shared mapping of a descriptor we own; the result is checked
+        let base = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                REGION_BYTES,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_SHARED,
+                fd.as_raw_fd(),
+                0,
+            )
+        };
+        if base == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error().into());
+        }
+        Ok(Self { fd, base: base.cast() })
+    }
+
+    /// Get the descriptor of the region, to pass to the app
+    pub fn fd(&self) -> BorrowedFd<'_> {
+        self.fd.as_fd()
+    }
+
+    fn header(&self) -> &Header {
+        // SAFETY: the mapping is page aligned, at least HEADER_BYTES long and
+        // lives as long as `self`; the header only holds atomics
+        unsafe { &*(self.base as *const Header) }
+    }
+
+    fn write_slot(&mut self, offset: usize, bytes: &[u8]) {
+        debug_assert!(bytes.len() <= SLOT_BYTES);
+        // SAFETY: the slot lies within the mapping and the peer does not
+        // touch it until the state word hands it over
+        unsafe { ptr::copy_nonoverlapping(bytes.as_ptr(), self.base.add(offset), bytes.len()) };
+    }
+
+    fn read_slot(&self, offset: usize, len: u32) -> Vec<u8> {
+        // The peer is another process; never trust its length
+        let len = (len as usize).min(SLOT_BYTES);
+        let mut bytes = vec![0u8; len];
+        // SAFETY: as in `write_slot`, clamped to the slot
+        unsafe { ptr::copy_nonoverlapping(self.base.add(offset), bytes.as_mut_ptr(), len) };
+        bytes
+    }
+
+    /// Send a request and wait up to `timeout` for the response (app side)
+    pub fn call(&mut self, request: &[u8], timeout: Duration) -> Result<Vec<u8>> {
+        if request.len() > SLOT_BYTES {
+            return Err(ipc_error(format!("request of {} bytes exceeds slot", request.len())));
+        }
+        match self.header().state.load(Ordering::SeqCst) {
+            IDLE => {}
+            // The answer to a call that timed out
+            RESPONSE => self.header().state.store(IDLE, Ordering::SeqCst),
+            _ => return Err(ipc_error("companion is still busy with an earlier request".to_string())),
+        }
+
+        self.write_slot(HEADER_BYTES, request);
+        let header = self.header();
+        header.request_len.store(request.len() as u32, Ordering::Relaxed);
+        header.state.store(REQUEST, Ordering::SeqCst);
+        if header.companion_sleeping.load(Ordering::SeqCst) != 0 {
+            futex_wake(&header.state);
+        }
+
+        if !wait_for(&header.state, REQUEST, &header.app_sleeping, timeout) {
+            return Err(ipc_error("companion did not answer".to_string()));
+        }
+        let response = self.read_slot(HEADER_BYTES + SLOT_BYTES, header.response_len.load(Ordering::Relaxed));
+        self.header().state.store(IDLE, Ordering::SeqCst);
+        Ok(response)
+    }
+
+    /// Wait up to `idle` for a request and answer it with `handler`
+    /// (companion side)
+    pub fn serve_one(&mut self, idle: Duration, handler: impl FnOnce(&[u8]) -> Vec<u8>) -> Wait {
+        let header = self.header();
+        let mut state = header.state.load(Ordering::SeqCst);
+        if state != REQUEST && state != CLOSED {
+            // Idle, or the app has not picked up the previous response yet
+            if !wait_for(&header.state, state, &header.companion_sleeping, idle) {
+                return Wait::Idle;
+            }
+            state = header.state.load(Ordering::SeqCst);
+        }
+        match state {
+            REQUEST => {}
+            CLOSED => return Wait::Closed,
+            _ => return Wait::Idle,
+        }
+
+        let request = self.read_slot(HEADER_BYTES, header.request_len.load(Ordering::Relaxed));
+        let response = handler(&request);
+        let len = response.len().min(SLOT_BYTES);
+        self.write_slot(HEADER_BYTES + SLOT_BYTES, &response[..len]);
+        let header = self.header();
+        header.response_len.store(len as u32, Ordering::Relaxed);
+        header.state.store(RESPONSE, Ordering::SeqCst);
+        if header.app_sleeping.load(Ordering::SeqCst) != 0 {
+            futex_wake(&header.state);
+        }
+        Wait::Served
+    }
+
+    /// Tell the companion the app is done with the channel
+    pub fn close(&self) {
+        let header = self.header();
+        header.state.store(CLOSED, Ordering::SeqCst);
+        futex_wake(&header.state);
+    }
+}
+
+impl Drop for SharedChannel {
+    fn drop(&mut self) {
+        // SAFETY: `base` is the start of a mapping of REGION_BYTES made in `map`
+        unsafe { libc::munmap(self.base.cast(), REGION_BYTES) };
+    }
+}
+
+/// Wait until `state` moves away from `current`
+///
+/// Spins first, then sleeps on the futex with `sleeping` set so the other
+/// side knows to wake us. Returns `false` on timeout.
+fn wait_for(state: &AtomicU32, current: u32, sleeping: &AtomicU32, timeout: Duration) -> bool {
+    for _ in 0..SPIN_ITERATIONS {
+        if state.load(Ordering::SeqCst) != current {
+            return true;
+        }
+        std::hint::spin_loop();
+    }
+
+    let deadline = Instant::now() + timeout;
+    loop {
+        sleeping.store(1, Ordering::SeqCst);
+        // Re-check after announcing the sleep, or a wake could be missed
+        if state.load(Ordering::SeqCst) != current {
+            sleeping.store(0, Ordering::SeqCst);
+            return true;
+        }
+        let remaining = deadline.saturating_duration_since(Instant::now());
+        if remaining.is_zero() {
+            sleeping.store(0, Ordering::SeqCst);
+            return false;
+        }
+        futex_wait(state, current, remaining);
+        sleeping.store(0, Ordering::SeqCst);
+        if state.load(Ordering::SeqCst) != current {
+            return true;
+        }
+    }
+}
+
+fn futex_wait(word: &AtomicU32, expected: u32, timeout: Duration) {
+    let timeout = libc::timespec {
+        tv_sec: timeout.as_secs() as libc::time_t,
+        tv_nsec: timeout.subsec_nanos() as libc::c_long,
+    };
+    // SAFETY: `word` is a live, aligned u32 in a shared mapping; a shared
+    // (not private) futex because the waker is another process. Spurious
+    // returns are handled by the caller re-checking the word.
+    unsafe {
+        libc::syscall(libc::SYS_futex, word.as_ptr(), libc::FUTEX_WAIT, expected, &timeout as *const libc::timespec);
+    }
+}
+
+fn futex_wake(word: &AtomicU32) {
+    // SAFETY: as in `futex_wait`
+    unsafe {
+        libc::syscall(libc::SYS_futex, word.as_ptr(), libc::FUTEX_WAKE, 1);
+    }
+}
+
+/// Pass `fd` over a UNIX socket with `SCM_RIGHTS`
+pub fn send_fd(socket: RawFd, fd: BorrowedFd<'_>) -> Result<()> {
+    let mut payload = [0u8; 1];
+    let mut iov = libc::iovec {
+        iov_base: payload.as_mut_ptr().cast(),
+        iov_len: payload.len(),
+    };
+    let mut control = [0u64; 4];
+    // SAFETY: all-zero is a valid msghdr; every pointer set below outlives the call
+    let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr().cast();
+    // SAFETY: CMSG_SPACE is a pure size computation
+    msg.msg_controllen = unsafe { libc::CMSG_SPACE(mem::size_of::<RawFd>() as u32) } as _;
+
+    // SAFETY: the control buffer is large enough for one descriptor, so the
+    // first header exists and its data fits
+    unsafe {
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        (*cmsg).cmsg_level = libc::SOL_SOCKET;
+        (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+        (*cmsg).cmsg_len = libc::CMSG_LEN(mem::size_of::<RawFd>() as u32) as _;
+        ptr::write_unaligned(libc::CMSG_DATA(cmsg) as *mut RawFd, fd.as_raw_fd());
+    }
+
+    // SAFETY: `msg` is fully initialized and points at live buffers
+    if unsafe { libc::sendmsg(socket, &msg, 0) } != 1 {
+        return Err(io::Error::last_os_error().into());
+    }
+    Ok(())
+}
+
+/// Receive a descriptor sent with [`send_fd`]
+pub fn recv_fd(socket: RawFd) -> Result<OwnedFd> {
+    let mut payload = [0u8; 1];
+    let mut iov = libc::iovec {
+        iov_base: payload.as_mut_ptr().cast(),
+        iov_len: payload.len(),
+    };
+    let mut control = [0u64; 4];
+    // SAFETY: as in `send_fd`
+    let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr().cast();
+    msg.msg_controllen = mem::size_of_val(&control) as _;
+
+    // SAFETY: `msg` points at live buffers of the sizes it states
+    if unsafe { libc::recvmsg(socket, &mut msg, libc::MSG_CMSG_CLOEXEC) } != 1 {
+        return Err(ipc_error("no descriptor received".to_string()));
+    }
+    // SAFETY: the kernel filled `msg`; the header is checked before its data is read
+    unsafe {
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        if cmsg.is_null() || (*cmsg).cmsg_level != libc::SOL_SOCKET || (*cmsg).cmsg_type != libc::SCM_RIGHTS {
+            return Err(ipc_error("no descriptor received".to_string()));
+        }
+        let fd = ptr::read_unaligned(libc::CMSG_DATA(cmsg) as *const RawFd);
+        Ok(OwnedFd::from_raw_fd(fd))
+    }
+}
+
+/// Whether the peer of `socket` is still connected and sent nothing
+///
+/// Data on the socket means the app went back to socket requests.
+pub fn socket_idle(socket: RawFd) -> bool {
+    let mut byte = 0u8;
+    // SAFETY: one-byte peek into a local buffer
+    let read = unsafe { libc::recv(socket, (&mut byte as *mut u8).cast(), 1, libc::MSG_PEEK | libc::MSG_DONTWAIT) };
+    read < 0 && io::Error::last_os_error().kind() == io::ErrorKind::WouldBlock
+}
+
+fn ipc_error(reason: String) -> crate::error::AuboError {
+    ZygiskError::IpcError { reason }.into()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::os::unix::net::UnixStream;
+    use std::thread;
+
+    /// Second mapping of the same region, as the app would have
+    fn peer(channel: &SharedChannel) -> SharedChannel {
+        SharedChannel::from_fd(channel.fd().try_clone_to_owned().unwrap()).unwrap()
+    }
+
+    #[test]
+    fn test_round_trips() {
+        let mut companion = SharedChannel::create().unwrap();
+        let mut app = peer(&companion);
+
+        let server = thread::spawn(move || {
+            let mut served = 0;
+            loop {
+                match companion.serve_one(Duration::from_secs(5), |request| request.iter().rev().copied().collect()) {
+                    Wait::Served => served += 1,
+                    Wait::Idle => {}
+                    Wait::Closed => return served,
+                }
+            }
+        });
+
+        for i in 0..200u32 {
+            let request = format!("request {}", i).into_bytes();
+            let response = app.call(&request, Duration::from_secs(5)).unwrap();
+            assert_eq!(response, request.iter().rev().copied().collect::<Vec<_>>());
+        }
+        // Sleeping past the spin exercises the futex path
+        thread::sleep(Duration::from_millis(20));
+        assert_eq!(app.call(b"late", Duration::from_secs(5)).unwrap(), b"etal");
+
+        app.close();
+        assert_eq!(server.join().unwrap(), 201);
+    }
+
+    #[test]
+    fn test_unanswered_call_times_out() {
+        let companion = SharedChannel::create().unwrap();
+        let mut app = peer(&companion);
+        assert!(app.call(b"hello", Duration::from_millis(20)).is_err());
+        assert!(SharedChannel::from_fd(companion.fd().try_clone_to_owned().unwrap()).is_ok());
+    }
+
+    #[test]
+    fn test_fd_passing() {
+        let (left, right) = UnixStream::pair().unwrap();
+        let companion = SharedChannel::create().unwrap();
+        send_fd(left.as_raw_fd(), companion.fd()).unwrap();
+        let app = SharedChannel::from_fd(recv_fd(right.as_raw_fd()).unwrap()).unwrap();
+
+        app.header().request_len.store(42, Ordering::SeqCst);
+        assert_eq!(companion.header().request_len.load(Ordering::SeqCst), 42);
+        assert!(socket_idle(right.as_raw_fd()));
+        drop(left);
+        assert!(!socket_idle(right.as_raw_fd()));
+    }
+}
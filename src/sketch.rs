@@ -0,0 +1,290 @@
+//! Distinct-host sketches for aubo-rs
+//!
+//! Counting how many different hosts an app contacts would need every host
+//! to be remembered. A HyperLogLog sketch estimates the same number from a
+//! fixed array of small registers: each host is hashed once, the top bits
+//! pick a register and the register keeps the longest run of leading zeros
+//! seen in the remaining bits. With 2048 registers the estimate is within a
+//! few percent, and two sketches of the same hosts merge by taking the
+//! larger value per register.
+//!
+//! Apps update their sketches on the lookup path with atomic maxima and
+//! forward them with their stats deltas; the companion merges them per app.
+
+use std::sync::atomic::{AtomicBool, AtomicU8, Ordering};
+
+use serde::{Deserialize, Serialize};
+
+/// Number of hash bits used to pick a register
+pub const HLL_PRECISION: u32 = 11;
+
+/// Registers per sketch
+pub const HLL_REGISTERS: usize = 1 << HLL_PRECISION;
+
+/// Hash a host name, ignoring ASCII case
+///
+/// FNV-1a followed by a 64-bit finalizer, so sketches built by different
+/// processes and builds agree.
+pub fn host_hash(host: &str) -> u64 {
+    let hash = host
+        .bytes()
+        .fold(0xcbf2_9ce4_8422_2325u64, |hash, byte| {
+            (hash ^ byte.to_ascii_lowercase() as u64).wrapping_mul(0x0100_0000_01b3)
+        });
+
+    // splitmix64 finalizer spreads FNV's weak high bits
+    let mut z = hash.wrapping_add(0x9e37_79b9_7f4a_7c15);
+    z = (z ^ (z >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    z = (z ^ (z >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+    z ^ (z >> 31)
+}
+
+/// HyperLogLog sketch with lock-free updates
+#[derive(Debug)]
+pub struct HyperLogLog {
+    registers: Box<[AtomicU8]>,
+    changed: AtomicBool,
+}
+
+impl Default for HyperLogLog {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl HyperLogLog {
+    /// Create an empty sketch
+    pub fn new() -> Self {
+        Self {
+            registers: (0..HLL_REGISTERS).map(|_| AtomicU8::new(0)).collect(),
+            changed: AtomicBool::new(false),
+        }
+    }
+
+    /// Add a hashed item
+    pub fn insert_hash(&self, hash: u64) {
+        let index = (hash >> (64 - HLL_PRECISION)) as usize;
+        let rank = ((hash << HLL_PRECISION).leading_zeros() + 1).min(64 - HLL_PRECISION + 1) as u8;
+        let register = &self.registers[index];
+        // Most inserts repeat a known host, so check before writing
+        if register.load(Ordering::Relaxed) < rank && register.fetch_max(rank, Ordering::Relaxed) < rank {
+            self.changed.store(true, Ordering::Release);
+        }
+    }
+
+    /// Merge registers from another sketch, returning whether any grew
+    ///
+    /// Registers of the wrong length are ignored.
+    pub fn merge_registers(&self, registers: &[u8]) -> bool {
+        if registers.len() != HLL_REGISTERS {
+            return false;
+        }
+        let mut grew = false;
+        for (register, &rank) in self.registers.iter().zip(registers) {
+            grew |= register.fetch_max(rank, Ordering::Relaxed) < rank;
+        }
+        if grew {
+            self.changed.store(true, Ordering::Release);
+        }
+        grew
+    }
+
+    /// Copy the registers
+    pub fn registers(&self) -> Vec<u8> {
+        self.registers.iter().map(|register| register.load(Ordering::Relaxed)).collect()
+    }
+
+    /// Copy the registers if they changed since the last call
+    pub fn take_changed(&self) -> Option<Vec<u8>> {
+        self.changed.swap(false, Ordering::AcqRel).then(|| self.registers())
+    }
+
+    /// Estimate the number of distinct items
+    pub fn estimate(&self) -> u64 {
+        let m = HLL_REGISTERS as f64;
+        let mut sum = 0.0;
+        let mut zeros = 0;
+        for register in self.registers.iter() {
+            let rank = register.load(Ordering::Relaxed);
+            sum += 1.0 / (1u64 << rank) as f64;
+            zeros += (rank == 0) as usize;
+        }
+
+        let alpha = 0.7213 / (1.0 + 1.079 / m);
+        let raw = alpha * m * m / sum;
+        // Linear counting is more accurate while many registers are empty
+        let estimate = if raw <= 2.5 * m && zeros > 0 {
+            m * (m / zeros as f64).ln()
+        } else {
+            raw
+        };
+        estimate.round() as u64
+    }
+}
+
+/// Registers of both host sketches, as forwarded to the companion
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct HostSketches {
+    /// Registers of the distinct-hosts sketch, empty if unchanged
+    pub hosts: Vec<u8>,
+    /// Registers of the distinct-blocked-hosts sketch, empty if unchanged
+    pub blocked_hosts: Vec<u8>,
+}
+
+impl HostSketches {
+    /// Fold newer registers into these
+    pub fn merge(&mut self, other: HostSketches) {
+        merge_max(&mut self.hosts, other.hosts);
+        merge_max(&mut self.blocked_hosts, other.blocked_hosts);
+    }
+}
+
+fn merge_max(into: &mut Vec<u8>, from: Vec<u8>) {
+    if into.len() != from.len() {
+        if into.is_empty() {
+            *into = from;
+        }
+        return;
+    }
+    for (rank, other) in into.iter_mut().zip(from) {
+        *rank = (*rank).max(other);
+    }
+}
+
+/// Distinct hosts and distinct blocked hosts of one app
+#[derive(Debug, Default)]
+pub struct HostCardinality {
+    hosts: HyperLogLog,
+    blocked_hosts: HyperLogLog,
+}
+
+impl HostCardinality {
+    /// Bytes of a serialized pair of sketches
+    pub const ENCODED_BYTES: usize = 2 * HLL_REGISTERS;
+
+    /// Create empty sketches
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Count a looked-up host, hashing it once for both sketches
+    pub fn record(&self, host: &str, blocked: bool) {
+        let hash = host_hash(host);
+        self.hosts.insert_hash(hash);
+        if blocked {
+            self.blocked_hosts.insert_hash(hash);
+        }
+    }
+
+    /// Take the registers of the sketches that changed since the last call
+    pub fn take_changed(&self) -> Option<HostSketches> {
+        let hosts = self.hosts.take_changed();
+        let blocked_hosts = self.blocked_hosts.take_changed();
+        if hosts.is_none() && blocked_hosts.is_none() {
+            return None;
+        }
+        Some(HostSketches {
+            hosts: hosts.unwrap_or_default(),
+            blocked_hosts: blocked_hosts.unwrap_or_default(),
+        })
+    }
+
+    /// Merge forwarded registers, returning whether anything grew
+    pub fn merge(&self, sketches: &HostSketches) -> bool {
+        let hosts = self.hosts.merge_registers(&sketches.hosts);
+        let blocked_hosts = self.blocked_hosts.merge_registers(&sketches.blocked_hosts);
+        hosts || blocked_hosts
+    }
+
+    /// Estimated number of distinct hosts
+    pub fn distinct_hosts(&self) -> u64 {
+        self.hosts.estimate()
+    }
+
+    /// Estimated number of distinct blocked hosts
+    pub fn distinct_blocked_hosts(&self) -> u64 {
+        self.blocked_hosts.estimate()
+    }
+
+    /// Serialize both sketches as raw registers
+    pub fn to_bytes(&self) -> Vec<u8> {
+        let mut bytes = self.hosts.registers();
+        bytes.extend(self.blocked_hosts.registers());
+        bytes
+    }
+
+    /// Load sketches written by [`Self::to_bytes`]
+    pub fn from_bytes(bytes: &[u8]) -> Option<Self> {
+        if bytes.len() != Self::ENCODED_BYTES {
+            return None;
+        }
+        let sketches = Self::new();
+        let (hosts, blocked_hosts) = bytes.split_at(HLL_REGISTERS);
+        sketches.hosts.merge_registers(hosts);
+        sketches.blocked_hosts.merge_registers(blocked_hosts);
+        sketches.hosts.changed.store(false, Ordering::Relaxed);
+        sketches.blocked_hosts.changed.store(false, Ordering::Relaxed);
+        Some(sketches)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn assert_close(estimate: u64, actual: u64) {
+        let error = (estimate as f64 - actual as f64).abs() / actual as f64;
+        assert!(error < 0.05, "estimate {} for {} is off by {:.1}%", estimate, actual, error * 100.0);
+    }
+
+    #[test]
+    fn test_estimates_distinct_hosts() {
+        let sketches = HostCardinality::new();
+        for round in 0..3 {
+            for i in 0..20_000 {
+                sketches.record(&format!("host{}.example.com", i), i % 10 == 0);
+            }
+            // Repeats and case changes add nothing
+            if round == 0 {
+                sketches.record("HOST1.example.com", false);
+            }
+        }
+
+        assert_close(sketches.distinct_hosts(), 20_000);
+        assert_close(sketches.distinct_blocked_hosts(), 2_000);
+        assert_eq!(HostCardinality::new().distinct_hosts(), 0);
+    }
+
+    #[test]
+    fn test_merge_matches_union() {
+        let left = HostCardinality::new();
+        let right = HostCardinality::new();
+        for i in 0..3_000 {
+            left.record(&format!("a{}.net", i), false);
+            right.record(&format!("a{}.net", i + 1_500), true);
+        }
+
+        let merged = HostCardinality::new();
+        assert!(merged.merge(&left.take_changed().unwrap()));
+        assert!(merged.merge(&right.take_changed().unwrap()));
+        assert_close(merged.distinct_hosts(), 4_500);
+        assert_close(merged.distinct_blocked_hosts(), 3_000);
+
+        // Merging the same registers again changes nothing
+        assert!(!merged.merge(&HostSketches {
+            hosts: left.hosts.registers(),
+            blocked_hosts: Vec::new(),
+        }));
+        assert!(left.take_changed().is_none());
+    }
+
+    #[test]
+    fn test_byte_round_trip() {
+        let sketches = HostCardinality::new();
+        sketches.record("tracker.net", true);
+        let loaded = HostCardinality::from_bytes(&sketches.to_bytes()).unwrap();
+        assert_eq!((loaded.distinct_hosts(), loaded.distinct_blocked_hosts()), (1, 1));
+        assert!(loaded.take_changed().is_none());
+        assert!(HostCardinality::from_bytes(&[0; 3]).is_none());
+    }
+}
@@ -0,0 +1,277 @@
+//! Slow-verdict sampling for aubo-rs
+//!
+//! Latency histograms say that the p999 moved, not which lookups moved it.
+//! Every process keeps a reservoir of the slowest lookups of the current
+//! reporting interval. A lookup faster than the fastest retained sample is
+//! turned away with one relaxed atomic load, so the sampler stays on in
+//! production; only lookups that make it into the reservoir take its lock.
+//!
+//! Per-stage times would cost a clock read per stage on every lookup.
+//! Instead, when the app reports, each sample is evaluated again with a
+//! [`StageTimer`] attached. Slow inputs are slow because of what they are
+//! (a long URL scanned by many regexes, a deep subdomain), so the replay
+//! shows where the time went. The companion keeps the most recent samples
+//! of each app for the `slow-lookups` control command.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+use parking_lot::Mutex;
+use serde::{Deserialize, Serialize};
+
+use crate::reqlog::{RuleId, RuleKind};
+use crate::utils::TimeUtils;
+
+/// Slowest lookups kept per reporting interval
+pub const SLOW_SAMPLES: usize = 8;
+
+/// Longest URL kept in a sample
+const MAX_SAMPLE_URL: usize = 256;
+
+/// Stage of the verdict path
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(rename_all = "snake_case")]
+pub enum Stage {
+    /// Extracting the domain from the URL
+    Parse,
+    /// Checking the domain and its parents against the allowlist
+    Allowlist,
+    /// Checking the domain and its parents against the blocklist
+    Blocklist,
+    /// Scanning the URL with the literal pattern automaton
+    Patterns,
+    /// Trying the regex rules in order
+    Regex,
+}
+
+impl Stage {
+    /// Name used in reports
+    pub fn name(self) -> &'static str {
+        match self {
+            Stage::Parse => "parse",
+            Stage::Allowlist => "allowlist",
+            Stage::Blocklist => "blocklist",
+            Stage::Patterns => "patterns",
+            Stage::Regex => "regex",
+        }
+    }
+}
+
+/// Name of the deepest tier a lookup reached
+pub fn tier_name(rule: RuleId) -> &'static str {
+    match rule.kind() {
+        RuleKind::Cached => "cache",
+        RuleKind::AllowedDomain => "allowlist",
+        RuleKind::BlockedDomain => "blocklist",
+        RuleKind::Pattern => "patterns",
+        RuleKind::Regex => "regex",
+        // Nothing matched, so every tier ran
+        RuleKind::None => "all",
+    }
+}
+
+/// Observer of a rule evaluation
+///
+/// The engine calls it as it moves through the stages. The `()` probe does
+/// nothing and compiles away on the lookup path.
+pub trait StageProbe {
+    /// A stage starts; the previous one, if any, is done
+    fn enter(&mut self, _stage: Stage) {}
+
+    /// One rule or domain entry was checked
+    fn rule_evaluated(&mut self) {}
+}
+
+impl StageProbe for () {}
+
+/// Where one lookup spent its time
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct LookupProfile {
+    /// Time per stage in nanoseconds, in the order the stages ran
+    pub stages: Vec<(Stage, u64)>,
+    /// Rules and domain entries checked
+    pub rules_evaluated: u32,
+    /// Text of the deciding rule, if one matched
+    pub rule_text: Option<String>,
+}
+
+/// Probe that times each stage of an evaluation
+#[derive(Debug, Default)]
+pub struct StageTimer {
+    current: Option<(Stage, Instant)>,
+    profile: LookupProfile,
+}
+
+impl StageTimer {
+    /// Create a timer with no stage started
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    fn close_stage(&mut self) {
+        if let Some((stage, started)) = self.current.take() {
+            let nanos = started.elapsed().as_nanos().min(u64::MAX as u128) as u64;
+            self.profile.stages.push((stage, nanos));
+        }
+    }
+
+    /// Stop timing and get the profile
+    pub fn finish(mut self) -> LookupProfile {
+        self.close_stage();
+        self.profile
+    }
+}
+
+impl StageProbe for StageTimer {
+    fn enter(&mut self, stage: Stage) {
+        self.close_stage();
+        self.current = Some((stage, Instant::now()));
+    }
+
+    fn rule_evaluated(&mut self) {
+        self.profile.rules_evaluated = self.profile.rules_evaluated.saturating_add(1);
+    }
+}
+
+/// One slow lookup
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct SlowLookup {
+    /// Time of the lookup in milliseconds since the epoch
+    pub timestamp_ms: u64,
+    /// Looked-up host or URL, truncated
+    pub url: String,
+    /// Request type reported by the hook
+    pub request_type: String,
+    /// Lookup latency in nanoseconds
+    pub latency_ns: u64,
+    /// Rule that decided the verdict
+    pub rule: RuleId,
+    /// Replayed stage times, filled in when the app reports
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub profile: Option<LookupProfile>,
+}
+
+impl SlowLookup {
+    /// Lookup latency
+    pub fn latency(&self) -> Duration {
+        Duration::from_nanos(self.latency_ns)
+    }
+}
+
+/// Keep the `limit` slowest of `samples`, slowest first
+pub fn keep_slowest(samples: &mut Vec<SlowLookup>, limit: usize) {
+    samples.sort_by(|a, b| b.latency_ns.cmp(&a.latency_ns));
+    samples.truncate(limit);
+}
+
+/// Reservoir of the slowest lookups since the last report
+#[derive(Debug, Default)]
+pub struct SlowLookupSampler {
+    /// Latency a lookup must exceed to be kept, zero until the reservoir fills
+    threshold_ns: AtomicU64,
+    samples: Mutex<Vec<SlowLookup>>,
+}
+
+impl SlowLookupSampler {
+    /// Create an empty sampler
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Offer a finished lookup
+    pub fn record(&self, url: &str, request_type: &str, rule: RuleId, latency: Duration) {
+        let latency_ns = latency.as_nanos().min(u64::MAX as u128) as u64;
+        if latency_ns <= self.threshold_ns.load(Ordering::Relaxed) {
+            return;
+        }
+
+        let mut samples = self.samples.lock();
+        if samples.len() >= SLOW_SAMPLES {
+            let Some(fastest) = samples.iter().enumerate().min_by_key(|(_, sample)| sample.latency_ns).map(|(i, _)| i)
+            else {
+                return;
+            };
+            if samples[fastest].latency_ns >= latency_ns {
+                return;
+            }
+            samples.swap_remove(fastest);
+        }
+
+        let mut end = url.len().min(MAX_SAMPLE_URL);
+        while !url.is_char_boundary(end) {
+            end -= 1;
+        }
+        samples.push(SlowLookup {
+            timestamp_ms: TimeUtils::now_millis(),
+            url: url[..end].to_string(),
+            request_type: request_type.to_string(),
+            latency_ns,
+            rule,
+            profile: None,
+        });
+        if samples.len() >= SLOW_SAMPLES {
+            let fastest = samples.iter().map(|sample| sample.latency_ns).min().unwrap_or(0);
+            self.threshold_ns.store(fastest, Ordering::Relaxed);
+        }
+    }
+
+    /// Take the samples of the interval, slowest first, and start a new one
+    pub fn take(&self) -> Vec<SlowLookup> {
+        let mut samples = std::mem::take(&mut *self.samples.lock());
+        self.threshold_ns.store(0, Ordering::Relaxed);
+        keep_slowest(&mut samples, SLOW_SAMPLES);
+        samples
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_reservoir_keeps_the_slowest() {
+        let sampler = SlowLookupSampler::new();
+        for i in 0..100u64 {
+            let latency = Duration::from_micros((i * 37) % 101);
+            sampler.record(&format!("host{}.net", i), "dns", RuleId::NONE, latency);
+        }
+
+        let samples = sampler.take();
+        assert_eq!(samples.len(), SLOW_SAMPLES);
+        let latencies: Vec<u64> = samples.iter().map(|sample| sample.latency_ns / 1000).collect();
+        assert_eq!(latencies, vec![100, 99, 98, 97, 96, 95, 94, 93]);
+        assert!(samples.iter().all(|sample| sample.request_type == "dns"));
+
+        // The next interval starts empty and accepts fast lookups again
+        assert!(sampler.take().is_empty());
+        sampler.record("fast.net", "dns", RuleId::NONE, Duration::from_nanos(1));
+        assert_eq!(sampler.take()[0].url, "fast.net");
+    }
+
+    #[test]
+    fn test_long_urls_are_truncated_on_char_boundaries() {
+        let sampler = SlowLookupSampler::new();
+        let url = format!("https://example.com/{}", "é".repeat(200));
+        sampler.record(&url, "http", RuleId::new(RuleKind::Regex, 3), Duration::from_millis(2));
+
+        let sample = &sampler.take()[0];
+        assert!(sample.url.len() <= MAX_SAMPLE_URL);
+        assert!(url.starts_with(&sample.url));
+        assert_eq!(tier_name(sample.rule), "regex");
+    }
+
+    #[test]
+    fn test_stage_timer_records_stages_in_order() {
+        let mut timer = StageTimer::new();
+        timer.enter(Stage::Parse);
+        timer.enter(Stage::Allowlist);
+        timer.rule_evaluated();
+        timer.rule_evaluated();
+        timer.enter(Stage::Blocklist);
+        let profile = timer.finish();
+
+        let stages: Vec<Stage> = profile.stages.iter().map(|(stage, _)| *stage).collect();
+        assert_eq!(stages, vec![Stage::Parse, Stage::Allowlist, Stage::Blocklist]);
+        assert_eq!(profile.rules_evaluated, 2);
+    }
+}
@@ -1,9 +1,73 @@
 use std::collections::HashMap;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
 use std::sync::Arc;
-use std::time::{SystemTime, UNIX_EPOCH};
-use parking_lot::RwLock;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+use ahash::RandomState;
+use parking_lot::{Mutex, RwLock};
 use serde::{Deserialize, Serialize};
+use crate::avoided::{AvoidedDelta, WorkAvoidedTracker};
 use crate::error::{AuboError, StatsError};
+use crate::memory::{string_map_heap_bytes, MemoryBreakdown};
+use crate::sketch::{HostCardinality, HostSketches};
+use crate::slowlog::{keep_slowest, SlowLookup, SLOW_SAMPLES};
+use crate::upstream::{UpstreamDelta, UpstreamTracker};
+
+/// Name of the stats entry in the memory breakdown
+pub const STATS_STRUCTURE: &str = "stats";
+
+/// Number of buckets in a latency histogram
+pub const LATENCY_BUCKETS: usize = 32;
+
+/// Blocked domains kept in requeued deltas, the most blocked first
+pub const MAX_REQUEUED_DOMAINS: usize = 1024;
+
+/// Histogram bucket for a latency
+///
+/// Bucket `i` holds latencies below `2^i` nanoseconds and at least half
+/// that; the last bucket also takes everything slower.
+pub fn latency_bucket(latency: Duration) -> usize {
+    let nanos = latency.as_nanos().min(u64::MAX as u128) as u64;
+    ((u64::BITS - nanos.leading_zeros()) as usize).min(LATENCY_BUCKETS - 1)
+}
+
+/// Estimate a latency percentile from histogram bucket counts
+///
+/// Returns the upper bound of the bucket holding the `quantile` (0.0-1.0),
+/// or `None` if the histogram is empty.
+pub fn latency_percentile<T: Copy + Into<u64>>(buckets: &[T], quantile: f64) -> Option<Duration> {
+    let total: u64 = buckets.iter().map(|&count| count.into()).sum();
+    if total == 0 {
+        return None;
+    }
+
+    let rank = ((total as f64 * quantile.clamp(0.0, 1.0)).ceil() as u64).max(1);
+    let mut seen = 0;
+    for (bucket, &count) in buckets.iter().enumerate() {
+        seen += count.into();
+        if seen >= rank {
+            return Some(Duration::from_nanos(1u64 << bucket));
+        }
+    }
+    Some(Duration::from_nanos(1u64 << (buckets.len() - 1)))
+}
+
+/// Lock-free histogram of filter lookup latencies
+#[derive(Debug, Default)]
+pub struct LatencyHistogram {
+    buckets: [AtomicU64; LATENCY_BUCKETS],
+}
+
+impl LatencyHistogram {
+    /// Count one lookup
+    pub fn record(&self, latency: Duration) {
+        self.buckets[latency_bucket(latency)].fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Take the counts recorded since the last call
+    pub fn take(&self) -> Vec<u64> {
+        self.buckets.iter().map(|bucket| bucket.swap(0, Ordering::Relaxed)).collect()
+    }
+}
 
 /// Performance metrics for the ad blocker
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -32,6 +96,8 @@ pub struct Stats {
     pub domains_blocked: HashMap<String, u64>,
     pub request_types: HashMap<String, u64>,
     pub performance_metrics: PerformanceMetrics,
+    #[serde(default)]
+    pub memory_breakdown: MemoryBreakdown,
     pub start_time: u64,
     pub last_updated: u64,
 }
@@ -50,17 +116,414 @@ impl Default for Stats {
             domains_blocked: HashMap::new(),
             request_types: HashMap::new(),
             performance_metrics: PerformanceMetrics::default(),
+            memory_breakdown: MemoryBreakdown::default(),
             start_time: now,
             last_updated: now,
         }
     }
 }
 
+impl Stats {
+    /// Heap bytes held by the statistics
+    pub fn heap_bytes(&self) -> usize {
+        string_map_heap_bytes(&self.domains_blocked)
+            + string_map_heap_bytes(&self.request_types)
+            + self.memory_breakdown.heap_bytes()
+    }
+}
+
+/// Counter changes since the last time they were persisted
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct StatsDelta {
+    /// New requests
+    pub total_requests: u64,
+    /// New blocked requests
+    pub blocked_requests: u64,
+    /// New allowed requests
+    pub allowed_requests: u64,
+    /// New blocks per domain
+    pub domains_blocked: HashMap<String, u64>,
+    /// New requests per request type
+    pub request_types: HashMap<String, u64>,
+    /// New verdict cache hits
+    #[serde(default)]
+    pub cache_hits: u64,
+    /// New verdict cache misses
+    #[serde(default)]
+    pub cache_misses: u64,
+    /// New lookups per latency bucket, see [`latency_bucket`]
+    #[serde(default)]
+    pub latency_buckets: Vec<u64>,
+    /// Distinct-host sketches, if they changed
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub host_sketches: Option<HostSketches>,
+    /// Upstream DNS resolutions, if any
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub upstream: Option<UpstreamDelta>,
+    /// Work saved by blocking, per filter list, if any
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub avoided: Option<AvoidedDelta>,
+    /// Slowest lookups of the interval, slowest first
+    #[serde(default, skip_serializing_if = "Vec::is_empty")]
+    pub slow_lookups: Vec<SlowLookup>,
+    /// New lookups that exceeded the latency budget and were let through
+    #[serde(default)]
+    pub lookup_timeouts: u64,
+    /// New lookups let through unchecked by the open circuit breaker
+    #[serde(default)]
+    pub lookups_bypassed: u64,
+    /// New circuit breaker trips
+    #[serde(default)]
+    pub breaker_trips: u64,
+    /// New lookups answered with reduced matching, see [`crate::degrade`]
+    #[serde(default)]
+    pub degraded_lookups: u64,
+    /// Latest engine memory breakdown, attached when reporting
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    pub memory: Option<MemoryBreakdown>,
+}
+
+impl StatsDelta {
+    /// Check if nothing changed
+    pub fn is_empty(&self) -> bool {
+        self.total_requests == 0
+            && self.domains_blocked.is_empty()
+            && self.request_types.is_empty()
+            && self.cache_hits == 0
+            && self.cache_misses == 0
+            && self.latency_buckets.iter().all(|&count| count == 0)
+            && self.host_sketches.is_none()
+            && self.upstream.is_none()
+            && self.avoided.is_none()
+            && self.slow_lookups.is_empty()
+            && self.lookup_timeouts == 0
+            && self.lookups_bypassed == 0
+            && self.breaker_trips == 0
+            && self.degraded_lookups == 0
+    }
+
+    /// Add another delta to this one
+    pub fn merge(&mut self, other: StatsDelta) {
+        self.total_requests += other.total_requests;
+        self.blocked_requests += other.blocked_requests;
+        self.allowed_requests += other.allowed_requests;
+        for (domain, count) in other.domains_blocked {
+            *self.domains_blocked.entry(domain).or_insert(0) += count;
+        }
+        for (request_type, count) in other.request_types {
+            *self.request_types.entry(request_type).or_insert(0) += count;
+        }
+        self.cache_hits += other.cache_hits;
+        self.cache_misses += other.cache_misses;
+        if self.latency_buckets.len() < other.latency_buckets.len() {
+            self.latency_buckets.resize(other.latency_buckets.len(), 0);
+        }
+        for (bucket, count) in other.latency_buckets.into_iter().enumerate() {
+            self.latency_buckets[bucket] += count;
+        }
+        match (&mut self.host_sketches, other.host_sketches) {
+            (Some(sketches), Some(other)) => sketches.merge(other),
+            (sketches @ None, other) => *sketches = other,
+            (Some(_), None) => {}
+        }
+        match (&mut self.upstream, other.upstream) {
+            (Some(upstream), Some(other)) => upstream.merge(other),
+            (upstream @ None, other) => *upstream = other,
+            (Some(_), None) => {}
+        }
+        match (&mut self.avoided, other.avoided) {
+            (Some(avoided), Some(other)) => avoided.merge(other),
+            (avoided @ None, other) => *avoided = other,
+            (Some(_), None) => {}
+        }
+        if !other.slow_lookups.is_empty() {
+            self.slow_lookups.extend(other.slow_lookups);
+            keep_slowest(&mut self.slow_lookups, SLOW_SAMPLES);
+        }
+        self.lookup_timeouts += other.lookup_timeouts;
+        self.lookups_bypassed += other.lookups_bypassed;
+        self.breaker_trips += other.breaker_trips;
+        self.degraded_lookups += other.degraded_lookups;
+        if other.memory.is_some() {
+            self.memory = other.memory;
+        }
+    }
+
+    /// Add this delta to lifetime totals
+    ///
+    /// Cache and latency counters only feed the time series, see
+    /// [`crate::timeseries`], and the live metrics; host sketches are merged
+    /// per app by the companion.
+    pub fn apply_to(&self, stats: &mut Stats) {
+        stats.total_requests += self.total_requests;
+        stats.blocked_requests += self.blocked_requests;
+        stats.allowed_requests += self.allowed_requests;
+        for (domain, count) in &self.domains_blocked {
+            *stats.domains_blocked.entry(domain.clone()).or_insert(0) += count;
+        }
+        for (request_type, count) in &self.request_types {
+            *stats.request_types.entry(request_type.clone()).or_insert(0) += count;
+        }
+    }
+}
+
+/// Keep the `limit` domains with the most blocks
+fn keep_most_blocked(domains: &mut HashMap<String, u64>, limit: usize) {
+    if domains.len() <= limit {
+        return;
+    }
+    let mut entries: Vec<_> = domains.drain().collect();
+    entries.sort_by(|a, b| b.1.cmp(&a.1));
+    entries.truncate(limit);
+    domains.extend(entries);
+}
+
+/// Number of independently locked shards per keyed counter
+const COUNTER_SHARDS: usize = 16;
+
+/// A count and the change number of its last update
+#[derive(Debug, Clone, Copy, Default)]
+struct VersionedCount {
+    count: u64,
+    changed_at: u64,
+}
+
+/// Per-key counters split across independently locked shards
+///
+/// Each update draws a change number from the shared sequence while holding
+/// its shard lock. A reader that loads the sequence before scanning shard by
+/// shard therefore sees every update numbered at or below what it loaded.
+#[derive(Debug)]
+struct ShardedCounts {
+    shards: Vec<Mutex<HashMap<String, VersionedCount, RandomState>>>,
+    hasher: RandomState,
+}
+
+impl ShardedCounts {
+    fn new() -> Self {
+        Self {
+            shards: (0..COUNTER_SHARDS).map(|_| Mutex::new(HashMap::default())).collect(),
+            hasher: RandomState::new(),
+        }
+    }
+
+    fn shard(&self, key: &str) -> &Mutex<HashMap<String, VersionedCount, RandomState>> {
+        &self.shards[self.hasher.hash_one(key) as usize % COUNTER_SHARDS]
+    }
+
+    fn add(&self, key: &str, sequence: &AtomicU64) {
+        let mut shard = self.shard(key).lock();
+        let changed_at = sequence.fetch_add(1, Ordering::AcqRel) + 1;
+        match shard.get_mut(key) {
+            Some(entry) => {
+                entry.count += 1;
+                entry.changed_at = changed_at;
+            }
+            None => {
+                shard.insert(key.to_string(), VersionedCount { count: 1, changed_at });
+            }
+        }
+    }
+
+    /// Current counts of keys changed after `cursor`
+    fn changed_since(&self, cursor: u64) -> Vec<(String, u64)> {
+        let mut changed = Vec::new();
+        for shard in &self.shards {
+            let shard = shard.lock();
+            changed.extend(
+                shard
+                    .iter()
+                    .filter(|(_, entry)| entry.changed_at > cursor)
+                    .map(|(key, entry)| (key.clone(), entry.count)),
+            );
+        }
+        changed
+    }
+
+    fn to_map(&self) -> HashMap<String, u64> {
+        let mut map = HashMap::new();
+        for shard in &self.shards {
+            map.extend(shard.lock().iter().map(|(key, entry)| (key.clone(), entry.count)));
+        }
+        map
+    }
+
+    fn clear(&self) {
+        for shard in &self.shards {
+            shard.lock().clear();
+        }
+    }
+
+    fn heap_bytes(&self) -> usize {
+        self.shards.iter().map(|shard| string_map_heap_bytes(&shard.lock())).sum()
+    }
+}
+
+/// Request counters shared by all clones of a collector
+#[derive(Debug)]
+struct Counters {
+    /// Last change number handed out, never 0 as that cursor means no
+    /// export yet
+    sequence: AtomicU64,
+    /// Change number of the last reset
+    reset_at: AtomicU64,
+    total_requests: AtomicU64,
+    blocked_requests: AtomicU64,
+    allowed_requests: AtomicU64,
+    last_updated: AtomicU64,
+    domains_blocked: ShardedCounts,
+    request_types: ShardedCounts,
+}
+
+impl Counters {
+    fn new() -> Self {
+        Self {
+            sequence: AtomicU64::new(1),
+            reset_at: AtomicU64::new(0),
+            total_requests: AtomicU64::new(0),
+            blocked_requests: AtomicU64::new(0),
+            allowed_requests: AtomicU64::new(0),
+            last_updated: AtomicU64::new(0),
+            domains_blocked: ShardedCounts::new(),
+            request_types: ShardedCounts::new(),
+        }
+    }
+
+    fn record(&self, blocked_domain: Option<&str>, request_type: &str) {
+        self.total_requests.fetch_add(1, Ordering::Relaxed);
+        match blocked_domain {
+            Some(domain) => {
+                self.blocked_requests.fetch_add(1, Ordering::Relaxed);
+                self.domains_blocked.add(domain, &self.sequence);
+            }
+            None => {
+                self.allowed_requests.fetch_add(1, Ordering::Relaxed);
+            }
+        }
+        self.request_types.add(request_type, &self.sequence);
+        self.last_updated.store(now_seconds(), Ordering::Relaxed);
+    }
+
+    fn reset(&self) {
+        self.domains_blocked.clear();
+        self.request_types.clear();
+        for counter in [&self.total_requests, &self.blocked_requests, &self.allowed_requests] {
+            counter.store(0, Ordering::Relaxed);
+        }
+        let reset_at = self.sequence.fetch_add(1, Ordering::AcqRel) + 1;
+        self.reset_at.store(reset_at, Ordering::Release);
+    }
+}
+
+fn now_seconds() -> u64 {
+    SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .unwrap_or_default()
+        .as_secs()
+}
+
+/// Counters changed since a cursor, see [`StatsCollector::export_since`]
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct StatsExport {
+    /// Cursor to pass to the next export
+    pub cursor: u64,
+    /// Whether this export holds every counter and replaces earlier ones
+    pub full: bool,
+    /// Total requests
+    pub total_requests: u64,
+    /// Total blocked requests
+    pub blocked_requests: u64,
+    /// Total allowed requests
+    pub allowed_requests: u64,
+    /// Current counts of domains whose count changed
+    pub domains_blocked: Vec<(String, u64)>,
+    /// Current counts of request types whose count changed
+    pub request_types: Vec<(String, u64)>,
+    /// Time of the last recorded request in seconds since the epoch
+    pub last_updated: u64,
+}
+
+impl StatsExport {
+    /// Check if no keyed counter changed
+    pub fn is_unchanged(&self) -> bool {
+        !self.full && self.domains_blocked.is_empty() && self.request_types.is_empty()
+    }
+}
+
+/// Counter values the last delta was taken at, see [`StatsCollector::take_delta`]
+#[derive(Debug, Default)]
+struct DeltaBaseline {
+    cursor: u64,
+    total_requests: u64,
+    blocked_requests: u64,
+    allowed_requests: u64,
+    domains_blocked: HashMap<String, u64>,
+    request_types: HashMap<String, u64>,
+    /// Deltas handed back by [`StatsCollector::requeue_delta`]
+    requeued: StatsDelta,
+}
+
+impl DeltaBaseline {
+    /// Turn an export into the changes since the previous one
+    fn advance(&mut self, export: StatsExport) -> StatsDelta {
+        if export.full {
+            // A reset dropped the counts, so everything in the export is new
+            let requeued = std::mem::take(&mut self.requeued);
+            *self = Self {
+                requeued,
+                ..Self::default()
+            };
+        }
+
+        let mut delta = std::mem::take(&mut self.requeued);
+        delta.merge(StatsDelta {
+            total_requests: export.total_requests.saturating_sub(self.total_requests),
+            blocked_requests: export.blocked_requests.saturating_sub(self.blocked_requests),
+            allowed_requests: export.allowed_requests.saturating_sub(self.allowed_requests),
+            domains_blocked: changes(&mut self.domains_blocked, export.domains_blocked),
+            request_types: changes(&mut self.request_types, export.request_types),
+            ..StatsDelta::default()
+        });
+        self.cursor = export.cursor;
+        self.total_requests = export.total_requests;
+        self.blocked_requests = export.blocked_requests;
+        self.allowed_requests = export.allowed_requests;
+        delta
+    }
+}
+
+/// Diff current keyed counts against `baseline` and update it
+fn changes(baseline: &mut HashMap<String, u64>, current: Vec<(String, u64)>) -> HashMap<String, u64> {
+    let mut changed = HashMap::new();
+    for (key, count) in current {
+        let previous = baseline.get(&key).copied().unwrap_or(0);
+        if count > previous {
+            changed.insert(key.clone(), count - previous);
+            baseline.insert(key, count);
+        }
+    }
+    changed
+}
+
 /// Thread-safe statistics collector for aubo-rs
+///
+/// Request counters are atomics and sharded maps, so recording never takes
+/// a collector-wide lock and readers only hold one shard at a time. Deltas
+/// for the companion are derived from the counters' change sequence by the
+/// reporter alone. The remaining fields of [`Stats`] change rarely and sit
+/// behind a lock.
 #[derive(Debug)]
 pub struct StatsCollector {
     stats: Arc<RwLock<Stats>>,
-    collecting: Arc<RwLock<bool>>,
+    counters: Arc<Counters>,
+    baseline: Arc<Mutex<DeltaBaseline>>,
+    latency: Arc<LatencyHistogram>,
+    cache_hits: Arc<AtomicU64>,
+    cache_misses: Arc<AtomicU64>,
+    hosts: Arc<HostCardinality>,
+    upstream: Arc<UpstreamTracker>,
+    avoided: Arc<WorkAvoidedTracker>,
+    collecting: Arc<AtomicBool>,
 }
 
 impl StatsCollector {
@@ -68,70 +531,187 @@ impl StatsCollector {
     pub fn new() -> Self {
         Self {
             stats: Arc::new(RwLock::new(Stats::default())),
-            collecting: Arc::new(RwLock::new(false)),
+            counters: Arc::new(Counters::new()),
+            baseline: Arc::new(Mutex::new(DeltaBaseline::default())),
+            latency: Arc::new(LatencyHistogram::default()),
+            cache_hits: Arc::new(AtomicU64::new(0)),
+            cache_misses: Arc::new(AtomicU64::new(0)),
+            hosts: Arc::new(HostCardinality::new()),
+            upstream: Arc::new(UpstreamTracker::new()),
+            avoided: Arc::new(WorkAvoidedTracker::new()),
+            collecting: Arc::new(AtomicBool::new(false)),
         }
     }
 
+    /// Take the counter changes recorded since the last call
+    ///
+    /// Keyed counters come from [`Self::export_since`] and are diffed
+    /// against the values the previous call saw, so recording never touches
+    /// the state kept here.
+    pub fn take_delta(&self) -> StatsDelta {
+        let mut baseline = self.baseline.lock();
+        let export = self.export_since(baseline.cursor);
+        let mut delta = baseline.advance(export);
+        drop(baseline);
+        delta.merge(StatsDelta {
+            cache_hits: self.cache_hits.swap(0, Ordering::Relaxed),
+            cache_misses: self.cache_misses.swap(0, Ordering::Relaxed),
+            latency_buckets: self.latency.take(),
+            host_sketches: self.hosts.take_changed(),
+            upstream: self.upstream.take(),
+            ..StatsDelta::default()
+        });
+        delta
+    }
+
+    /// Put back a delta that could not be persisted
+    ///
+    /// Per-domain counts beyond [`MAX_REQUEUED_DOMAINS`] are dropped, so a
+    /// companion that keeps failing cannot grow the app's memory; the other
+    /// parts of a delta are bounded already.
+    pub fn requeue_delta(&self, delta: StatsDelta) {
+        let mut baseline = self.baseline.lock();
+        baseline.requeued.merge(delta);
+        keep_most_blocked(&mut baseline.requeued.domains_blocked, MAX_REQUEUED_DOMAINS);
+    }
+
     /// Start collecting statistics
     pub fn start_collection(&self) -> Result<(), AuboError> {
-        let mut collecting = self.collecting.write();
-        *collecting = true;
+        self.collecting.store(true, Ordering::Relaxed);
         Ok(())
     }
 
     /// Stop collecting statistics
     pub fn stop_collection(&self) -> Result<(), AuboError> {
-        let mut collecting = self.collecting.write();
-        *collecting = false;
+        self.collecting.store(false, Ordering::Relaxed);
         Ok(())
     }
 
     /// Record a blocked request
     pub fn record_blocked_request(&self, domain: &str, request_type: &str) {
-        if !*self.collecting.read() {
+        if !self.collecting.load(Ordering::Relaxed) {
             return;
         }
 
-        let mut stats = self.stats.write();
-        stats.total_requests += 1;
-        stats.blocked_requests += 1;
-        
-        // Update domain count
-        *stats.domains_blocked.entry(domain.to_string()).or_insert(0) += 1;
-        
-        // Update request type count
-        *stats.request_types.entry(request_type.to_string()).or_insert(0) += 1;
-        
-        // Update timestamp
-        stats.last_updated = SystemTime::now()
-            .duration_since(UNIX_EPOCH)
-            .unwrap_or_default()
-            .as_secs();
+        self.counters.record(Some(domain), request_type);
     }
 
     /// Record an allowed request
     pub fn record_allowed_request(&self, _domain: &str, request_type: &str) {
-        if !*self.collecting.read() {
+        if !self.collecting.load(Ordering::Relaxed) {
             return;
         }
 
-        let mut stats = self.stats.write();
-        stats.total_requests += 1;
-        stats.allowed_requests += 1;
-        
-        // Update request type count
-        *stats.request_types.entry(request_type.to_string()).or_insert(0) += 1;
-        
-        // Update timestamp
-        stats.last_updated = SystemTime::now()
-            .duration_since(UNIX_EPOCH)
-            .unwrap_or_default()
-            .as_secs();
+        self.counters.record(None, request_type);
+    }
+
+    /// Record how long a filter lookup took
+    ///
+    /// `cache_hit` is `None` when the lookup did not consult the verdict
+    /// cache. Only atomics are touched, so this is safe on the hot path.
+    pub fn record_lookup(&self, latency: Duration, cache_hit: Option<bool>) {
+        if !self.collecting.load(Ordering::Relaxed) {
+            return;
+        }
+
+        self.latency.record(latency);
+        match cache_hit {
+            Some(true) => self.cache_hits.fetch_add(1, Ordering::Relaxed),
+            Some(false) => self.cache_misses.fetch_add(1, Ordering::Relaxed),
+            None => 0,
+        };
+    }
+
+    /// Count a looked-up host in the distinct-host sketches
+    pub fn record_host(&self, host: &str, blocked: bool) {
+        if !self.collecting.load(Ordering::Relaxed) {
+            return;
+        }
+        self.hosts.record(host, blocked);
+    }
+
+    /// Count a resolution done by the real resolver
+    pub fn record_resolution(&self, host: &str, latency: Duration, failed: bool) {
+        if !self.collecting.load(Ordering::Relaxed) {
+            return;
+        }
+        self.upstream.record(host, latency, failed);
+    }
+
+    /// Count a DNS lookup of `host` answered by blocking
+    pub fn record_blocked_resolution(&self, host: &str) {
+        if !self.collecting.load(Ordering::Relaxed) {
+            return;
+        }
+        self.upstream.record_blocked();
+        self.avoided.record_blocked(host);
+    }
+
+    /// Get the estimator of the work blocking saved
+    pub fn work_avoided(&self) -> &WorkAvoidedTracker {
+        &self.avoided
+    }
+
+    /// Take the work saved since the last call, attributed with `list_of`
+    pub fn take_avoided(&self, list_of: impl Fn(&str) -> Option<String>) -> Option<AvoidedDelta> {
+        self.avoided.take(list_of)
+    }
+
+    /// Get the distinct-host sketches of this process
+    pub fn host_cardinality(&self) -> &HostCardinality {
+        &self.hosts
     }
 
     /// Get a snapshot of current statistics
+    ///
+    /// This copies every per-domain counter; prefer [`Self::export_since`]
+    /// for repeated polling.
     pub fn get_stats(&self) -> Stats {
-        self.stats.read().clone()
+        let mut stats = self.stats.read().clone();
+        let counters = &self.counters;
+        stats.total_requests = counters.total_requests.load(Ordering::Relaxed);
+        stats.blocked_requests = counters.blocked_requests.load(Ordering::Relaxed);
+        stats.allowed_requests = counters.allowed_requests.load(Ordering::Relaxed);
+        stats.domains_blocked = counters.domains_blocked.to_map();
+        stats.request_types = counters.request_types.to_map();
+        stats.last_updated = stats.last_updated.max(counters.last_updated.load(Ordering::Relaxed));
+        stats
+    }
+
+    /// Export the counters that changed after `cursor`
+    ///
+    /// Pass 0 for the first call and the returned cursor afterwards. Totals
+    /// are always included; keyed counters only when they changed, with
+    /// their current value. If the cursor predates a reset the export is
+    /// marked full and replaces everything the caller has. Writers are never
+    /// blocked for longer than it takes to scan one shard, and nothing is
+    /// allocated for counters that did not change.
+    pub fn export_since(&self, cursor: u64) -> StatsExport {
+        let counters = &self.counters;
+        let latest = counters.sequence.load(Ordering::Acquire);
+        let full = cursor == 0 || cursor < counters.reset_at.load(Ordering::Acquire) || cursor > latest;
+        let since = if full { 0 } else { cursor };
+
+        StatsExport {
+            cursor: latest,
+            full,
+            total_requests: counters.total_requests.load(Ordering::Relaxed),
+            blocked_requests: counters.blocked_requests.load(Ordering::Relaxed),
+            allowed_requests: counters.allowed_requests.load(Ordering::Relaxed),
+            domains_blocked: counters.domains_blocked.changed_since(since),
+            request_types: counters.request_types.changed_since(since),
+            last_updated: counters.last_updated.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Get the number of blocked requests
+    pub fn blocked_requests(&self) -> u64 {
+        self.counters.blocked_requests.load(Ordering::Relaxed)
+    }
+
+    /// Get the number of blocks per domain
+    pub fn domains_blocked(&self) -> HashMap<String, u64> {
+        self.counters.domains_blocked.to_map()
     }
 
     /// Update performance metrics
@@ -145,17 +725,45 @@ impl StatsCollector {
         stats.performance_metrics.avg_processing_time_us = avg_processing_time_us;
         stats.performance_metrics.memory_usage_bytes = memory_usage_bytes;
         stats.performance_metrics.cpu_usage_percent = cpu_usage_percent;
-        
-        stats.last_updated = SystemTime::now()
-            .duration_since(UNIX_EPOCH)
-            .unwrap_or_default()
-            .as_secs();
+        stats.last_updated = now_seconds();
+    }
+
+    /// Replace the engine memory breakdown
+    ///
+    /// The entry for the stats themselves is refreshed on every update.
+    pub fn update_memory_breakdown(&self, breakdown: MemoryBreakdown) {
+        let mut stats = self.stats.write();
+        stats.memory_breakdown = breakdown;
+        let own_bytes = stats.heap_bytes() + self.counter_heap_bytes();
+        stats.memory_breakdown.set_structure(STATS_STRUCTURE, own_bytes, 0);
+    }
+
+    /// Update the memory entry of a single structure
+    pub fn update_structure_memory(&self, name: &str, heap_bytes: usize, mapped_bytes: usize) {
+        let mut stats = self.stats.write();
+        stats.memory_breakdown.set_structure(name, heap_bytes, mapped_bytes);
+        let own_bytes = stats.heap_bytes() + self.counter_heap_bytes();
+        stats.memory_breakdown.set_structure(STATS_STRUCTURE, own_bytes, 0);
+    }
+
+    fn counter_heap_bytes(&self) -> usize {
+        self.counters.domains_blocked.heap_bytes() + self.counters.request_types.heap_bytes()
+    }
+
+    /// Get the current engine memory breakdown
+    pub fn memory_breakdown(&self) -> MemoryBreakdown {
+        self.stats.read().memory_breakdown.clone()
     }
 
     /// Reset all statistics
     pub fn reset(&self) {
         let mut stats = self.stats.write();
         *stats = Stats::default();
+        self.counters.reset();
+        *self.baseline.lock() = DeltaBaseline::default();
+        self.latency.take();
+        self.cache_hits.store(0, Ordering::Relaxed);
+        self.cache_misses.store(0, Ordering::Relaxed);
     }
 
     /// Get statistics as JSON string
@@ -187,6 +795,14 @@ impl Clone for StatsCollector {
     fn clone(&self) -> Self {
         Self {
             stats: Arc::clone(&self.stats),
+            counters: Arc::clone(&self.counters),
+            baseline: Arc::clone(&self.baseline),
+            latency: Arc::clone(&self.latency),
+            cache_hits: Arc::clone(&self.cache_hits),
+            cache_misses: Arc::clone(&self.cache_misses),
+            hosts: Arc::clone(&self.hosts),
+            upstream: Arc::clone(&self.upstream),
+            avoided: Arc::clone(&self.avoided),
             collecting: Arc::clone(&self.collecting),
         }
     }
@@ -352,6 +968,193 @@ mod tests {
         assert_eq!(stats.request_types.get("websocket"), Some(&1));
     }
 
+    #[test]
+    fn test_memory_breakdown_updates() {
+        let collector = StatsCollector::new();
+
+        let mut breakdown = MemoryBreakdown::default();
+        breakdown.set_structure("blocked_domains", 4096, 0);
+        collector.update_memory_breakdown(breakdown);
+        collector.update_structure_memory("verdict_cache", 2048, 0);
+
+        let stats = collector.get_stats();
+        let breakdown = &stats.memory_breakdown;
+        assert_eq!(breakdown.structure("blocked_domains").unwrap().heap_bytes, 4096);
+        assert_eq!(breakdown.structure("verdict_cache").unwrap().heap_bytes, 2048);
+        assert!(breakdown.structure(STATS_STRUCTURE).unwrap().heap_bytes > 0);
+
+        let json = collector.to_json().unwrap();
+        assert!(json.contains("verdict_cache"));
+    }
+
+    #[test]
+    fn test_deltas_are_taken_once() {
+        let collector = StatsCollector::new();
+        collector.start_collection().unwrap();
+
+        collector.record_blocked_request("ads.example.com", "dns");
+        collector.record_allowed_request("example.com", "dns");
+
+        let delta = collector.take_delta();
+        assert_eq!(delta.total_requests, 2);
+        assert_eq!(delta.blocked_requests, 1);
+        assert_eq!(delta.domains_blocked.get("ads.example.com"), Some(&1));
+        assert!(collector.take_delta().is_empty());
+
+        // Deltas that failed to persist are merged with newer ones
+        collector.requeue_delta(delta);
+        collector.record_blocked_request("ads.example.com", "dns");
+        let delta = collector.take_delta();
+        assert_eq!(delta.domains_blocked.get("ads.example.com"), Some(&2));
+
+        let mut totals = Stats::default();
+        delta.apply_to(&mut totals);
+        assert_eq!(totals.total_requests, 3);
+        assert_eq!(totals.request_types.get("dns"), Some(&3));
+    }
+
+    #[test]
+    fn test_requeued_domains_are_bounded() {
+        let collector = StatsCollector::new();
+        for round in 0..3 {
+            let mut delta = StatsDelta {
+                total_requests: MAX_REQUEUED_DOMAINS as u64,
+                ..Default::default()
+            };
+            for i in 0..MAX_REQUEUED_DOMAINS {
+                delta.domains_blocked.insert(format!("host{}-{}.example.com", round, i), 1);
+            }
+            delta.domains_blocked.insert("ads.example.com".to_string(), 10);
+            collector.requeue_delta(delta);
+        }
+
+        let delta = collector.take_delta();
+        assert_eq!(delta.total_requests, 3 * MAX_REQUEUED_DOMAINS as u64);
+        assert_eq!(delta.domains_blocked.len(), MAX_REQUEUED_DOMAINS);
+        assert_eq!(delta.domains_blocked.get("ads.example.com"), Some(&30));
+    }
+
+    #[test]
+    fn test_deltas_while_recording() {
+        let collector = StatsCollector::new();
+        collector.start_collection().unwrap();
+
+        let writers: Vec<_> = (0..4)
+            .map(|i| {
+                let collector = collector.clone();
+                thread::spawn(move || {
+                    for j in 0..1000 {
+                        let domain = format!("ads{}.example.com", j % 7);
+                        if (i + j) % 2 == 0 {
+                            collector.record_blocked_request(&domain, "dns");
+                        } else {
+                            collector.record_allowed_request(&domain, "https");
+                        }
+                    }
+                })
+            })
+            .collect();
+
+        // Deltas taken while writers run add up to the final counts
+        let mut sum = StatsDelta::default();
+        while writers.iter().any(|writer| !writer.is_finished()) {
+            sum.merge(collector.take_delta());
+        }
+        for writer in writers {
+            writer.join().unwrap();
+        }
+        sum.merge(collector.take_delta());
+
+        let stats = collector.get_stats();
+        assert_eq!(sum.total_requests, 4000);
+        assert_eq!((sum.blocked_requests, sum.allowed_requests), (2000, 2000));
+        assert_eq!(sum.domains_blocked, stats.domains_blocked);
+        assert_eq!(sum.request_types, stats.request_types);
+        assert!(collector.take_delta().is_empty());
+    }
+
+    #[test]
+    fn test_export_since_cursor() {
+        let collector = StatsCollector::new();
+        collector.start_collection().unwrap();
+        collector.record_blocked_request("ads.example.com", "dns");
+        collector.record_blocked_request("tracker.net", "dns");
+
+        let first = collector.export_since(0);
+        assert!(first.full);
+        assert_eq!(first.total_requests, 2);
+        assert_eq!(first.domains_blocked.len(), 2);
+
+        // Nothing changed, so nothing but the totals is returned
+        let idle = collector.export_since(first.cursor);
+        assert!(idle.is_unchanged());
+        assert_eq!((idle.cursor, idle.total_requests), (first.cursor, 2));
+
+        collector.record_blocked_request("tracker.net", "dns");
+        collector.record_allowed_request("example.com", "https");
+        let next = collector.export_since(first.cursor);
+        assert!(!next.full);
+        assert_eq!(next.domains_blocked, vec![("tracker.net".to_string(), 2)]);
+        let mut types = next.request_types.clone();
+        types.sort();
+        assert_eq!(types, vec![("dns".to_string(), 3), ("https".to_string(), 1)]);
+
+        // A cursor from before a reset gets a full export
+        collector.reset();
+        collector.record_allowed_request("example.com", "https");
+        let after_reset = collector.export_since(next.cursor);
+        assert!(after_reset.full);
+        assert_eq!(after_reset.total_requests, 1);
+        assert_eq!(after_reset.request_types, vec![("https".to_string(), 1)]);
+    }
+
+    #[test]
+    fn test_lookup_latency_and_cache_counters() {
+        assert_eq!(latency_bucket(Duration::ZERO), 0);
+        assert_eq!(latency_bucket(Duration::from_nanos(1000)), 10);
+        assert_eq!(latency_bucket(Duration::from_secs(60)), LATENCY_BUCKETS - 1);
+
+        let collector = StatsCollector::new();
+        collector.record_lookup(Duration::from_micros(1), Some(true));
+        assert!(collector.take_delta().is_empty());
+
+        collector.start_collection().unwrap();
+        for _ in 0..9 {
+            collector.record_lookup(Duration::from_nanos(300), Some(true));
+        }
+        collector.record_lookup(Duration::from_micros(50), Some(false));
+        collector.record_lookup(Duration::from_micros(50), None);
+
+        let delta = collector.take_delta();
+        assert_eq!((delta.cache_hits, delta.cache_misses), (9, 1));
+        assert_eq!(delta.latency_buckets.iter().sum::<u64>(), 11);
+        assert!(!delta.is_empty());
+        assert_eq!(latency_percentile(&delta.latency_buckets, 0.5), Some(Duration::from_nanos(512)));
+        assert_eq!(latency_percentile(&delta.latency_buckets, 0.99), Some(Duration::from_nanos(65536)));
+        assert_eq!(latency_percentile::<u64>(&[], 0.5), None);
+        assert!(collector.take_delta().is_empty());
+    }
+
+    #[test]
+    fn test_host_sketches_travel_with_deltas() {
+        let collector = StatsCollector::new();
+        collector.start_collection().unwrap();
+        collector.record_host("ads.example.com", true);
+        collector.record_host("example.com", false);
+
+        let mut delta = collector.take_delta();
+        let sketches = delta.host_sketches.clone().unwrap();
+        assert_eq!(sketches.hosts.len(), crate::sketch::HLL_REGISTERS);
+        assert!(collector.take_delta().is_empty());
+
+        // Requeued sketches are kept until the next report
+        collector.requeue_delta(delta.clone());
+        collector.record_host("example.com", false);
+        delta.merge(collector.take_delta());
+        assert_eq!(delta.host_sketches, Some(sketches));
+        assert_eq!(collector.host_cardinality().distinct_hosts(), 2);
+    }
+
     #[test]
     fn test_stats_serialization() {
         let collector = StatsCollector::new();
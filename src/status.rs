@@ -0,0 +1,465 @@
+//! Status and kernel-log reporting for aubo-rs
+//!
+//! Every app process used to rewrite `status.txt` and `module.prop` and
+//! open `/dev/kmsg` for each message, so a boot with a hundred apps meant
+//! hundreds of file rewrites of the same content. App processes now only
+//! queue [`StatusEvent`]s in memory and hand them to the companion with
+//! their periodic reports. The companion keeps the latest status per app in
+//! a [`StatusBoard`] and writes files at most once per flush interval:
+//! kernel-log lines go through one persistent `/dev/kmsg` descriptor,
+//! repeated lines are coalesced, and load messages appear once per boot.
+
+use std::collections::{HashMap, HashSet, VecDeque};
+use std::fs::{self, File, OpenOptions};
+use std::io::Write;
+use std::path::{Path, PathBuf};
+
+use log::debug;
+use once_cell::sync::Lazy;
+use parking_lot::Mutex;
+use serde::{Deserialize, Serialize};
+
+use crate::error::Result;
+use crate::utils::TimeUtils;
+
+/// Events an app keeps while the companion is unreachable
+pub const MAX_PENDING_EVENTS: usize = 64;
+
+/// Kernel log device
+const KMSG_PATH: &str = "/dev/kmsg";
+
+/// Module properties shown by the root manager
+pub const MODULE_PROP_PATH: &str = "/data/adb/modules/aubo_rs/module.prop";
+
+/// Status file name below the data directory
+const STATUS_FILE: &str = "status.txt";
+
+/// Debug log below the data directory, mirroring kernel-log lines
+const DEBUG_LOG_FILE: &str = "logs/debug.log";
+
+/// Something an app wants reported
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+#[serde(tag = "kind", rename_all = "snake_case")]
+pub enum StatusEvent {
+    /// The app's module state changed
+    Status {
+        /// Short state such as `running` or `error`
+        status: String,
+        /// Human-readable detail
+        message: String,
+        /// Installed hooks in the app
+        hooks_active: u32,
+        /// Loaded filter rules in the app
+        filters_loaded: u32,
+    },
+    /// A line for the kernel log
+    KernelLog {
+        /// Message without prefix
+        message: String,
+        /// Log this text at most once per boot, for load messages
+        once_per_boot: bool,
+    },
+}
+
+/// Events queued in this process for the companion
+static PENDING: Lazy<Mutex<VecDeque<StatusEvent>>> = Lazy::new(|| Mutex::new(VecDeque::new()));
+
+/// Queue an event for the companion, dropping the oldest if the queue is full
+pub fn queue(event: StatusEvent) {
+    let mut pending = PENDING.lock();
+    if pending.len() >= MAX_PENDING_EVENTS {
+        pending.pop_front();
+    }
+    pending.push_back(event);
+}
+
+/// Queue a kernel-log line
+pub fn kernel_log(message: impl Into<String>) {
+    queue(StatusEvent::KernelLog {
+        message: message.into(),
+        once_per_boot: false,
+    });
+}
+
+/// Queue a kernel-log line that only the first process of a boot logs
+pub fn kernel_log_once(message: impl Into<String>) {
+    queue(StatusEvent::KernelLog {
+        message: message.into(),
+        once_per_boot: true,
+    });
+}
+
+/// Take the queued events
+pub fn take_pending() -> Vec<StatusEvent> {
+    PENDING.lock().drain(..).collect()
+}
+
+/// Put back events that could not be delivered, ahead of newer ones
+pub fn requeue(events: Vec<StatusEvent>) {
+    let mut pending = PENDING.lock();
+    for event in events.into_iter().rev() {
+        if pending.len() >= MAX_PENDING_EVENTS {
+            break;
+        }
+        pending.push_front(event);
+    }
+}
+
+/// Write the queued events out from this process
+///
+/// Only for processes that will never reach the companion, such as one
+/// whose initialization failed; nobody else would deliver their events.
+pub fn flush_unattached(data_dir: &Path) {
+    let events = take_pending();
+    if !events.is_empty() {
+        write_unattached(StatusBoard::new(data_dir, MODULE_PROP_PATH), events);
+    }
+}
+
+fn write_unattached(mut board: StatusBoard, events: Vec<StatusEvent>) {
+    board.apply(&format!("pid {}", std::process::id()), events);
+    if let Err(e) = board.flush(None) {
+        debug!("Failed to write status without companion: {}", e);
+    }
+}
+
+/// Latest status of one app
+#[derive(Debug, Clone, PartialEq)]
+struct AppStatus {
+    status: String,
+    message: String,
+    hooks_active: u32,
+    filters_loaded: u32,
+    updated: u64,
+}
+
+/// A kernel-log line waiting for the next flush
+#[derive(Debug)]
+struct PendingLine {
+    message: String,
+    repeats: u32,
+}
+
+/// Companion-side aggregate of app status, written out in batches
+pub struct StatusBoard {
+    status_path: PathBuf,
+    debug_log_path: PathBuf,
+    module_prop_path: PathBuf,
+    kmsg_path: PathBuf,
+    kmsg: Option<File>,
+    debug_log: Option<File>,
+    apps: HashMap<String, AppStatus>,
+    latest: Option<String>,
+    lines: Vec<PendingLine>,
+    logged_once: HashSet<String>,
+    dirty: bool,
+}
+
+impl StatusBoard {
+    /// Create a board writing below `data_dir` and to `module_prop`
+    pub fn new(data_dir: &Path, module_prop: impl Into<PathBuf>) -> Self {
+        Self {
+            status_path: data_dir.join(STATUS_FILE),
+            debug_log_path: data_dir.join(DEBUG_LOG_FILE),
+            module_prop_path: module_prop.into(),
+            kmsg_path: PathBuf::from(KMSG_PATH),
+            kmsg: None,
+            debug_log: None,
+            apps: HashMap::new(),
+            latest: None,
+            lines: Vec::new(),
+            logged_once: HashSet::new(),
+            dirty: false,
+        }
+    }
+
+    /// Write kernel-log lines to `path` instead of `/dev/kmsg`
+    pub fn with_kmsg_path(mut self, path: impl Into<PathBuf>) -> Self {
+        self.kmsg_path = path.into();
+        self
+    }
+
+    /// Record events reported by `app`
+    pub fn apply(&mut self, app: &str, events: Vec<StatusEvent>) {
+        for event in events {
+            match event {
+                StatusEvent::Status { status, message, hooks_active, filters_loaded } => {
+                    let next = AppStatus {
+                        status,
+                        message,
+                        hooks_active,
+                        filters_loaded,
+                        updated: TimeUtils::now_seconds(),
+                    };
+                    let changed = self.apps.get(app).map_or(true, |current| {
+                        current.status != next.status || current.message != next.message
+                    });
+                    self.apps.insert(app.to_string(), next);
+                    self.latest = Some(app.to_string());
+                    self.dirty |= changed;
+                }
+                StatusEvent::KernelLog { message, once_per_boot } => {
+                    if once_per_boot && !self.logged_once.insert(message.clone()) {
+                        continue;
+                    }
+                    match self.lines.iter_mut().find(|line| line.message == message) {
+                        Some(line) => line.repeats += 1,
+                        None => self.lines.push(PendingLine { message, repeats: 0 }),
+                    }
+                }
+            }
+        }
+    }
+
+    /// Check if anything waits to be written
+    pub fn is_dirty(&self) -> bool {
+        self.dirty || !self.lines.is_empty()
+    }
+
+    /// Write pending kernel-log lines and, if the status changed, the status
+    /// files
+    ///
+    /// `blocked_total` is shown in `module.prop` when stats are journaled.
+    pub fn flush(&mut self, blocked_total: Option<u64>) -> Result<()> {
+        self.flush_lines();
+        if !self.dirty {
+            return Ok(());
+        }
+        self.dirty = false;
+
+        let Some(latest) = self.latest.as_ref().and_then(|app| self.apps.get(app)) else {
+            return Ok(());
+        };
+        let running = self.apps.values().filter(|app| app.status == "running").count();
+        let failed = self.apps.values().filter(|app| app.status == "error").count();
+        let timestamp = chrono::Utc::now().format("%Y-%m-%d %H:%M:%S UTC");
+        let uptime = fs::read_to_string("/proc/uptime")
+            .ok()
+            .and_then(|uptime| uptime.split_whitespace().next().map(str::to_string))
+            .unwrap_or_else(|| "unknown".to_string());
+
+        let status_content = format!(
+            "status={}\ntime={}\nmessage={}\nversion={}\nuptime={}\nhooks_active={}\nfilters_loaded={}\nlast_update={}\napps_running={}\napps_failed={}\nlib_path=/data/adb/modules/aubo_rs/lib/aubo_rs.so\nconfig_path=/data/adb/aubo-rs/aubo-rs.toml\ndebug_log={}\n",
+            latest.status,
+            timestamp,
+            latest.message.replace('\n', " "),
+            env!("CARGO_PKG_VERSION"),
+            uptime,
+            latest.hooks_active,
+            latest.filters_loaded,
+            latest.updated,
+            running,
+            failed,
+            self.debug_log_path.display(),
+        );
+        if let Some(parent) = self.status_path.parent() {
+            fs::create_dir_all(parent)?;
+        }
+        fs::write(&self.status_path, status_content)?;
+
+        if let Ok(content) = fs::read_to_string(&self.module_prop_path) {
+            let updated = render_module_prop(&content, &latest.status, &latest.message, blocked_total);
+            if updated != content {
+                fs::write(&self.module_prop_path, updated)?;
+            }
+        }
+        Ok(())
+    }
+
+    fn flush_lines(&mut self) {
+        if self.lines.is_empty() {
+            return;
+        }
+
+        if self.kmsg.is_none() {
+            self.kmsg = OpenOptions::new().write(true).open(&self.kmsg_path).ok();
+        }
+        if self.debug_log.is_none() {
+            if let Some(parent) = self.debug_log_path.parent() {
+                let _ = fs::create_dir_all(parent);
+            }
+            self.debug_log = OpenOptions::new()
+                .create(true)
+                .append(true)
+                .open(&self.debug_log_path)
+                .ok();
+        }
+
+        let timestamp = chrono::Utc::now().format("%Y-%m-%d %H:%M:%S UTC");
+        for line in self.lines.drain(..) {
+            let message = match line.repeats {
+                0 => line.message,
+                repeats => format!("{} (repeated {} times)", line.message, repeats),
+            };
+            // Each write to /dev/kmsg is one record
+            if let Some(kmsg) = self.kmsg.as_mut() {
+                if kmsg.write_all(format!("<6>aubo-rs: {}\n", message).as_bytes()).is_err() {
+                    debug!("Failed to write kernel log, reopening on next flush");
+                    self.kmsg = None;
+                }
+            }
+            if let Some(debug_log) = self.debug_log.as_mut() {
+                let _ = writeln!(debug_log, "{}: {}", timestamp, message);
+            }
+        }
+    }
+}
+
+/// Rewrite the description and runtime section of `module.prop`
+fn render_module_prop(content: &str, status: &str, message: &str, blocked_total: Option<u64>) -> String {
+    let running = status == "running";
+    let mark = |ok: bool| if ok { "✅" } else { "❌" };
+    let zygisk_status = mark(Path::new("/data/adb/modules/zygisksu").exists());
+    let library_status = mark(Path::new("/data/adb/modules/aubo_rs/lib/aubo_rs.so").exists());
+    let blocked_count = blocked_total.unwrap_or(0);
+
+    let root_method = if Path::new("/data/adb/modules/magisk_busybox").exists() || Path::new("/system/xbin/magisk").exists() {
+        "Magisk"
+    } else if Path::new("/data/adb/modules/kernelsu").exists() || Path::new("/system/bin/ksu").exists() {
+        "KernelSU"
+    } else if Path::new("/data/adb/modules/apatch").exists() || Path::new("/system/bin/apd").exists() {
+        "APatch"
+    } else {
+        "Unknown"
+    };
+
+    let dynamic_desc = format!(
+        "[{}Network Hooks {}Ad Filters {}ZygiskNext {}Library. Root: {}, {} blocked] System-wide ad-blocker using Rust and ZygiskNext",
+        mark(running), mark(running), zygisk_status, library_status, root_method, blocked_count
+    );
+
+    let mut new_content = String::new();
+    for line in content.lines() {
+        if line.starts_with("# Runtime Status") {
+            break;
+        }
+        if line.starts_with("description=") {
+            new_content.push_str(&format!("description={}\n", dynamic_desc));
+        } else {
+            new_content.push_str(line);
+            new_content.push('\n');
+        }
+    }
+    // Trailing blank lines would otherwise grow on every rewrite
+    while new_content.ends_with("\n\n") {
+        new_content.pop();
+    }
+
+    new_content.push_str(&format!(
+        "\n# Runtime Status\nruntimeStatus={}\nruntimeMessage={}\nruntimeActive={}\nhooksActive={}\nfiltersActive={}\nzygiskActive={}\nlibraryActive={}\nblockedTotal={}\nrootMethod={}\n",
+        status,
+        message.replace('\n', " "),
+        running,
+        mark(running),
+        mark(running),
+        zygisk_status,
+        library_status,
+        blocked_count,
+        root_method
+    ));
+    new_content
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn status(status: &str, message: &str) -> StatusEvent {
+        StatusEvent::Status {
+            status: status.to_string(),
+            message: message.to_string(),
+            hooks_active: 3,
+            filters_loaded: 120,
+        }
+    }
+
+    fn log_line(message: &str, once_per_boot: bool) -> StatusEvent {
+        StatusEvent::KernelLog {
+            message: message.to_string(),
+            once_per_boot,
+        }
+    }
+
+    #[test]
+    fn test_pending_queue_is_bounded() {
+        take_pending();
+        for i in 0..MAX_PENDING_EVENTS + 5 {
+            kernel_log(format!("line {}", i));
+        }
+        let events = take_pending();
+        assert_eq!(events.len(), MAX_PENDING_EVENTS);
+        assert_eq!(events[0], log_line("line 5", false));
+
+        requeue(events);
+        assert_eq!(take_pending().len(), MAX_PENDING_EVENTS);
+    }
+
+    #[test]
+    fn test_board_coalesces_until_flush() {
+        let dir = tempfile::tempdir().unwrap();
+        let kmsg = dir.path().join("kmsg");
+        fs::write(&kmsg, "").unwrap();
+        let module_prop = dir.path().join("module.prop");
+        fs::write(&module_prop, "id=aubo_rs\ndescription=old\n").unwrap();
+        let mut board = StatusBoard::new(dir.path(), &module_prop).with_kmsg_path(&kmsg);
+
+        for app in ["com.example.one", "com.example.two"] {
+            board.apply(
+                app,
+                vec![
+                    log_line("Module loaded", true),
+                    log_line("Hook failed", false),
+                    status("running", "Filtering"),
+                ],
+            );
+        }
+        // Nothing touches storage before the flush
+        assert!(board.is_dirty());
+        assert!(!dir.path().join(STATUS_FILE).exists());
+
+        board.flush(Some(42)).unwrap();
+        let kernel_log = fs::read_to_string(&kmsg).unwrap();
+        assert_eq!(kernel_log.matches("Module loaded").count(), 1);
+        assert!(kernel_log.contains("Hook failed (repeated 1 times)"));
+
+        let status_file = fs::read_to_string(dir.path().join(STATUS_FILE)).unwrap();
+        assert!(status_file.contains("status=running"));
+        assert!(status_file.contains("apps_running=2"));
+        let prop = fs::read_to_string(&module_prop).unwrap();
+        assert!(prop.starts_with("id=aubo_rs\ndescription=["));
+        assert!(prop.contains("blockedTotal=42"));
+
+        // The same status again is not a change; a later boot message is dropped
+        board.apply("com.example.one", vec![status("running", "Filtering"), log_line("Module loaded", true)]);
+        assert!(!board.is_dirty());
+    }
+
+    #[test]
+    fn test_flush_unattached_writes_directly() {
+        let dir = tempfile::tempdir().unwrap();
+        let kmsg = dir.path().join("kmsg");
+        fs::write(&kmsg, "").unwrap();
+        let board = StatusBoard::new(dir.path(), dir.path().join("module.prop")).with_kmsg_path(&kmsg);
+        write_unattached(
+            board,
+            vec![
+                log_line("=== INITIALIZATION FAILED ===", false),
+                status("error", "Initialization failed"),
+            ],
+        );
+
+        assert!(fs::read_to_string(&kmsg).unwrap().contains("aubo-rs: === INITIALIZATION FAILED ==="));
+        let debug_log = fs::read_to_string(dir.path().join(DEBUG_LOG_FILE)).unwrap();
+        assert!(debug_log.contains("INITIALIZATION FAILED"));
+        let status_file = fs::read_to_string(dir.path().join(STATUS_FILE)).unwrap();
+        assert!(status_file.contains("status=error"));
+    }
+
+    #[test]
+    fn test_module_prop_rewrite_is_stable() {
+        let original = "id=aubo_rs\ndescription=old\n";
+        let once = render_module_prop(original, "running", "ok", Some(1));
+        let twice = render_module_prop(&once, "running", "ok", Some(1));
+        assert_eq!(once, twice);
+    }
+}
@@ -0,0 +1,462 @@
+//! Time-series stats for aubo-rs
+//!
+//! Lifetime totals say nothing about trends, so the companion also folds
+//! every stats delta into three rings of fixed-size slots: one slot per
+//! minute, per hour and per day. A delta is added to the current slot of
+//! each ring, which makes the coarser rings exact downsamples of the finer
+//! ones. Ring lengths are bounded by `retention_period`, so storage never
+//! grows; a slot is reused once its time range has left the ring.
+//!
+//! All rings share one file with a fixed layout: a header followed by every
+//! slot at a fixed offset, little-endian throughout. Only slots that changed
+//! are rewritten, and readers can map the file and index slots directly.
+
+use std::collections::BTreeSet;
+use std::fs::{self, File, OpenOptions};
+use std::os::unix::fs::FileExt;
+use std::path::{Path, PathBuf};
+use std::time::Duration;
+
+use log::{debug, warn};
+use serde::{Deserialize, Serialize};
+
+use crate::error::{Result, StatsError};
+use crate::stats::{latency_percentile, StatsDelta, LATENCY_BUCKETS};
+
+/// Magic bytes at the start of the file
+const MAGIC: &[u8; 8] = b"AUBOTIME";
+
+/// File format version
+const VERSION: u32 = 1;
+
+/// Header size: magic, version, slot size and the three ring lengths
+pub const HEADER_BYTES: usize = 28;
+
+/// Encoded slot size: five `u64` counters and one `u32` per latency bucket
+pub const SLOT_BYTES: usize = 5 * 8 + LATENCY_BUCKETS * 4;
+
+/// Granularity of a ring
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Serialize, Deserialize)]
+#[serde(rename_all = "snake_case")]
+pub enum Resolution {
+    /// One slot per minute
+    Minute,
+    /// One slot per hour
+    Hour,
+    /// One slot per day
+    Day,
+}
+
+impl Resolution {
+    /// All resolutions, in file order
+    pub const ALL: [Resolution; 3] = [Resolution::Minute, Resolution::Hour, Resolution::Day];
+
+    /// Seconds covered by one slot
+    pub fn seconds(self) -> u64 {
+        match self {
+            Resolution::Minute => 60,
+            Resolution::Hour => 60 * 60,
+            Resolution::Day => 24 * 60 * 60,
+        }
+    }
+
+    /// Longest ring kept regardless of the retention period
+    fn max_slots(self) -> usize {
+        match self {
+            Resolution::Minute => 60,
+            Resolution::Hour => 7 * 24,
+            Resolution::Day => 366,
+        }
+    }
+
+    /// Ring length for a retention period
+    pub fn slots_for(self, retention: Duration) -> usize {
+        let slots = retention.as_secs().div_ceil(self.seconds()) as usize;
+        slots.clamp(1, self.max_slots())
+    }
+}
+
+/// Counters for one time range
+#[derive(Debug, Clone, PartialEq)]
+pub struct TimeSlot {
+    /// Start of the range in seconds since the epoch, 0 if unused
+    pub start: u64,
+    /// Requests seen
+    pub requests: u64,
+    /// Requests blocked
+    pub blocked: u64,
+    /// Verdict cache hits
+    pub cache_hits: u64,
+    /// Verdict cache misses
+    pub cache_misses: u64,
+    /// Lookups per latency bucket, saturating
+    pub latency: [u32; LATENCY_BUCKETS],
+}
+
+impl Default for TimeSlot {
+    fn default() -> Self {
+        Self {
+            start: 0,
+            requests: 0,
+            blocked: 0,
+            cache_hits: 0,
+            cache_misses: 0,
+            latency: [0; LATENCY_BUCKETS],
+        }
+    }
+}
+
+impl TimeSlot {
+    fn add(&mut self, delta: &StatsDelta) {
+        self.requests += delta.total_requests;
+        self.blocked += delta.blocked_requests;
+        self.cache_hits += delta.cache_hits;
+        self.cache_misses += delta.cache_misses;
+        for (slot, &count) in self.latency.iter_mut().zip(&delta.latency_buckets) {
+            *slot = slot.saturating_add(count.min(u32::MAX as u64) as u32);
+        }
+    }
+
+    /// Share of requests that were blocked
+    pub fn block_rate(&self) -> f64 {
+        ratio(self.blocked, self.requests)
+    }
+
+    /// Share of cache lookups that hit
+    pub fn cache_hit_ratio(&self) -> f64 {
+        ratio(self.cache_hits, self.cache_hits + self.cache_misses)
+    }
+
+    /// Estimated lookup latency percentile, `quantile` in 0.0-1.0
+    pub fn latency_percentile(&self, quantile: f64) -> Option<Duration> {
+        latency_percentile(&self.latency, quantile)
+    }
+
+    fn encode(&self, out: &mut [u8]) {
+        let counters = [self.start, self.requests, self.blocked, self.cache_hits, self.cache_misses];
+        for (chunk, value) in out.chunks_exact_mut(8).zip(counters) {
+            chunk.copy_from_slice(&value.to_le_bytes());
+        }
+        for (chunk, value) in out[5 * 8..].chunks_exact_mut(4).zip(self.latency) {
+            chunk.copy_from_slice(&value.to_le_bytes());
+        }
+    }
+
+    fn decode(data: &[u8]) -> Self {
+        let counter = |index: usize| u64::from_le_bytes(data[index * 8..index * 8 + 8].try_into().unwrap());
+        let mut latency = [0; LATENCY_BUCKETS];
+        for (value, chunk) in latency.iter_mut().zip(data[5 * 8..].chunks_exact(4)) {
+            *value = u32::from_le_bytes(chunk.try_into().unwrap());
+        }
+        Self {
+            start: counter(0),
+            requests: counter(1),
+            blocked: counter(2),
+            cache_hits: counter(3),
+            cache_misses: counter(4),
+            latency,
+        }
+    }
+}
+
+fn ratio(part: u64, whole: u64) -> f64 {
+    if whole == 0 {
+        0.0
+    } else {
+        part as f64 / whole as f64
+    }
+}
+
+/// One slot rendered for export
+#[derive(Debug, Clone, PartialEq, Serialize, Deserialize)]
+pub struct TimeSeriesPoint {
+    /// Start of the range in seconds since the epoch
+    pub start: u64,
+    /// Requests seen
+    pub requests: u64,
+    /// Requests blocked
+    pub blocked: u64,
+    /// Share of requests that were blocked
+    pub block_rate: f64,
+    /// Share of cache lookups that hit
+    pub cache_hit_ratio: f64,
+    /// Median lookup latency in microseconds
+    pub p50_us: f64,
+    /// 95th percentile lookup latency in microseconds
+    pub p95_us: f64,
+    /// 99th percentile lookup latency in microseconds
+    pub p99_us: f64,
+}
+
+impl From<&TimeSlot> for TimeSeriesPoint {
+    fn from(slot: &TimeSlot) -> Self {
+        let micros = |quantile| {
+            slot.latency_percentile(quantile)
+                .map(|latency| latency.as_secs_f64() * 1e6)
+                .unwrap_or(0.0)
+        };
+        Self {
+            start: slot.start,
+            requests: slot.requests,
+            blocked: slot.blocked,
+            block_rate: slot.block_rate(),
+            cache_hit_ratio: slot.cache_hit_ratio(),
+            p50_us: micros(0.50),
+            p95_us: micros(0.95),
+            p99_us: micros(0.99),
+        }
+    }
+}
+
+/// Fixed-size minute, hour and day rings backed by one file
+pub struct TimeSeries {
+    path: PathBuf,
+    file: Option<File>,
+    lengths: [usize; 3],
+    slots: Vec<TimeSlot>,
+    dirty: BTreeSet<usize>,
+}
+
+impl TimeSeries {
+    /// Open the rings at `path`, sized for `retention`
+    ///
+    /// A file written for a different retention period or format is
+    /// discarded, as its slots would land at the wrong offsets.
+    pub fn open(path: &Path, retention: Duration) -> Result<Self> {
+        let lengths = Resolution::ALL.map(|resolution| resolution.slots_for(retention));
+        let total: usize = lengths.iter().sum();
+        if let Some(parent) = path.parent() {
+            fs::create_dir_all(parent)?;
+        }
+
+        let header = encode_header(lengths);
+        let mut series = Self {
+            path: path.to_path_buf(),
+            file: None,
+            lengths,
+            slots: vec![TimeSlot::default(); total],
+            dirty: BTreeSet::new(),
+        };
+
+        match fs::read(path) {
+            Ok(content) if content.len() == HEADER_BYTES + total * SLOT_BYTES && content[..HEADER_BYTES] == header => {
+                for (slot, data) in series.slots.iter_mut().zip(content[HEADER_BYTES..].chunks_exact(SLOT_BYTES)) {
+                    *slot = TimeSlot::decode(data);
+                }
+                debug!("Loaded {} time-series slots from {}", total, path.display());
+            }
+            Ok(_) => {
+                warn!("Discarding time series {} written with another layout", path.display());
+                series.dirty.extend(0..total);
+            }
+            Err(_) => series.dirty.extend(0..total),
+        }
+        Ok(series)
+    }
+
+    /// Get the number of slots in the ring of `resolution`
+    pub fn ring_len(&self, resolution: Resolution) -> usize {
+        self.lengths[resolution as usize]
+    }
+
+    fn ring_offset(&self, resolution: Resolution) -> usize {
+        self.lengths[..resolution as usize].iter().sum()
+    }
+
+    /// Add a delta reported at `timestamp` (seconds since the epoch)
+    pub fn record(&mut self, timestamp: u64, delta: &StatsDelta) {
+        if delta.is_empty() {
+            return;
+        }
+
+        for resolution in Resolution::ALL {
+            let seconds = resolution.seconds();
+            let start = timestamp - timestamp % seconds;
+            let index = self.ring_offset(resolution) + (start / seconds) as usize % self.ring_len(resolution);
+
+            let slot = &mut self.slots[index];
+            if slot.start != start {
+                *slot = TimeSlot { start, ..TimeSlot::default() };
+            }
+            slot.add(delta);
+            self.dirty.insert(index);
+        }
+    }
+
+    /// Get the slots of one ring still within its window at `now`, oldest first
+    pub fn slots(&self, resolution: Resolution, now: u64) -> Vec<&TimeSlot> {
+        let offset = self.ring_offset(resolution);
+        let window = resolution.seconds() * self.ring_len(resolution) as u64;
+        let oldest = (now - now % resolution.seconds()).saturating_sub(window - resolution.seconds());
+
+        let mut slots: Vec<_> = self.slots[offset..offset + self.ring_len(resolution)]
+            .iter()
+            .filter(|slot| slot.start != 0 && slot.start >= oldest && slot.start <= now)
+            .collect();
+        slots.sort_by_key(|slot| slot.start);
+        slots
+    }
+
+    /// Render one ring for export
+    pub fn points(&self, resolution: Resolution, now: u64) -> Vec<TimeSeriesPoint> {
+        self.slots(resolution, now).into_iter().map(TimeSeriesPoint::from).collect()
+    }
+
+    /// Write the slots that changed since the last flush
+    ///
+    /// Slots are written in place, so each flush costs a few small writes
+    /// regardless of how much history the rings hold.
+    pub fn flush(&mut self) -> Result<()> {
+        if self.dirty.is_empty() {
+            return Ok(());
+        }
+
+        if self.file.is_none() {
+            let file = OpenOptions::new()
+                .read(true)
+                .write(true)
+                .create(true)
+                .truncate(false)
+                .open(&self.path)
+                .map_err(|e| write_failed(&self.path, e))?;
+            let expected = (HEADER_BYTES + self.slots.len() * SLOT_BYTES) as u64;
+            file.set_len(expected).map_err(|e| write_failed(&self.path, e))?;
+            file.write_all_at(&encode_header(self.lengths), 0)
+                .map_err(|e| write_failed(&self.path, e))?;
+            self.file = Some(file);
+        }
+
+        let file = self.file.as_ref().expect("time series file is open");
+        let mut buffer = [0u8; SLOT_BYTES];
+        for &index in &self.dirty {
+            self.slots[index].encode(&mut buffer);
+            file.write_all_at(&buffer, (HEADER_BYTES + index * SLOT_BYTES) as u64)
+                .map_err(|e| write_failed(&self.path, e))?;
+        }
+        self.dirty.clear();
+        Ok(())
+    }
+}
+
+impl Drop for TimeSeries {
+    fn drop(&mut self) {
+        if let Err(e) = self.flush() {
+            warn!("Failed to flush time series: {}", e);
+        }
+    }
+}
+
+fn encode_header(lengths: [usize; 3]) -> [u8; HEADER_BYTES] {
+    let mut header = [0u8; HEADER_BYTES];
+    header[..8].copy_from_slice(MAGIC);
+    let fields = [VERSION, SLOT_BYTES as u32, lengths[0] as u32, lengths[1] as u32, lengths[2] as u32];
+    for (chunk, value) in header[8..].chunks_exact_mut(4).zip(fields) {
+        chunk.copy_from_slice(&value.to_le_bytes());
+    }
+    header
+}
+
+fn write_failed(path: &Path, e: std::io::Error) -> crate::error::AuboError {
+    StatsError::WriteFailed {
+        path: path.display().to_string(),
+        reason: e.to_string(),
+    }
+    .into()
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const DAY: u64 = 24 * 60 * 60;
+
+    fn delta(requests: u64, blocked: u64) -> StatsDelta {
+        let mut latency_buckets = vec![0; LATENCY_BUCKETS];
+        latency_buckets[10] = requests;
+        StatsDelta {
+            total_requests: requests,
+            blocked_requests: blocked,
+            allowed_requests: requests - blocked,
+            cache_hits: blocked,
+            cache_misses: requests - blocked,
+            latency_buckets,
+            ..Default::default()
+        }
+    }
+
+    #[test]
+    fn test_ring_lengths_follow_retention() {
+        let week = Duration::from_secs(7 * DAY);
+        assert_eq!(Resolution::Minute.slots_for(week), 60);
+        assert_eq!(Resolution::Hour.slots_for(week), 168);
+        assert_eq!(Resolution::Day.slots_for(week), 7);
+
+        let short = Duration::from_secs(30 * 60);
+        assert_eq!(Resolution::Minute.slots_for(short), 30);
+        assert_eq!(Resolution::Day.slots_for(short), 1);
+    }
+
+    #[test]
+    fn test_deltas_are_downsampled() {
+        let dir = tempfile::tempdir().unwrap();
+        let mut series = TimeSeries::open(&dir.path().join("stats.ts"), Duration::from_secs(7 * DAY)).unwrap();
+
+        let base = 100 * DAY;
+        series.record(base + 10, &delta(10, 4));
+        series.record(base + 70, &delta(10, 1));
+        series.record(base + 3700, &delta(20, 0));
+
+        let now = base + 3700;
+        let minutes = series.slots(Resolution::Minute, now);
+        assert_eq!(minutes.len(), 1, "older minutes fell out of the hour window");
+        assert_eq!(minutes[0].requests, 20);
+
+        let hours = series.points(Resolution::Hour, now);
+        assert_eq!(hours.len(), 2);
+        assert_eq!((hours[0].requests, hours[0].blocked), (20, 5));
+        assert!((hours[0].block_rate - 0.25).abs() < 1e-9);
+        assert!((hours[0].cache_hit_ratio - 0.25).abs() < 1e-9);
+        assert!((hours[0].p99_us - 1.024).abs() < 1e-9);
+
+        let days = series.slots(Resolution::Day, now);
+        assert_eq!(days.len(), 1);
+        assert_eq!(days[0].requests, 40);
+    }
+
+    #[test]
+    fn test_slots_are_reused_after_wrapping() {
+        let dir = tempfile::tempdir().unwrap();
+        let mut series = TimeSeries::open(&dir.path().join("stats.ts"), Duration::from_secs(2 * DAY)).unwrap();
+
+        series.record(10 * DAY, &delta(5, 5));
+        series.record(12 * DAY, &delta(1, 0));
+
+        let days = series.slots(Resolution::Day, 12 * DAY);
+        assert_eq!(days.len(), 1);
+        assert_eq!((days[0].start, days[0].requests), (12 * DAY, 1));
+    }
+
+    #[test]
+    fn test_file_round_trip() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("stats.ts");
+        let retention = Duration::from_secs(7 * DAY);
+        let now = 100 * DAY + 5;
+
+        {
+            let mut series = TimeSeries::open(&path, retention).unwrap();
+            series.record(now, &delta(3, 2));
+            series.flush().unwrap();
+            let expected = HEADER_BYTES + (60 + 168 + 7) * SLOT_BYTES;
+            assert_eq!(fs::metadata(&path).unwrap().len(), expected as u64);
+            series.record(now, &delta(1, 1));
+        }
+
+        let series = TimeSeries::open(&path, retention).unwrap();
+        assert_eq!(series.slots(Resolution::Day, now)[0].blocked, 3);
+
+        // Another retention period changes the layout, so history is dropped
+        let series = TimeSeries::open(&path, Duration::from_secs(DAY)).unwrap();
+        assert!(series.slots(Resolution::Day, now).is_empty());
+    }
+}
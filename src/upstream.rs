@@ -0,0 +1,295 @@
+//! Upstream DNS resolution tracking for aubo-rs
+//!
+//! The resolver hooks wrap the real `getaddrinfo` and `gethostbyname`, so
+//! they time every resolution that was not blocked and report it here with
+//! whether it failed. Each process keeps counts, a log2 latency histogram
+//! and a Space-Saving top-K of hosts by total resolution time, and hands
+//! them to the companion with its stats delta. The companion merges them per
+//! app.
+//!
+//! The top-K answers which resolutions would gain most from caching or
+//! prefetching. The mean resolution latency times the number of blocked DNS
+//! lookups estimates the resolver time blocking saved.
+
+use std::time::Duration;
+
+use parking_lot::Mutex;
+use serde::{Deserialize, Serialize};
+
+use crate::stats::{latency_bucket, LATENCY_BUCKETS};
+
+/// Hosts kept in the slowest-hosts sketch
+pub const TOP_HOSTS: usize = 32;
+
+/// Resolution time spent on one host
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct HostLatency {
+    /// Looked-up host
+    pub host: String,
+    /// Total resolution time in nanoseconds, possibly overestimated
+    pub total_ns: u64,
+    /// Upper bound of the overestimate from evicted hosts
+    pub error_ns: u64,
+    /// Resolutions counted for the host
+    pub resolutions: u64,
+    /// Resolutions that failed
+    pub failures: u64,
+    /// Slowest resolution in nanoseconds
+    pub max_ns: u64,
+}
+
+impl HostLatency {
+    /// Mean time of the counted resolutions
+    pub fn mean(&self) -> Duration {
+        let counted = self.total_ns.saturating_sub(self.error_ns);
+        Duration::from_nanos(counted / self.resolutions.max(1))
+    }
+
+    /// Share of counted resolutions that failed
+    pub fn failure_rate(&self) -> f64 {
+        self.failures as f64 / self.resolutions.max(1) as f64
+    }
+}
+
+/// Space-Saving sketch of the hosts with the most resolution time
+///
+/// When full, a new host replaces the one with the least time and inherits
+/// that time as its error, so a host that truly holds a top share is never
+/// missed and its time is overestimated by at most its `error_ns`.
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct SlowestHosts {
+    hosts: Vec<HostLatency>,
+}
+
+impl SlowestHosts {
+    /// Count one resolution of `host`
+    pub fn record(&mut self, host: &str, latency: Duration, failed: bool) {
+        let nanos = latency.as_nanos().min(u64::MAX as u128) as u64;
+        let entry = match self.hosts.iter().position(|entry| entry.host.eq_ignore_ascii_case(host)) {
+            Some(index) => &mut self.hosts[index],
+            None => self.admit(host),
+        };
+        entry.total_ns = entry.total_ns.saturating_add(nanos);
+        entry.resolutions += 1;
+        entry.failures += failed as u64;
+        entry.max_ns = entry.max_ns.max(nanos);
+    }
+
+    /// Fold another sketch into this one
+    pub fn merge(&mut self, other: SlowestHosts) {
+        for incoming in other.hosts {
+            match self.hosts.iter_mut().find(|entry| entry.host == incoming.host) {
+                Some(entry) => {
+                    entry.total_ns = entry.total_ns.saturating_add(incoming.total_ns);
+                    entry.error_ns = entry.error_ns.saturating_add(incoming.error_ns);
+                    entry.resolutions += incoming.resolutions;
+                    entry.failures += incoming.failures;
+                    entry.max_ns = entry.max_ns.max(incoming.max_ns);
+                }
+                None => {
+                    // Hosts below the least tracked time could not displace anything
+                    let full = self.hosts.len() == TOP_HOSTS;
+                    if !full || incoming.total_ns > self.min_total() {
+                        let entry = self.admit(&incoming.host);
+                        let inherited = entry.total_ns;
+                        *entry = HostLatency {
+                            total_ns: incoming.total_ns.saturating_add(inherited),
+                            error_ns: incoming.error_ns.saturating_add(inherited),
+                            ..incoming
+                        };
+                    }
+                }
+            }
+        }
+    }
+
+    /// Get the hosts by total resolution time, slowest first
+    pub fn top(&self) -> Vec<HostLatency> {
+        let mut hosts = self.hosts.clone();
+        hosts.sort_by(|a, b| b.total_ns.cmp(&a.total_ns).then_with(|| a.host.cmp(&b.host)));
+        hosts
+    }
+
+    /// Check if no host was counted
+    pub fn is_empty(&self) -> bool {
+        self.hosts.is_empty()
+    }
+
+    fn min_total(&self) -> u64 {
+        self.hosts.iter().map(|entry| entry.total_ns).min().unwrap_or(0)
+    }
+
+    /// Add an entry for `host`, evicting the one with the least time if full
+    fn admit(&mut self, host: &str) -> &mut HostLatency {
+        if self.hosts.len() < TOP_HOSTS {
+            self.hosts.push(HostLatency {
+                host: host.to_ascii_lowercase(),
+                ..HostLatency::default()
+            });
+            return self.hosts.last_mut().expect("just pushed");
+        }
+
+        let (index, evicted) = self
+            .hosts
+            .iter()
+            .enumerate()
+            .min_by_key(|(_, entry)| entry.total_ns)
+            .map(|(index, entry)| (index, entry.total_ns))
+            .expect("sketch is full");
+        self.hosts[index] = HostLatency {
+            host: host.to_ascii_lowercase(),
+            total_ns: evicted,
+            error_ns: evicted,
+            ..HostLatency::default()
+        };
+        &mut self.hosts[index]
+    }
+}
+
+/// Upstream resolution counts since the last report
+#[derive(Debug, Clone, Default, PartialEq, Serialize, Deserialize)]
+pub struct UpstreamDelta {
+    /// Resolutions passed to the real resolver
+    pub resolutions: u64,
+    /// Resolutions that failed
+    pub failures: u64,
+    /// Total resolution time in nanoseconds
+    pub total_ns: u64,
+    /// DNS lookups answered by blocking instead of resolving
+    pub blocked: u64,
+    /// Resolutions per latency bucket, see [`latency_bucket`]
+    pub latency_buckets: Vec<u64>,
+    /// Hosts with the most resolution time
+    pub slowest: SlowestHosts,
+}
+
+impl UpstreamDelta {
+    /// Check if nothing was counted
+    pub fn is_empty(&self) -> bool {
+        self.resolutions == 0 && self.blocked == 0
+    }
+
+    /// Add another delta to this one
+    pub fn merge(&mut self, other: UpstreamDelta) {
+        self.resolutions += other.resolutions;
+        self.failures += other.failures;
+        self.total_ns = self.total_ns.saturating_add(other.total_ns);
+        self.blocked += other.blocked;
+        if self.latency_buckets.len() < other.latency_buckets.len() {
+            self.latency_buckets.resize(other.latency_buckets.len(), 0);
+        }
+        for (bucket, count) in other.latency_buckets.into_iter().enumerate() {
+            self.latency_buckets[bucket] += count;
+        }
+        self.slowest.merge(other.slowest);
+    }
+
+    /// Mean resolution time
+    pub fn mean(&self) -> Duration {
+        Duration::from_nanos(self.total_ns / self.resolutions.max(1))
+    }
+
+    /// Resolver time saved by blocked lookups, at the mean resolution time
+    pub fn estimated_saved(&self) -> Duration {
+        self.mean().saturating_mul(self.blocked.min(u32::MAX as u64) as u32)
+    }
+}
+
+/// Per-process collector of upstream resolutions
+///
+/// Resolutions take milliseconds, so a lock here costs nothing measurable.
+#[derive(Debug, Default)]
+pub struct UpstreamTracker {
+    pending: Mutex<UpstreamDelta>,
+}
+
+impl UpstreamTracker {
+    /// Create an empty tracker
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Count a resolution done by the real resolver
+    pub fn record(&self, host: &str, latency: Duration, failed: bool) {
+        let mut pending = self.pending.lock();
+        if pending.latency_buckets.is_empty() {
+            pending.latency_buckets = vec![0; LATENCY_BUCKETS];
+        }
+        pending.resolutions += 1;
+        pending.failures += failed as u64;
+        pending.total_ns = pending.total_ns.saturating_add(latency.as_nanos().min(u64::MAX as u128) as u64);
+        pending.latency_buckets[latency_bucket(latency)] += 1;
+        pending.slowest.record(host, latency, failed);
+    }
+
+    /// Count a DNS lookup that was blocked instead of resolved
+    pub fn record_blocked(&self) {
+        self.pending.lock().blocked += 1;
+    }
+
+    /// Take the counts since the last call, if any
+    pub fn take(&self) -> Option<UpstreamDelta> {
+        let delta = std::mem::take(&mut *self.pending.lock());
+        (!delta.is_empty()).then_some(delta)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_tracker_counts_and_estimates_savings() {
+        let tracker = UpstreamTracker::new();
+        assert!(tracker.take().is_none());
+
+        tracker.record("cdn.example.com", Duration::from_millis(20), false);
+        tracker.record("CDN.example.com", Duration::from_millis(40), true);
+        tracker.record_blocked();
+        tracker.record_blocked();
+
+        let delta = tracker.take().unwrap();
+        assert_eq!((delta.resolutions, delta.failures, delta.blocked), (2, 1, 2));
+        assert_eq!(delta.mean(), Duration::from_millis(30));
+        assert_eq!(delta.estimated_saved(), Duration::from_millis(60));
+
+        let top = delta.slowest.top();
+        assert_eq!(top.len(), 1);
+        assert_eq!((top[0].host.as_str(), top[0].max_ns), ("cdn.example.com", 40_000_000));
+        assert_eq!(top[0].failure_rate(), 0.5);
+        assert!(tracker.take().is_none());
+    }
+
+    #[test]
+    fn test_slowest_hosts_survive_eviction() {
+        let mut sketch = SlowestHosts::default();
+        for round in 0..5 {
+            sketch.record("slow.example.com", Duration::from_millis(500), false);
+            for i in 0..TOP_HOSTS * 2 {
+                sketch.record(&format!("fast{}-{}.net", round, i), Duration::from_millis(1), false);
+            }
+        }
+
+        let top = sketch.top();
+        assert_eq!(top.len(), TOP_HOSTS);
+        assert_eq!(top[0].host, "slow.example.com");
+        assert_eq!(top[0].resolutions, 5);
+        assert!(top[0].mean() >= Duration::from_millis(500));
+    }
+
+    #[test]
+    fn test_merge_sums_shared_hosts() {
+        let mut left = UpstreamDelta::default();
+        let mut right = UpstreamDelta::default();
+        left.slowest.record("a.net", Duration::from_millis(10), false);
+        right.slowest.record("a.net", Duration::from_millis(30), true);
+        right.slowest.record("b.net", Duration::from_millis(5), false);
+        right.blocked = 3;
+
+        left.merge(right);
+        let top = left.slowest.top();
+        assert_eq!((top[0].host.as_str(), top[0].total_ns, top[0].failures), ("a.net", 40_000_000, 1));
+        assert_eq!(top[1].host, "b.net");
+        assert_eq!(left.blocked, 3);
+    }
+}
@@ -5,6 +5,8 @@
 
 use std::collections::hash_map::DefaultHasher;
 use std::hash::{Hash, Hasher};
+use std::sync::mpsc::{self, RecvTimeoutError};
+use std::thread::JoinHandle;
 use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
 
 use url::Url;
@@ -190,13 +192,72 @@ impl PerfTimer {
     }
 }
 
+/// Background thread that runs a closure at a fixed interval until stopped
+pub struct PeriodicTask {
+    name: String,
+    stop_tx: Option<mpsc::Sender<()>>,
+    handle: Option<JoinHandle<()>>,
+}
+
+impl PeriodicTask {
+    /// Spawn a named thread that calls `tick` every `interval`
+    pub fn spawn<F>(name: impl Into<String>, interval: Duration, mut tick: F) -> Result<Self>
+    where
+        F: FnMut() + Send + 'static,
+    {
+        let name = name.into();
+        let (stop_tx, stop_rx) = mpsc::channel::<()>();
+
+        let handle = std::thread::Builder::new()
+            .name(name.clone())
+            .spawn(move || loop {
+                match stop_rx.recv_timeout(interval) {
+                    Err(RecvTimeoutError::Timeout) => tick(),
+                    _ => break,
+                }
+            })?;
+
+        Ok(Self {
+            name,
+            stop_tx: Some(stop_tx),
+            handle: Some(handle),
+        })
+    }
+
+    /// Get the task name
+    pub fn name(&self) -> &str {
+        &self.name
+    }
+
+    /// Signal the task to stop and wait for the thread to exit
+    pub fn stop(mut self) {
+        self.shutdown();
+    }
+
+    fn shutdown(&mut self) {
+        // Dropping the sender wakes the thread immediately
+        self.stop_tx.take();
+        if let Some(handle) = self.handle.take() {
+            if handle.join().is_err() {
+                log::error!("Background task '{}' panicked", self.name);
+            }
+        }
+    }
+}
+
+impl Drop for PeriodicTask {
+    fn drop(&mut self) {
+        self.shutdown();
+    }
+}
+
 /// Memory usage utilities
 pub struct MemoryUtils;
 
 impl MemoryUtils {
     /// Get current process memory usage in bytes
     pub fn get_memory_usage() -> Result<u64> {
-        #[cfg(target_os = "android")]
+        #[cfg(any(target_os = "android", target_os = "linux"))]
         {
             use std::fs;
             let statm = fs::read_to_string("/proc/self/statm")?;
@@ -209,9 +270,9 @@ impl MemoryUtils {
                 Ok(0)
             }
         }
-        #[cfg(not(target_os = "android"))]
+        #[cfg(not(any(target_os = "android", target_os = "linux")))]
         {
-            // Fallback for non-Android platforms
+            // Fallback for platforms without procfs
             Ok(0)
         }
     }
@@ -376,6 +437,17 @@ impl SystemInfo {
         }
     }
     
+    /// Get the name of the current process, e.g. the app package name
+    ///
+    /// App processes forked from zygote rename themselves, so the first
+    /// argument in `/proc/self/cmdline` is the package (or `package:service`).
+    pub fn process_name() -> Option<String> {
+        let cmdline = std::fs::read("/proc/self/cmdline").ok()?;
+        let name = cmdline.split(|&byte| byte == 0).next()?;
+        let name = String::from_utf8_lossy(name).trim().to_string();
+        (!name.is_empty()).then_some(name)
+    }
+
     /// Check if running on rooted device
     pub fn is_rooted() -> bool {
         #[cfg(target_os = "android")]
@@ -423,6 +495,27 @@ mod tests {
         assert_eq!(MemoryUtils::format_bytes(1048576), "1.00 MB");
     }
 
+    #[test]
+    fn test_periodic_task_runs_and_stops() {
+        use std::sync::atomic::{AtomicUsize, Ordering};
+        use std::sync::Arc;
+
+        let ticks = Arc::new(AtomicUsize::new(0));
+        let counter = Arc::clone(&ticks);
+        let task = PeriodicTask::spawn("test-task", Duration::from_millis(5), move || {
+            counter.fetch_add(1, Ordering::SeqCst);
+        })
+        .unwrap();
+
+        std::thread::sleep(Duration::from_millis(50));
+        task.stop();
+
+        let after_stop = ticks.load(Ordering::SeqCst);
+        assert!(after_stop > 0);
+        std::thread::sleep(Duration::from_millis(20));
+        assert_eq!(ticks.load(Ordering::SeqCst), after_stop);
+    }
+
     #[test]
     fn test_validation_utils() {
         assert!(ValidationUtils::is_valid_url("https://example.com"));
@@ -167,6 +167,14 @@ fi
 # Clean up extraction directory
 rm -rf "$MODPATH/lib/arm64"
 
+# Extract command-line tools (aubo-ctl, aubo-bench)
+if unzip -o "$ZIPFILE" 'system/bin/*' -d "$MODPATH" > /dev/null 2>&1; then
+    chmod 755 "$MODPATH"/system/bin/*
+    log_info "✓ Command-line tools installed at system/bin"
+else
+    log_warn "Command-line tools not found in package"
+fi
+
 log_info "Setting up data directory and configuration..."
 
 # Extract configuration file if it doesn't exist
@@ -187,6 +195,23 @@ mkdir -p "$DATA_DIR/stats"
 chmod -R 755 "$DATA_DIR"
 chown -R root:root "$DATA_DIR" 2>/dev/null || true
 
+# Benchmark the operating modes on this device and save the fastest
+# configuration; runs again on every module update
+BENCH_LOG="$DATA_DIR/logs/benchmark.log"
+if [ -x "$MODPATH/system/bin/aubo-bench" ] && [ -f "$DATA_DIR/aubo-rs.toml" ]; then
+    log_info "Benchmarking operating modes on this device..."
+    if AUBO_LIBRARY="$MODPATH/system/lib64/libaubo_rs.so" "$MODPATH/system/bin/aubo-bench" "$DATA_DIR/aubo-rs.toml" > "$BENCH_LOG" 2>&1; then
+        while IFS= read -r line; do
+            log_debug "benchmark: $line"
+        done < "$BENCH_LOG"
+        log_info "✓ Benchmark $(grep '^chosen:' "$BENCH_LOG")"
+    else
+        log_warn "Self-benchmark failed, keeping configured modes (see $BENCH_LOG)"
+    fi
+else
+    log_warn "Self-benchmark skipped: aubo-bench or configuration missing"
+fi
+
 # Create initial status file
 cat > "$DATA_DIR/status.txt" << EOF
 status=installed